@@ -33,6 +33,9 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
     recovery.cpp \
     bootloader.cpp \
+    bootprofile.c \
+    calibrate.cpp \
+    logwriter.c \
     install.cpp \
     roots.cpp \
     ui.cpp \
@@ -84,6 +87,7 @@ LOCAL_STATIC_LIBRARIES := \
     libmtdutils \
     libmmcutils \
     libbmlutils \
+    libminsha1 \
     libmincrypt \
     libminadbd \
     libbusybox \
@@ -143,6 +147,24 @@ ifneq ($(BOARD_RECOVERY_NEEDS_REL_INPUT),)
     LOCAL_CFLAGS += -DBOARD_RECOVERY_NEEDS_REL_INPUT
 endif
 
+# Lab builds can fold the benchmark runner into the multi-call binary
+# (RECOVERY_BENCH := true) so the rack exercises the exact recovery
+# image it flashed; production recoveries leave it out.  The verifier
+# suite stays standalone-only -- its harness carries symbols recovery
+# already owns (see benchrunner.c).
+ifeq ($(RECOVERY_BENCH),true)
+    LOCAL_CFLAGS += -DRECOVERY_BENCH -DRECOVERY_BENCH_RUNNER
+    LOCAL_SRC_FILES += \
+        benchrunner.c \
+        minzip/Benchmark.c \
+        minui/benchmark.c \
+        applypatch/benchmark.c \
+        applypatch/bsdiff.c
+    LOCAL_C_INCLUDES += external/bzip2
+    LOCAL_STATIC_LIBRARIES += \
+        libapplypatch libmtdutils libminsha1 libmincrypt libbz libz
+endif
+
 # This binary is in the recovery ramdisk, which is otherwise a copy of root.
 # It gets copied there in config/Makefile.  LOCAL_MODULE_TAGS suppresses
 # a (redundant) copy of the binary in /system/bin for user builds.
@@ -310,6 +332,7 @@ LOCAL_SRC_FILES := \
     messagesocket.cpp
 LOCAL_STATIC_LIBRARIES := \
     libvoldclient \
+    libminsha1 \
     libmincrypt \
     libminui \
     libminzip \
@@ -319,6 +342,50 @@ LOCAL_STATIC_LIBRARIES := \
 LOCAL_C_INCLUDES += system/core/fs_mgr/include
 include $(BUILD_EXECUTABLE)
 
+# Unified benchmark runner; see benchrunner.c for usage.  Compiles the
+# per-module suites with -DRECOVERY_BENCH_RUNNER so their standalone
+# main()s drop out and the runner drives their entry points directly.
+include $(CLEAR_VARS)
+LOCAL_MODULE := recovery_bench
+LOCAL_MODULE_TAGS := eng
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_CFLAGS += -DRECOVERY_BENCH_RUNNER -DNO_RECOVERY_MOUNT
+LOCAL_CFLAGS += -Wno-unused-parameter
+LOCAL_SRC_FILES := \
+    benchrunner.c \
+    minzip/Benchmark.c \
+    minui/benchmark.c \
+    applypatch/benchmark.c \
+    applypatch/bsdiff.c \
+    verifier_test.cpp \
+    asn1_decoder.cpp \
+    verifier.cpp \
+    ui.cpp \
+    messagesocket.cpp
+LOCAL_C_INCLUDES += \
+    external/bzip2 \
+    external/zlib \
+    external/safe-iop/include \
+    system/core/fs_mgr/include
+LOCAL_STATIC_LIBRARIES := \
+    libapplypatch \
+    libmtdutils \
+    libvoldclient \
+    libminsha1 \
+    libmincrypt \
+    libminui \
+    libpng \
+    libminzip \
+    libz \
+    libbz \
+    libselinux \
+    libcutils \
+    liblog \
+    libstdc++ \
+    libm \
+    libc
+include $(BUILD_EXECUTABLE)
+
 
 include $(LOCAL_PATH)/bmlutils/Android.mk \
     $(LOCAL_PATH)/flashutils/Android.mk \
@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -80,6 +81,10 @@ struct sideload_data {
 
 static struct sideload_data sideload_data;
 
+// Written by stop_sideload() to wake the wait loop immediately
+// instead of at its next periodic check.
+static int cancel_pipe[2] = { -1, -1 };
+
 // How long (in seconds) we wait for the host to start sending us a
 // package, before timing out.
 #define ADB_INSTALL_TIMEOUT 300
@@ -87,7 +92,7 @@ static struct sideload_data sideload_data;
 void *adb_sideload_thread(void* v) {
 
     pid_t child;
-    if ((child = fork()) == 0) {
+    if ((child = vfork()) == 0) {
         execl("/sbin/recovery", "recovery", "--adbd", NULL);
         _exit(-1);
     }
@@ -95,12 +100,19 @@ void *adb_sideload_thread(void* v) {
     time_t start_time = time(NULL);
     time_t now = start_time;
 
-    // FUSE_SIDELOAD_HOST_PATHNAME will start to exist once the host
-    // connects and starts serving a package.  Poll for its
-    // appearance.  (Note that inotify doesn't work with FUSE.)
+    // FUSE_SIDELOAD_HOST_PATHNAME starts to exist once the host
+    // connects and the child mounts the sideload filesystem.  inotify
+    // doesn't work with FUSE, but the mount itself is an event the
+    // kernel reports: poll() on /proc/mounts raises POLLERR|POLLPRI
+    // whenever the mount table changes.  Wait on that plus the cancel
+    // pipe, with a periodic timeout only to re-check the child and
+    // the overall deadline, so both the host connecting and the user
+    // cancelling are acted on immediately instead of at the next tick
+    // of a 1s stat loop.
     int result = INSTALL_NONE;
     int status = -1;
     struct stat st;
+    int mounts_fd = open("/proc/mounts", O_RDONLY);
     while (now - start_time < ADB_INSTALL_TIMEOUT) {
         /*
          * Exit if either:
@@ -126,9 +138,28 @@ void *adb_sideload_thread(void* v) {
             break;
         }
 
-        sleep(1);
+        struct pollfd fds[2];
+        fds[0].fd = mounts_fd;
+        fds[0].events = POLLERR | POLLPRI;
+        fds[1].fd = cancel_pipe[0];
+        fds[1].events = POLLIN;
+        // Once the mount exists (stat says ENOTCONN) no further mount
+        // event is coming -- the FUSE handshake finishes in
+        // milliseconds, so spin the stat quickly for that stretch.
+        int timeout = (status != 0 && errno == ENOTCONN) ? 50 : 1000;
+        if (poll(fds, cancel_pipe[0] >= 0 ? 2 : 1, timeout) > 0 &&
+            (fds[0].revents & (POLLERR | POLLPRI))) {
+            // Reading resets the changed state; otherwise the next
+            // poll() reports the same event again and the loop spins.
+            char scratch[1024];
+            lseek(mounts_fd, 0, SEEK_SET);
+            while (read(mounts_fd, scratch, sizeof(scratch)) > 0) { }
+        }
         now = time(NULL);
     }
+    if (mounts_fd >= 0) {
+        close(mounts_fd);
+    }
 
     if (status == 0) {
         // Signal UI thread that we can no longer cancel
@@ -173,11 +204,23 @@ start_sideload(RecoveryUI* ui_, int* wipe_cache, const char* install_file) {
     sideload_data.cancel = false;
     sideload_data.result = INSTALL_NONE;
 
+    if (pipe(cancel_pipe) == 0) {
+        // The wait loop's child must not inherit our ends.
+        fcntl(cancel_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(cancel_pipe[1], F_SETFD, FD_CLOEXEC);
+    } else {
+        cancel_pipe[0] = cancel_pipe[1] = -1;
+    }
+
     pthread_create(&sideload_thread, NULL, &adb_sideload_thread, NULL);
 }
 
 void stop_sideload() {
     sideload_data.cancel = true;
+    if (cancel_pipe[1] >= 0) {
+        char c = 'c';
+        write(cancel_pipe[1], &c, 1);
+    }
 }
 
 int wait_sideload() {
@@ -185,6 +228,12 @@ int wait_sideload() {
 
     pthread_join(sideload_thread, NULL);
 
+    if (cancel_pipe[0] >= 0) {
+        close(cancel_pipe[0]);
+        close(cancel_pipe[1]);
+        cancel_pipe[0] = cancel_pipe[1] = -1;
+    }
+
     ui->FlushKeys();
 
     maybe_restart_adbd();
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "allocstats.h"
+
+// One mutex for the registry and all counter updates.  The tracked
+// allocations are coarse (entry tables, 256KB scratch buffers), so
+// contention here is negligible next to the malloc it brackets.
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static AllocCounter* counters = NULL;
+
+void alloc_counter_add(AllocCounter* c, size_t bytes) {
+    pthread_mutex_lock(&stats_mutex);
+    if (!c->registered) {
+        c->next = counters;
+        counters = c;
+        c->registered = 1;
+    }
+    c->live += bytes;
+    if (c->live > c->peak) c->peak = c->live;
+    ++c->allocs;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void alloc_counter_sub(AllocCounter* c, size_t bytes) {
+    pthread_mutex_lock(&stats_mutex);
+    if (bytes > c->live) bytes = c->live;   // mismatched sub; clamp
+    c->live -= bytes;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+// Summary lands in the rotated logs via the redirected stdout.
+void alloc_stats_dump(void) {
+    AllocCounter* c;
+    size_t total_live = 0;
+
+    pthread_mutex_lock(&stats_mutex);
+    printf("alloc stats:\n");
+    for (c = counters; c != NULL; c = c->next) {
+        printf("  %-20s live=%zu peak=%zu allocs=%lld\n",
+               c->tag, c->live, c->peak, c->allocs);
+        total_live += c->live;
+    }
+    printf("  %-20s live=%zu\n", "total", total_live);
+    pthread_mutex_unlock(&stats_mutex);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_ALLOCSTATS_H
+#define RECOVERY_ALLOCSTATS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Central registry of per-subsystem allocation counters, for low-memory
+// tuning on 512MB-class devices.  Subsystems that manage their own
+// buffers (the minzip scratch arena, entry tables, ...) define a static
+// AllocCounter with a tag and call alloc_counter_add/_sub around their
+// allocations; the counter links itself into the registry on first use.
+// alloc_stats_dump() prints live and peak bytes per tag -- call it on
+// demand or from an allocation-failure path before giving up.
+
+typedef struct AllocCounter {
+    const char* tag;             // e.g. "minzip.scratch"; a literal
+    size_t live;
+    size_t peak;
+    long long allocs;            // lifetime alloc count
+    int registered;
+    struct AllocCounter* next;
+} AllocCounter;
+
+void alloc_counter_add(AllocCounter* c, size_t bytes);
+void alloc_counter_sub(AllocCounter* c, size_t bytes);
+void alloc_stats_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // RECOVERY_ALLOCSTATS_H
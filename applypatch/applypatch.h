@@ -60,6 +60,19 @@ int applypatch_check(const char* filename,
                      int num_patches,
                      char** const patch_sha1_str);
 
+// One (file, acceptable-sha1s) pair for applypatch_check_batch();
+// result receives the applypatch_check() verdict for the item.
+typedef struct {
+  const char* filename;
+  int num_patches;
+  char** patch_sha1_str;
+  int result;
+} ApplyPatchCheckItem;
+
+// Check many files at once, with reads sorted into on-disk order and
+// hashing overlapped with I/O.  Returns the number of failed items.
+int applypatch_check_batch(ApplyPatchCheckItem* items, int num_items);
+
 int LoadFileContents(const char* filename, FileContents* file);
 int SaveFileContents(const char* filename, const FileContents* file);
 void FreeFileContents(FileContents* file);
@@ -57,103 +57,182 @@
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
-static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
-{
-	off_t i,j,k,x,tmp,jj,kk;
-
-	if(len<16) {
-		for(k=start;k<start+len;k+=j) {
-			j=1;x=V[I[k]+h];
-			for(i=1;k+i<start+len;i++) {
-				if(V[I[k+i]+h]<x) {
-					x=V[I[k+i]+h];
-					j=0;
-				};
-				if(V[I[k+i]+h]==x) {
-					tmp=I[k+j];I[k+j]=I[k+i];I[k+i]=tmp;
-					j++;
-				};
-			};
-			for(i=0;i<j;i++) V[I[k+i]]=k+j-1;
-			if(j==1) I[k]=-1;
-		};
-		return;
-	};
-
-	x=V[I[start+len/2]+h];
-	jj=0;kk=0;
-	for(i=start;i<start+len;i++) {
-		if(V[I[i]+h]<x) jj++;
-		if(V[I[i]+h]==x) kk++;
-	};
-	jj+=start;kk+=jj;
-
-	i=start;j=0;k=0;
-	while(i<jj) {
-		if(V[I[i]+h]<x) {
-			i++;
-		} else if(V[I[i]+h]==x) {
-			tmp=I[i];I[i]=I[jj+j];I[jj+j]=tmp;
-			j++;
-		} else {
-			tmp=I[i];I[i]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
-	};
+/*
+ * Suffix array construction via SA-IS (induced sorting), replacing the
+ * original qsufsort.  SA-IS runs in linear time, where qsufsort's
+ * prefix-doubling is O(n log^2 n) and dominated bsdiff runtime on
+ * large inputs.  Structure follows the standard sais-lite formulation:
+ * classify L/S-type positions, sort the LMS substrings by induced
+ * sorting, recurse on the reduced string if names collide, and induce
+ * the final order.
+ *
+ * "cs" selects how the text is read: 0 for the original u_char input,
+ * 1 for the off_t-encoded reduced strings used at recursion levels.
+ */
+#define SAIS_CHR(T,i,cs) \
+	((cs) ? ((const off_t *)(T))[i] : ((const u_char *)(T))[i])
 
-	while(jj+j<kk) {
-		if(V[I[jj+j]+h]==x) {
-			j++;
-		} else {
-			tmp=I[jj+j];I[jj+j]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
-	};
+static void sais_counts(const void *T, off_t *C, off_t n, off_t k, int cs)
+{
+	off_t i;
 
-	if(jj>start) split(I,V,start,jj-start,h);
+	for(i=0;i<k;i++) C[i]=0;
+	for(i=0;i<n;i++) C[SAIS_CHR(T,i,cs)]++;
+}
 
-	for(i=0;i<kk-jj;i++) V[I[jj+i]]=kk-1;
-	if(jj==kk-1) I[jj]=-1;
+/* B[c] = start (end=0) or one-past-end (end=1) of bucket c. */
+static void sais_buckets(const off_t *C, off_t *B, off_t k, int end)
+{
+	off_t i,sum=0;
 
-	if(start+len>kk) split(I,V,kk,start+len-kk,h);
+	for(i=0;i<k;i++) {
+		sum+=C[i];
+		B[i]=end ? sum : sum-C[i];
+	}
 }
 
-static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
+/* Induce the order of all suffixes from the sorted LMS positions
+ * currently in SA. */
+static void sais_induce(const void *T, off_t *SA, off_t *C, off_t *B,
+	off_t n, off_t k, int cs)
 {
-	off_t buckets[256];
-	off_t i,h,len;
+	off_t *b,i,j,c0,c1;
+
+	/* compute SAl */
+	sais_buckets(C,B,k,0);
+	j=n-1;
+	c1=SAIS_CHR(T,j,cs);
+	b=SA+B[c1];
+	*b++ = ((0<j)&&(SAIS_CHR(T,j-1,cs)<c1)) ? ~j : j;
+	for(i=0;i<n;i++) {
+		j=SA[i];SA[i]=~j;
+		if(0<j) {
+			--j;
+			if((c0=SAIS_CHR(T,j,cs))!=c1) {
+				B[c1]=b-SA;b=SA+B[c1=c0];
+			}
+			*b++ = ((0<j)&&(SAIS_CHR(T,j-1,cs)<c1)) ? ~j : j;
+		}
+	}
+
+	/* compute SAs */
+	sais_buckets(C,B,k,1);
+	for(i=n-1,b=SA+B[c1=0];0<=i;i--) {
+		j=SA[i];
+		if(0<j) {
+			--j;
+			if((c0=SAIS_CHR(T,j,cs))!=c1) {
+				B[c1]=b-SA;b=SA+B[c1=c0];
+			}
+			*--b = ((j==0)||(SAIS_CHR(T,j-1,cs)>c1)) ? ~j : j;
+		} else {
+			SA[i]=~j;
+		}
+	}
+}
 
-	for(i=0;i<256;i++) buckets[i]=0;
-	for(i=0;i<oldsize;i++) buckets[old[i]]++;
-	for(i=1;i<256;i++) buckets[i]+=buckets[i-1];
-	for(i=255;i>0;i--) buckets[i]=buckets[i-1];
-	buckets[0]=0;
+/* Build the suffix array of T[0..n-1] into SA, which must have room
+ * for n+fs entries.  Returns 0 on success. */
+static int sais_main(const void *T, off_t *SA, off_t fs, off_t n, off_t k,
+	int cs)
+{
+	off_t *C,*B,*RA;
+	off_t i,j,c,m,p,q,plen,qlen,name,c0,c1;
+	int diff;
+
+	if(n==0) return 0;
+	if(n==1) { SA[0]=0; return 0; }
+
+	if((C=malloc(k*2*sizeof(off_t)))==NULL) return -1;
+	B=C+k;
+
+	/* stage 1: sort all the LMS substrings by induced sorting */
+	sais_counts(T,C,n,k,cs);
+	sais_buckets(C,B,k,1);
+	for(i=0;i<n;i++) SA[i]=0;
+	for(i=n-2,c=0,c1=SAIS_CHR(T,n-1,cs);0<=i;i--,c1=c0) {
+		if((c0=SAIS_CHR(T,i,cs))<(c1+c)) c=1;
+		else if(c!=0) { SA[--B[c1]]=i+1;c=0; }
+	}
+	sais_induce(T,SA,C,B,n,k,cs);
+
+	/* compact the sorted LMS positions into SA[0..m-1] */
+	for(i=0,m=0;i<n;i++) {
+		p=SA[i];
+		if((0<p)&&(SAIS_CHR(T,p-1,cs)>SAIS_CHR(T,p,cs))) {
+			for(j=p+1;(j<n)&&(SAIS_CHR(T,p,cs)==SAIS_CHR(T,j,cs));j++) { }
+			if((j<n)&&(SAIS_CHR(T,p,cs)<SAIS_CHR(T,j,cs))) SA[m++]=p;
+		}
+	}
+
+	/* store LMS-substring lengths, then name the substrings */
+	for(i=m;i<n;i++) SA[i]=0;
+	for(i=n-2,j=n,c=0,c1=SAIS_CHR(T,n-1,cs);0<=i;i--,c1=c0) {
+		if((c0=SAIS_CHR(T,i,cs))<(c1+c)) c=1;
+		else if(c!=0) { SA[m+((i+1)>>1)]=j-i-1;j=i+1;c=0; }
+	}
+	for(i=0,name=0,q=n,qlen=0;i<m;i++) {
+		p=SA[i];plen=SA[m+(p>>1)];diff=1;
+		if(plen==qlen) {
+			for(j=0;(j<plen)&&
+				(SAIS_CHR(T,p+j,cs)==SAIS_CHR(T,q+j,cs));j++) { }
+			if(j==plen) diff=0;
+		}
+		if(diff!=0) { name++;q=p;qlen=plen; }
+		SA[m+(p>>1)]=name;
+	}
+
+	/* stage 2: recurse if the names aren't unique yet */
+	if(name<m) {
+		RA=SA+n+fs-m;
+		for(i=n-1,j=m-1;m<=i;i--) {
+			if(SA[i]!=0) RA[j--]=SA[i]-1;
+		}
+		if(sais_main(RA,SA,fs+n-m*2,m,name,1)!=0) {
+			free(C);
+			return -1;
+		}
+		for(i=n-2,j=m-1,c=0,c1=SAIS_CHR(T,n-1,cs);0<=i;i--,c1=c0) {
+			if((c0=SAIS_CHR(T,i,cs))<(c1+c)) c=1;
+			else if(c!=0) { RA[j--]=i+1;c=0; }
+		}
+		for(i=0;i<m;i++) SA[i]=RA[SA[i]];
+	}
+
+	/* stage 3: induce the full suffix array from the sorted LMS set */
+	sais_counts(T,C,n,k,cs);
+	sais_buckets(C,B,k,1);
+	for(i=m;i<n;i++) SA[i]=0;
+	for(i=m-1;0<=i;i--) {
+		j=SA[i];SA[i]=0;
+		SA[--B[SAIS_CHR(T,j,cs)]]=j;
+	}
+	sais_induce(T,SA,C,B,n,k,cs);
+
+	free(C);
+	return 0;
+}
 
-	for(i=0;i<oldsize;i++) I[++buckets[old[i]]]=i;
+/* Fill I[0..oldsize] with the suffix array of old, in the layout the
+ * search() routine expects: I[0] is the empty suffix. */
+static void suffixsort(off_t *I, u_char *old, off_t oldsize)
+{
+	if(sais_main(old,I+1,0,oldsize,256,0)!=0)
+		err(1,"suffix array construction");
 	I[0]=oldsize;
-	for(i=0;i<oldsize;i++) V[i]=buckets[old[i]];
-	V[oldsize]=0;
-	for(i=1;i<256;i++) if(buckets[i]==buckets[i-1]+1) I[buckets[i]]=-1;
-	I[0]=-1;
-
-	for(h=1;I[0]!=-(oldsize+1);h+=h) {
-		len=0;
-		for(i=0;i<oldsize+1;) {
-			if(I[i]<0) {
-				len-=I[i];
-				i-=I[i];
-			} else {
-				if(len) I[i-len]=-len;
-				len=V[I[i]]+1-i;
-				split(I,V,i,len,h);
-				i+=len;
-				len=0;
-			};
-		};
-		if(len) I[i-len]=-len;
-	};
+}
 
-	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
+// Build (if not already built) the cached suffix array for 'old'.
+// Exposed so imgdiff can pre-sort a source that is shared between
+// chunks before handing the chunks to concurrent bsdiff callers;
+// bsdiff() itself otherwise builds *IP lazily and is not thread-safe
+// when two callers share the same IP.
+void bsdiff_presort(u_char* old, off_t oldsize, off_t** IP)
+{
+        if (*IP == NULL) {
+            *IP = malloc((oldsize+1) * sizeof(off_t));
+            suffixsort(*IP, old, oldsize);
+        }
 }
 
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
@@ -219,7 +298,7 @@ static void offtout(off_t x,u_char *buf)
 //    - the "I" block of memory is owned by the caller, who passes a
 //      pointer to *I, which can be NULL.  This way if we call
 //      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//      the suffixsort() step the first time.
 //
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
            const char* patch_filename)
@@ -240,13 +319,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	BZFILE * pfbz2;
 	int bz2err;
 
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
-        }
+        bsdiff_presort(old, oldsize, IP);
         I = *IP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
@@ -21,6 +21,8 @@
 // notice.
 
 #include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -28,6 +30,10 @@
 
 #include <bzlib.h>
 
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "mincrypt/sha.h"
 #include "applypatch.h"
 
@@ -81,6 +87,41 @@ static off_t offtin(u_char *buf)
     return y;
 }
 
+// dst[i] += src[i] for i in [0, len).  This is the hot inner loop of
+// bspatch; on ARM we add 16 bytes per iteration with NEON.
+static void add_bytes(unsigned char* dst, const unsigned char* src,
+                      ssize_t len) {
+    ssize_t i = 0;
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t d = vld1q_u8(dst + i);
+        uint8x16_t s = vld1q_u8(src + i);
+        vst1q_u8(dst + i, vaddq_u8(d, s));
+    }
+#endif
+    for (; i < len; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+// Like the original guarded add loop: bytes whose source position falls
+// outside [0, old_size) are left untouched.  "oldpos" is the source
+// position of dst[0].
+static void add_old_data(unsigned char* dst, const unsigned char* old_data,
+                         ssize_t old_size, off_t oldpos, ssize_t len) {
+    ssize_t lo = 0, hi = len;
+
+    if (oldpos < 0) {
+        lo = -oldpos;
+        if (lo > len) lo = len;
+    }
+    if (oldpos + len > old_size) {
+        hi = old_size - oldpos;
+        if (hi < lo) hi = lo;
+    }
+    add_bytes(dst + lo, old_data + oldpos + lo, hi - lo);
+}
+
 int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     stream->next_out = (char*)buffer;
     stream->avail_out = size;
@@ -97,25 +138,278 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     return 0;
 }
 
+// Size of each of the two staging buffers the streaming patcher
+// ping-pongs between.  One is being filled (decompress + add) while the
+// writer thread sinks the other.
+#define BSPATCH_STREAM_BUF (256 * 1024)
+
+// Hand-off state between the patch producer and the writer thread.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char* pending;     // buffer ready to be written, or NULL
+    ssize_t pending_len;
+    int done;                   // no more buffers coming
+    int write_error;
+    SinkFn sink;
+    void* token;
+} WriterState;
+
+static void* bspatch_writer(void* arg) {
+    WriterState* ws = (WriterState*) arg;
+
+    pthread_mutex_lock(&ws->lock);
+    while (1) {
+        while (ws->pending == NULL && !ws->done) {
+            pthread_cond_wait(&ws->cond, &ws->lock);
+        }
+        if (ws->pending == NULL) break;   // done and drained
+
+        unsigned char* data = ws->pending;
+        ssize_t len = ws->pending_len;
+        pthread_mutex_unlock(&ws->lock);
+
+        int err = 0;
+        if (ws->sink(data, len, ws->token) < len) {
+            printf("short write of output: %d (%s)\n", errno, strerror(errno));
+            err = 1;
+        }
+
+        pthread_mutex_lock(&ws->lock);
+        ws->pending = NULL;
+        if (err) ws->write_error = 1;
+        pthread_cond_broadcast(&ws->cond);
+    }
+    pthread_mutex_unlock(&ws->lock);
+    return NULL;
+}
+
+// Queue "len" bytes at "data" for the writer thread, blocking until the
+// previous buffer has been sunk.  Returns 0 on success.
+static int writer_submit(WriterState* ws, unsigned char* data, ssize_t len) {
+    pthread_mutex_lock(&ws->lock);
+    while (ws->pending != NULL && !ws->write_error) {
+        pthread_cond_wait(&ws->cond, &ws->lock);
+    }
+    if (ws->write_error) {
+        pthread_mutex_unlock(&ws->lock);
+        return 1;
+    }
+    ws->pending = data;
+    ws->pending_len = len;
+    pthread_cond_broadcast(&ws->cond);
+    pthread_mutex_unlock(&ws->lock);
+    return 0;
+}
+
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
                      SinkFn sink, void* token, SHA_CTX* ctx) {
+    // Stream the patched output through a pair of staging buffers
+    // instead of materializing the whole new file: decompression and
+    // the add loop run here while a writer thread sinks the previous
+    // chunk, so I/O overlaps CPU and peak memory stays bounded.
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
+    unsigned char* header = (unsigned char*) patch->data + patch_offset;
+    if (memcmp(header, "BSDIFF40", 8) != 0) {
+        printf("corrupt bsdiff patch file header (magic number)\n");
+        return 1;
     }
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
+    ssize_t ctrl_len, data_len, new_size;
+    ctrl_len = offtin(header+8);
+    data_len = offtin(header+16);
+    new_size = offtin(header+24);
+
+    if (ctrl_len < 0 || data_len < 0 || new_size < 0) {
+        printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
-    if (ctx) SHA_update(ctx, new_data, new_size);
-    free(new_data);
 
-    return 0;
+    int bzerr;
+
+    bz_stream cstream;
+    cstream.next_in = patch->data + patch_offset + 32;
+    cstream.avail_in = ctrl_len;
+    cstream.bzalloc = NULL;
+    cstream.bzfree = NULL;
+    cstream.opaque = NULL;
+    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
+        printf("failed to bzinit control stream (%d)\n", bzerr);
+    }
+
+    bz_stream dstream;
+    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
+    dstream.avail_in = data_len;
+    dstream.bzalloc = NULL;
+    dstream.bzfree = NULL;
+    dstream.opaque = NULL;
+    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
+        printf("failed to bzinit diff stream (%d)\n", bzerr);
+    }
+
+    bz_stream estream;
+    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
+    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
+    estream.bzalloc = NULL;
+    estream.bzfree = NULL;
+    estream.opaque = NULL;
+    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
+        printf("failed to bzinit extra stream (%d)\n", bzerr);
+    }
+
+    unsigned char* bufs = malloc(2 * BSPATCH_STREAM_BUF);
+    if (bufs == NULL) {
+        printf("failed to allocate streaming buffers\n");
+        return 1;
+    }
+
+    WriterState ws;
+    pthread_mutex_init(&ws.lock, NULL);
+    pthread_cond_init(&ws.cond, NULL);
+    ws.pending = NULL;
+    ws.pending_len = 0;
+    ws.done = 0;
+    ws.write_error = 0;
+    ws.sink = sink;
+    ws.token = token;
+
+    pthread_t writer;
+    int have_writer = (pthread_create(&writer, NULL, bspatch_writer, &ws) == 0);
+
+    int ret = 1;
+    int cur = 0;                      // which staging buffer we're filling
+    ssize_t fill = 0;                 // bytes staged in the current buffer
+    off_t oldpos = 0, newpos = 0;
+    off_t ctrl[3];
+    unsigned char buf[24];
+
+    while (newpos < new_size) {
+        // Read control data
+        if (FillBuffer(buf, 24, &cstream) != 0) {
+            printf("error while reading control stream\n");
+            goto bail;
+        }
+        ctrl[0] = offtin(buf);
+        ctrl[1] = offtin(buf+8);
+        ctrl[2] = offtin(buf+16);
+
+        if (ctrl[0] < 0 || ctrl[1] < 0) {
+            printf("corrupt patch (negative byte counts)\n");
+            goto bail;
+        }
+
+        if (newpos + ctrl[0] + ctrl[1] > new_size) {
+            printf("corrupt patch (new file overrun)\n");
+            goto bail;
+        }
+
+        // Diff region: decompress into the staging buffer in chunks,
+        // add the old data, and flush full buffers to the writer.
+        off_t remaining = ctrl[0];
+        while (remaining > 0) {
+            ssize_t chunk = BSPATCH_STREAM_BUF - fill;
+            if (chunk > remaining) chunk = remaining;
+            unsigned char* dst = bufs + cur * BSPATCH_STREAM_BUF + fill;
+
+            if (FillBuffer(dst, chunk, &dstream) != 0) {
+                printf("error while reading diff stream\n");
+                goto bail;
+            }
+            add_old_data(dst, old_data, old_size, oldpos, chunk);
+            if (ctx) SHA_update(ctx, dst, chunk);
+
+            fill += chunk;
+            oldpos += chunk;
+            newpos += chunk;
+            remaining -= chunk;
+
+            if (fill == BSPATCH_STREAM_BUF) {
+                if (have_writer) {
+                    if (writer_submit(&ws, bufs + cur * BSPATCH_STREAM_BUF,
+                                      fill) != 0) goto bail;
+                    cur = 1 - cur;
+                } else {
+                    if (sink(bufs + cur * BSPATCH_STREAM_BUF, fill,
+                             token) < fill) {
+                        printf("short write of output: %d (%s)\n",
+                               errno, strerror(errno));
+                        goto bail;
+                    }
+                }
+                fill = 0;
+            }
+        }
+
+        // Extra region: same staging, no add loop.
+        remaining = ctrl[1];
+        while (remaining > 0) {
+            ssize_t chunk = BSPATCH_STREAM_BUF - fill;
+            if (chunk > remaining) chunk = remaining;
+            unsigned char* dst = bufs + cur * BSPATCH_STREAM_BUF + fill;
+
+            if (FillBuffer(dst, chunk, &estream) != 0) {
+                printf("error while reading extra stream\n");
+                goto bail;
+            }
+            if (ctx) SHA_update(ctx, dst, chunk);
+
+            fill += chunk;
+            newpos += chunk;
+            remaining -= chunk;
+
+            if (fill == BSPATCH_STREAM_BUF) {
+                if (have_writer) {
+                    if (writer_submit(&ws, bufs + cur * BSPATCH_STREAM_BUF,
+                                      fill) != 0) goto bail;
+                    cur = 1 - cur;
+                } else {
+                    if (sink(bufs + cur * BSPATCH_STREAM_BUF, fill,
+                             token) < fill) {
+                        printf("short write of output: %d (%s)\n",
+                               errno, strerror(errno));
+                        goto bail;
+                    }
+                }
+                fill = 0;
+            }
+        }
+
+        oldpos += ctrl[2];
+    }
+
+    // Flush the final partial buffer.
+    if (fill > 0) {
+        if (have_writer) {
+            if (writer_submit(&ws, bufs + cur * BSPATCH_STREAM_BUF,
+                              fill) != 0) goto bail;
+        } else {
+            if (sink(bufs + cur * BSPATCH_STREAM_BUF, fill, token) < fill) {
+                printf("short write of output: %d (%s)\n",
+                       errno, strerror(errno));
+                goto bail;
+            }
+        }
+    }
+
+    ret = 0;
+
+bail:
+    if (have_writer) {
+        pthread_mutex_lock(&ws.lock);
+        ws.done = 1;
+        pthread_cond_broadcast(&ws.cond);
+        pthread_mutex_unlock(&ws.lock);
+        pthread_join(writer, NULL);
+        if (ws.write_error) ret = 1;
+    }
+    pthread_mutex_destroy(&ws.lock);
+    pthread_cond_destroy(&ws.cond);
+    free(bufs);
+    BZ2_bzDecompressEnd(&cstream);
+    BZ2_bzDecompressEnd(&dstream);
+    BZ2_bzDecompressEnd(&estream);
+    return ret;
 }
 
 int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
@@ -190,8 +484,6 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
 
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
     unsigned char buf[24];
     while (newpos < *new_size) {
         // Read control data
@@ -221,11 +513,7 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         }
 
         // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
-            }
-        }
+        add_old_data(*new_data + newpos, old_data, old_size, oldpos, ctrl[0]);
 
         // Adjust pointers
         newpos += ctrl[0];
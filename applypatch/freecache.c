@@ -11,7 +11,15 @@
 
 #include "applypatch.h"
 
-static int EliminateOpenFiles(char** files, int file_count) {
+// One deletion candidate, captured during the directory scan so the
+// eviction pass never has to stat anything again.
+typedef struct {
+  char* name;
+  size_t size;
+  time_t mtime;
+} ExpendableFile;
+
+static int EliminateOpenFiles(ExpendableFile* files, int file_count) {
   DIR* d;
   struct dirent* de;
   d = opendir("/proc");
@@ -55,10 +63,10 @@ static int EliminateOpenFiles(char** files, int file_count) {
         if (strncmp(link, "/cache/", 7) == 0) {
           int j;
           for (j = 0; j < file_count; ++j) {
-            if (files[j] && strcmp(files[j], link) == 0) {
+            if (files[j].name && strcmp(files[j].name, link) == 0) {
               printf("%s is open by %s\n", link, de->d_name);
-              free(files[j]);
-              files[j] = NULL;
+              free(files[j].name);
+              files[j].name = NULL;
             }
           }
         }
@@ -71,12 +79,26 @@ static int EliminateOpenFiles(char** files, int file_count) {
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
+// Oldest files first; among equally old files, prefer deleting the
+// bigger one so fewer unlinks are needed to reach the target.
+static int expendable_compare(const void* a, const void* b) {
+  const ExpendableFile* fa = (const ExpendableFile*)a;
+  const ExpendableFile* fb = (const ExpendableFile*)b;
+  if (fa->mtime != fb->mtime) {
+    return (fa->mtime < fb->mtime) ? -1 : 1;
+  }
+  if (fa->size != fb->size) {
+    return (fa->size > fb->size) ? -1 : 1;
+  }
+  return 0;
+}
+
+static int FindExpendableFiles(ExpendableFile** files, int* entries) {
   DIR* d;
   struct dirent* de;
   int size = 32;
   *entries = 0;
-  *names = malloc(size * sizeof(char*));
+  *files = malloc(size * sizeof(ExpendableFile));
 
   char path[FILENAME_MAX];
 
@@ -107,9 +129,12 @@ int FindExpendableFiles(char*** names, int* entries) {
       if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
         if (*entries >= size) {
           size *= 2;
-          *names = realloc(*names, size * sizeof(char*));
+          *files = realloc(*files, size * sizeof(ExpendableFile));
         }
-        (*names)[(*entries)++] = strdup(path);
+        (*files)[*entries].name = strdup(path);
+        (*files)[*entries].size = st.st_size;
+        (*files)[*entries].mtime = st.st_mtime;
+        ++*entries;
       }
     }
 
@@ -118,10 +143,13 @@ int FindExpendableFiles(char*** names, int* entries) {
 
   printf("%d regular files in deletable directories\n", *entries);
 
-  if (EliminateOpenFiles(*names, *entries) < 0) {
+  if (EliminateOpenFiles(*files, *entries) < 0) {
     return -1;
   }
 
+  // Index the survivors so the caller can evict in one ordered sweep.
+  qsort(*files, *entries, sizeof(ExpendableFile), expendable_compare);
+
   return 0;
 }
 
@@ -134,10 +162,10 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
     return 0;
   }
 
-  char** names;
+  ExpendableFile* files;
   int entries;
 
-  if (FindExpendableFiles(&names, &entries) < 0) {
+  if (FindExpendableFiles(&files, &entries) < 0) {
     return -1;
   }
 
@@ -147,26 +175,39 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
     return -1;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
-
+  // Delete candidates oldest-first in a single sweep.  Rather than
+  // calling statfs after every unlink, track how much we expect each
+  // deletion to free and only re-check the filesystem once enough has
+  // notionally been reclaimed; sparse files and filesystem overhead
+  // mean the estimate can run high, in which case the sweep just
+  // continues with the updated numbers.
+  size_t reclaimed = 0;
   int i;
   for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
+    if (files[i].name == NULL) continue;
+
+    if (unlink(files[i].name) == 0) {
+      printf("deleted %s (%ld bytes)\n", files[i].name, (long)files[i].size);
+      reclaimed += files[i].size;
+    } else {
+      printf("failed to unlink %s: %s\n", files[i].name, strerror(errno));
+    }
+
+    if (free_now + reclaimed >= bytes_needed) {
       free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
+      reclaimed = 0;
+      printf("now %ld bytes free on /cache (%ld needed)\n",
+             (long)free_now, (long)bytes_needed);
     }
   }
+  if (free_now < bytes_needed && reclaimed > 0) {
+    free_now = FreeSpaceForFile("/cache");
+  }
 
-  for (; i < entries; ++i) {
-    free(names[i]);
+  for (i = 0; i < entries; ++i) {
+    free(files[i].name);
   }
-  free(names);
+  free(files);
 
   return (free_now >= bytes_needed) ? 0 : -1;
 }
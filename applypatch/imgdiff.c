@@ -122,6 +122,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -181,6 +182,17 @@ static int fileentry_compare(const void* a, const void* b) {
 // from bsdiff.c
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
            const char* patch_filename);
+void bsdiff_presort(u_char* old, off_t oldsize, off_t** IP);
+
+// How many worker threads to fan chunk work out across.  This is a
+// host tool, so use every core the build machine has; each job is a
+// whole chunk, so more threads than chunks buys nothing.
+static int WorkerCount(int num_jobs) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) n = 1;
+  if (n > num_jobs) n = num_jobs;
+  return (int)n;
+}
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -598,6 +610,67 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
   return -1;
 }
 
+/*
+ * Run ReconstructDeflateChunk() on every deflate chunk in the list
+ * concurrently, recording each verdict in results[] (0 on success,
+ * nonzero on failure; entries for non-deflate chunks are left at 0).
+ * The parameter search recompresses every chunk up to twice, which is
+ * by far the most expensive part of target analysis, and the chunks
+ * are completely independent.
+ */
+typedef struct {
+  ImageChunk* chunks;
+  int* results;
+  int num_chunks;
+  int next_chunk;
+  pthread_mutex_t lock;
+} ReconstructPool;
+
+static void* ReconstructWorker(void* cookie) {
+  ReconstructPool* pool = (ReconstructPool*) cookie;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    int i = pool->next_chunk;
+    if (i >= pool->num_chunks) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    ++pool->next_chunk;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pool->chunks[i].type == CHUNK_DEFLATE) {
+      pool->results[i] = ReconstructDeflateChunk(pool->chunks+i);
+    }
+  }
+}
+
+static void ReconstructAllDeflateChunks(ImageChunk* chunks, int num_chunks,
+                                        int* results) {
+  ReconstructPool pool;
+  pool.chunks = chunks;
+  pool.results = results;
+  pool.num_chunks = num_chunks;
+  pool.next_chunk = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+
+  memset(results, 0, num_chunks * sizeof(int));
+
+  int num_threads = WorkerCount(num_chunks);
+  pthread_t threads[num_threads];
+  int i, started = 0;
+  for (i = 0; i < num_threads-1; ++i) {
+    if (pthread_create(threads+started, NULL, ReconstructWorker, &pool) != 0) {
+      break;
+    }
+    ++started;
+  }
+  ReconstructWorker(&pool);   // this thread works too
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&pool.lock);
+}
+
 /*
  * Given source and target chunks, compute a bsdiff patch between them
  * by running bsdiff in a subprocess.  Return the patch data, placing
@@ -668,6 +741,81 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   return data;
 }
 
+/*
+ * Worker pool for computing the per-chunk bsdiff patches.  Each job is
+ * one (source, target) pair; jobs never share a target, and any source
+ * shared between jobs (the whole-file source used for normal chunks in
+ * zip mode) must have its suffix array built with bsdiff_presort()
+ * before the pool runs, since bsdiff() builds it lazily and two
+ * workers must not race on the same cache.
+ */
+typedef struct {
+  ImageChunk* src;
+  ImageChunk* tgt;
+  unsigned char** data;
+  size_t* size;
+} PatchJob;
+
+typedef struct {
+  PatchJob* jobs;
+  int num_jobs;
+  int next_job;
+  pthread_mutex_t lock;
+} PatchPool;
+
+static void* PatchWorker(void* cookie) {
+  PatchPool* pool = (PatchPool*) cookie;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    int i = pool->next_job;
+    if (i >= pool->num_jobs) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    ++pool->next_job;
+    pthread_mutex_unlock(&pool->lock);
+
+    PatchJob* job = pool->jobs + i;
+    *job->data = MakePatch(job->src, job->tgt, job->size);
+  }
+}
+
+static void RunPatchJobs(PatchJob* jobs, int num_jobs) {
+  PatchPool pool;
+  pool.jobs = jobs;
+  pool.num_jobs = num_jobs;
+  pool.next_job = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+
+  // Pre-sort any source that more than one job patches against, so
+  // the workers only ever build suffix arrays for sources they own
+  // exclusively.
+  int i, j;
+  for (i = 0; i < num_jobs; ++i) {
+    for (j = 0; j < i; ++j) {
+      if (jobs[j].src == jobs[i].src) {
+        bsdiff_presort(jobs[i].src->data, jobs[i].src->len, &jobs[i].src->I);
+        break;
+      }
+    }
+  }
+
+  int num_threads = WorkerCount(num_jobs);
+  pthread_t threads[num_threads];
+  int started = 0;
+  for (i = 0; i < num_threads-1; ++i) {
+    if (pthread_create(threads+started, NULL, PatchWorker, &pool) != 0) {
+      break;
+    }
+    ++started;
+  }
+  PatchWorker(&pool);   // this thread works too
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&pool.lock);
+}
+
 /*
  * Cause a gzip chunk to be treated as a normal chunk (ie, as a blob
  * of uninterpreted data).  The resulting patch will likely be about
@@ -876,13 +1024,20 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Confirm that given the uncompressed chunk data in the target, we
+  // can recompress it and get exactly the same bits as are in the
+  // input target image.  The parameter search for each chunk is
+  // independent and expensive, so fan it out across all cores; the
+  // fixups for chunks that fail stay serial below because they mutate
+  // the source list.
+  int* reconstructed = malloc(num_tgt_chunks * sizeof(int));
+  ReconstructAllDeflateChunks(tgt_chunks, num_tgt_chunks, reconstructed);
+
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (tgt_chunks[i].type == CHUNK_DEFLATE) {
-      // Confirm that given the uncompressed chunk data in the target, we
-      // can recompress it and get exactly the same bits as are in the
-      // input target image.  If this fails, treat the chunk as a normal
+      // If the chunk couldn't be reconstructed, treat it as a normal
       // non-deflated chunk.
-      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
+      if (reconstructed[i] < 0) {
         printf("failed to reconstruct target deflate chunk %d [%s]; "
                "treating as normal\n", i, tgt_chunks[i].filename);
         ChangeDeflateChunkToNormal(tgt_chunks+i);
@@ -918,6 +1073,7 @@ int main(int argc, char** argv) {
       }
     }
   }
+  free(reconstructed);
 
   // Merging neighboring normal chunks.
   if (zip_mode) {
@@ -946,15 +1102,16 @@ int main(int argc, char** argv) {
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
   unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
   size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  PatchJob* jobs = malloc(num_tgt_chunks * sizeof(PatchJob));
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        jobs[i].src = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        jobs[i].src = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -964,7 +1121,22 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      jobs[i].src = src_chunks+i;
+    }
+    jobs[i].tgt = tgt_chunks+i;
+    jobs[i].data = patch_data+i;
+    jobs[i].size = patch_size+i;
+  }
+
+  // Each chunk's patch only depends on its own source/target pair, so
+  // the bsdiff runs can proceed in parallel.
+  RunPatchJobs(jobs, num_tgt_chunks);
+  free(jobs);
+
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (patch_data[i] == NULL) {
+      printf("failed to generate patch for chunk %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
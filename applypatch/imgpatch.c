@@ -18,6 +18,8 @@
 // format.
 
 #include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <sys/cdefs.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -30,11 +32,222 @@
 #include "imgdiff.h"
 #include "utils.h"
 
+// Number of worker threads patching chunks concurrently, and the
+// maximum number of finished-but-not-yet-sunk chunk outputs we'll hold
+// in memory while the coordinator catches up.
+#define IMGPATCH_MAX_THREADS 4
+#define IMGPATCH_MAX_INFLIGHT 4
+
+// One chunk of the image patch, parsed up front so workers can process
+// chunks independently and the coordinator can sink the outputs in
+// order.
+typedef struct {
+    int type;
+
+    // CHUNK_NORMAL / CHUNK_DEFLATE
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_DEFLATE only
+    size_t expanded_len;
+    size_t target_len;
+    int level, method, windowBits, memLevel, strategy;
+    size_t bonus_size;
+
+    // CHUNK_RAW: data lives inside the patch itself.
+    ssize_t raw_start;
+    ssize_t raw_len;
+
+    // Result, produced by a worker.
+    unsigned char* out;         // NULL for CHUNK_RAW (sunk from the patch)
+    ssize_t out_len;
+    int done;                   // protected by the shared lock
+    int error;
+} ChunkWork;
+
+// State shared between the chunk workers and the coordinator.
+typedef struct {
+    const unsigned char* old_data;
+    const Value* patch;
+    const Value* bonus_data;
+    ChunkWork* chunks;
+    int num_chunks;
+    int next_chunk;             // next chunk index to claim; under lock
+    int next_sink;              // next chunk index to be sunk; under lock
+    int failed;                 // under lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ImgPatchState;
+
+// Produce the output of one chunk into chunk->out / chunk->out_len.
+// RAW chunks produce nothing (the coordinator sinks straight from the
+// patch data).  Returns 0 on success.
+static int produce_chunk(ImgPatchState* st, ChunkWork* chunk) {
+    const Value* patch = st->patch;
+
+    if (chunk->type == CHUNK_RAW) {
+        return 0;
+    }
+
+    if (chunk->type == CHUNK_NORMAL) {
+        if (ApplyBSDiffPatchMem(st->old_data + chunk->src_start,
+                                chunk->src_len, patch, chunk->patch_offset,
+                                &chunk->out, &chunk->out_len) != 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    // CHUNK_DEFLATE: inflate the source region, bspatch it, then
+    // re-deflate with the original parameters.
+
+    unsigned char* expanded_source = malloc(chunk->expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %zu bytes for expanded_source\n",
+               chunk->expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = chunk->src_len;
+    strm.next_in = (unsigned char*)(st->old_data + chunk->src_start);
+    strm.avail_out = chunk->expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != chunk->bonus_size) {
+        printf("source inflation short by %zu bytes\n",
+               strm.avail_out - chunk->bonus_size);
+        free(expanded_source);
+        return -1;
+    }
+    inflateEnd(&strm);
+
+    if (chunk->bonus_size) {
+        memcpy(expanded_source + (chunk->expanded_len - chunk->bonus_size),
+               st->bonus_data->data, chunk->bonus_size);
+    }
+
+    // Apply the bsdiff patch (in memory) to the uncompressed data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    if (ApplyBSDiffPatchMem(expanded_source, chunk->expanded_len,
+                            patch, chunk->patch_offset,
+                            &uncompressed_target_data,
+                            &uncompressed_target_size) != 0) {
+        free(expanded_source);
+        return -1;
+    }
+    free(expanded_source);
+
+    // Compress the target data into a growable output buffer.
+    size_t out_alloc = uncompressed_target_size / 2 + 32768;
+    unsigned char* out = malloc(out_alloc);
+    if (out == NULL) {
+        printf("failed to allocate deflate output buffer\n");
+        free(uncompressed_target_data);
+        return -1;
+    }
+    size_t out_size = 0;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    ret = deflateInit2(&strm, chunk->level, chunk->method, chunk->windowBits,
+                       chunk->memLevel, chunk->strategy);
+    if (ret != Z_OK) {
+        printf("failed to init target deflation: %d\n", ret);
+        free(out);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    do {
+        if (out_alloc - out_size < 32768) {
+            out_alloc *= 2;
+            unsigned char* newout = realloc(out, out_alloc);
+            if (newout == NULL) {
+                printf("failed to grow deflate output buffer\n");
+                free(out);
+                free(uncompressed_target_data);
+                deflateEnd(&strm);
+                return -1;
+            }
+            out = newout;
+        }
+        strm.avail_out = out_alloc - out_size;
+        strm.next_out = out + out_size;
+        ret = deflate(&strm, Z_FINISH);
+        out_size = out_alloc - strm.avail_out;
+    } while (ret != Z_STREAM_END);
+    deflateEnd(&strm);
+    free(uncompressed_target_data);
+
+    chunk->out = out;
+    chunk->out_len = out_size;
+    return 0;
+}
+
+// Worker thread: claim chunks off the shared cursor and produce their
+// outputs, staying no more than IMGPATCH_MAX_INFLIGHT chunks ahead of
+// the coordinator so memory stays bounded.
+static void* imgpatch_worker(void* arg) {
+    ImgPatchState* st = (ImgPatchState*) arg;
+
+    while (1) {
+        pthread_mutex_lock(&st->lock);
+        while (!st->failed && st->next_chunk < st->num_chunks &&
+               st->next_chunk - st->next_sink >= IMGPATCH_MAX_INFLIGHT) {
+            pthread_cond_wait(&st->cond, &st->lock);
+        }
+        if (st->failed || st->next_chunk >= st->num_chunks) {
+            pthread_mutex_unlock(&st->lock);
+            break;
+        }
+        ChunkWork* chunk = &st->chunks[st->next_chunk++];
+        pthread_mutex_unlock(&st->lock);
+
+        int err = produce_chunk(st, chunk);
+
+        pthread_mutex_lock(&st->lock);
+        chunk->done = 1;
+        chunk->error = err;
+        if (err) st->failed = 1;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+    return NULL;
+}
+
 /*
  * Apply the patch given in 'patch_filename' to the source data given
  * by (old_data, old_size).  Write the patched output to the 'output'
  * file, and update the SHA context with the output data as well.
  * Return 0 on success.
+ *
+ * Chunks are patched by a pool of worker threads; the outputs are sunk
+ * (and hashed) strictly in chunk order by this thread.
  */
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
                     const Value* patch,
@@ -56,178 +269,191 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
     }
 
     int num_chunks = Read4(header+8);
+    if (num_chunks <= 0) {
+        printf("patch has bad chunk count %d\n", num_chunks);
+        return -1;
+    }
 
+    ChunkWork* chunks = calloc(num_chunks, sizeof(ChunkWork));
+    if (chunks == NULL) {
+        printf("failed to allocate chunk table\n");
+        return -1;
+    }
+
+    // Pass 1: parse all the chunk headers so workers can run
+    // independently.
     int i;
     for (i = 0; i < num_chunks; ++i) {
+        ChunkWork* chunk = &chunks[i];
+
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto fail;
         }
-        int type = Read4(patch->data + pos);
+        chunk->type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (chunk->type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            chunk->src_start = Read8(normal_header);
+            chunk->src_len = Read8(normal_header+8);
+            chunk->patch_offset = Read8(normal_header+16);
+        } else if (chunk->type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            ssize_t data_len = Read4(raw_header);
-
-            if (pos + data_len > patch->size) {
+            chunk->raw_len = Read4(raw_header);
+            chunk->raw_start = pos;
+            if (pos + chunk->raw_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
-            }
-            if (ctx) SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
+                goto fail;
             }
-            pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+            pos += chunk->raw_len;
+        } else if (chunk->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
+            chunk->src_start = Read8(deflate_header);
+            chunk->src_len = Read8(deflate_header+8);
+            chunk->patch_offset = Read8(deflate_header+16);
+            chunk->expanded_len = Read8(deflate_header+24);
+            chunk->target_len = Read8(deflate_header+32);
+            chunk->level = Read4(deflate_header+40);
+            chunk->method = Read4(deflate_header+44);
+            chunk->windowBits = Read4(deflate_header+48);
+            chunk->memLevel = Read4(deflate_header+52);
+            chunk->strategy = Read4(deflate_header+56);
 
             // Note: expanded_len will include the bonus data size if
             // the patch was constructed with bonus data.  The
             // deflation will come up 'bonus_size' bytes short; these
             // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+            chunk->bonus_size =
+                (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, chunk->type);
+            goto fail;
+        }
+    }
 
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %zu bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
-            }
+    // Pass 2: fan the chunks out to workers; sink results in order.
+    ImgPatchState st;
+    st.old_data = old_data;
+    st.patch = patch;
+    st.bonus_data = bonus_data;
+    st.chunks = chunks;
+    st.num_chunks = num_chunks;
+    st.next_chunk = 0;
+    st.next_sink = 0;
+    st.failed = 0;
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
-            }
+    pthread_t threads[IMGPATCH_MAX_THREADS];
+    int thread_count = 0;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = IMGPATCH_MAX_THREADS;
+    if (num_cpus > 0 && num_cpus < want) want = num_cpus;
+    if (num_chunks < want) want = num_chunks;
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
-            }
-            // We should have filled the output buffer exactly, except
-            // for the bonus_size.
-            if (strm.avail_out != bonus_size) {
-                printf("source inflation short by %zu bytes\n", strm.avail_out-bonus_size);
-                return -1;
+    if (want > 1) {
+        for (i = 0; i < want; ++i) {
+            if (pthread_create(&threads[thread_count], NULL,
+                               imgpatch_worker, &st) != 0) {
+                break;
             }
-            inflateEnd(&strm);
+            thread_count++;
+        }
+    }
 
-            if (bonus_size) {
-                memcpy(expanded_source + (expanded_len - bonus_size),
-                       bonus_data->data, bonus_size);
-            }
+    int result = 0;
+    for (i = 0; i < num_chunks; ++i) {
+        ChunkWork* chunk = &chunks[i];
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
+        if (thread_count > 0) {
+            pthread_mutex_lock(&st.lock);
+            while (!chunk->done && !st.failed) {
+                pthread_cond_wait(&st.cond, &st.lock);
             }
-
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
+            if (st.failed && !chunk->done) {
+                pthread_mutex_unlock(&st.lock);
+                result = -1;
+                break;
             }
+            pthread_mutex_unlock(&st.lock);
+        } else {
+            // No workers: produce on this thread.
+            chunk->done = 1;
+            chunk->error = produce_chunk(&st, chunk);
+        }
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                if (ctx) SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
+        if (chunk->error) {
+            result = -1;
+            break;
+        }
+
+        const unsigned char* data;
+        ssize_t len;
+        if (chunk->type == CHUNK_RAW) {
+            data = (unsigned char*)patch->data + chunk->raw_start;
+            len = chunk->raw_len;
         } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+            data = chunk->out;
+            len = chunk->out_len;
+        }
+
+        if (ctx) SHA_update(ctx, data, len);
+        if (sink(data, len, token) != len) {
+            printf("failed to write chunk %d output\n", i);
+            result = -1;
+            break;
         }
+
+        free(chunk->out);
+        chunk->out = NULL;
+
+        // Open the in-flight window for the workers.
+        pthread_mutex_lock(&st.lock);
+        st.next_sink = i + 1;
+        pthread_cond_broadcast(&st.cond);
+        pthread_mutex_unlock(&st.lock);
     }
 
-    return 0;
+    // Shut the pool down (on failure, wake anyone parked on the window).
+    pthread_mutex_lock(&st.lock);
+    if (result != 0) st.failed = 1;
+    st.next_sink = num_chunks;
+    pthread_cond_broadcast(&st.cond);
+    pthread_mutex_unlock(&st.lock);
+    for (i = 0; i < thread_count; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.cond);
+
+    for (i = 0; i < num_chunks; ++i) {
+        free(chunks[i].out);
+    }
+    free(chunks);
+    return result;
+
+fail:
+    free(chunks);
+    return -1;
 }
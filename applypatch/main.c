@@ -27,7 +27,40 @@ int CheckMode(int argc, char** argv) {
     if (argc < 3) {
         return 2;
     }
-    return applypatch_check(argv[2], argc-3, argv+3);
+
+    // Arguments are one or more groups of <file> [<sha1> ...],
+    // separated by "--".  Multiple groups are verified as a batch so
+    // reads happen in disk order with hashing pipelined behind them.
+    int num_items = 1;
+    int i;
+    for (i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--") == 0) ++num_items;
+    }
+
+    ApplyPatchCheckItem* items = malloc(num_items * sizeof(ApplyPatchCheckItem));
+    int n = 0;
+    i = 2;
+    while (i < argc) {
+        items[n].filename = argv[i];
+        items[n].patch_sha1_str = argv + i + 1;
+        items[n].num_patches = 0;
+        for (++i; i < argc && strcmp(argv[i], "--") != 0; ++i) {
+            ++items[n].num_patches;
+        }
+        if (i < argc) ++i;   // skip the "--"
+        ++n;
+    }
+
+    int result;
+    if (n == 1) {
+        // preserve the single-file exit status (eg, -ENOENT).
+        result = applypatch_check(items[0].filename, items[0].num_patches,
+                                  items[0].patch_sha1_str);
+    } else {
+        result = applypatch_check_batch(items, n) == 0 ? 0 : 1;
+    }
+    free(items);
+    return result;
 }
 
 int SpaceMode(int argc, char** argv) {
@@ -184,7 +217,7 @@ int main(int argc, char** argv) {
         printf(
             "usage: %s [-b <bonus-file>] <src-file> <tgt-file> <tgt-sha1> <tgt-size> "
             "[<src-sha1>:<patch> ...]\n"
-            "   or  %s -c <file> [<sha1> ...]\n"
+            "   or  %s -c <file> [<sha1> ...] [-- <file> [<sha1> ...] ...]\n"
             "   or  %s -s <bytes>\n"
             "   or  %s -l\n"
             "\n"
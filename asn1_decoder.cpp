@@ -15,15 +15,26 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "asn1_decoder.h"
 
 
+// Child contexts returned by the constructed/sequence/set getters are
+// bump-allocated from a small pool that trails the root context's
+// allocation, so a signature walk costs one calloc total instead of
+// one per nesting step.  Freeing a pooled child is a no-op; everything
+// is released with the root.
+#define ASN1_CONTEXT_POOL 16
+
 typedef struct asn1_context {
     size_t length;
     uint8_t* p;
     int app_type;
+    struct asn1_context* arena;  // root owning this context's storage,
+                                 // or NULL if it was its own allocation
+    int pool_used;               // arena roots: children handed out
 } asn1_context_t;
 
 
@@ -38,7 +49,8 @@ static const int kTagSet = 0x31;
 static const int kTagConstructed = 0xA0;
 
 asn1_context_t* asn1_context_new(uint8_t* buffer, size_t length) {
-    asn1_context_t* ctx = (asn1_context_t*) calloc(1, sizeof(asn1_context_t));
+    asn1_context_t* ctx = (asn1_context_t*) calloc(
+            1 + ASN1_CONTEXT_POOL, sizeof(asn1_context_t));
     if (ctx == NULL) {
         return NULL;
     }
@@ -47,7 +59,33 @@ asn1_context_t* asn1_context_new(uint8_t* buffer, size_t length) {
     return ctx;
 }
 
+static asn1_context_t* asn1_context_child(asn1_context_t* ctx,
+        uint8_t* buffer, size_t length) {
+    asn1_context_t* root = (ctx->arena != NULL) ? ctx->arena : ctx;
+    asn1_context_t* child;
+    if (root->pool_used < ASN1_CONTEXT_POOL) {
+        child = root + 1 + root->pool_used++;
+        memset(child, 0, sizeof(*child));
+        child->arena = root;
+    } else {
+        // Pool exhausted (unusually deep nesting): fall back to a
+        // plain allocation with no pool of its own.
+        child = (asn1_context_t*) calloc(1, sizeof(asn1_context_t));
+        if (child == NULL) {
+            return NULL;
+        }
+        child->pool_used = ASN1_CONTEXT_POOL;
+    }
+    child->p = buffer;
+    child->length = length;
+    return child;
+}
+
 void asn1_context_free(asn1_context_t* ctx) {
+    // Pooled children are released with their root.
+    if (ctx == NULL || ctx->arena != NULL) {
+        return;
+    }
     free(ctx);
 }
 
@@ -115,7 +153,7 @@ asn1_context_t* asn1_constructed_get(asn1_context_t* ctx) {
     if (!decode_length(ctx, &length) || length > ctx->length) {
         return NULL;
     }
-    asn1_context_t* app_ctx = asn1_context_new(ctx->p, length);
+    asn1_context_t* app_ctx = asn1_context_child(ctx, ctx->p, length);
     app_ctx->app_type = type & kMaskAppType;
     return app_ctx;
 }
@@ -145,7 +183,7 @@ asn1_context_t* asn1_sequence_get(asn1_context_t* ctx) {
     if (!decode_length(ctx, &length) || length > ctx->length) {
         return NULL;
     }
-    return asn1_context_new(ctx->p, length);
+    return asn1_context_child(ctx, ctx->p, length);
 }
 
 asn1_context_t* asn1_set_get(asn1_context_t* ctx) {
@@ -156,7 +194,7 @@ asn1_context_t* asn1_set_get(asn1_context_t* ctx) {
     if (!decode_length(ctx, &length) || length > ctx->length) {
         return NULL;
     }
-    return asn1_context_new(ctx->p, length);
+    return asn1_context_child(ctx, ctx->p, length);
 }
 
 bool asn1_sequence_next(asn1_context_t* ctx) {
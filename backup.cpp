@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -18,6 +20,326 @@
 
 using namespace android;
 
+/*
+ * Incremental backups.  --incremental=<path> names an index file from
+ * the previous run, one "<size> <mtime> <path>" line per regular
+ * file.  Files whose size and mtime still match the index are left
+ * out of the archive; every file seen is recorded into a fresh index,
+ * which ships inside the archive as MANIFEST (so the host knows the
+ * full tree the delta was cut against) and replaces <path> once the
+ * backup completes.  The SOD carries incremental=1 so the restore
+ * side layers the archive over the existing contents instead of
+ * formatting first.
+ */
+#define INC_INDEX_TMP "/tmp/bu.index.new"
+
+struct inc_entry {
+    uint64_t size;
+    uint64_t mtime;
+    char* path;
+};
+
+static struct inc_entry* inc_entries;
+static int inc_count;
+static FILE* inc_new;
+static const char* inc_path;
+
+static int inc_entry_cmp(const void* a, const void* b)
+{
+    return strcmp(((const struct inc_entry*)a)->path,
+                  ((const struct inc_entry*)b)->path);
+}
+
+static void inc_init(const char* path)
+{
+    inc_path = path;
+    inc_new = fopen(INC_INDEX_TMP, "w");
+    if (inc_new == NULL) {
+        logmsg("inc_init: cannot create %s, doing full backup\n",
+                INC_INDEX_TMP);
+        inc_path = NULL;
+        return;
+    }
+
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        // first run: full backup, but still build the index
+        logmsg("inc_init: no index at %s, doing full backup\n", path);
+        return;
+    }
+    int alloc = 0;
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char* p = line;
+        uint64_t size = strtoull(p, &p, 10);
+        uint64_t mtime = strtoull(p, &p, 10);
+        if (*p != ' ')
+            continue;
+        ++p;
+        char* nl = strchr(p, '\n');
+        if (nl)
+            *nl = '\0';
+        if (inc_count == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            inc_entries = (struct inc_entry*)realloc(inc_entries,
+                    alloc * sizeof(struct inc_entry));
+        }
+        inc_entries[inc_count].size = size;
+        inc_entries[inc_count].mtime = mtime;
+        inc_entries[inc_count].path = strdup(p);
+        ++inc_count;
+    }
+    fclose(fp);
+    qsort(inc_entries, inc_count, sizeof(struct inc_entry), inc_entry_cmp);
+    logmsg("inc_init: %d entries from %s\n", inc_count, path);
+}
+
+static int inc_unchanged(const char* path, const struct stat* st)
+{
+    if (inc_count == 0)
+        return 0;
+    struct inc_entry key;
+    key.path = (char*)path;
+    struct inc_entry* e = (struct inc_entry*)bsearch(&key, inc_entries,
+            inc_count, sizeof(struct inc_entry), inc_entry_cmp);
+    return e != NULL &&
+            e->size == (uint64_t)st->st_size &&
+            e->mtime == (uint64_t)st->st_mtime;
+}
+
+static void inc_record(const char* path, const struct stat* st)
+{
+    if (inc_new != NULL) {
+        fprintf(inc_new, "%llu %llu %s\n",
+                (unsigned long long)st->st_size,
+                (unsigned long long)st->st_mtime, path);
+    }
+}
+
+static int inc_finish()
+{
+    if (inc_new == NULL)
+        return 0;
+    fclose(inc_new);
+    inc_new = NULL;
+    int rc = tar_append_file(tar, INC_INDEX_TMP, "MANIFEST");
+    if (rc != 0) {
+        logmsg("inc_finish: cannot append manifest, rc=%d\n", rc);
+        return rc;
+    }
+    if (rename(INC_INDEX_TMP, inc_path) != 0) {
+        logmsg("inc_finish: cannot save index to %s\n", inc_path);
+    }
+    return 0;
+}
+
+/*
+ * Readahead pipeline for the tree walk.  tar_append_file reads each
+ * file synchronously, so backing up thousands of small cold files
+ * serializes one open+read round trip to storage per file.  A walker
+ * thread traverses the tree in the same order as do_backup_tree,
+ * feeding a small pool of reader threads that open upcoming files and
+ * pull their contents into the page cache; by the time the tar writer
+ * reaches a file its data is already resident.  Only the writer ever
+ * appends to the archive, so ordering is untouched, and the walker is
+ * throttled against the writer's progress so the window stays bounded.
+ */
+#define RA_READERS 2
+#define RA_QUEUE_LEN 64
+#define RA_WINDOW_BYTES (16 * 1024 * 1024)
+#define RA_FILE_MAX (4 * 1024 * 1024)
+
+struct ra_state {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    char* queue[RA_QUEUE_LEN];
+    int q_head;
+    int q_len;
+
+    uint64_t ahead;         // bytes fetched but not yet consumed by the writer
+    int walk_done;
+    int stop;
+
+    pthread_t walker;
+    pthread_t readers[RA_READERS];
+    int nreaders;
+
+    char root[PATH_MAX];
+    int root_is_data;
+};
+
+static struct ra_state* ra;
+
+static void ra_push(struct ra_state* r, const char* path)
+{
+    char* dup = strdup(path);
+    if (dup == NULL)
+        return;
+    pthread_mutex_lock(&r->lock);
+    while (r->q_len == RA_QUEUE_LEN && !r->stop) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    if (r->stop) {
+        free(dup);
+    }
+    else {
+        r->queue[(r->q_head + r->q_len) % RA_QUEUE_LEN] = dup;
+        ++r->q_len;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Mirrors do_backup_tree's traversal and filters so both visit
+// regular files in the same order.
+static void ra_walk(struct ra_state* r, const char* path)
+{
+    DIR* dp = opendir(path);
+    if (dp == NULL)
+        return;
+    int path_is_data = r->root_is_data && !strcmp(path, r->root);
+    struct dirent* de;
+    while (!r->stop && (de = readdir(dp)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        if (path_is_data && !strcmp(de->d_name, "media") && is_data_media()) {
+            continue;
+        }
+        char filepath[PATH_MAX];
+        snprintf(filepath, sizeof(filepath), "%s/%s", path, de->d_name);
+        struct stat st;
+        if (lstat(filepath, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            ra_walk(r, filepath);
+        }
+        else if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+                !inc_unchanged(filepath, &st)) {
+            ra_push(r, filepath);
+        }
+    }
+    closedir(dp);
+}
+
+static void* ra_walker_thread(void* arg)
+{
+    struct ra_state* r = (struct ra_state*)arg;
+    ra_walk(r, r->root);
+    pthread_mutex_lock(&r->lock);
+    r->walk_done = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static void* ra_reader_thread(void* arg)
+{
+    struct ra_state* r = (struct ra_state*)arg;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        if (r->stop || (r->q_len == 0 && r->walk_done)) {
+            break;
+        }
+        if (r->q_len == 0 || r->ahead > RA_WINDOW_BYTES) {
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        char* path = r->queue[r->q_head];
+        r->q_head = (r->q_head + 1) % RA_QUEUE_LEN;
+        --r->q_len;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+
+        uint64_t fetched = 0;
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                fetched = min((uint64_t)st.st_size, (uint64_t)RA_FILE_MAX);
+                posix_fadvise(fd, 0, fetched, POSIX_FADV_WILLNEED);
+            }
+            close(fd);
+        }
+        free(path);
+
+        pthread_mutex_lock(&r->lock);
+        r->ahead += fetched;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// Writer progress: credit back bytes the tar side has now read so the
+// walker can move the window forward.
+static void ra_consumed(uint64_t len)
+{
+    if (ra == NULL)
+        return;
+    pthread_mutex_lock(&ra->lock);
+    ra->ahead -= min(ra->ahead, len);
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+static void ra_start(const char* root)
+{
+    struct ra_state* r = (struct ra_state*)calloc(1, sizeof(*r));
+    if (r == NULL)
+        return;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    strcpy(r->root, root);
+    r->root_is_data = !strcmp(root, "/data");
+
+    if (pthread_create(&r->walker, NULL, ra_walker_thread, r) != 0) {
+        free(r);
+        return;
+    }
+    int started;
+    for (started = 0; started < RA_READERS; ++started) {
+        if (pthread_create(&r->readers[started], NULL, ra_reader_thread, r) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        pthread_mutex_lock(&r->lock);
+        r->stop = 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->walker, NULL);
+        free(r);
+        return;
+    }
+    r->nreaders = started;
+    ra = r;
+}
+
+static void ra_stop()
+{
+    struct ra_state* r = ra;
+    if (r == NULL)
+        return;
+    ra = NULL;
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->walker, NULL);
+    for (int i = 0; i < r->nreaders; ++i) {
+        pthread_join(r->readers[i], NULL);
+    }
+    while (r->q_len > 0) {
+        free(r->queue[r->q_head]);
+        r->q_head = (r->q_head + 1) % RA_QUEUE_LEN;
+        --r->q_len;
+    }
+    free(r);
+}
+
 static int append_sod(const char* opt_hash)
 {
     const char* key;
@@ -35,6 +357,11 @@ static int append_sod(const char* opt_hash)
     property_get(key, value, "");
     p += sprintf(p, "%s=%s\n", key, value);
 
+    if (inc_count > 0) {
+        // delta against a previous index: restore must not format
+        p += sprintf(p, "incremental=1\n");
+    }
+
     for (int i = 0; i < MAX_PART; ++i) {
         partspec* part = part_get(i);
         if (!part)
@@ -103,6 +430,278 @@ static int append_eod(const char* opt_hash)
     return rc;
 }
 
+/*
+ * Content-addressed dedup.  --dedup=<manifest> puts the backup into a
+ * chunked representation for regular-file payloads: each file is cut
+ * into 1MB chunks, every chunk is SHA1-hashed, and only chunks whose
+ * hash is not in the manifest are shipped, as "CHUNK/<hex>" entries.
+ * Each file itself becomes a "DEDUP<path>" recipe -- its metadata and
+ * the ordered chunk hashes -- from which the host rehydrates it.  The
+ * manifest holds one hex hash per line: the chunks the host already
+ * acknowledged holding; every chunk we ship is appended to it, so
+ * repeated backups in a service session (and near-identical devices
+ * sharing system-app data) transfer each chunk once.  Dedup archives
+ * must be rehydrated on the host before they can be restored.
+ */
+#define DEDUP_CHUNK (1024 * 1024)
+
+struct dd_hash {
+    uint8_t h[SHA_DIGEST_LENGTH];
+};
+
+static struct dd_hash* dd_hashes;
+static int dd_count;
+static int dd_alloc;
+static FILE* dd_append;
+static int dd_active;
+
+static int dd_hash_cmp(const void* a, const void* b)
+{
+    return memcmp(a, b, SHA_DIGEST_LENGTH);
+}
+
+static int dd_hex2bin(const char* hex, uint8_t* bin)
+{
+    for (int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+        unsigned v;
+        if (sscanf(hex + 2*i, "%2x", &v) != 1)
+            return -1;
+        bin[i] = v;
+    }
+    return 0;
+}
+
+static int dd_lookup(const uint8_t* h)
+{
+    return bsearch(h, dd_hashes, dd_count, sizeof(struct dd_hash),
+            dd_hash_cmp) != NULL;
+}
+
+// sorted insert; n is small relative to the memmove cost that matters
+static void dd_add(const uint8_t* h)
+{
+    if (dd_count == dd_alloc) {
+        dd_alloc = dd_alloc ? dd_alloc * 2 : 4096;
+        dd_hashes = (struct dd_hash*)realloc(dd_hashes,
+                dd_alloc * sizeof(struct dd_hash));
+    }
+    int lo = 0;
+    int hi = dd_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (memcmp(dd_hashes[mid].h, h, SHA_DIGEST_LENGTH) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    memmove(&dd_hashes[lo + 1], &dd_hashes[lo],
+            (dd_count - lo) * sizeof(struct dd_hash));
+    memcpy(dd_hashes[lo].h, h, SHA_DIGEST_LENGTH);
+    ++dd_count;
+}
+
+static void dedup_init(const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp != NULL) {
+        char line[128];
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            uint8_t h[SHA_DIGEST_LENGTH];
+            if (strlen(line) >= 2*SHA_DIGEST_LENGTH &&
+                    dd_hex2bin(line, h) == 0) {
+                if (dd_count == dd_alloc) {
+                    dd_alloc = dd_alloc ? dd_alloc * 2 : 4096;
+                    dd_hashes = (struct dd_hash*)realloc(dd_hashes,
+                            dd_alloc * sizeof(struct dd_hash));
+                }
+                memcpy(dd_hashes[dd_count++].h, h, SHA_DIGEST_LENGTH);
+            }
+        }
+        fclose(fp);
+        qsort(dd_hashes, dd_count, sizeof(struct dd_hash), dd_hash_cmp);
+    }
+    dd_append = fopen(path, "a");
+    if (dd_append == NULL) {
+        logmsg("dedup_init: cannot append to %s, dedup disabled\n", path);
+        return;
+    }
+    dd_active = 1;
+    logmsg("dedup_init: %d known chunks from %s\n", dd_count, path);
+}
+
+static int dedup_append_file(TAR* t, const char* savename, const struct stat* st)
+{
+    int fd = open(savename, O_RDONLY);
+    if (fd < 0) {
+        logmsg("dedup_append_file: open %s failed\n", savename);
+        return -1;
+    }
+
+    int nchunks = st->st_size / DEDUP_CHUNK + 1;
+    // header line plus one hash line per chunk
+    size_t recipe_max = 128 + nchunks * (2*SHA_DIGEST_LENGTH + 16);
+    char* recipe = (char*)malloc(recipe_max);
+    uint8_t* buf = (uint8_t*)malloc(DEDUP_CHUNK);
+    if (recipe == NULL || buf == NULL) {
+        free(recipe);
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    char* p = recipe;
+    p += sprintf(p, "size=%llu mode=%o uid=%d gid=%d mtime=%lu\n",
+            (unsigned long long)st->st_size, st->st_mode,
+            st->st_uid, st->st_gid, (unsigned long)st->st_mtime);
+
+    int rc = 0;
+    for (;;) {
+        ssize_t n = read(fd, buf, DEDUP_CHUNK);
+        if (n < 0) {
+            logmsg("dedup_append_file: read %s failed\n", savename);
+            rc = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        uint8_t digest[SHA_DIGEST_LENGTH];
+        SHA_CTX ctx;
+        SHA1_Init(&ctx);
+        SHA1_Update(&ctx, buf, n);
+        SHA1_Final(digest, &ctx);
+
+        char hexdigest[2*SHA_DIGEST_LENGTH + 1];
+        for (int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+            sprintf(hexdigest + 2*i, "%02x", digest[i]);
+        }
+        p += sprintf(p, "%s %u\n", hexdigest, (unsigned)n);
+
+        if (!dd_lookup(digest)) {
+            char chunkname[64];
+            sprintf(chunkname, "CHUNK/%s", hexdigest);
+            rc = tar_append_file_contents(t, chunkname, 0600,
+                    getuid(), getgid(), buf, n);
+            if (rc != 0) {
+                logmsg("dedup_append_file: cannot append chunk\n");
+                break;
+            }
+            dd_add(digest);
+            fprintf(dd_append, "%s\n", hexdigest);
+        }
+    }
+    close(fd);
+
+    if (rc == 0) {
+        char recipename[PATH_MAX + 8];
+        snprintf(recipename, sizeof(recipename), "DEDUP%s", savename);
+        rc = tar_append_file_contents(t, recipename, 0600,
+                getuid(), getgid(), recipe, p - recipe);
+    }
+    free(recipe);
+    free(buf);
+    return rc;
+}
+
+/*
+ * Sparse-aware append.  tar_append_file reads a sparse file as a
+ * fully materialized byte stream, pulling page after page of zeros
+ * through the cache.  For large files that are actually sparse we
+ * write the header ourselves (as tar_append_device_contents already
+ * does) and walk the data extents with SEEK_DATA/SEEK_HOLE: hole
+ * ranges are emitted from a constant zero block without touching the
+ * file, data ranges are read normally.  The archive bytes are
+ * identical to what tar_append_file would produce -- the zeros still
+ * enter the stream, where gzip collapses them -- so no restore-side
+ * or host-side change is needed to read it.
+ */
+#define SPARSE_APPEND_MIN (1024 * 1024)
+
+static int file_is_sparse(const struct stat* st)
+{
+    return st->st_size >= SPARSE_APPEND_MIN &&
+            (uint64_t)st->st_blocks * 512 < (uint64_t)st->st_size;
+}
+
+static int tar_append_file_sparse(TAR* t, const char* realname, const char* savename)
+{
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    if (lstat(realname, &st) != 0) {
+        logmsg("tar_append_file_sparse: lstat %s failed\n", realname);
+        return -1;
+    }
+    int fd = open(realname, O_RDONLY);
+    if (fd < 0) {
+        logmsg("tar_append_file_sparse: open %s failed\n", realname);
+        return -1;
+    }
+
+    th_set_from_stat(t, &st);
+    th_set_path(t, savename);
+    if (th_write(t) != 0) {
+        logmsg("tar_append_file_sparse: th_write failed\n");
+        close(fd);
+        return -1;
+    }
+
+    static const char zeros[T_BLOCKSIZE] = { 0 };
+    char buf[T_BLOCKSIZE];
+    uint64_t size = st.st_size;
+    uint64_t pos = 0;
+    uint64_t data_start = 0;
+    uint64_t data_end = 0;
+    int rc = 0;
+
+    while (pos < size) {
+        if (pos >= data_end) {
+            off_t d = lseek(fd, pos, SEEK_DATA);
+            if (d < 0) {
+                if (errno == ENXIO) {
+                    // no data past pos: all hole to EOF
+                    data_start = data_end = size;
+                }
+                else {
+                    // filesystem without SEEK_DATA: treat rest as data
+                    data_start = pos;
+                    data_end = size;
+                }
+            }
+            else {
+                data_start = d;
+                off_t h = lseek(fd, d, SEEK_HOLE);
+                data_end = (h < 0) ? size : (uint64_t)h;
+            }
+        }
+        if (pos + T_BLOCKSIZE <= data_start) {
+            // block lies entirely in a hole
+            if (tar_block_write(t, zeros) == -1) {
+                rc = -1;
+                break;
+            }
+            pos += T_BLOCKSIZE;
+            continue;
+        }
+        size_t want = min(size - pos, (uint64_t)T_BLOCKSIZE);
+        ssize_t n = pread(fd, buf, want, pos);
+        if (n < 0) {
+            logmsg("tar_append_file_sparse: read %s failed\n", realname);
+            rc = -1;
+            break;
+        }
+        if ((size_t)n < T_BLOCKSIZE) {
+            memset(buf + n, 0, T_BLOCKSIZE - n);
+        }
+        if (tar_block_write(t, buf) == -1) {
+            rc = -1;
+            break;
+        }
+        pos += T_BLOCKSIZE;
+    }
+
+    close(fd);
+    return rc;
+}
+
 static int do_backup_tree(const String8& path)
 {
     int rc = 0;
@@ -149,17 +748,43 @@ static int do_backup_tree(const String8& path)
             }
         }
         else {
-            rc = tar_append_file(tar, filepath.string(), filepath.string());
+            if (S_ISREG(st.st_mode) && inc_unchanged(filepath.string(), &st)) {
+                inc_record(filepath.string(), &st);
+                continue;
+            }
+            if (dd_active && S_ISREG(st.st_mode)) {
+                rc = dedup_append_file(tar, filepath.string(), &st);
+            }
+            else if (S_ISREG(st.st_mode) && file_is_sparse(&st)) {
+                rc = tar_append_file_sparse(tar, filepath.string(), filepath.string());
+            }
+            else {
+                rc = tar_append_file(tar, filepath.string(), filepath.string());
+            }
             if (rc != 0) {
                 logmsg("do_backup_tree: path=%s, tar_append_file failed, rc=%d\n", path.string(), rc);
                 break;
             }
+            if (S_ISREG(st.st_mode)) {
+                ra_consumed(st.st_size);
+                inc_record(filepath.string(), &st);
+            }
         }
     }
     closedir(dp);
     return rc;
 }
 
+// Push arbitrary-length data straight into the archive's write
+// callback, the way libtar's tar_block_write macro does for single
+// blocks.  The callbacks take any length, and hashing and progress
+// both live there, so nothing is lost by skipping the 512-byte
+// dance.
+#define tar_data_write(t, buf, len) \
+    (*(((tartype_t*)(t)->type)->writefunc))((t)->fd, (buf), (len))
+
+#define DEV_CHUNK (1024 * 1024)
+
 static int tar_append_device_contents(TAR* t, const char* devname, const char* savename)
 {
     struct stat st;
@@ -176,19 +801,55 @@ static int tar_append_device_contents(TAR* t, const char* devname, const char* s
         return -1;
     }
     st.st_size = lseek(fd, 0, SEEK_END);
-    close(fd);
+    lseek(fd, 0, SEEK_SET);
 
     th_set_from_stat(t, &st);
     th_set_path(t, savename);
     if (th_write(t) != 0) {
         logmsg("tar_append_device_contents: th_write failed\n");
+        close(fd);
         return -1;
     }
-    if (tar_append_regfile(t, devname) != 0) {
-        logmsg("tar_append_device_contents: tar_append_regfile %s failed\n", devname);
+
+    // Stream the device in large extents instead of letting
+    // tar_append_regfile pull it through 512-byte blocks; a partition
+    // image is one long run, so big sequential reads feed the
+    // compressor at device speed.
+    char* buf = (char*)malloc(DEV_CHUNK + T_BLOCKSIZE);  // room for padding
+    if (buf == NULL) {
+        close(fd);
         return -1;
     }
-    return 0;
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t remain = st.st_size;
+    int rc = 0;
+    while (remain > 0) {
+        size_t want = min(remain, (uint64_t)DEV_CHUNK);
+        ssize_t n = read(fd, buf, want);
+        if (n <= 0) {
+            logmsg("tar_append_device_contents: read %s failed\n", devname);
+            rc = -1;
+            break;
+        }
+        remain -= n;
+        size_t out = n;
+        if (remain == 0 && (out % T_BLOCKSIZE) != 0) {
+            // pad the final chunk out to the tar block boundary
+            size_t pad = T_BLOCKSIZE - (out % T_BLOCKSIZE);
+            memset(buf + out, 0, pad);
+            out += pad;
+        }
+        if (tar_data_write(t, buf, out) != (ssize_t)out) {
+            logmsg("tar_append_device_contents: write failed\n");
+            rc = -1;
+            break;
+        }
+    }
+
+    free(buf);
+    close(fd);
+    return rc;
 }
 
 int do_backup(int argc, char **argv)
@@ -228,6 +889,14 @@ int do_backup(int argc, char **argv)
             opt_hash = optval;
             logmsg("do_backup: hash=%s\n", opt_hash);
         }
+        else if (!strcmp(optname, "incremental")) {
+            inc_init(optval);
+            logmsg("do_backup: incremental=%s\n", optval);
+        }
+        else if (!strcmp(optname, "dedup")) {
+            dedup_init(optval);
+            logmsg("do_backup: dedup=%s\n", optval);
+        }
         else {
             logmsg("do_backup: invalid option name \"%s\"\n", optname);
             return -1;
@@ -250,6 +919,7 @@ int do_backup(int argc, char **argv)
     }
 
     append_sod(opt_hash);
+    flush_tar();
 
     hash_name = strdup(opt_hash);
 
@@ -269,20 +939,29 @@ int do_backup(int argc, char **argv)
                 continue;
             }
             String8 path(curpart->path);
+            ra_start(curpart->path);
             rc = do_backup_tree(path);
+            ra_stop();
             ensure_path_unmounted(curpart->path);
         }
     }
 
+    inc_finish();
+
+    if (dd_append != NULL) {
+        fclose(dd_append);
+        dd_append = NULL;
+    }
+
     free(hash_name);
     hash_name = NULL;
 
     append_eod(opt_hash);
+    flush_tar();
 
     tar_append_eof(tar);
 
-    if (opt_compress)
-        gzflush(gzf, Z_FINISH);
+    finish_tar();
 
     logmsg("backup complete: rc=%d\n", rc);
 
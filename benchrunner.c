@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Unified on-device benchmark runner.  Wraps the per-module benchmark
+ * suites (minzip, applypatch, minui, verifier) behind one entry point
+ * with a shared warmup/repetition policy and emits a single JSON
+ * report, so the lab rack can chart results across nightly builds and
+ * device models without parsing each suite's human-readable output.
+ *
+ *   recovery_bench [-n reps] [-w warmups] [-p package.zip]
+ *                  [-o out.json] [-s suite]
+ *
+ * Suites that exercise a real OTA package (minzip, verifier) only run
+ * when -p names one; the others run unconditionally.  Each suite's own
+ * stdout goes to /tmp/recovery_bench.<suite>.log for eyeballing; the
+ * report records wall-clock stats (mean/min/max/stddev) per suite,
+ * which is the uniform number the charts need.  The suites' internal
+ * iteration counts are pinned to 1 where they have one, so repetition
+ * policy lives here and only here.
+ *
+ * The runner also builds standalone as recovery_bench (eng); lab
+ * builds can fold it into the multi-call recovery binary by setting
+ * RECOVERY_BENCH := true (see recovery_cmds.h).
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cutils/properties.h>
+
+int minzip_bench_main(int argc, char** argv);
+int applypatch_bench_main(int argc, char** argv);
+int minui_bench_main(int argc, char** argv);
+#ifndef RECOVERY_BENCH
+int verifier_test_main(int argc, char** argv);
+#endif
+
+#define MAX_SUITE_ARGS 8
+#define LOG_TEMPLATE "/tmp/recovery_bench.%s.log"
+#define DEFAULT_REPORT "/tmp/recovery_bench.json"
+
+typedef struct {
+    const char* name;
+    int (*entry)(int argc, char** argv);
+    /* Canonical argv; a package path is appended when needs_package. */
+    int needs_package;
+    int nargs;
+    const char* args[MAX_SUITE_ARGS];
+} BenchSuite;
+
+/* The registry.  New suites land here after their module gains a
+ * <name>_bench_main entry point (see the #ifndef RECOVERY_BENCH_RUNNER
+ * wrappers in the suite sources).
+ */
+static const BenchSuite suites[] = {
+    { "applypatch", applypatch_bench_main, 0, 5,
+      { "applypatch_bench", "-n", "1", "-s", "4194304" } },
+    { "minui", minui_bench_main, 0, 3,
+      { "minui_bench", "-n", "60" } },
+    { "minzip", minzip_bench_main, 1, 1,
+      { "minzip_bench" } },
+#ifndef RECOVERY_BENCH
+    /* The verifier suite's test harness carries its own RecoveryUI;
+     * inside the recovery binary those symbols already exist, so this
+     * suite is only available in the standalone build.
+     */
+    { "verifier", verifier_test_main, 1, 4,
+      { "verifier_test", "-bench", "-n", "1" } },
+#endif
+};
+
+#define NUM_SUITES (int)(sizeof(suites) / sizeof(suites[0]))
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* One timed invocation with the suite's stdout parked in its log.  The
+ * suites parse flags with getopt, so its state is reset between calls.
+ */
+static int run_once(const BenchSuite* s, const char* package,
+        const char* logfile, uint64_t* us_out)
+{
+    char* argv[MAX_SUITE_ARGS + 2];
+    int argc = 0;
+    int i;
+
+    for (i = 0; i < s->nargs; i++) {
+        argv[argc++] = (char*)s->args[i];
+    }
+    if (s->needs_package) {
+        argv[argc++] = (char*)package;
+    }
+    argv[argc] = NULL;
+
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int fd = open(logfile, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+
+    optind = 1;
+    uint64_t start = now_us();
+    int rc = s->entry(argc, argv);
+    uint64_t us = now_us() - start;
+
+    fflush(stdout);
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+
+    *us_out = us;
+    return rc;
+}
+
+/* Best-effort storage classification for the report: enough to group
+ * rack results by medium, not a full inventory.
+ */
+static const char* detect_storage(void)
+{
+    char line[64];
+    FILE* f = fopen("/proc/mtd", "r");
+    if (f != NULL) {
+        /* Header line only means no MTD partitions. */
+        int has_parts = fgets(line, sizeof(line), f) != NULL &&
+                fgets(line, sizeof(line), f) != NULL;
+        fclose(f);
+        if (has_parts) return "mtd";
+    }
+    f = fopen("/sys/class/block/mmcblk0/device/type", "r");
+    if (f != NULL) {
+        int ok = fgets(line, sizeof(line), f) != NULL;
+        fclose(f);
+        if (ok) {
+            if (strncmp(line, "MMC", 3) == 0) return "emmc";
+            if (strncmp(line, "SD", 2) == 0) return "sd";
+        }
+    }
+    return "unknown";
+}
+
+/* Minimal escaper for the few free-form strings (model names) that
+ * land in the report.
+ */
+static void json_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+            fputc(*s, f);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: recovery_bench [-n reps] [-w warmups] [-p package.zip]\n"
+            "                      [-o out.json] [-s suite]\n"
+            "  -n  timed repetitions per suite (default 3)\n"
+            "  -w  untimed warmup runs per suite (default 1)\n"
+            "  -p  OTA package for the minzip and verifier suites\n"
+            "  -o  report path (default " DEFAULT_REPORT ")\n"
+            "  -s  run only the named suite\n");
+    exit(2);
+}
+
+int recovery_bench_main(int argc, char** argv)
+{
+    int reps = 3;
+    int warmups = 1;
+    const char* package = NULL;
+    const char* report_path = DEFAULT_REPORT;
+    const char* only = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:w:p:o:s:")) != -1) {
+        switch (opt) {
+        case 'n': reps = atoi(optarg); break;
+        case 'w': warmups = atoi(optarg); break;
+        case 'p': package = optarg; break;
+        case 'o': report_path = optarg; break;
+        case 's': only = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind != argc) usage();
+    if (reps < 1) reps = 1;
+    if (warmups < 0) warmups = 0;
+
+    if (only != NULL) {
+        int i;
+        for (i = 0; i < NUM_SUITES; i++) {
+            if (strcmp(only, suites[i].name) == 0) break;
+        }
+        if (i == NUM_SUITES) {
+            fprintf(stderr, "unknown suite \"%s\"\n", only);
+            return 2;
+        }
+    }
+
+    FILE* report = fopen(report_path, "w");
+    if (report == NULL) {
+        fprintf(stderr, "can't write %s\n", report_path);
+        return 1;
+    }
+
+    char model[PROPERTY_VALUE_MAX];
+    char device[PROPERTY_VALUE_MAX];
+    char build[PROPERTY_VALUE_MAX];
+    property_get("ro.product.model", model, "unknown");
+    property_get("ro.product.device", device, "unknown");
+    property_get("ro.build.display.id", build, "unknown");
+
+    fprintf(report, "{\n");
+    fprintf(report, "  \"model\": ");
+    json_string(report, model);
+    fprintf(report, ",\n  \"device\": ");
+    json_string(report, device);
+    fprintf(report, ",\n  \"build\": ");
+    json_string(report, build);
+    fprintf(report, ",\n  \"storage\": \"%s\"", detect_storage());
+    fprintf(report, ",\n  \"time\": %lld", (long long)time(NULL));
+    fprintf(report, ",\n  \"reps\": %d,\n  \"warmups\": %d", reps, warmups);
+    fprintf(report, ",\n  \"benchmarks\": [");
+
+    int failures = 0;
+    int emitted = 0;
+    int i;
+    for (i = 0; i < NUM_SUITES; i++) {
+        const BenchSuite* s = &suites[i];
+        if (only != NULL && strcmp(only, s->name) != 0) continue;
+
+        fprintf(report, "%s\n    { \"name\": \"%s\"",
+                emitted ? "," : "", s->name);
+        emitted++;
+
+        if (s->needs_package && package == NULL) {
+            fprintf(stderr, "%s: skipped (needs -p package)\n", s->name);
+            fprintf(report, ", \"status\": \"skipped\","
+                    " \"reason\": \"needs -p package\" }");
+            continue;
+        }
+
+        char logfile[64];
+        snprintf(logfile, sizeof(logfile), LOG_TEMPLATE, s->name);
+        unlink(logfile);
+
+        uint64_t us;
+        int rc = 0;
+        int r;
+        for (r = 0; r < warmups && rc == 0; r++) {
+            rc = run_once(s, package, logfile, &us);
+        }
+
+        double sum = 0.0;
+        double sumsq = 0.0;
+        double min_ms = 0.0;
+        double max_ms = 0.0;
+        int samples = 0;
+
+        fprintf(report, ", \"samples_ms\": [");
+        for (r = 0; r < reps && rc == 0; r++) {
+            rc = run_once(s, package, logfile, &us);
+            if (rc != 0) break;
+            double ms = us / 1000.0;
+            fprintf(report, "%s%.3f", samples ? ", " : "", ms);
+            sum += ms;
+            sumsq += ms * ms;
+            if (samples == 0 || ms < min_ms) min_ms = ms;
+            if (samples == 0 || ms > max_ms) max_ms = ms;
+            samples++;
+        }
+        fprintf(report, "]");
+
+        if (rc != 0) {
+            fprintf(stderr, "%s: FAILED (exit %d), see %s\n",
+                    s->name, rc, logfile);
+            fprintf(report, ", \"status\": \"failed\", \"exit\": %d", rc);
+            failures++;
+        } else {
+            double mean = sum / samples;
+            double var = samples > 1 ?
+                    (sumsq - sum * mean) / (samples - 1) : 0.0;
+            if (var < 0.0) var = 0.0;
+            fprintf(stderr, "%s: %d runs, mean %.1f ms (+/- %.1f)\n",
+                    s->name, samples, mean, sqrt(var));
+            fprintf(report, ", \"status\": \"ok\""
+                    ", \"mean_ms\": %.3f, \"min_ms\": %.3f"
+                    ", \"max_ms\": %.3f, \"stddev_ms\": %.3f",
+                    mean, min_ms, max_ms, sqrt(var));
+        }
+        fprintf(report, ", \"log\": \"%s\" }", logfile);
+    }
+
+    fprintf(report, "\n  ]\n}\n");
+    fclose(report);
+    fprintf(stderr, "report: %s\n", report_path);
+    return failures ? 1 : 0;
+}
+
+#ifndef RECOVERY_BENCH
+int main(int argc, char** argv)
+{
+    return recovery_bench_main(argc, argv);
+}
+#endif
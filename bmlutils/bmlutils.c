@@ -35,10 +35,71 @@ extern "C"{
 #define BOARD_BML_RECOVERY          "/dev/block/bml8"
 #endif
 
+/* All BML reads and writes go through BML_CHUNK-sized buffers; the
+ * old 4KB/512-byte loops (and the dd shell-outs) made every partition
+ * operation pay per-call overhead thousands of times over.
+ */
+#define BML_CHUNK (1024 * 1024)
+
+/* Fill a read buffer completely, tolerating short reads (the restore
+ * source may be a pipe).  Returns bytes read, or -1 on error.
+ */
+static ssize_t read_full(int fd, char *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/* Write count zero bytes to the start of device in BML_CHUNK slices.
+ * Replaces the "/sbin/dd if=/dev/zero" shell-out.
+ */
+static int bml_zero_device(const char *device, long long count)
+{
+    int ret = 0;
+
+    int fd = open(device, O_WRONLY | O_LARGEFILE);
+    if (fd < 0)
+        return -1;
+    ioctl(fd, BML_UNLOCK_ALL, 0);
+
+    char *buf = calloc(1, BML_CHUNK);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+    while (count > 0) {
+        ssize_t chunk = count < BML_CHUNK ? count : BML_CHUNK;
+        if (write(fd, buf, chunk) != chunk) {
+            ret = -1;
+            break;
+        }
+        count -= chunk;
+    }
+    free(buf);
+    if (fsync(fd))
+        ret = -1;
+    close(fd);
+    return ret;
+}
+
 static int restore_internal(const char* bml, const char* filename)
 {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
+    char *buf;
+    int dstfd, srcfd;
+    ssize_t bytes_read;
+    int ret = 0;
+
     if (filename == NULL)
         srcfd = 0;
     else {
@@ -51,20 +112,38 @@ static int restore_internal(const char* bml, const char* filename)
         return 3;
     if (ioctl(dstfd, BML_UNLOCK_ALL, 0))
         return 4;
-    do {
-        total_read += bytes_read = read(srcfd, buf, 4096);
-        if (!bytes_read)
+
+    buf = malloc(BML_CHUNK);
+    if (buf == NULL)
+        return 5;
+
+    for (;;) {
+        bytes_read = read_full(srcfd, buf, BML_CHUNK);
+        if (bytes_read < 0) {
+            ret = 5;
+            break;
+        }
+        if (bytes_read == 0)
             break;
-        if (bytes_read < 4096)
-            memset(&buf[bytes_read], 0, 4096 - bytes_read);
-        if (write(dstfd, buf, 4096) < 4096)
-            return 5;
-    } while(bytes_read == 4096);
-    
+        if (bytes_read % 4096) {
+            /* zero-pad the tail to the 4KB granularity the old
+             * fixed-size loop wrote */
+            ssize_t padded = (bytes_read + 4095) & ~4095;
+            memset(buf + bytes_read, 0, padded - bytes_read);
+            bytes_read = padded;
+        }
+        if (write(dstfd, buf, bytes_read) < bytes_read) {
+            ret = 5;
+            break;
+        }
+    }
+
+    free(buf);
     close(dstfd);
-    close(srcfd);
-    
-    return 0;
+    if (srcfd != 0)
+        close(srcfd);
+
+    return ret;
 }
 
 int cmd_bml_restore_raw_partition(const char *partition, const char *filename)
@@ -107,58 +186,70 @@ int cmd_bml_backup_raw_partition(const char *partition, const char *out_file)
         return -1;
     }
 
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
+    char *buf;
+    int in, out;
+    ssize_t len;
     int ret = -1;
-    char *in_file = bml;
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
+    in = open(bml, O_RDONLY | O_LARGEFILE);
+    if (in < 0)
         goto ERROR3;
 
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
+    out = open(out_file, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+    if (out < 0)
         goto ERROR2;
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+    buf = malloc(BML_CHUNK);
+    if (buf == NULL)
+        goto ERROR1;
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
+    for (;;) {
+        len = read_full(in, buf, BML_CHUNK);
+        if (len < 0)
+            goto ERROR0;
+        if (len == 0)
+            break;
+        if (write(out, buf, len) != len)
+            goto ERROR0;
     }
 
-    fsync(out);
-    ret = 0;
+    if (fsync(out) == 0)
+        ret = 0;
+ERROR0:
+    free(buf);
 ERROR1:
-    fclose ( out );
+    close(out);
 ERROR2:
-    fclose ( in );
+    close(in);
 ERROR3:
     return ret;
 }
 
 int cmd_bml_erase_raw_partition(const char *partition)
 {
-    // TODO: implement raw wipe
-    return 0;
+    const char* bml;
+    if (strcmp("boot", partition) == 0)
+        bml = BOARD_BML_BOOT;
+    else if (strcmp("recovery", partition) == 0)
+        bml = BOARD_BML_RECOVERY;
+    else if (partition[0] == '/') {
+        // support explicitly provided device paths
+        bml = partition;
+    }
+    else {
+        printf("Invalid partition.\n");
+        return -1;
+    }
+
+    int fd = open(bml, O_RDONLY | O_LARGEFILE);
+    if (fd < 0)
+        return -1;
+    long long sz = lseek64(fd, 0, SEEK_END);
+    close(fd);
+    if (sz <= 0)
+        return -1;
+
+    return bml_zero_device(bml, sz);
 }
 
 int cmd_bml_erase_partition(const char *partition, const char *filesystem)
@@ -192,8 +283,7 @@ int format_rfs_device (const char *device, const char *path) {
     // dump 10KB of zeros to partition before format due to fat.format bug
     char cmd[PATH_MAX];
 
-    sprintf(cmd, "/sbin/dd if=/dev/zero of=%s bs=4096 count=10", device);
-    if(__system(cmd)) {
+    if (bml_zero_device(device, 10 * 4096)) {
         printf("failure while zeroing rfs partition.\n");
         return -1;
     }
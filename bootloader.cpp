@@ -31,34 +31,74 @@ static int set_bootloader_message_mtd(const struct bootloader_message *in, const
 static int get_bootloader_message_block(struct bootloader_message *out, const fstab_rec* v);
 static int set_bootloader_message_block(const struct bootloader_message *in, const fstab_rec* v);
 
+// In-memory copy of the command page.  Recovery reads the BCB several
+// times per session (get_args, sideload paths, finish_recovery) and
+// misc I/O is synchronous, so the first successful read fills the cache
+// and later reads are served from it; writes that match the cache skip
+// the device entirely.  Recovery is not the only writer: the updater
+// child writes the stage field directly (set_stage), so install paths
+// must call invalidate_bootloader_message_cache() when it exits.
+static struct bootloader_message bcb_cache;
+static bool bcb_cache_valid = false;
+
+void invalidate_bootloader_message_cache() {
+    bcb_cache_valid = false;
+}
+
 int get_bootloader_message(struct bootloader_message *out) {
+    if (bcb_cache_valid) {
+        memcpy(out, &bcb_cache, sizeof(bcb_cache));
+        return 0;
+    }
+
     fstab_rec* v = volume_for_path("/misc");
     if (v == NULL) {
         LOGI("Cannot load volume /misc.\n");
         return -1;
     }
+    int ret;
     if (strcmp(v->fs_type, "mtd") == 0) {
-        return get_bootloader_message_mtd(out, v);
+        ret = get_bootloader_message_mtd(out, v);
     } else if (strcmp(v->fs_type, "emmc") == 0) {
-        return get_bootloader_message_block(out, v);
+        ret = get_bootloader_message_block(out, v);
+    } else {
+        LOGE("unknown misc partition fs_type \"%s\"\n", v->fs_type);
+        return -1;
     }
-    LOGE("unknown misc partition fs_type \"%s\"\n", v->fs_type);
-    return -1;
+    if (ret == 0) {
+        memcpy(&bcb_cache, out, sizeof(bcb_cache));
+        bcb_cache_valid = true;
+    }
+    return ret;
 }
 
 int set_bootloader_message(const struct bootloader_message *in) {
+    if (bcb_cache_valid && memcmp(in, &bcb_cache, sizeof(bcb_cache)) == 0) {
+        return 0;  // already what's on the device
+    }
+
     fstab_rec* v = volume_for_path("/misc");
     if (v == NULL) {
         LOGI("Cannot load volume /misc.\n");
         return -1;
     }
+    int ret;
     if (strcmp(v->fs_type, "mtd") == 0) {
-        return set_bootloader_message_mtd(in, v);
+        ret = set_bootloader_message_mtd(in, v);
     } else if (strcmp(v->fs_type, "emmc") == 0) {
-        return set_bootloader_message_block(in, v);
+        ret = set_bootloader_message_block(in, v);
+    } else {
+        LOGE("unknown misc partition fs_type \"%s\"\n", v->fs_type);
+        return -1;
+    }
+    if (ret == 0) {
+        memcpy(&bcb_cache, in, sizeof(bcb_cache));
+        bcb_cache_valid = true;
+    } else {
+        // the device state is now uncertain; reread before trusting it
+        bcb_cache_valid = false;
     }
-    LOGE("unknown misc partition fs_type \"%s\"\n", v->fs_type);
-    return -1;
+    return ret;
 }
 
 // ------------------------------
@@ -187,6 +227,25 @@ static int get_bootloader_message_block(struct bootloader_message *out,
 
 static int set_bootloader_message_block(const struct bootloader_message *in,
                                         const fstab_rec* v) {
+    long base = 0;
+    size_t off = 0;
+    size_t len = sizeof(*in);
+
+    // When the cache knows what's on the device, narrow the write to
+    // the bytes that actually changed instead of rewriting the whole
+    // message.
+    if (bcb_cache_valid) {
+        const char* oldp = (const char*) &bcb_cache;
+        const char* newp = (const char*) in;
+        size_t first = 0;
+        size_t last = len;
+        while (first < len && oldp[first] == newp[first]) first++;
+        if (first == len) return 0;  // nothing dirty
+        while (last > first && oldp[last-1] == newp[last-1]) last--;
+        off = first;
+        len = last - first;
+    }
+
     wait_for_device(v->blk_device);
     FILE* f = fopen(v->blk_device, "rb+");
     if (f == NULL) {
@@ -194,9 +253,10 @@ static int set_bootloader_message_block(const struct bootloader_message *in,
         return -1;
     }
 #ifdef BOARD_RECOVERY_BLDRMSG_OFFSET
-    fseek(f, BOARD_RECOVERY_BLDRMSG_OFFSET, SEEK_SET);
+    base = BOARD_RECOVERY_BLDRMSG_OFFSET;
 #endif
-    int count = fwrite(in, sizeof(*in), 1, f);
+    fseek(f, base + off, SEEK_SET);
+    int count = fwrite((const char*) in + off, len, 1, f);
     if (count != 1) {
         LOGE("Failed writing %s\n(%s)\n", v->blk_device, strerror(errno));
         return -1;
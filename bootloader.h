@@ -64,6 +64,14 @@ struct bootloader_message {
 int get_bootloader_message(struct bootloader_message *out);
 int set_bootloader_message(const struct bootloader_message *in);
 
+/* Drop the in-memory copy of the BCB so the next read goes back to
+ * the device.  Must be called whenever something outside recovery's
+ * own get/set calls may have written /misc -- in particular after a
+ * package install, since the updater writes the stage field directly
+ * via set_stage().
+ */
+void invalidate_bootloader_message_cache();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootprofile.h"
+
+#define MAX_SPANS 32
+
+#define BOOTTIME_FILE "/tmp/recovery_boottime"
+
+typedef struct {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+} ProfileSpan;
+
+static ProfileSpan spans[MAX_SPANS];
+static int span_count = 0;
+static int current_phase = -1;   // index into spans, or -1
+
+// subsystem hooks may report from other threads (icon loading)
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t boot_profile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void boot_profile_report(const char* name, uint64_t start_ms, uint64_t end_ms) {
+    pthread_mutex_lock(&profile_mutex);
+    if (span_count < MAX_SPANS) {
+        spans[span_count].name = name;
+        spans[span_count].start = start_ms;
+        spans[span_count].end = end_ms;
+        ++span_count;
+    }
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+void boot_profile_phase(const char* name) {
+    uint64_t now = boot_profile_now();
+    pthread_mutex_lock(&profile_mutex);
+    if (current_phase >= 0) {
+        spans[current_phase].end = now;
+    }
+    current_phase = -1;
+    if (span_count < MAX_SPANS) {
+        spans[span_count].name = name;
+        spans[span_count].start = now;
+        spans[span_count].end = now;
+        current_phase = span_count;
+        ++span_count;
+    }
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+void boot_profile_done(void) {
+    uint64_t now = boot_profile_now();
+    pthread_mutex_lock(&profile_mutex);
+    if (current_phase >= 0) {
+        spans[current_phase].end = now;
+        current_phase = -1;
+    }
+
+    // summary lands in the rotated logs via the redirected stdout
+    printf("startup profile:\n");
+    int i;
+    for (i = 0; i < span_count; ++i) {
+        printf("  %-24s %6llu ms (at %llu ms)\n", spans[i].name,
+               (unsigned long long)(spans[i].end - spans[i].start),
+               (unsigned long long)spans[i].start);
+    }
+
+    FILE* f = fopen(BOOTTIME_FILE, "w");
+    if (f != NULL) {
+        for (i = 0; i < span_count; ++i) {
+            fprintf(f, "%s %llu %llu\n", spans[i].name,
+                    (unsigned long long)spans[i].start,
+                    (unsigned long long)spans[i].end);
+        }
+        fclose(f);
+    }
+    pthread_mutex_unlock(&profile_mutex);
+}
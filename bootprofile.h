@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_BOOTPROFILE_H
+#define RECOVERY_BOOTPROFILE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Lightweight startup profiler.  main() brackets its serial init
+// phases with boot_profile_phase() calls (each call ends the previous
+// phase and starts the named one); subsystems with their own notion of
+// a span (minui resource loading, vold connect) report it with
+// boot_profile_now() + boot_profile_report().  boot_profile_done()
+// closes the last phase and emits a summary into the log plus a
+// machine-readable /tmp/recovery_boottime.
+
+// Monotonic timestamp in milliseconds.
+uint64_t boot_profile_now(void);
+
+// End the current phase (if any) and start a new one.
+void boot_profile_phase(const char* name);
+
+// Record a span measured by the caller.
+void boot_profile_report(const char* name, uint64_t start_ms, uint64_t end_ms);
+
+// End the current phase and write the summary.
+void boot_profile_done(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // RECOVERY_BOOTPROFILE_H
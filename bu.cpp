@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -130,20 +131,81 @@ void part_set(partspec* part)
     curpart->off = 0;
 }
 
+/*
+ * Once a second a structured record
+ *
+ *   <partition> <bytes_done> <bytes_total> <rate_bytes_per_sec> <eta_sec>
+ *
+ * is sent over the messagesocket (as a "progress" command, ignored by
+ * receivers that only speak "dialog") and rewritten atomically to
+ * PROGRESS_FILE, where host tooling can poll it with adb shell.  A
+ * record that stops updating means the operation has stalled; eta is
+ * -1 until a rate is established.  Totals are the per-partition used
+ * counts from the SOD scan, so bytes_done can run slightly past
+ * bytes_total on tar overhead.
+ */
+#define PROGRESS_FILE "/tmp/bu.progress"
+
+static uint64_t emit_progress(time_t now, time_t last_time, uint64_t last_done)
+{
+    static uint64_t rate = 0;
+
+    uint64_t total = 0;
+    uint64_t done = 0;
+    for (int i = 0; i < MAX_PART; ++i) {
+        partspec* part = part_get(i);
+        if (!part)
+            break;
+        total += part->used;
+        done += part->off;
+    }
+
+    if (last_time != 0 && now > last_time && done >= last_done) {
+        uint64_t inst = (done - last_done) / (now - last_time);
+        // light smoothing so one slow second doesn't spike the eta
+        rate = rate ? (rate * 3 + inst) / 4 : inst;
+    }
+    long long eta = -1;
+    if (rate > 0 && total > done) {
+        eta = (total - done) / rate;
+    }
+
+    char rec[256];
+    snprintf(rec, sizeof(rec), "%s %llu %llu %llu %lld",
+            curpart->name, (unsigned long long)done,
+            (unsigned long long)total, (unsigned long long)rate, eta);
+    ms.Progress(rec);
+
+    char tmp[] = PROGRESS_FILE ".tmp";
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        int len = strlen(rec);
+        rec[len] = '\n';
+        write(fd, rec, len + 1);
+        close(fd);
+        rename(tmp, PROGRESS_FILE);
+    }
+    return done;
+}
+
 int update_progress(uint64_t off)
 {
     static time_t last_time = 0;
     static int last_pct = 0;
+    static uint64_t last_done = 0;
     if (curpart) {
         curpart->off += off;
         time_t now = time(NULL);
         int pct = min(100, (int)((uint64_t)100*curpart->off/curpart->used));
-        if (now != last_time && pct != last_pct) {
-            char msg[256];
-            sprintf(msg, "%s: %d%% complete", curpart->name, pct);
-            ms.Show(msg);
+        if (now != last_time) {
+            last_done = emit_progress(now, last_time, last_done);
+            if (pct != last_pct) {
+                char msg[256];
+                sprintf(msg, "%s: %d%% complete", curpart->name, pct);
+                ms.Show(msg);
+                last_pct = pct;
+            }
             last_time = now;
-            last_pct = pct;
         }
     }
     return 0;
@@ -155,8 +217,11 @@ static int tar_cb_open(const char* path, int mode, ...)
     return -1;
 }
 
+static void gzr_stop();
+
 static int tar_cb_close(int fd)
 {
+    gzr_stop();
     return 0;
 }
 
@@ -173,6 +238,40 @@ static ssize_t tar_cb_read(int fd, void* buf, size_t len)
     return nread;
 }
 
+/*
+ * Write coalescing for the uncompressed stream.  libtar hands the
+ * archive over in 512-byte records, and pushing each one straight
+ * into the adb socket costs a syscall and a short USB transfer
+ * apiece, which underruns the link.  Records are gathered here and
+ * written out a megabyte at a time; flush_tar() pushes partial
+ * contents at the stream markers so the host sees them promptly.
+ * The compressed paths already batch internally (zlib's buffer, or
+ * whole pgz members).
+ */
+#define TAR_OBUF_SIZE (1024 * 1024)
+static uint8_t* tar_obuf;
+static size_t tar_obuf_len;
+static int tar_obuf_fd = -1;
+
+static int tar_obuf_flush()
+{
+    uint8_t* p = tar_obuf;
+    size_t len = tar_obuf_len;
+    while (len > 0) {
+        ssize_t n = ::write(tar_obuf_fd, p, len);
+        if (n < 0) {
+            logmsg("tar_obuf_flush: error: %s\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+            break;
+        p += n;
+        len -= n;
+    }
+    tar_obuf_len = 0;
+    return 0;
+}
+
 static ssize_t tar_cb_write(int fd, const void* buf, size_t len)
 {
     ssize_t written = 0;
@@ -183,6 +282,23 @@ static ssize_t tar_cb_write(int fd, const void* buf, size_t len)
         hash_datalen += len;
     }
 
+    if (tar_obuf != NULL && fd == tar_obuf_fd) {
+        const uint8_t* p = (const uint8_t*)buf;
+        size_t remain = len;
+        while (remain > 0) {
+            size_t chunk = min(TAR_OBUF_SIZE - tar_obuf_len, remain);
+            memcpy(tar_obuf + tar_obuf_len, p, chunk);
+            tar_obuf_len += chunk;
+            p += chunk;
+            remain -= chunk;
+            if (tar_obuf_len == TAR_OBUF_SIZE && tar_obuf_flush() != 0) {
+                return -1;
+            }
+        }
+        update_progress(len);
+        return len;
+    }
+
     while (len > 0) {
         ssize_t n = ::write(fd, buf, len);
         if (n < 0) {
@@ -206,10 +322,153 @@ static tartype_t tar_io = {
     tar_cb_write
 };
 
+/*
+ * Overlapped inflate for restore.  libtar pulls the tar stream
+ * through tar_gz_cb_read and then writes each extracted file itself,
+ * so inflate (CPU) and file writeout (I/O) take turns in one thread.
+ * For gzip restores a decompressor thread runs gzread ahead into a
+ * small ring of chunks and the extract path consumes from the ring,
+ * so the next files inflate while the current one is being written.
+ * Hashing stays on the consumer side, where the stream is actually
+ * handed to libtar, so the SOD/EOD accounting in do_restore_tree is
+ * unchanged.
+ */
+#define GZR_CHUNK (256 * 1024)
+#define GZR_SLOTS 8
+
+struct gzr_slot {
+    uint8_t data[GZR_CHUNK];
+    int len;
+    int used;
+};
+
+struct gzr_state {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct gzr_slot slots[GZR_SLOTS];
+    int head;           // next slot to consume
+    int count;          // filled slots
+    int eof;
+    int error;
+    int stop;
+    pthread_t thread;
+};
+
+static struct gzr_state* gzr;
+
+static void* gzr_thread_func(void* arg)
+{
+    struct gzr_state* g = (struct gzr_state*)arg;
+
+    pthread_mutex_lock(&g->lock);
+    while (!g->stop) {
+        if (g->count == GZR_SLOTS) {
+            pthread_cond_wait(&g->cond, &g->lock);
+            continue;
+        }
+        struct gzr_slot* slot = &g->slots[(g->head + g->count) % GZR_SLOTS];
+        pthread_mutex_unlock(&g->lock);
+
+        int n = gzread(gzf, slot->data, GZR_CHUNK);
+
+        pthread_mutex_lock(&g->lock);
+        if (n < 0) {
+            g->error = 1;
+        }
+        else if (n == 0) {
+            g->eof = 1;
+        }
+        else {
+            slot->len = n;
+            slot->used = 0;
+            ++g->count;
+        }
+        pthread_cond_broadcast(&g->cond);
+        if (n <= 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+    return NULL;
+}
+
+static void gzr_start()
+{
+    struct gzr_state* g = (struct gzr_state*)calloc(1, sizeof(*g));
+    if (g == NULL) {
+        // fall back to inline gzread
+        return;
+    }
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    if (pthread_create(&g->thread, NULL, gzr_thread_func, g) != 0) {
+        free(g);
+        return;
+    }
+    gzr = g;
+}
+
+static void gzr_stop()
+{
+    struct gzr_state* g = gzr;
+    if (g == NULL)
+        return;
+    gzr = NULL;
+    pthread_mutex_lock(&g->lock);
+    g->stop = 1;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+    // If the thread is parked in a socket read (abort mid-stream),
+    // unblock it; the stream is finished either way by the time the
+    // archive is closed.
+    shutdown(adb_ifd, SHUT_RD);
+    pthread_join(g->thread, NULL);
+    free(g);
+}
+
+static ssize_t gzr_read(void* buf, size_t len)
+{
+    struct gzr_state* g = gzr;
+    uint8_t* p = (uint8_t*)buf;
+    size_t copied = 0;
+
+    pthread_mutex_lock(&g->lock);
+    while (copied < len) {
+        if (g->count > 0) {
+            struct gzr_slot* slot = &g->slots[g->head];
+            size_t chunk = min((size_t)(slot->len - slot->used), len - copied);
+            memcpy(p + copied, slot->data + slot->used, chunk);
+            slot->used += chunk;
+            copied += chunk;
+            if (slot->used == slot->len) {
+                g->head = (g->head + 1) % GZR_SLOTS;
+                --g->count;
+                pthread_cond_broadcast(&g->cond);
+            }
+            continue;
+        }
+        if (g->error) {
+            pthread_mutex_unlock(&g->lock);
+            return -1;
+        }
+        if (g->eof) {
+            break;
+        }
+        pthread_cond_wait(&g->cond, &g->lock);
+    }
+    pthread_mutex_unlock(&g->lock);
+    return copied;
+}
+
 static ssize_t tar_gz_cb_read(int fd, void* buf, size_t len)
 {
-    int nread;
-    nread = gzread(gzf, buf, len);
+    ssize_t nread;
+    if (gzr != NULL) {
+        nread = gzr_read(buf, len);
+    }
+    else {
+        nread = gzread(gzf, buf, len);
+    }
     if (nread > 0 && hash_name) {
         SHA1_Update(&sha_ctx, (u_char*)buf, nread);
         MD5_Update(&md5_ctx, buf, nread);
@@ -252,6 +511,319 @@ static tartype_t tar_io_gz = {
     tar_gz_cb_write
 };
 
+/*
+ * Parallel gzip writer.  Single-threaded deflate caps backup
+ * throughput at one core's compression speed, so the tar stream is
+ * cut into PGZ_BLOCK-sized chunks, each deflated by a worker thread
+ * into an independent gzip member, and the members are written out in
+ * order.  Concatenated members are themselves a valid gzip stream, so
+ * the restore side's gzread (and gunzip on a host) decode the result
+ * unchanged.
+ */
+#define PGZ_BLOCK (256 * 1024)
+#define PGZ_MAX_WORKERS 4
+
+enum {
+    PGZ_FREE,       // slot available to the submitter
+    PGZ_FILLED,     // input complete, awaiting (or under) compression
+    PGZ_DONE        // compressed, awaiting ordered writeout
+};
+
+struct pgz_job {
+    uint8_t*    in;
+    uint32_t    in_len;
+    uint8_t*    out;
+    uint32_t    out_len;
+    int         state;
+};
+
+struct pgz_state {
+    int fd;
+    int level;
+
+    int nworkers;
+    int njobs;
+    struct pgz_job* jobs;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Job sequence counters; job N lives in slot N % njobs.
+    unsigned seq_fill;      // next block to be filled by the submitter
+    unsigned seq_comp;      // next block to be claimed by a worker
+    unsigned seq_write;     // next block to be written out
+
+    int finish;
+    int error;
+
+    pthread_t workers[PGZ_MAX_WORKERS];
+    pthread_t writer;
+};
+
+static struct pgz_state* pgz = NULL;
+
+// Deflate one job's input into a self-contained gzip member.
+static int pgz_deflate_member(struct pgz_job* job, int level)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED,
+                     15 + 16 /* gzip wrapper */, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    uLong bound = deflateBound(&zs, job->in_len) + 32;
+    job->out = (uint8_t*)malloc(bound);
+    if (job->out == NULL) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = job->in;
+    zs.avail_in = job->in_len;
+    zs.next_out = job->out;
+    zs.avail_out = bound;
+    int zrc = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (zrc != Z_STREAM_END) {
+        free(job->out);
+        job->out = NULL;
+        return -1;
+    }
+    job->out_len = bound - zs.avail_out;
+    return 0;
+}
+
+static void* pgz_worker(void* arg)
+{
+    struct pgz_state* p = (struct pgz_state*)arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        if (p->error || (p->finish && p->seq_comp == p->seq_fill)) {
+            break;
+        }
+        if (p->seq_comp == p->seq_fill) {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        struct pgz_job* job = &p->jobs[p->seq_comp++ % p->njobs];
+        pthread_mutex_unlock(&p->lock);
+
+        int rc = pgz_deflate_member(job, p->level);
+
+        pthread_mutex_lock(&p->lock);
+        if (rc != 0) {
+            p->error = 1;
+        } else {
+            job->state = PGZ_DONE;
+        }
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void* pgz_writer(void* arg)
+{
+    struct pgz_state* p = (struct pgz_state*)arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        if (p->error || (p->finish && p->seq_write == p->seq_fill)) {
+            break;
+        }
+        struct pgz_job* job = &p->jobs[p->seq_write % p->njobs];
+        if (p->seq_write == p->seq_fill || job->state != PGZ_DONE) {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        int rc = 0;
+        uint8_t* buf = job->out;
+        uint32_t len = job->out_len;
+        while (len > 0) {
+            ssize_t n = ::write(p->fd, buf, len);
+            if (n < 0) {
+                logmsg("pgz_writer: write error: %s\n", strerror(errno));
+                rc = -1;
+                break;
+            }
+            buf += n;
+            len -= n;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        free(job->out);
+        job->out = NULL;
+        job->in_len = 0;
+        job->state = PGZ_FREE;
+        if (rc != 0) {
+            p->error = 1;
+        }
+        ++p->seq_write;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void pgz_free(struct pgz_state* p)
+{
+    if (p->jobs) {
+        for (int i = 0; i < p->njobs; ++i) {
+            free(p->jobs[i].in);
+            free(p->jobs[i].out);
+        }
+        free(p->jobs);
+    }
+    free(p);
+}
+
+static struct pgz_state* pgz_open(int fd, int level)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 2) {
+        // nothing to parallelize; plain gzdopen is cheaper
+        return NULL;
+    }
+
+    struct pgz_state* p = (struct pgz_state*)calloc(1, sizeof(*p));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->fd = fd;
+    p->level = level;
+    p->nworkers = min((int)ncpu, PGZ_MAX_WORKERS);
+    p->njobs = p->nworkers * 2;
+    p->jobs = (struct pgz_job*)calloc(p->njobs, sizeof(struct pgz_job));
+    if (p->jobs == NULL) {
+        pgz_free(p);
+        return NULL;
+    }
+    for (int i = 0; i < p->njobs; ++i) {
+        p->jobs[i].in = (uint8_t*)malloc(PGZ_BLOCK);
+        if (p->jobs[i].in == NULL) {
+            pgz_free(p);
+            return NULL;
+        }
+        p->jobs[i].state = PGZ_FREE;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    int started;
+    for (started = 0; started < p->nworkers; ++started) {
+        if (pthread_create(&p->workers[started], NULL, pgz_worker, p) != 0) {
+            break;
+        }
+    }
+    if (started == 0 || pthread_create(&p->writer, NULL, pgz_writer, p) != 0) {
+        pthread_mutex_lock(&p->lock);
+        p->error = 1;
+        p->finish = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        for (int i = 0; i < started; ++i) {
+            pthread_join(p->workers[i], NULL);
+        }
+        pgz_free(p);
+        return NULL;
+    }
+    p->nworkers = started;
+    return p;
+}
+
+static ssize_t pgz_write(struct pgz_state* p, const void* data, size_t len)
+{
+    const uint8_t* buf = (const uint8_t*)data;
+    size_t remain = len;
+
+    pthread_mutex_lock(&p->lock);
+    while (remain > 0 && !p->error) {
+        struct pgz_job* job = &p->jobs[p->seq_fill % p->njobs];
+        if (job->state != PGZ_FREE) {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        uint32_t chunk = PGZ_BLOCK - job->in_len;
+        if (chunk > remain) {
+            chunk = remain;
+        }
+        memcpy(job->in + job->in_len, buf, chunk);
+        job->in_len += chunk;
+        buf += chunk;
+        remain -= chunk;
+        if (job->in_len == PGZ_BLOCK) {
+            job->state = PGZ_FILLED;
+            ++p->seq_fill;
+            pthread_cond_broadcast(&p->cond);
+        }
+    }
+    int error = p->error;
+    pthread_mutex_unlock(&p->lock);
+    return error ? -1 : (ssize_t)len;
+}
+
+static int pgz_finish(struct pgz_state* p)
+{
+    pthread_mutex_lock(&p->lock);
+    // The slot at seq_fill can still be in flight when the stream
+    // length is an exact multiple of PGZ_BLOCK under backpressure;
+    // wait for it to come back like the submit path does, so an
+    // unreaped job is never re-queued.  Once it is free, in_len only
+    // reflects a partial fill left by pgz_write.
+    struct pgz_job* job = &p->jobs[p->seq_fill % p->njobs];
+    while (!p->error && job->state != PGZ_FREE) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    if (!p->error && (job->in_len > 0 || p->seq_fill == 0)) {
+        // Flush the partial last block; if there was no data at all,
+        // emit one empty member so the output is still a valid gzip
+        // file.
+        job->state = PGZ_FILLED;
+        ++p->seq_fill;
+    }
+    p->finish = 1;
+    pthread_cond_broadcast(&p->cond);
+    while (!p->error && p->seq_write < p->seq_fill) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    int error = p->error;
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->nworkers; ++i) {
+        pthread_join(p->workers[i], NULL);
+    }
+    pthread_join(p->writer, NULL);
+    pgz_free(p);
+    return error ? -1 : 0;
+}
+
+static ssize_t tar_pgz_cb_write(int fd, const void* buf, size_t len)
+{
+    if (hash_name) {
+        SHA1_Update(&sha_ctx, (u_char*)buf, len);
+        MD5_Update(&md5_ctx, buf, len);
+        hash_datalen += len;
+    }
+
+    ssize_t written = pgz_write(pgz, buf, len);
+    if (written < 0) {
+        logmsg("tar_pgz_cb_write: error\n");
+        return -1;
+    }
+    update_progress(written);
+    return written;
+}
+
+static tartype_t tar_io_pgz = {
+    tar_cb_open,
+    tar_cb_close,
+    tar_gz_cb_read,     // backups never read; placeholder
+    tar_pgz_cb_write
+};
+
 int create_tar(int fd, const char* compress, const char* mode)
 {
     int rc = -1;
@@ -260,23 +832,104 @@ int create_tar(int fd, const char* compress, const char* mode)
     MD5_Init(&md5_ctx);
 
     if (!compress || strcasecmp(compress, "none") == 0) {
+        if (strcmp(mode, "w") == 0) {
+            // best effort; tar_cb_write falls back to direct writes
+            tar_obuf = (uint8_t*)malloc(TAR_OBUF_SIZE);
+            tar_obuf_len = 0;
+            tar_obuf_fd = fd;
+        }
         rc = tar_fdopen(&tar, fd, "foobar", &tar_io,
                 0, /* oflags: unused */
                 0, /* mode: unused */
                 TAR_GNU | TAR_STORE_SELINUX /* options */);
     }
-    else if (strcasecmp(compress, "gzip") == 0) {
-        gzf = gzdopen(fd, mode);
-        if (gzf != NULL) {
-            rc = tar_fdopen(&tar, 0, "foobar", &tar_io_gz,
+    else if (strncasecmp(compress, "gzip", 4) == 0 &&
+             (compress[4] == '\0' || compress[4] == ':')) {
+        // The codec takes an optional level suffix -- "gzip:1" trades
+        // ratio for speed, "gzip:9" the reverse -- which any gzip
+        // decoder (including an old restore side) reads regardless.
+        int level = Z_DEFAULT_COMPRESSION;
+        if (compress[4] == ':') {
+            int n = atoi(&compress[5]);
+            if (n >= 1 && n <= 9) {
+                level = n;
+            } else {
+                logmsg("create_tar: bad gzip level \"%s\", using default\n",
+                       &compress[5]);
+            }
+        }
+        // Compress on all cores when writing and there's more than
+        // one; the parallel writer's output is a sequence of gzip
+        // members, which gzread on the restore side accepts as a
+        // plain gzip stream.  Fall back to zlib's writer if the
+        // engine can't start.
+        if (strcmp(mode, "w") == 0) {
+            pgz = pgz_open(fd, level);
+        }
+        if (pgz != NULL) {
+            rc = tar_fdopen(&tar, 0, "foobar", &tar_io_pgz,
                     0, /* oflags: unused */
                     0, /* mode: unused */
                     TAR_GNU | TAR_STORE_SELINUX /* options */);
+        } else {
+            char gzmode[8];
+            if (strcmp(mode, "w") == 0 && level != Z_DEFAULT_COMPRESSION) {
+                sprintf(gzmode, "w%d", level);
+            } else {
+                strcpy(gzmode, mode);
+            }
+            gzf = gzdopen(fd, gzmode);
+            if (gzf != NULL) {
+                rc = tar_fdopen(&tar, 0, "foobar", &tar_io_gz,
+                        0, /* oflags: unused */
+                        0, /* mode: unused */
+                        TAR_GNU | TAR_STORE_SELINUX /* options */);
+                if (rc == 0 && strcmp(mode, "r") == 0) {
+                    // inflate ahead of extraction
+                    gzr_start();
+                }
+            }
         }
     }
     return rc;
 }
 
+// Push buffered output toward the socket without ending the stream;
+// called at the SOD/EOD markers so the host sees them right away.
+// (The pgz engine has no mid-stream flush; its writer thread is
+// already draining members as they complete.)
+int flush_tar()
+{
+    if (gzf != NULL) {
+        return (gzflush(gzf, Z_SYNC_FLUSH) == Z_OK) ? 0 : -1;
+    }
+    if (tar_obuf != NULL) {
+        return tar_obuf_flush();
+    }
+    return 0;
+}
+
+// Drain and close whichever writer create_tar set up.
+int finish_tar()
+{
+    if (pgz != NULL) {
+        int rc = pgz_finish(pgz);
+        pgz = NULL;
+        return rc;
+    }
+    if (gzf != NULL) {
+        return (gzflush(gzf, Z_FINISH) == Z_OK) ? 0 : -1;
+    }
+    if (tar_obuf != NULL) {
+        int rc = tar_obuf_flush();
+        free(tar_obuf);
+        tar_obuf = NULL;
+        tar_obuf_fd = -1;
+        return rc;
+    }
+    return 0;
+}
+
 static void do_exit(int rc)
 {
     char rcstr[80];
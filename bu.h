@@ -56,6 +56,8 @@ extern void part_set(partspec* part);
 extern int update_progress(uint64_t off);
 
 extern int create_tar(int fd, const char* compress, const char* mode);
+extern int flush_tar();
+extern int finish_tar();
 
 extern int do_backup(int argc, char** argv);
 extern int do_restore(int argc, char** argv);
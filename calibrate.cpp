@@ -0,0 +1,350 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#include "calibrate.h"
+#include "common.h"
+#include "mincrypt/sha.h"
+#include "minzip/Zip.h"
+#include "roots.h"
+
+#define CALIBRATION_FILE "/cache/recovery/calibration"
+#define CALIBRATION_TMP  "/cache/recovery/calibration.dat"
+
+// Per-stage budget; the whole pass stays around 20 seconds.
+#define STAGE_BUDGET_US (3 * 1000000)
+
+#define SEQ_CHUNK   (1024 * 1024)
+#define RAND_CHUNK  4096
+#define HASH_BUF    (8 * 1024 * 1024)
+#define MAX_CORES   8
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int mb_per_sec(uint64_t bytes, uint64_t us) {
+    if (us == 0) return 0;
+    return (int)((bytes * 1000000) / us / (1024 * 1024));
+}
+
+// Sequential write to a scratch file on /cache, fsync included --
+// this is what extraction and log writes actually experience.
+static int bench_seq_write(uint64_t* out_bytes) {
+    int fd = open(CALIBRATION_TMP, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+
+    char* buf = (char*)malloc(SEQ_CHUNK);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+    memset(buf, 0xa5, SEQ_CHUNK);
+
+    uint64_t written = 0;
+    uint64_t start = now_us();
+    while (now_us() - start < STAGE_BUDGET_US) {
+        if (write(fd, buf, SEQ_CHUNK) != SEQ_CHUNK) break;
+        written += SEQ_CHUNK;
+    }
+    fsync(fd);
+    uint64_t us = now_us() - start;
+    close(fd);
+    free(buf);
+
+    *out_bytes = written;
+    return mb_per_sec(written, us);
+}
+
+// Sequential read of the scratch file, with the page cache dropped
+// first so the storage actually gets exercised.
+static int bench_seq_read() {
+    int fd = open(CALIBRATION_TMP, O_RDONLY);
+    if (fd < 0) return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    char* buf = (char*)malloc(SEQ_CHUNK);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    uint64_t total = 0;
+    uint64_t start = now_us();
+    while (now_us() - start < STAGE_BUDGET_US) {
+        ssize_t n = read(fd, buf, SEQ_CHUNK);
+        if (n <= 0) {
+            if (lseek(fd, 0, SEEK_SET) != 0) break;
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            continue;
+        }
+        total += n;
+    }
+    uint64_t us = now_us() - start;
+    close(fd);
+    free(buf);
+    return mb_per_sec(total, us);
+}
+
+// Random 4KB reads across the scratch file; reported as IOPS.
+static int bench_rand_read(uint64_t file_bytes) {
+    if (file_bytes < RAND_CHUNK) return -1;
+    int fd = open(CALIBRATION_TMP, O_RDONLY);
+    if (fd < 0) return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    char buf[RAND_CHUNK];
+    uint64_t nblocks = file_bytes / RAND_CHUNK;
+    unsigned int seed = 12345;
+    int reads = 0;
+    uint64_t start = now_us();
+    while (now_us() - start < STAGE_BUDGET_US) {
+        uint64_t block = rand_r(&seed) % nblocks;
+        if (pread(fd, buf, RAND_CHUNK, block * RAND_CHUNK) != RAND_CHUNK)
+            break;
+        ++reads;
+    }
+    uint64_t us = now_us() - start;
+    close(fd);
+    return us ? (int)((uint64_t)reads * 1000000 / us) : 0;
+}
+
+typedef struct {
+    const uint8_t* buf;
+    size_t len;
+    uint64_t deadline;
+    uint64_t hashed;
+} HashWork;
+
+static void* hash_worker(void* cookie) {
+    HashWork* w = (HashWork*)cookie;
+    uint8_t digest[SHA_DIGEST_SIZE];
+    while (now_us() < w->deadline) {
+        SHA_hash(w->buf, w->len, digest);
+        w->hashed += w->len;
+    }
+    return NULL;
+}
+
+// SHA-1 throughput over an in-memory buffer: single core, then all
+// cores hashing concurrently (the aggregate tells us whether the
+// dual-hash and follower-thread schemes are worth enabling here).
+static void bench_hash(int* single_mbps, int* multi_mbps, int* cores_out) {
+    uint8_t* buf = (uint8_t*)malloc(HASH_BUF);
+    if (buf == NULL) {
+        *single_mbps = *multi_mbps = -1;
+        return;
+    }
+    size_t i;
+    unsigned int seed = 99;
+    for (i = 0; i < HASH_BUF; i += 4096) {
+        buf[i] = rand_r(&seed) & 0xff;
+    }
+
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) cores = 1;
+    if (cores > MAX_CORES) cores = MAX_CORES;
+    *cores_out = cores;
+
+    HashWork work[MAX_CORES];
+    memset(work, 0, sizeof(work));
+    work[0].buf = buf;
+    work[0].len = HASH_BUF;
+    work[0].deadline = now_us() + STAGE_BUDGET_US / 2;
+    uint64_t start = now_us();
+    hash_worker(&work[0]);
+    *single_mbps = mb_per_sec(work[0].hashed, now_us() - start);
+
+    uint64_t deadline = now_us() + STAGE_BUDGET_US / 2;
+    pthread_t threads[MAX_CORES];
+    int started = 0;
+    int t;
+    for (t = 0; t < cores; ++t) {
+        work[t].buf = buf;
+        work[t].len = HASH_BUF;
+        work[t].deadline = deadline;
+        work[t].hashed = 0;
+    }
+    start = now_us();
+    for (t = 1; t < cores; ++t) {
+        if (pthread_create(&threads[started], NULL, hash_worker, &work[t]) == 0)
+            ++started;
+    }
+    hash_worker(&work[0]);
+    for (t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    uint64_t total = 0;
+    for (t = 0; t < cores; ++t) total += work[t].hashed;
+    *multi_mbps = mb_per_sec(total, now_us() - start);
+
+    free(buf);
+}
+
+// Inflate throughput: deflate a synthetic buffer once, then measure
+// repeated inflation (the decompression side is all installs pay).
+static int bench_inflate() {
+    uint8_t* plain = (uint8_t*)malloc(HASH_BUF);
+    uLongf comp_cap = compressBound(HASH_BUF);
+    uint8_t* comp = (uint8_t*)malloc(comp_cap);
+    if (plain == NULL || comp == NULL) {
+        free(plain);
+        free(comp);
+        return -1;
+    }
+    // Mixed runs and noise, to land near typical OTA entry ratios.
+    size_t i;
+    unsigned int seed = 7;
+    for (i = 0; i < HASH_BUF; ++i) {
+        plain[i] = (i & 0x400) ? (rand_r(&seed) & 0xff) : 0x20;
+    }
+
+    uLongf comp_len = comp_cap;
+    if (compress2((Bytef*)comp, &comp_len, (Bytef*)plain, HASH_BUF,
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+        free(plain);
+        free(comp);
+        return -1;
+    }
+
+    uint64_t total = 0;
+    uint64_t start = now_us();
+    while (now_us() - start < STAGE_BUDGET_US) {
+        uLongf plain_len = HASH_BUF;
+        if (uncompress((Bytef*)plain, &plain_len, (Bytef*)comp, comp_len)
+                != Z_OK) {
+            break;
+        }
+        total += plain_len;
+    }
+    uint64_t us = now_us() - start;
+    free(plain);
+    free(comp);
+    return mb_per_sec(total, us);
+}
+
+int run_performance_calibration() {
+    if (ensure_path_mounted(CALIBRATION_FILE) != 0) {
+        ui_print("Can't mount /cache\n");
+        return -1;
+    }
+
+    ui_print("Calibrating, this takes about 20 seconds...\n");
+
+    uint64_t file_bytes = 0;
+    int seq_write = bench_seq_write(&file_bytes);
+    ui_print("  sequential write: %d MB/s\n", seq_write);
+    int seq_read = bench_seq_read();
+    ui_print("  sequential read:  %d MB/s\n", seq_read);
+    int rand_iops = bench_rand_read(file_bytes);
+    ui_print("  random 4K read:   %d IOPS\n", rand_iops);
+    unlink(CALIBRATION_TMP);
+
+    int sha1_1t = 0, sha1_mt = 0, cores = 1;
+    bench_hash(&sha1_1t, &sha1_mt, &cores);
+    ui_print("  sha1: %d MB/s single, %d MB/s on %d cores\n",
+             sha1_1t, sha1_mt, cores);
+
+    int inflate_mbps = bench_inflate();
+    ui_print("  inflate: %d MB/s\n", inflate_mbps);
+
+    // Derived tuning: parallel extraction pays off when the CPUs scale
+    // and the storage isn't already the bottleneck for a single
+    // inflater.
+    int extract_threads = 1;
+    if (sha1_1t > 0 && sha1_mt > sha1_1t + sha1_1t / 2) {
+        extract_threads = cores;
+        if (inflate_mbps > 0 && seq_write > 0 &&
+                seq_write < inflate_mbps) {
+            // Storage-bound: more inflaters just queue on the disk.
+            extract_threads = 2;
+        }
+    }
+
+    FILE* f = fopen(CALIBRATION_FILE, "w");
+    if (f == NULL) {
+        ui_print("Can't write %s: %s\n", CALIBRATION_FILE, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "seq_write_mbps=%d\n", seq_write);
+    fprintf(f, "seq_read_mbps=%d\n", seq_read);
+    fprintf(f, "rand_read_iops=%d\n", rand_iops);
+    fprintf(f, "sha1_single_mbps=%d\n", sha1_1t);
+    fprintf(f, "sha1_multi_mbps=%d\n", sha1_mt);
+    fprintf(f, "inflate_mbps=%d\n", inflate_mbps);
+    fprintf(f, "cores=%d\n", cores);
+    fprintf(f, "extract_threads=%d\n", extract_threads);
+    fclose(f);
+
+    ui_print("Saved to %s (extract_threads=%d)\n",
+             CALIBRATION_FILE, extract_threads);
+    return 0;
+}
+
+// Parsed copy of the calibration file; loaded once per boot.
+#define MAX_CAL_KEYS 16
+static struct {
+    char key[32];
+    int value;
+} cal_values[MAX_CAL_KEYS];
+static int cal_count = -1;   // -1: not loaded yet
+
+static void calibration_load() {
+    cal_count = 0;
+    if (ensure_path_mounted(CALIBRATION_FILE) != 0) return;
+    FILE* f = fopen(CALIBRATION_FILE, "r");
+    if (f == NULL) return;
+
+    char line[64];
+    while (cal_count < MAX_CAL_KEYS && fgets(line, sizeof(line), f) != NULL) {
+        char* eq = strchr(line, '=');
+        if (eq == NULL || eq == line) continue;
+        *eq = '\0';
+        strlcpy(cal_values[cal_count].key, line,
+                sizeof(cal_values[cal_count].key));
+        cal_values[cal_count].value = atoi(eq + 1);
+        ++cal_count;
+    }
+    fclose(f);
+}
+
+int calibration_get_int(const char* key, int def) {
+    if (cal_count < 0) calibration_load();
+    int i;
+    for (i = 0; i < cal_count; ++i) {
+        if (strcmp(cal_values[i].key, key) == 0) return cal_values[i].value;
+    }
+    return def;
+}
+
+void calibration_apply() {
+    // 0 keeps minzip's own per-CPU default.
+    mzSetExtractThreadCount(calibration_get_int("extract_threads", 0));
+}
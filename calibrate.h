@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_CALIBRATE_H
+#define RECOVERY_CALIBRATE_H
+
+// One-time device calibration: measures storage and CPU throughput,
+// persists the results (plus derived tuning values) as key=value
+// pairs in /cache/recovery/calibration, and lets install-time code
+// read them back instead of shipping one-size-fits-all constants.
+
+// Run the ~20 second measurement pass and write the calibration file.
+// Invoked from the device menu; prints progress via ui_print.
+// Returns 0 on success.
+int run_performance_calibration();
+
+// Read an integer from the calibration file (parsed and cached on
+// first call).  Returns 'def' if the file or key is missing.
+int calibration_get_int(const char* key, int def);
+
+// Push calibrated values into the tunables that consume them (minzip
+// extraction threads, for now).  A no-op when the device has never
+// been calibrated.
+void calibration_apply();
+
+#endif  // RECOVERY_CALIBRATE_H
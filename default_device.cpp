@@ -15,7 +15,9 @@
  */
 
 #include <linux/input.h>
+#include <string.h>
 
+#include "calibrate.h"
 #include "common.h"
 #include "device.h"
 #include "screen_ui.h"
@@ -33,6 +35,7 @@ static const char* ITEMS[] =  {"Reboot",
                                "Clear Cache",
                                "Erase Internal Storage",
                                "Recovery Settings",
+                               "Performance Calibration",
                                NULL };
 
 static Device::BuiltinAction ACTIONS[] = {
@@ -42,6 +45,7 @@ static Device::BuiltinAction ACTIONS[] = {
     Device::WIPE_CACHE,
     Device::WIPE_MEDIA,
     Device::RECOVERY_SETTINGS,
+    Device::NO_ACTION,      // Performance Calibration, handled in-device
     Device::NO_ACTION
 };
 
@@ -113,6 +117,12 @@ class DefaultDevice : public Device {
                 ITEMS[menu_position] == NULL) {
             return NO_ACTION;
         }
+        // Device-specific entries (the wipe-media shuffle in the
+        // constructor moves positions around, so match by name).
+        if (strcmp(ITEMS[menu_position], "Performance Calibration") == 0) {
+            run_performance_calibration();
+            return NO_ACTION;
+        }
         return ACTIONS[menu_position];
     }
 
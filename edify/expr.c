@@ -25,28 +25,120 @@
 
 // Functions should:
 //
-//    - return a malloc()'d string
+//    - return a Value made with StringValue() (or otherwise owned by
+//      the evaluation arena)
 //    - if Evaluate() on any argument returns NULL, return NULL.
 
 int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
+// -----------------------------------------------------------------
+//   the evaluation arena
+// -----------------------------------------------------------------
+
+// Transient strings and Values produced during evaluation are not
+// freed individually by their consumers.  Every allocation that
+// becomes part of a result is registered here and released in one
+// sweep by EvalArenaReset() when the script is done, which replaces
+// millions of tiny free() calls on a big updater-script with one
+// pass.  The same pointer may get registered more than once (eg, a
+// string that is unwrapped from one Value and wrapped into another),
+// so the sweep sorts and skips duplicates.
+
+static void** eval_track = NULL;
+static int eval_track_entries = 0;
+static int eval_track_size = 0;
+
+// Argument-array pool; see "the argument pool" below.
+static char* arg_pool = NULL;
+static size_t arg_pool_size = 0;
+static size_t arg_pool_used = 0;
+
+void EvalArenaAdopt(void* ptr) {
+    if (ptr == NULL) return;
+    if (eval_track_entries >= eval_track_size) {
+        eval_track_size = eval_track_size*2 + 1024;
+        eval_track = realloc(eval_track, eval_track_size * sizeof(void*));
+    }
+    eval_track[eval_track_entries++] = ptr;
+}
+
+static int ptr_compare(const void* a, const void* b) {
+    void* pa = *(void* const *)a;
+    void* pb = *(void* const *)b;
+    if (pa < pb) return -1;
+    if (pa > pb) return 1;
+    return 0;
+}
+
+void EvalArenaReset() {
+    qsort(eval_track, eval_track_entries, sizeof(void*), ptr_compare);
+    int i;
+    for (i = 0; i < eval_track_entries; ++i) {
+        if (i > 0 && eval_track[i] == eval_track[i-1]) continue;
+        free(eval_track[i]);
+    }
+    eval_track_entries = 0;
+
+    free(arg_pool);
+    arg_pool = NULL;
+    arg_pool_size = 0;
+    arg_pool_used = 0;
+}
+
+// -----------------------------------------------------------------
+//   the argument pool
+// -----------------------------------------------------------------
+
+// ReadVarArgs/ReadValueVarArgs used to malloc an argument array per
+// builtin invocation and make the caller free it -- once per
+// statement for a thousand-entry symlink() or set_metadata() list.
+// The arrays are carved from this pool instead.  Evaluate() and
+// EvaluateValue() mark the pool before running a function and release
+// back to the mark when it returns, so the pool's high-water mark is
+// the deepest argument list in flight, not the sum over the script.
+
+static void* ArgPoolAlloc(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (arg_pool_used + size > arg_pool_size) {
+        if (arg_pool_used == 0) {
+            // Nothing live points into the block, so it may move.
+            size_t new_size = arg_pool_size*2 + 4096;
+            while (new_size < size) new_size *= 2;
+            arg_pool = realloc(arg_pool, new_size);
+            arg_pool_size = new_size;
+        } else {
+            // An outer function still holds arrays in the pool and
+            // the block must not move under them; let the evaluation
+            // arena carry the overflow.
+            void* p = malloc(size);
+            EvalArenaAdopt(p);
+            return p;
+        }
+    }
+    void* p = arg_pool + arg_pool_used;
+    arg_pool_used += size;
+    return p;
+}
+
 char* Evaluate(State* state, Expr* expr) {
+    size_t mark = arg_pool_used;
     Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    arg_pool_used = mark;
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
-        FreeValue(v);
         return NULL;
     }
-    char* result = v->data;
-    free(v);
-    return result;
+    return v->data;
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    size_t mark = arg_pool_used;
+    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    arg_pool_used = mark;
+    return v;
 }
 
 Value* StringValue(char* str) {
@@ -55,13 +147,14 @@ Value* StringValue(char* str) {
     v->type = VAL_STRING;
     v->size = strlen(str);
     v->data = str;
+    EvalArenaAdopt(v);
+    EvalArenaAdopt(str);
     return v;
 }
 
 void FreeValue(Value* v) {
-    if (v == NULL) return;
-    free(v->data);
-    free(v);
+    // Values are owned by the evaluation arena; freeing is a no-op,
+    // kept so existing call sites read as "done with this value".
 }
 
 Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -92,9 +185,6 @@ Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     result[p] = '\0';
 
   done:
-    for (i = 0; i < argc; ++i) {
-        free(strings[i]);
-    }
     free(strings);
     return StringValue(result);
 }
@@ -111,11 +201,9 @@ Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     if (BooleanString(cond) == true) {
-        free(cond);
         return EvaluateValue(state, argv[1]);
     } else {
         if (argc == 3) {
-            free(cond);
             return EvaluateValue(state, argv[2]);
         } else {
             return StringValue(cond);
@@ -130,7 +218,9 @@ Value* AbortFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
     free(state->errmsg);
     if (msg) {
-        state->errmsg = msg;
+        // errmsg is freed by the script's caller, so it can't share
+        // the arena's copy.
+        state->errmsg = strdup(msg);
     } else {
         state->errmsg = strdup("called abort()");
     }
@@ -145,7 +235,6 @@ Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]) {
             return NULL;
         }
         int b = BooleanString(v);
-        free(v);
         if (!b) {
             int prefix_len;
             int len = argv[i]->end - argv[i]->start;
@@ -180,7 +269,6 @@ Value* StdoutFn(const char* name, State* state, int argc, Expr* argv[]) {
             return NULL;
         }
         fputs(v, stdout);
-        free(v);
     }
     return StringValue(strdup(""));
 }
@@ -190,7 +278,6 @@ Value* LogicalAndFn(const char* name, State* state,
     char* left = Evaluate(state, argv[0]);
     if (left == NULL) return NULL;
     if (BooleanString(left) == true) {
-        free(left);
         return EvaluateValue(state, argv[1]);
     } else {
         return StringValue(left);
@@ -202,7 +289,6 @@ Value* LogicalOrFn(const char* name, State* state,
     char* left = Evaluate(state, argv[0]);
     if (left == NULL) return NULL;
     if (BooleanString(left) == false) {
-        free(left);
         return EvaluateValue(state, argv[1]);
     } else {
         return StringValue(left);
@@ -214,7 +300,6 @@ Value* LogicalNotFn(const char* name, State* state,
     char* val = Evaluate(state, argv[0]);
     if (val == NULL) return NULL;
     bool bv = BooleanString(val);
-    free(val);
     return StringValue(strdup(bv ? "" : "t"));
 }
 
@@ -224,13 +309,10 @@ Value* SubstringFn(const char* name, State* state,
     if (needle == NULL) return NULL;
     char* haystack = Evaluate(state, argv[1]);
     if (haystack == NULL) {
-        free(needle);
         return NULL;
     }
 
     char* result = strdup(strstr(haystack, needle) ? "t" : "");
-    free(needle);
-    free(haystack);
     return StringValue(result);
 }
 
@@ -239,13 +321,10 @@ Value* EqualityFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (left == NULL) return NULL;
     char* right = Evaluate(state, argv[1]);
     if (right == NULL) {
-        free(left);
         return NULL;
     }
 
     char* result = strdup(strcmp(left, right) == 0 ? "t" : "");
-    free(left);
-    free(right);
     return StringValue(result);
 }
 
@@ -254,13 +333,10 @@ Value* InequalityFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (left == NULL) return NULL;
     char* right = Evaluate(state, argv[1]);
     if (right == NULL) {
-        free(left);
         return NULL;
     }
 
     char* result = strdup(strcmp(left, right) != 0 ? "t" : "");
-    free(left);
-    free(right);
     return StringValue(result);
 }
 
@@ -298,8 +374,6 @@ Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
     result = l_int < r_int;
 
   done:
-    free(left);
-    free(right);
     return StringValue(strdup(result ? "t" : ""));
 }
 
@@ -340,6 +414,128 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     return e;
 }
 
+// -----------------------------------------------------------------
+//   compile-time simplification
+// -----------------------------------------------------------------
+
+// updater-scripts are dominated by huge assert/symlink/set_metadata
+// argument lists: tens of thousands of string literals glued together
+// with '+'.  Rather than re-deriving those strings with a malloc per
+// node at run time, we walk the tree once after parsing: literal
+// names are interned so each distinct string is stored only once, and
+// side-effect-free operators whose arguments are all literals are
+// evaluated now and replaced by a literal holding their result.
+// After folding, most of the tree is leaves and evaluation touches
+// the allocator far less.
+
+static char** intern_table = NULL;
+static int intern_entries = 0;
+static int intern_size = 0;
+
+// Return the canonical copy of the malloc'd string s, taking
+// ownership of it (s is freed if an equal string is already
+// interned).
+static char* InternString(char* s) {
+    int lo = 0;
+    int hi = intern_entries;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(s, intern_table[mid]);
+        if (cmp == 0) {
+            free(s);
+            return intern_table[mid];
+        } else if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    if (intern_entries >= intern_size) {
+        intern_size = intern_size*2 + 16;
+        intern_table = realloc(intern_table, intern_size * sizeof(char*));
+    }
+    memmove(intern_table+lo+1, intern_table+lo,
+            (intern_entries-lo) * sizeof(char*));
+    intern_table[lo] = s;
+    ++intern_entries;
+    return s;
+}
+
+// Operators that depend only on their arguments and have no side
+// effects, so applying them to literals at compile time is
+// indistinguishable from doing it at run time.
+static bool FnIsPure(Function fn) {
+    return fn == ConcatFn ||
+           fn == LogicalAndFn ||
+           fn == LogicalOrFn ||
+           fn == LogicalNotFn ||
+           fn == SubstringFn ||
+           fn == EqualityFn ||
+           fn == InequalityFn ||
+           fn == LessThanIntFn ||
+           fn == GreaterThanIntFn;
+}
+
+// Fold e in place; returns true if e is (now) a literal.
+static bool FoldExpr(Expr* e) {
+    if (e->fn == Literal) {
+        e->name = InternString(e->name);
+        return true;
+    }
+
+    bool all_literal = true;
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        if (!FoldExpr(e->argv[i])) all_literal = false;
+    }
+
+    // A sequence or ifelse whose discarded/deciding side is a literal
+    // can be replaced by the branch that will actually run.
+    if (e->fn == SequenceFn && e->argv[0]->fn == Literal) {
+        *e = *e->argv[1];
+        return e->fn == Literal;
+    }
+    if (e->fn == IfElseFn && (e->argc == 2 || e->argc == 3) &&
+        e->argv[0]->fn == Literal) {
+        if (BooleanString(e->argv[0]->name)) {
+            *e = *e->argv[1];
+        } else if (e->argc == 3) {
+            *e = *e->argv[2];
+        } else {
+            // false with no else branch: the result is the condition.
+            *e = *e->argv[0];
+        }
+        return e->fn == Literal;
+    }
+
+    if (!all_literal || !FnIsPure(e->fn)) return false;
+
+    State state;
+    state.cookie = NULL;
+    state.script = NULL;
+    state.errmsg = NULL;
+    Value* v = e->fn(e->name, &state, e->argc, e->argv);
+    free(state.errmsg);
+    if (v == NULL || v->type != VAL_STRING) {
+        FreeValue(v);
+        return false;
+    }
+
+    e->fn = Literal;
+    // the intern table must own its strings outright, so fold results
+    // are copied out of the evaluation arena.
+    e->name = InternString(strdup(v->data));
+    e->argc = 0;
+    return true;
+}
+
+void FoldConstants(Expr* root) {
+    FoldExpr(root);
+    // discard the intermediate values built while folding.
+    EvalArenaReset();
+}
+
 // -----------------------------------------------------------------
 //   the function table
 // -----------------------------------------------------------------
@@ -399,71 +595,54 @@ void RegisterBuiltins() {
 
 // Evaluate the expressions in argv, giving 'count' char* (the ... is
 // zero or more char** to put them in).  If any expression evaluates
-// to NULL, free the rest and return -1.  Return 0 on success.
+// to NULL, return -1.  Return 0 on success.  The strings are written
+// straight into the out-pointers; no intermediate array is built.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = Evaluate(state, argv[i]);
-        if (args[i] == NULL) {
+        char* arg = Evaluate(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
-            int j;
-            for (j = 0; j < i; ++j) {
-                free(args[j]);
-            }
-            free(args);
             return -1;
         }
-        *(va_arg(v, char**)) = args[i];
+        *(va_arg(v, char**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
 // Evaluate the expressions in argv, giving 'count' Value* (the ... is
 // zero or more Value** to put them in).  If any expression evaluates
-// to NULL, free the rest and return -1.  Return 0 on success.
+// to NULL, return -1.  Return 0 on success.  The Values are written
+// straight into the out-pointers; no intermediate array is built.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = EvaluateValue(state, argv[i]);
-        if (args[i] == NULL) {
+        Value* arg = EvaluateValue(state, argv[i]);
+        if (arg == NULL) {
             va_end(v);
-            int j;
-            for (j = 0; j < i; ++j) {
-                FreeValue(args[j]);
-            }
-            free(args);
             return -1;
         }
-        *(va_arg(v, Value**)) = args[i];
+        *(va_arg(v, Value**)) = arg;
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
 // Evaluate the expressions in argv, returning an array of char*
-// results.  If any evaluate to NULL, free the rest and return NULL.
-// The caller is responsible for freeing the returned array and the
-// strings it contains.
+// results, or NULL if any evaluate to NULL.  The array lives in the
+// argument pool and is released when the calling function returns;
+// callers must not free it.
 char** ReadVarArgs(State* state, int argc, Expr* argv[]) {
-    char** args = (char**)malloc(argc * sizeof(char*));
+    char** args = (char**)ArgPoolAlloc(argc * sizeof(char*));
     int i = 0;
     for (i = 0; i < argc; ++i) {
         args[i] = Evaluate(state, argv[i]);
         if (args[i] == NULL) {
-            int j;
-            for (j = 0; j < i; ++j) {
-                free(args[j]);
-            }
-            free(args);
             return NULL;
         }
     }
@@ -471,20 +650,15 @@ char** ReadVarArgs(State* state, int argc, Expr* argv[]) {
 }
 
 // Evaluate the expressions in argv, returning an array of Value*
-// results.  If any evaluate to NULL, free the rest and return NULL.
-// The caller is responsible for freeing the returned array and the
-// Values it contains.
+// results, or NULL if any evaluate to NULL.  The array lives in the
+// argument pool and is released when the calling function returns;
+// callers must not free it.
 Value** ReadValueVarArgs(State* state, int argc, Expr* argv[]) {
-    Value** args = (Value**)malloc(argc * sizeof(Value*));
+    Value** args = (Value**)ArgPoolAlloc(argc * sizeof(Value*));
     int i = 0;
     for (i = 0; i < argc; ++i) {
         args[i] = EvaluateValue(state, argv[i]);
         if (args[i] == NULL) {
-            int j;
-            for (j = 0; j < i; ++j) {
-                FreeValue(args[j]);
-            }
-            free(args);
             return NULL;
         }
     }
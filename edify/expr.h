@@ -66,17 +66,28 @@ struct Expr {
 };
 
 // Take one of the Expr*s passed to the function as an argument,
-// evaluate it, return the resulting Value.  The caller takes
-// ownership of the returned Value.
+// evaluate it, return the resulting Value.  The Value is owned by the
+// evaluation arena and stays live until EvalArenaReset(); callers
+// must not free it.
 Value* EvaluateValue(State* state, Expr* expr);
 
 // Take one of the Expr*s passed to the function as an argument,
 // evaluate it, assert that it is a string, and return the resulting
-// char*.  The caller takes ownership of the returned char*.  This is
-// a convenience function for older functions that want to deal only
-// with strings.
+// char*.  The string is owned by the evaluation arena; callers must
+// not free it.  This is a convenience function for older functions
+// that want to deal only with strings.
 char* Evaluate(State* state, Expr* expr);
 
+// Hand ownership of a malloc'd pointer to the evaluation arena, for
+// functions that build result Values directly rather than through
+// StringValue().  Registering the same pointer twice is harmless.
+void EvalArenaAdopt(void* ptr);
+
+// Free everything produced during evaluation.  Call once after the
+// script's result has been consumed; no Value or string returned by
+// Evaluate()/EvaluateValue() may be used afterwards.
+void EvalArenaReset();
+
 // Glue to make an Expr out of a literal.
 Value* Literal(const char* name, State* state, int argc, Expr* argv[]);
 
@@ -96,6 +107,11 @@ Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]);
 // of arguments.
 Expr* Build(Function fn, YYLTYPE loc, int count, ...);
 
+// Simplify a parsed script in place: intern literal strings and
+// evaluate pure operators with constant arguments now instead of at
+// run time.  Call once after parse_string() succeeds.
+void FoldConstants(Expr* root);
+
 // Global builtins, registered by RegisterBuiltins().
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]);
@@ -134,24 +150,28 @@ Function FindFunction(const char* name);
 
 // Evaluate the expressions in argv, giving 'count' char* (the ... is
 // zero or more char** to put them in).  If any expression evaluates
-// to NULL, free the rest and return -1.  Return 0 on success.
+// to NULL, return -1.  Return 0 on success.  The strings are owned by
+// the evaluation arena; callers must not free them.
 int ReadArgs(State* state, Expr* argv[], int count, ...);
 
 // Evaluate the expressions in argv, giving 'count' Value* (the ... is
 // zero or more Value** to put them in).  If any expression evaluates
-// to NULL, free the rest and return -1.  Return 0 on success.
+// to NULL, return -1.  Return 0 on success.  The Values are owned by
+// the evaluation arena; callers must not free them.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...);
 
 // Evaluate the expressions in argv, returning an array of char*
-// results.  If any evaluate to NULL, free the rest and return NULL.
-// The caller is responsible for freeing the returned array and the
-// strings it contains.
+// results, or NULL if any evaluate to NULL.  The array is carved from
+// the argument pool and released when the calling function returns;
+// callers must not free it (or the strings, which the evaluation
+// arena owns).
 char** ReadVarArgs(State* state, int argc, Expr* argv[]);
 
 // Evaluate the expressions in argv, returning an array of Value*
-// results.  If any evaluate to NULL, free the rest and return NULL.
-// The caller is responsible for freeing the returned array and the
-// Values it contains.
+// results, or NULL if any evaluate to NULL.  The array is carved from
+// the argument pool and released when the calling function returns;
+// callers must not free it (or the Values, which the evaluation arena
+// owns).
 Value** ReadValueVarArgs(State* state, int argc, Expr* argv[]);
 
 // Use printf-style arguments to compose an error message to put into
@@ -38,6 +38,8 @@ int expect(const char* expr_str, const char* expected, int* errors) {
         return 0;
     }
 
+    FoldConstants(e);
+
     State state;
     state.cookie = NULL;
     state.script = strdup(expr_str);
@@ -49,23 +51,23 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     if (result == NULL && expected != NULL) {
         printf("error evaluating \"%s\"\n", expr_str);
         ++*errors;
+        EvalArenaReset();
         return 0;
     }
 
     if (result == NULL && expected == NULL) {
+        EvalArenaReset();
         return 1;
     }
 
-    if (strcmp(result, expected) != 0) {
+    int matched = (strcmp(result, expected) == 0);
+    if (!matched) {
         printf("evaluating \"%s\": expected \"%s\", got \"%s\"\n",
                expr_str, expected, result);
         ++*errors;
-        free(result);
-        return 0;
     }
-
-    free(result);
-    return 1;
+    EvalArenaReset();
+    return matched;
 }
 
 int test() {
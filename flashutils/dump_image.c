@@ -25,6 +25,10 @@ extern "C"{
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+
+#include <openssl/sha.h>
 
 #include "cutils/log.h"
 #include "flashutils.h"
@@ -59,10 +63,14 @@ static int die(const char *msg, ...) {
 
 /* Read a flash partition and write it to an image file. */
 
+// Streaming chunk: large enough that mtdutils batches several erase
+// blocks into each read syscall.
+#define DUMP_CHUNK (256 * 1024)
+
 int dump_image(char* partition_name, char* filename, dump_image_callback callback) {
     MtdReadContext *in;
     const MtdPartition *partition;
-    char buf[BLOCK_SIZE + SPARE_SIZE];
+    char *buf;
     size_t partition_size;
     size_t read_size;
     size_t total;
@@ -98,19 +106,29 @@ int dump_image(char* partition_name, char* filename, dump_image_callback callbac
         return die("error opening %s: %s\n", partition_name, strerror(errno));
     }
 
+    buf = malloc(DUMP_CHUNK);
+    if (buf == NULL) {
+        mtd_read_close(in);
+        close(fd);
+        unlink(filename);
+        return die("error allocating dump buffer");
+    }
+
     total = 0;
-    while ((len = mtd_read_data(in, buf, BLOCK_SIZE)) > 0) {
+    while ((len = mtd_read_data(in, buf, DUMP_CHUNK)) > 0) {
         wrote = write(fd, buf, len);
         if (wrote != len) {
+            free(buf);
             close(fd);
             unlink(filename);
             return die("error writing %s", filename);
         }
-        total += BLOCK_SIZE;
+        total += len;
         if (callback != NULL)
             callback(total, partition_size);
     }
 
+    free(buf);
     mtd_read_close(in);
 
     if (close(fd)) {
@@ -143,14 +161,175 @@ int main(int argc, char **argv)
 
 #endif
 
+/* Extent size for the streamed dump path. */
+#define DUMP_CHUNK (4 * 1024 * 1024)
+
+static unsigned long long now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void show_progress(unsigned long long done, unsigned long long total,
+        unsigned long long start_ms)
+{
+    unsigned long long elapsed = now_ms() - start_ms;
+    double rate = elapsed ?
+            (double)done / (1024 * 1024) * 1000 / elapsed : 0.0;
+    if (total)
+        fprintf(stderr, "\rdumped %llu/%llu MB (%.1f MB/s)",
+                done >> 20, total >> 20, rate);
+    else
+        fprintf(stderr, "\rdumped %llu MB (%.1f MB/s)", done >> 20, rate);
+}
+
+/*
+ * Stream a raw block device to out_file.  The copy normally runs
+ * through sendfile() in DUMP_CHUNK extents so the data never crosses
+ * into userspace; with do_sha1 set (or on kernels whose sendfile can't
+ * take this source/sink pair) it drops to a large read/write loop so
+ * the stream can be SHA1-hashed inline.  Progress and throughput go to
+ * stderr about once a second.
+ */
+static int dump_stream(const char *device, const char *out_file, int do_sha1)
+{
+    int ret = -1;
+    char *buf = NULL;
+
+    int in = open(device, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "error opening %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+
+    int out;
+    if (!strcmp(out_file, "-"))
+        out = fileno(stdout);
+    else
+        out = open(out_file, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (out < 0) {
+        fprintf(stderr, "error opening %s: %s\n", out_file, strerror(errno));
+        close(in);
+        return -1;
+    }
+
+    unsigned long long total = 0;
+    off64_t end = lseek64(in, 0, SEEK_END);
+    if (end > 0 && lseek64(in, 0, SEEK_SET) == 0)
+        total = end;
+
+    SHA_CTX sha;
+    if (do_sha1)
+        SHA1_Init(&sha);
+
+    int use_sendfile = !do_sha1;
+    unsigned long long done = 0;
+    unsigned long long start = now_ms();
+    unsigned long long last_tick = start;
+
+    for (;;) {
+        ssize_t len;
+        if (use_sendfile) {
+            len = sendfile(out, in, NULL, DUMP_CHUNK);
+            if (len < 0 && done == 0 &&
+                    (errno == EINVAL || errno == ENOSYS)) {
+                // Kernel can't sendfile this pair; copy instead.
+                use_sendfile = 0;
+                continue;
+            }
+        } else {
+            if (buf == NULL) {
+                buf = malloc(DUMP_CHUNK);
+                if (buf == NULL) {
+                    fprintf(stderr, "out of memory\n");
+                    goto done;
+                }
+            }
+            len = read(in, buf, DUMP_CHUNK);
+            if (len > 0) {
+                if (do_sha1)
+                    SHA1_Update(&sha, buf, len);
+                if (write(out, buf, len) != len) {
+                    fprintf(stderr, "\nerror writing %s: %s\n",
+                            out_file, strerror(errno));
+                    goto done;
+                }
+            }
+        }
+        if (len < 0) {
+            fprintf(stderr, "\nerror reading %s: %s\n",
+                    device, strerror(errno));
+            goto done;
+        }
+        if (len == 0)
+            break;
+
+        done += len;
+        unsigned long long t = now_ms();
+        if (t - last_tick >= 1000) {
+            show_progress(done, total, start);
+            last_tick = t;
+        }
+    }
+
+    show_progress(done, total, start);
+    fputc('\n', stderr);
+
+    if (out != fileno(stdout) && fsync(out)) {
+        fprintf(stderr, "error syncing %s: %s\n", out_file, strerror(errno));
+        goto done;
+    }
+
+    if (do_sha1) {
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        int i;
+        SHA1_Final(digest, &sha);
+        printf("SHA1(%s)= ", device);
+        for (i = 0; i < SHA_DIGEST_LENGTH; ++i)
+            printf("%02x", digest[i]);
+        printf("\n");
+    }
+
+    ret = 0;
+
+done:
+    free(buf);
+    if (out != fileno(stdout))
+        close(out);
+    close(in);
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
+    int do_sha1 = 0;
+    if (argc == 4 && strcmp(argv[1], "-s") == 0) {
+        do_sha1 = 1;
+        ++argv;
+        --argc;
+    }
     if (argc != 3) {
-        fprintf(stderr, "usage: %s partition file.img\n", argv[0]);
+        fprintf(stderr, "usage: %s [-s] partition file.img\n", argv[0]);
         return 2;
     }
 
-    return backup_raw_partition(NULL, argv[1], argv[2]);
+    // MTD needs the ECC- and bad-block-aware library read path;
+    // everything else is a plain block device we can stream directly.
+    char device[256];
+    const char *src = NULL;
+    if (argv[1][0] == '/')
+        src = argv[1];
+    else if (device_flash_type() != MTD &&
+            get_partition_device(argv[1], device) == 0)
+        src = device;
+
+    if (src == NULL || strstr(src, "/mtd") != NULL) {
+        if (do_sha1)
+            fprintf(stderr, "warning: -s not supported on mtd, ignoring\n");
+        return backup_raw_partition(NULL, argv[1], argv[2]);
+    }
+    return dump_stream(src, argv[2], do_sha1);
 }
 #ifdef __cplusplus
 }
@@ -47,6 +47,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <linux/fuse.h>
+#include <linux/if_alg.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,6 +55,7 @@
 #include <sys/inotify.h>
 #include <sys/mount.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/time.h>
@@ -84,20 +86,130 @@ struct fuse_data {
     gid_t gid;
 
     uint32_t curr_block;    // cache the block most recently used
-    uint8_t* block_data;
+    uint8_t* block_data;    // fallback buffer when the block cache is off
+    uint8_t* curr_data;     // data for curr_block; points into the block
+                            // cache (no copy) or at block_data
 
     uint8_t* extra_block;   // another block of storage for reads that
                             // span two blocks
 
-    uint8_t* hashes;        // SHA-256 hash of each block (all zeros
-                            // if block hasn't been read yet)
+    uint8_t* hashes;        // SHA-256 hash of each block
+    uint8_t* verified;      // bitmap: 1 if the block's hash has been
+                            // recorded (the block has been read and
+                            // verified at least once)
+
+    // Kernel crypto API (AF_ALG) handles for sha256, which lands on
+    // the SoC's hash engine when a driver is present; -1 when the
+    // socket can't be set up, in which case hashing falls back to the
+    // mincrypt C implementation.
+    int alg_tfm;
+    int alg_op;
 
     // Block cache
     uint32_t block_cache_max_size;   // Max allowed block cache size
     uint32_t block_cache_size;       // Current block cache size
     uint8_t** block_cache;           // Block cache data
+
+    // Readahead pipeline.  The lock covers the provider, the hashes
+    // and the cache; the prefetch thread pulls blocks up to
+    // prefetch_limit into the cache while the main loop is busy
+    // hashing, replying and waiting for the next kernel request.
+    pthread_t prefetch_t;
+    pthread_mutex_t lock;
+    pthread_cond_t prefetch_cond;
+    uint32_t prefetch_next;          // next block the prefetcher pulls
+    uint32_t prefetch_limit;         // one past the last block to pull
+    int prefetch_run;                // cleared to stop the thread
+};
+
+// How far past the last demanded block the prefetcher runs.  Each
+// fetch is a full adb round trip, so this is the pipeline depth that
+// hides request/response latency behind the serving of earlier blocks.
+#define PREFETCH_DEPTH 8
+
+// When an install fails and the package is sideloaded again, the whole
+// file used to be re-fetched from scratch.  Instead, spool the block
+// hash table and the contents of the block cache to tmpfs on teardown,
+// and restore them on the next run if the file size and block size
+// match.  We can't know the package's overall digest up front, so the
+// spool is validated by re-pulling the first block and comparing it
+// against the recorded hash; a mismatch (different package, same size)
+// throws the spool away.  Restored blocks are served from the cache
+// without touching the host; everything else is re-pulled and verified
+// against the restored hashes, preserving the first-read-wins
+// invariant across retries.  The spool lives in /tmp so it naturally
+// vanishes when recovery reboots after a successful install.
+#define SIDELOAD_SPOOL "/tmp/sideload.spool"
+#define SPOOL_MAGIC 0x314c5053   // "SPL1", little-endian
+
+struct spool_header {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t file_size;
+    uint32_t cached;        // number of block data records after the hashes
 };
 
+static int verified_test(const struct fuse_data* fd, uint32_t block) {
+    return fd->verified[block >> 3] & (1 << (block & 7));
+}
+
+static void verified_set(struct fuse_data* fd, uint32_t block) {
+    fd->verified[block >> 3] |= (1 << (block & 7));
+}
+
+// Try to open an AF_ALG sha256 transform.  Hashing every block is the
+// main CPU cost of serving a sideload, so route it through the kernel
+// crypto API, which picks the best implementation registered -- the
+// SoC's SHA engine or the kernel's NEON code where available.  Any
+// failure just leaves alg_op at -1 and hashing in software.
+static void alg_sha256_open(struct fuse_data* fd) {
+    struct sockaddr_alg sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.salg_family = AF_ALG;
+    strcpy((char*)sa.salg_type, "hash");
+    strcpy((char*)sa.salg_name, "sha256");
+
+    int tfm = socket(AF_ALG, SOCK_SEQPACKET, 0);
+    if (tfm < 0) {
+        return;
+    }
+    if (bind(tfm, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+        close(tfm);
+        return;
+    }
+    int op = accept(tfm, NULL, NULL);
+    if (op < 0) {
+        close(tfm);
+        return;
+    }
+    fd->alg_tfm = tfm;
+    fd->alg_op = op;
+}
+
+static void alg_sha256_close(struct fuse_data* fd) {
+    if (fd->alg_op >= 0) close(fd->alg_op);
+    if (fd->alg_tfm >= 0) close(fd->alg_tfm);
+    fd->alg_op = -1;
+    fd->alg_tfm = -1;
+}
+
+// Hash one full (padded) block, through AF_ALG when it's open.  An
+// AF_ALG error mid-stream drops back to software for the rest of the
+// run rather than failing the read.
+static void block_hash(struct fuse_data* fd, const uint8_t* data,
+                       uint8_t* hash) {
+    if (fd->alg_op >= 0) {
+        if (send(fd->alg_op, data, fd->block_size, 0) ==
+                (ssize_t)fd->block_size &&
+            read(fd->alg_op, hash, SHA256_DIGEST_SIZE) ==
+                SHA256_DIGEST_SIZE) {
+            return;
+        }
+        alg_sha256_close(fd);
+    }
+    SHA256_hash((uint8_t*)data, fd->block_size, hash);
+}
+
 static uint64_t free_memory() {
     uint64_t mem = 0;
     FILE* fp = fopen("/proc/meminfo", "r");
@@ -125,23 +237,18 @@ static uint64_t free_memory() {
     return mem;
 }
 
-static int block_cache_fetch(struct fuse_data* fd, uint32_t block)
+// Store a block in the cache, taking ownership of data (which must be
+// a malloc'd buffer of block_size bytes).  The eviction scan never
+// frees curr_block's entry, so replies being assembled from cache
+// memory stay valid while the prefetch thread inserts blocks.
+static void block_cache_put(struct fuse_data* fd, uint32_t block,
+                            uint8_t* data)
 {
-    if (fd->block_cache == NULL) {
-        return -1;
+    if (fd->block_cache[block] != NULL) {
+        free(fd->block_cache[block]);
+        fd->block_cache[block] = NULL;
+        fd->block_cache_size--;
     }
-    if (fd->block_cache[block] == NULL) {
-        return -1;
-    }
-    memcpy(fd->block_data, fd->block_cache[block], fd->block_size);
-    return 0;
-}
-
-static void block_cache_enter(struct fuse_data* fd, uint32_t block)
-{
-    struct block_entry* entry;
-    if (!fd->block_cache)
-        return;
     if (fd->block_cache_size == fd->block_cache_max_size) {
         // Evict a block from the cache.  Since the file is typically read
         // sequentially, start looking from the block behind the current
@@ -160,12 +267,199 @@ static void block_cache_enter(struct fuse_data* fd, uint32_t block)
         }
     }
 
-    fd->block_cache[block] = (uint8_t*)malloc(fd->block_size);
-    memcpy(fd->block_cache[block], fd->block_data, fd->block_size);
-
+    fd->block_cache[block] = data;
     fd->block_cache_size++;
 }
 
+// Copying variant of block_cache_put, for callers whose source buffer
+// must survive (e.g. the spool loader reusing one read buffer).
+static void block_cache_enter(struct fuse_data* fd, uint32_t block,
+                              const uint8_t* data)
+{
+    if (!fd->block_cache)
+        return;
+    uint8_t* copy = (uint8_t*)malloc(fd->block_size);
+    if (copy == NULL)
+        return;
+    memcpy(copy, data, fd->block_size);
+    block_cache_put(fd, block, copy);
+}
+
+// Forget everything restored from the spool: zero the hash table and
+// drop any cached blocks.  Used when the spool turns out to describe a
+// different package than the one the host is serving.
+static void spool_reset(struct fuse_data* fd)
+{
+    memset(fd->hashes, 0, fd->file_blocks * SHA256_DIGEST_SIZE);
+    memset(fd->verified, 0, (fd->file_blocks + 7) / 8);
+    if (fd->block_cache) {
+        uint32_t n;
+        for (n = 0; n < fd->file_blocks; ++n) {
+            free(fd->block_cache[n]);
+            fd->block_cache[n] = NULL;
+        }
+    }
+    fd->block_cache_size = 0;
+    // The spool on disk describes a package we're no longer serving;
+    // drop it now rather than leaving it to confuse a later run.
+    unlink(SIDELOAD_SPOOL);
+}
+
+// Restore the hash table and cached blocks from a previous run's
+// spool, if one exists for a file of the same size and block size.
+// Returns 1 if anything was restored (the caller must then validate
+// the spool against the host), 0 otherwise.
+static int spool_load(struct fuse_data* fd)
+{
+    FILE* f = fopen(SIDELOAD_SPOOL, "rb");
+    if (f == NULL) {
+        return 0;
+    }
+
+    struct spool_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        hdr.magic != SPOOL_MAGIC ||
+        hdr.block_size != fd->block_size ||
+        hdr.file_size != fd->file_size) {
+        fclose(f);
+        return 0;
+    }
+
+    if (fread(fd->hashes, SHA256_DIGEST_SIZE, fd->file_blocks, f) !=
+        fd->file_blocks) {
+        spool_reset(fd);
+        fclose(f);
+        return 0;
+    }
+
+    // The spool format keeps the all-zero hash as its "never read"
+    // marker; rebuild the in-memory bitmap from it so re-pulled blocks
+    // are checked against the restored hashes instead of overwriting
+    // them.
+    uint32_t b;
+    for (b = 0; b < fd->file_blocks; ++b) {
+        const uint8_t* h = fd->hashes + b * SHA256_DIGEST_SIZE;
+        int z;
+        for (z = 0; z < SHA256_DIGEST_SIZE && h[z] == 0; ++z) { }
+        if (z < SHA256_DIGEST_SIZE) {
+            verified_set(fd, b);
+        }
+    }
+
+    uint32_t i;
+    for (i = 0; i < hdr.cached; ++i) {
+        uint32_t block;
+        if (fread(&block, sizeof(block), 1, f) != 1 ||
+            block >= fd->file_blocks ||
+            fread(fd->block_data, fd->block_size, 1, f) != 1) {
+            break;
+        }
+        if (fd->block_cache != NULL &&
+            fd->block_cache[block] == NULL &&
+            fd->block_cache_size < fd->block_cache_max_size) {
+            block_cache_enter(fd, block, fd->block_data);
+        }
+    }
+
+    fclose(f);
+    return 1;
+}
+
+// Check that the restored spool describes the package the host is
+// serving: re-pull the first block and compare it against the
+// recorded hash.  A mismatch means a different package of the same
+// size, so the spool is discarded and this run starts from scratch.
+static void spool_validate(struct fuse_data* fd)
+{
+    size_t fetch_size = fd->block_size;
+    if (fetch_size > fd->file_size) {
+        fetch_size = fd->file_size;
+        memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+    }
+    if (fd->vtab->read_block(fd->cookie, 0, fd->block_data, fetch_size) < 0) {
+        spool_reset(fd);
+        return;
+    }
+
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    block_hash(fd, fd->block_data, hash);
+    if (!verified_test(fd, 0) ||
+        memcmp(hash, fd->hashes, SHA256_DIGEST_SIZE) != 0) {
+        spool_reset(fd);
+        return;
+    }
+
+    // The probe doubles as the first fetch.
+    fd->curr_block = 0;
+    fd->curr_data = fd->block_data;
+    if (fd->block_cache != NULL && fd->block_cache[0] == NULL) {
+        block_cache_enter(fd, 0, fd->block_data);
+    }
+}
+
+// Write the hash table and the contents of the block cache out to the
+// spool for the next run.  Cached blocks are freed as they are
+// written, so peak memory stays flat while the data moves to tmpfs.
+static void spool_save(struct fuse_data* fd)
+{
+    FILE* f = fopen(SIDELOAD_SPOOL, "wb");
+    if (f == NULL) {
+        return;
+    }
+
+    struct spool_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SPOOL_MAGIC;
+    hdr.block_size = fd->block_size;
+    hdr.file_size = fd->file_size;
+    hdr.cached = fd->block_cache ? fd->block_cache_size : 0;
+
+    // The full size is known before the first byte is written.
+    // Allocate the fixed prefix (header + hash table) up front, and
+    // size the rest of the file sparsely: on tmpfs fallocate commits
+    // pages immediately, and committing the data region while the
+    // cached blocks still sit in RAM would double peak memory.  Data
+    // pages commit one block at a time below, as each cached block is
+    // written and freed.
+    uint64_t prefix = sizeof(hdr) +
+            (uint64_t)fd->file_blocks * SHA256_DIGEST_SIZE;
+    uint64_t total = prefix +
+            (uint64_t)hdr.cached * (sizeof(uint32_t) + fd->block_size);
+    if (posix_fallocate(fileno(f), 0, prefix) != 0 ||
+        ftruncate(fileno(f), total) != 0) {
+        fclose(f);
+        unlink(SIDELOAD_SPOOL);
+        return;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(fd->hashes, SHA256_DIGEST_SIZE, fd->file_blocks, f) !=
+        fd->file_blocks) {
+        fclose(f);
+        unlink(SIDELOAD_SPOOL);
+        return;
+    }
+
+    if (fd->block_cache) {
+        uint32_t n;
+        for (n = 0; n < fd->file_blocks; ++n) {
+            if (fd->block_cache[n] == NULL) {
+                continue;
+            }
+            if (fwrite(&n, sizeof(n), 1, f) != 1 ||
+                fwrite(fd->block_cache[n], fd->block_size, 1, f) != 1) {
+                fclose(f);
+                unlink(SIDELOAD_SPOOL);
+                return;
+            }
+            free(fd->block_cache[n]);
+            fd->block_cache[n] = NULL;
+        }
+    }
+
+    fclose(f);
+}
+
 static void fuse_reply(struct fuse_data* fd, __u64 unique, const void *data, size_t len)
 {
     struct fuse_out_header hdr;
@@ -263,6 +557,12 @@ static int handle_open(void* data, struct fuse_data* fd, const struct fuse_in_he
     struct fuse_open_out out;
     memset(&out, 0, sizeof(out));
     out.fh = 10;  // an arbitrary number; we always use the same handle
+    // The package's bytes never change once read (that's the
+    // filesystem's core invariant), so let the kernel keep its page
+    // cache across opens -- the updater's read of a region the
+    // verifier already paged in is then served without calling back
+    // into the provider.
+    out.open_flags = FOPEN_KEEP_CACHE;
     fuse_reply(fd, hdr->unique, &out, sizeof(out));
     return NO_STATUS;
 }
@@ -275,9 +575,49 @@ static int handle_release(void* data, struct fuse_data* fd, const struct fuse_in
     return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(struct fuse_data* fd, uint32_t block) {
+// Verify a block's data against the recorded hash.  Call with
+// fd->lock held.
+//
+// - If this is the first time we've read this block (its bit in the
+//   verified bitmap is clear), record the hash and accept the block
+//   (returns 1).
+// - If the hash of the received data matches the recorded hash,
+//   accept it (returns 0).
+// - Otherwise the host sent different bits than the first time
+//   (returns -EIO).
+//
+// The bitmap, not an all-zero recorded hash, is what distinguishes
+// "never read" from "verified": a block whose real digest happened to
+// be all zeroes would otherwise be treated as unread on every
+// re-request, letting the host swap its contents between reads.
+// Blocks served from the in-process cache never come through here at
+// all -- their bits are set and their bytes are ours, so re-reads
+// after the kernel drops its pages cost no hashing.
+static int verify_block(struct fuse_data* fd, uint32_t block,
+                        const uint8_t* data) {
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    uint8_t* blockhash = fd->hashes + block * SHA256_DIGEST_SIZE;
+
+    block_hash(fd, data, hash);
+    if (!verified_test(fd, block)) {
+        memcpy(blockhash, hash, SHA256_DIGEST_SIZE);
+        verified_set(fd, block);
+        return 1;
+    }
+
+    if (memcmp(hash, blockhash, SHA256_DIGEST_SIZE) == 0) {
+        return 0;
+    }
+
+    return -EIO;
+}
+
+// Fetch a block from the host, leaving fd->curr_data pointing at its
+// contents.  Cache hits are served in place; fresh fetches land
+// directly in a buffer that the cache then owns, so the data is never
+// copied on its way to the reply.  Returns 0 on successful fetch,
+// negative otherwise.  Call with fd->lock held.
+static int fetch_block_locked(struct fuse_data* fd, uint32_t block) {
     if (block == fd->curr_block) {
         return 0;
     }
@@ -285,55 +625,126 @@ static int fetch_block(struct fuse_data* fd, uint32_t block) {
     if (block >= fd->file_blocks) {
         memset(fd->block_data, 0, fd->block_size);
         fd->curr_block = block;
+        fd->curr_data = fd->block_data;
         return 0;
     }
 
-    if (block_cache_fetch(fd, block) == 0) {
+    if (fd->block_cache != NULL && fd->block_cache[block] != NULL) {
         fd->curr_block = block;
+        fd->curr_data = fd->block_cache[block];
         return 0;
     }
 
+    uint8_t* dest = fd->block_data;
+    if (fd->block_cache != NULL) {
+        dest = (uint8_t*)malloc(fd->block_size);
+        if (dest == NULL) {
+            dest = fd->block_data;
+        }
+    }
+
     size_t fetch_size = fd->block_size;
     if (block * fd->block_size + fetch_size > fd->file_size) {
         // If we're reading the last (partial) block of the file,
         // expect a shorter response from the host, and pad the rest
         // of the block with zeroes.
         fetch_size = fd->file_size - (block * fd->block_size);
-        memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+        memset(dest + fetch_size, 0, fd->block_size - fetch_size);
     }
 
-    int result = fd->vtab->read_block(fd->cookie, block, fd->block_data, fetch_size);
-    if (result < 0) return result;
+    int result = fd->vtab->read_block(fd->cookie, block, dest, fetch_size);
+    if (result < 0) {
+        if (dest != fd->block_data) free(dest);
+        return result;
+    }
+
+    result = verify_block(fd, block, dest);
+    if (result < 0) {
+        fd->curr_block = -1;
+        fd->curr_data = NULL;
+        if (dest != fd->block_data) free(dest);
+        return result;
+    }
 
     fd->curr_block = block;
+    fd->curr_data = dest;
+    if (dest != fd->block_data) {
+        block_cache_put(fd, block, dest);
+    }
+    return 0;
+}
 
-    // Verify the hash of the block we just got from the host.
-    //
-    // - If the hash of the just-received data matches the stored hash
-    //   for the block, accept it.
-    // - If the stored hash is all zeroes, store the new hash and
-    //   accept the block (this is the first time we've read this
-    //   block).
-    // - Otherwise, return -EINVAL for the read.
+static int fetch_block(struct fuse_data* fd, uint32_t block) {
+    pthread_mutex_lock(&fd->lock);
+    int result = fetch_block_locked(fd, block);
+    if (result == 0 && fd->prefetch_run) {
+        // keep the pipeline running ahead of the reader
+        if (block + 1 > fd->prefetch_next) {
+            fd->prefetch_next = block + 1;
+        }
+        uint32_t limit = block + 1 + PREFETCH_DEPTH;
+        if (limit > fd->prefetch_limit) {
+            fd->prefetch_limit = limit;
+        }
+        pthread_cond_signal(&fd->prefetch_cond);
+    }
+    pthread_mutex_unlock(&fd->lock);
+    return result;
+}
 
-    uint8_t hash[SHA256_DIGEST_SIZE];
-    SHA256_hash(fd->block_data, fd->block_size, hash);
-    uint8_t* blockhash = fd->hashes + block * SHA256_DIGEST_SIZE;
-    if (memcmp(hash, blockhash, SHA256_DIGEST_SIZE) == 0) {
-        return 0;
+// Speculatively pull one block into the cache.  Call with fd->lock
+// held; the provider round trip happens under the lock, so a demand
+// fetch waits at most one request behind us.
+static void prefetch_one(struct fuse_data* fd, uint32_t block) {
+    if (block >= fd->file_blocks || fd->block_cache[block] != NULL) {
+        return;
     }
 
-    int i;
-    for (i = 0; i < SHA256_DIGEST_SIZE; ++i) {
-        if (blockhash[i] != 0) {
-            fd->curr_block = -1;
-            return -EIO;
-        }
+    uint8_t* buf = (uint8_t*)malloc(fd->block_size);
+    if (buf == NULL) {
+        return;
     }
 
-    memcpy(blockhash, hash, SHA256_DIGEST_SIZE);
-    block_cache_enter(fd, block);
-    return 0;
+    size_t fetch_size = fd->block_size;
+    if (block * fd->block_size + fetch_size > fd->file_size) {
+        fetch_size = fd->file_size - (block * fd->block_size);
+        memset(buf + fetch_size, 0, fd->block_size - fetch_size);
+    }
+
+    if (fd->vtab->read_block(fd->cookie, block, buf, fetch_size) < 0) {
+        free(buf);
+        return;
+    }
+    // A hash mismatch just means this block doesn't enter the cache;
+    // the demand fetch will see the same mismatch and fail the read.
+    if (verify_block(fd, block, buf) >= 0) {
+        block_cache_put(fd, block, buf);
+    } else {
+        free(buf);
+    }
+}
+
+static void* prefetch_thread_func(void* cookie) {
+    struct fuse_data* fd = (struct fuse_data*)cookie;
+    pthread_mutex_lock(&fd->lock);
+    while (fd->prefetch_run) {
+        // While the cache has room the transfer free-runs ahead of the
+        // reader, so verification and install overlap with the whole
+        // transfer instead of paying for it block by block.  Once the
+        // cache is nearly full, fall back to running just
+        // PREFETCH_DEPTH ahead of demand so we don't evict blocks the
+        // reader hasn't gotten to yet.
+        int free_run =
+            fd->block_cache_size + PREFETCH_DEPTH <= fd->block_cache_max_size;
+        if (fd->prefetch_next >= fd->file_blocks ||
+            (!free_run && fd->prefetch_next >= fd->prefetch_limit)) {
+            pthread_cond_wait(&fd->prefetch_cond, &fd->lock);
+            continue;
+        }
+        prefetch_one(fd, fd->prefetch_next++);
+    }
+    pthread_mutex_unlock(&fd->lock);
+    return NULL;
 }
 
 static int handle_read(void* data, struct fuse_data* fd, const struct fuse_in_header* hdr) {
@@ -385,20 +796,24 @@ static int handle_read(void* data, struct fuse_data* fd, const struct fuse_in_he
     if (size + block_offset <= fd->block_size) {
         // First case: the read fits entirely in the first block.
 
-        vec[1].iov_base = fd->block_data + block_offset;
+        vec[1].iov_base = fd->curr_data + block_offset;
         vec[1].iov_len = size;
         vec_used = 2;
     } else {
         // Second case: the read spills over into the next block.
+        // The first block is copied to extra_block because fetching
+        // the next one moves curr_block past it, which makes its
+        // cache entry fair game for eviction; curr_block itself is
+        // never evicted, so vec[2] can point into the cache.
 
-        memcpy(fd->extra_block, fd->block_data + block_offset,
+        memcpy(fd->extra_block, fd->curr_data + block_offset,
                fd->block_size - block_offset);
         vec[1].iov_base = fd->extra_block;
         vec[1].iov_len = fd->block_size - block_offset;
 
         result = fetch_block(fd, block+1);
         if (result != 0) return result;
-        vec[2].iov_base = fd->block_data;
+        vec[2].iov_base = fd->curr_data;
         vec[2].iov_len = size - vec[1].iov_len;
         vec_used = 3;
     }
@@ -435,6 +850,8 @@ int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
 
     struct fuse_data fd;
     memset(&fd, 0, sizeof(fd));
+    fd.alg_tfm = -1;
+    fd.alg_op = -1;
     fd.vtab = vtab;
     fd.cookie = cookie;
     fd.file_size = file_size;
@@ -455,10 +872,21 @@ int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
         goto done;
     }
 
+    fd.verified = (uint8_t*)calloc((fd.file_blocks + 7) / 8, 1);
+    if (fd.verified == NULL) {
+        fprintf(stderr, "failed to allocate %d bites for verified bitmap\n",
+                (fd.file_blocks + 7) / 8);
+        result = -1;
+        goto done;
+    }
+
+    alg_sha256_open(&fd);
+
     fd.uid = getuid();
     fd.gid = getgid();
 
     fd.curr_block = -1;
+    fd.curr_data = NULL;
     fd.block_data = (uint8_t*)malloc(block_size);
     if (fd.block_data == NULL) {
         fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
@@ -490,6 +918,23 @@ int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
         }
     }
 
+    // Pick up where a previous failed run of the same package left off.
+    if (fd.file_blocks > 0 && spool_load(&fd)) {
+        spool_validate(&fd);
+    }
+
+    pthread_mutex_init(&fd.lock, NULL);
+    pthread_cond_init(&fd.prefetch_cond, NULL);
+    fd.prefetch_next = 0;
+    fd.prefetch_limit = 0;
+    fd.prefetch_run = 0;
+    if (fd.block_cache != NULL) {
+        // prefetched blocks live in the cache, so the pipeline only
+        // runs when we could afford one
+        fd.prefetch_run =
+            (pthread_create(&fd.prefetch_t, NULL, prefetch_thread_func, &fd) == 0);
+    }
+
     signal(SIGTERM, sig_term);
 
     fd.ffd = open("/dev/fuse", O_RDWR);
@@ -589,6 +1034,18 @@ int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
     }
 
   done:
+    if (fd.prefetch_run) {
+        pthread_mutex_lock(&fd.lock);
+        fd.prefetch_run = 0;
+        pthread_cond_signal(&fd.prefetch_cond);
+        pthread_mutex_unlock(&fd.lock);
+        pthread_join(fd.prefetch_t, NULL);
+    }
+
+    if (fd.hashes != NULL && fd.file_blocks > 0) {
+        spool_save(&fd);
+    }
+
     fd.vtab->close(fd.cookie);
 
     result = umount2(FUSE_SIDELOAD_HOST_MOUNTPOINT, MNT_DETACH);
@@ -604,7 +1061,9 @@ int run_fuse_sideload(struct provider_vtab* vtab, void* cookie,
         }
         free(fd.block_cache);
     }
+    alg_sha256_close(&fd);
     free(fd.hashes);
+    free(fd.verified);
     free(fd.block_data);
     free(fd.extra_block);
 
@@ -18,11 +18,20 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <setjmp.h>
 
+#include "bootloader.h"
+#include "bootprofile.h"
+#include "calibrate.h"
 #include "common.h"
 #include "install.h"
 #include "mincrypt/rsa.h"
@@ -32,6 +41,8 @@
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
+#include "trace.h"
+#include "updater_protocol.h"
 #include "verifier.h"
 #include "ui.h"
 
@@ -49,11 +60,127 @@ static const float DEFAULT_FILES_PROGRESS_FRACTION = 0.4;
 static const float DEFAULT_IMAGE_PROGRESS_FRACTION = 0.1;
 
 static jmp_buf jb;
+static pthread_t jb_owner;
 static void sig_bus(int sig)
 {
+    if (!pthread_equal(pthread_self(), jb_owner)) {
+        // The fault landed on a helper thread (the verifier's SHA-256
+        // follower); longjmp into another thread's jmp_buf is
+        // undefined.  Poison the follower's stream so the main thread
+        // can't deadlock on it, and take this thread out -- the main
+        // thread will fault on the same dead mapping and abort
+        // through its own handler.
+        verify_file_sigbus();
+        pthread_exit(NULL);
+    }
     longjmp(jb, 1);
 }
 
+// State shared across the packages of one flash session (see
+// install.h).  gProgressScale shrinks every progress segment so n
+// packages together fill the bar exactly once; ShowProgress segments
+// accumulate, so the bar simply keeps advancing from one package into
+// the next.
+static Certificate* gSessionKeys = NULL;
+static int gSessionNumKeys = 0;
+static int gSessionTotal = 1;
+static int gSessionIndex = 0;
+static float gProgressScale = 1.0;
+
+// Per-phase I/O accounting, appended to last_install in key=value form
+// so fleet analytics can watch storage health across OTA waves.  The
+// counters for recovery itself come from /proc/self/io; the updater
+// runs as a child, so its traffic shows up in the RUSAGE_CHILDREN
+// block counts instead (its own extract/block-update split is reported
+// through the command pipe and the trace file).
+
+#define MAX_IO_PHASES 4
+
+typedef struct {
+    long long rchar;
+    long long wchar;
+    long long syscr;
+    long long syscw;
+    long long read_bytes;
+    long long write_bytes;
+} ProcIoCounters;
+
+typedef struct {
+    const char* name;
+    ProcIoCounters io;           // /proc/self/io delta
+    long long child_inblock;     // 512-byte blocks, reaped children
+    long long child_oublock;
+    uint64_t ms;
+} PhaseIoStat;
+
+static PhaseIoStat phase_stats[MAX_IO_PHASES];
+static int phase_stat_count = 0;
+static ProcIoCounters phase_io_start;
+static struct rusage phase_children_start;
+static uint64_t phase_ms_start;
+
+static void read_proc_io(ProcIoCounters* c) {
+    memset(c, 0, sizeof(*c));
+    FILE* f = fopen("/proc/self/io", "r");
+    if (f == NULL) return;
+
+    char key[32];
+    long long value;
+    while (fscanf(f, "%31[^:]: %lld\n", key, &value) == 2) {
+        if (strcmp(key, "rchar") == 0) c->rchar = value;
+        else if (strcmp(key, "wchar") == 0) c->wchar = value;
+        else if (strcmp(key, "syscr") == 0) c->syscr = value;
+        else if (strcmp(key, "syscw") == 0) c->syscw = value;
+        else if (strcmp(key, "read_bytes") == 0) c->read_bytes = value;
+        else if (strcmp(key, "write_bytes") == 0) c->write_bytes = value;
+    }
+    fclose(f);
+}
+
+static void phase_io_begin(void) {
+    read_proc_io(&phase_io_start);
+    getrusage(RUSAGE_CHILDREN, &phase_children_start);
+    phase_ms_start = boot_profile_now();
+}
+
+static void phase_io_end(const char* name) {
+    if (phase_stat_count >= MAX_IO_PHASES) return;
+
+    ProcIoCounters now;
+    struct rusage children;
+    read_proc_io(&now);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    PhaseIoStat* p = &phase_stats[phase_stat_count++];
+    p->name = name;
+    p->io.rchar = now.rchar - phase_io_start.rchar;
+    p->io.wchar = now.wchar - phase_io_start.wchar;
+    p->io.syscr = now.syscr - phase_io_start.syscr;
+    p->io.syscw = now.syscw - phase_io_start.syscw;
+    p->io.read_bytes = now.read_bytes - phase_io_start.read_bytes;
+    p->io.write_bytes = now.write_bytes - phase_io_start.write_bytes;
+    p->child_inblock = children.ru_inblock - phase_children_start.ru_inblock;
+    p->child_oublock = children.ru_oublock - phase_children_start.ru_oublock;
+    p->ms = boot_profile_now() - phase_ms_start;
+}
+
+static void write_phase_io_stats(FILE* log) {
+    int i;
+    for (i = 0; i < phase_stat_count; ++i) {
+        PhaseIoStat* p = &phase_stats[i];
+        fprintf(log, "%s.ms=%llu\n", p->name, (unsigned long long)p->ms);
+        fprintf(log, "%s.rchar=%lld\n", p->name, p->io.rchar);
+        fprintf(log, "%s.wchar=%lld\n", p->name, p->io.wchar);
+        fprintf(log, "%s.syscr=%lld\n", p->name, p->io.syscr);
+        fprintf(log, "%s.syscw=%lld\n", p->name, p->io.syscw);
+        fprintf(log, "%s.read_bytes=%lld\n", p->name, p->io.read_bytes);
+        fprintf(log, "%s.write_bytes=%lld\n", p->name, p->io.write_bytes);
+        fprintf(log, "%s.child_inblock=%lld\n", p->name, p->child_inblock);
+        fprintf(log, "%s.child_oublock=%lld\n", p->name, p->child_oublock);
+    }
+    phase_stat_count = 0;
+}
+
 // If the package contains an update binary, extract it and run it.
 static int
 try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
@@ -115,6 +242,13 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
     //        ui_print <string>
     //            display <string> on the screen.
     //
+    //        log <string>
+    //            write <string> to the log file but not the screen.
+    //
+    //     Since we set UPDATER_FRAME_ENV in its environment, the
+    //     program may also interleave framed binary messages with the
+    //     text commands; see updater_protocol.h for the encoding.
+    //
     //   - the name of the package zip file.
     //
 
@@ -127,21 +261,87 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
     args[3] = (char*)path;
     args[4] = NULL;
 
-    pid_t pid = fork();
+    // Advertise that we accept framed binary messages on the pipe in
+    // addition to the text commands above (see updater_protocol.h).
+    // Binaries that only speak text ignore this.  Set in our own
+    // environment before vfork since the child shares our address
+    // space until it execs and must not call setenv itself.
+    setenv(UPDATER_FRAME_ENV, "1", 1);
+
+    // vfork instead of fork: the package is mapped while this runs,
+    // and duplicating the page tables of a process with a large OTA
+    // mapped can stall or even fail with ENOMEM.
+    pid_t pid = vfork();
     if (pid == 0) {
         umask(022);
         close(pipefd[0]);
         execv(binary, (char* const*)args);
-        fprintf(stdout, "E:Can't run %s (%s)\n", binary, strerror(errno));
         _exit(-1);
     }
+    unsetenv(UPDATER_FRAME_ENV);
     close(pipefd[1]);
 
     *wipe_cache = 0;
 
     char buffer[1024];
     FILE* from_child = fdopen(pipefd[0], "r");
-    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
+    for (;;) {
+        // The updater may interleave framed binary messages with the
+        // text commands; the frame marker byte never begins a text
+        // command, so peeking at the first byte tells them apart.
+        int first = getc(from_child);
+        if (first == EOF) break;
+        if (first == UPDATER_FRAME_MAGIC) {
+            unsigned char header[3];
+            if (fread(header, 1, sizeof(header), from_child)
+                    != sizeof(header)) {
+                break;
+            }
+            size_t len = header[1] | (header[2] << 8);
+            char* payload = (char*)malloc(len + 1);
+            if (fread(payload, 1, len, from_child) != len) {
+                free(payload);
+                break;
+            }
+            payload[len] = '\0';
+
+            switch (header[0]) {
+              case UPDATER_FRAME_PROGRESS: {
+                float fraction;
+                int32_t seconds;
+                if (len == 8) {
+                    memcpy(&fraction, payload, 4);
+                    memcpy(&seconds, payload+4, 4);
+                    ui->ShowProgress(
+                        fraction * (1-VERIFICATION_PROGRESS_FRACTION) * gProgressScale,
+                        seconds);
+                }
+                break;
+              }
+              case UPDATER_FRAME_SET_PROGRESS: {
+                float fraction;
+                if (len == 4) {
+                    memcpy(&fraction, payload, 4);
+                    ui->SetProgress(fraction);
+                }
+                break;
+              }
+              case UPDATER_FRAME_UI_PRINT:
+                ui->Print("%s", payload);
+                if (len == 0 || payload[len-1] != '\n') {
+                    ui->Print("\n");
+                }
+                fflush(stdout);
+                break;
+              default:
+                LOGE("unknown frame opcode %d\n", header[0]);
+                break;
+            }
+            free(payload);
+            continue;
+        }
+        ungetc(first, from_child);
+        if (fgets(buffer, sizeof(buffer), from_child) == NULL) break;
         char* command = strtok(buffer, " \n");
         if (command == NULL) {
             continue;
@@ -152,7 +352,8 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
             float fraction = strtof(fraction_s, NULL);
             int seconds = strtol(seconds_s, NULL, 10);
 
-            ui->ShowProgress(fraction * (1-VERIFICATION_PROGRESS_FRACTION), seconds);
+            ui->ShowProgress(fraction * (1-VERIFICATION_PROGRESS_FRACTION) * gProgressScale,
+                             seconds);
         } else if (strcmp(command, "set_progress") == 0) {
             char* fraction_s = strtok(NULL, " \n");
             float fraction = strtof(fraction_s, NULL);
@@ -169,6 +370,13 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
             *wipe_cache = 1;
         } else if (strcmp(command, "clear_display") == 0) {
             ui->SetBackground(RecoveryUI::NONE);
+        } else if (strcmp(command, "log") == 0) {
+            // diagnostics from the updater (eg, per-command install
+            // statistics); they go to the log but not the screen.
+            char* str = strtok(NULL, "\n");
+            if (str) {
+                LOGI("%s\n", str);
+            }
         } else if (strcmp(command, "enable_reboot") == 0) {
             // packages can explicitly request that they want the user
             // to be able to reboot during installation (useful for
@@ -195,6 +403,104 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
     return INSTALL_SUCCESS;
 }
 
+// How much of the package the prefetcher asks the kernel for at a time.
+#define PREFETCH_WINDOW_BYTES (8 * 1024 * 1024)
+
+// Walks the mapped package issuing MADV_WILLNEED a window at a time, so
+// the storage streams the file in while verify_file's hashing burns CPU
+// on pages that already arrived.  The mapping stays alive (and its
+// pages hot) until after the updater has run, so the extraction pass
+// that follows verification reads from the page cache instead of going
+// back to eMMC.  madvise never faults, so a FUSE-backed package that
+// dies mid-transfer can't SIGBUS this thread.
+static void* package_prefetch_thread(void* cookie)
+{
+    MemMapping* map = (MemMapping*) cookie;
+    int i;
+
+    for (i = 0; i < map->range_count; ++i) {
+        unsigned char* addr = (unsigned char*) map->ranges[i].addr;
+        size_t length = map->ranges[i].length;
+        size_t off;
+
+        for (off = 0; off < length; off += PREFETCH_WINDOW_BYTES) {
+            size_t chunk = length - off;
+            if (chunk > PREFETCH_WINDOW_BYTES) chunk = PREFETCH_WINDOW_BYTES;
+            madvise(addr + off, chunk, MADV_WILLNEED);
+        }
+    }
+    return NULL;
+}
+
+// Note there is deliberately no cache of verification results.  Any
+// record that lets recovery skip verify_file() would live somewhere
+// the booted system can write (/cache), so the system -- the thing
+// signature checking defends against -- could seed it and have an
+// unsigned package installed as "verified".  Repeat flashes pay the
+// full hash-and-RSA pass every time; the prefetch and RAM staging
+// above keep that cost to the CPU side only.
+
+// Where a package gets staged into RAM; recovery's /tmp is tmpfs.
+#define PACKAGE_STAGE_FILE "/tmp/update-staged.zip"
+
+// RAM to leave free after staging, for the updater's own allocations
+// (patch buffers, the block updater's new-data cache).
+#define STAGE_HEADROOM (96 * 1024 * 1024)
+
+// Copy the package into tmpfs so verification and every extraction
+// read hit DRAM instead of paying slow removable media twice.  Only
+// worth it when the package isn't already on RAM-backed or internal
+// storage and fits in free memory with headroom to spare.  Returns
+// true if PACKAGE_STAGE_FILE now holds the package.
+static bool
+stage_package_in_ram(const char* path)
+{
+    if (path[0] == '@' ||
+        strncmp(path, "/tmp/", 5) == 0 ||
+        strncmp(path, "/cache/", 7) == 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+
+    struct sysinfo si;
+    if (sysinfo(&si) != 0) return false;
+    uint64_t avail = (uint64_t)(si.freeram + si.bufferram) * si.mem_unit;
+    if ((uint64_t)st.st_size + STAGE_HEADROOM > avail) {
+        LOGI("not staging %lld byte package; only %llu bytes of RAM free\n",
+             (long long)st.st_size, (unsigned long long)avail);
+        return false;
+    }
+
+    int src = open(path, O_RDONLY);
+    if (src < 0) return false;
+    int dst = open(PACKAGE_STAGE_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (dst < 0) {
+        close(src);
+        return false;
+    }
+
+    ui->Print("Staging package to RAM...\n");
+
+    char* buf = (char*)malloc(1024 * 1024);
+    bool ok = (buf != NULL);
+    while (ok) {
+        ssize_t n = read(src, buf, 1024 * 1024);
+        if (n == 0) break;
+        if (n < 0 || write(dst, buf, n) != n) ok = false;
+    }
+    free(buf);
+    close(src);
+    close(dst);
+
+    if (!ok) {
+        LOGW("staging %s failed; installing in place\n", path);
+        unlink(PACKAGE_STAGE_FILE);
+    }
+    return ok;
+}
+
 static int
 really_install_package(const char *path, int* wipe_cache, bool needs_mount)
 {
@@ -202,9 +508,11 @@ really_install_package(const char *path, int* wipe_cache, bool needs_mount)
 
     ui->SetBackground(RecoveryUI::INSTALLING_UPDATE);
     ui->Print("Finding update package...\n");
-    // Give verification half the progress bar...
-    ui->SetProgressType(RecoveryUI::DETERMINATE);
-    ui->ShowProgress(VERIFICATION_PROGRESS_FRACTION, VERIFICATION_PROGRESS_TIME);
+    // Give verification half the progress bar...  (The progress type
+    // was set when the session started; setting it again here would
+    // reset the scope and wipe out earlier packages' segments.)
+    ui->ShowProgress(VERIFICATION_PROGRESS_FRACTION * gProgressScale,
+                     VERIFICATION_PROGRESS_TIME);
 
     // Resolve symlink in case legacy /sdcard path is used
     // Requires: symlink uses absolute path
@@ -239,39 +547,51 @@ really_install_package(const char *path, int* wipe_cache, bool needs_mount)
         }
     }
 
+    bool staged = stage_package_in_ram(path);
+    if (staged) path = PACKAGE_STAGE_FILE;
+
     MemMapping map;
     if (sysMapFile(path, &map) != 0) {
         LOGE("failed to map file\n");
+        if (staged) unlink(PACKAGE_STAGE_FILE);
         return INSTALL_CORRUPT;
     }
 
-    int numKeys;
-    Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
-    if (loadedKeys == NULL) {
-        LOGE("Failed to load keys\n");
-        return INSTALL_CORRUPT;
-    }
-    LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
-
-    set_perf_mode(true);
-
     ui->Print("Verifying update package...\n");
 
+    // Stream the package in ahead of the hash so verification overlaps
+    // the read instead of serializing behind it.
+    pthread_t prefetch_t;
+    bool prefetching = (pthread_create(&prefetch_t, NULL,
+                                       package_prefetch_thread, &map) == 0);
+
     int err;
 
     // Because we mmap() the update file which is backed by FUSE, we get
     // SIGBUS when the host aborts the transfer.  We handle this by using
     // setjmp/longjmp.
+    trace_begin("verify_file");
+    phase_io_begin();
+    jb_owner = pthread_self();
     signal(SIGBUS, sig_bus);
     if (setjmp(jb) == 0) {
-        err = verify_file(map.addr, map.length, loadedKeys, numKeys);
+        err = verify_file(map.addr, map.length, gSessionKeys, gSessionNumKeys);
     }
     else {
+        // The longjmp abandoned verify_file mid-flight; its follower
+        // thread may still be hashing out of the mapping.  Stop and
+        // join it before sysReleaseMap unmaps the buffer under it.
+        verify_file_abort();
         err = VERIFY_FAILURE;
     }
     signal(SIGBUS, SIG_DFL);
+    phase_io_end("verify");
+    trace_end();
+
+    // The prefetcher only touches the mapping, which must outlive it;
+    // collect the thread before any sysReleaseMap path below.
+    if (prefetching) pthread_join(prefetch_t, NULL);
 
-    free(loadedKeys);
     LOGI("verify_file returned %d\n", err);
     if (err != VERIFY_SUCCESS) {
         LOGE("signature verification failed\n");
@@ -295,43 +615,126 @@ really_install_package(const char *path, int* wipe_cache, bool needs_mount)
      */
     ui->Print("Installing update...\n");
     ui->SetEnableReboot(false);
+    trace_begin("update_binary");
+    phase_io_begin();
     ret = try_update_binary(path, &zip, wipe_cache);
+    phase_io_end("update");
+    trace_end();
     ui->SetEnableReboot(true);
     ui->Print("\n");
 
+    // The update binary may have written the BCB stage field behind
+    // the cache's back (set_stage); without this, finish_recovery's
+    // all-zero clear compares equal to the stale copy and is skipped,
+    // leaving a two-step package's stage marker armed across reboot.
+    invalidate_bootloader_message_cache();
+
+    // Update binaries routinely mount and unmount /system and /data
+    // themselves, so the cached mount table is stale too.
+    invalidate_mount_state();
+
+    phase_io_begin();
     sysReleaseMap(&map);
+    phase_io_end("finish");
 
 out:
-    set_perf_mode(false);
+    if (staged) unlink(PACKAGE_STAGE_FILE);
     return ret;
 }
 
 int
-install_package(const char* path, int* wipe_cache, const char* install_file,
-                bool needs_mount)
+install_queue_start(int num_packages)
+{
+    if (setup_install_mounts() != 0) {
+        LOGE("failed to set up expected mounts for install; aborting\n");
+        return INSTALL_ERROR;
+    }
+
+    gSessionKeys = load_keys(PUBLIC_KEYS_FILE, &gSessionNumKeys);
+    if (gSessionKeys == NULL) {
+        LOGE("Failed to load keys\n");
+        return INSTALL_CORRUPT;
+    }
+    LOGI("%d key(s) loaded from %s\n", gSessionNumKeys, PUBLIC_KEYS_FILE);
+
+    if (num_packages < 1) num_packages = 1;
+    gSessionTotal = num_packages;
+    gSessionIndex = 0;
+    gProgressScale = 1.0 / num_packages;
+    ui->SetProgressType(RecoveryUI::DETERMINATE);
+
+    set_perf_mode(true);
+    calibration_apply();
+    return INSTALL_SUCCESS;
+}
+
+int
+install_queue_package(const char* path, int* wipe_cache,
+                      const char* install_file, bool needs_mount)
 {
-    FILE* install_log = fopen_path(install_file, "w");
+    // One last_install for the whole session: each package appends
+    // its path, its result character, and its per-phase I/O stats.
+    FILE* install_log = fopen_path(install_file,
+                                   gSessionIndex == 0 ? "w" : "a");
     if (install_log) {
         fputs(path, install_log);
         fputc('\n', install_log);
     } else {
         LOGE("failed to open last_install: %s\n", strerror(errno));
     }
-    int result;
-    if (setup_install_mounts() != 0) {
-        LOGE("failed to set up expected mounts for install; aborting\n");
-        result = INSTALL_ERROR;
-    } else {
-        result = really_install_package(path, wipe_cache, needs_mount);
+    if (gSessionTotal > 1) {
+        ui->Print("Package %d of %d\n", gSessionIndex + 1, gSessionTotal);
     }
+    int result;
+    trace_begin("install_package");
+    result = really_install_package(path, wipe_cache, needs_mount);
+    trace_end();
+    // Recovery usually reboots rather than exiting, so the atexit
+    // handler never fires; flush the trace while we still can.
+    trace_dump();
+    ++gSessionIndex;
     if (install_log) {
         fputc(result == INSTALL_SUCCESS ? '1' : '0', install_log);
         fputc('\n', install_log);
+        write_phase_io_stats(install_log);
         fclose(install_log);
     }
     return result;
 }
 
+void
+install_queue_finish()
+{
+    free(gSessionKeys);
+    gSessionKeys = NULL;
+    gSessionNumKeys = 0;
+    gSessionTotal = 1;
+    gSessionIndex = 0;
+    gProgressScale = 1.0;
+    set_perf_mode(false);
+}
+
+int
+install_package(const char* path, int* wipe_cache, const char* install_file,
+                bool needs_mount)
+{
+    int result = install_queue_start(1);
+    if (result == INSTALL_SUCCESS) {
+        result = install_queue_package(path, wipe_cache, install_file,
+                                       needs_mount);
+        install_queue_finish();
+    } else {
+        // Session setup failed before any package ran; still record
+        // the attempt in last_install.
+        FILE* install_log = fopen_path(install_file, "w");
+        if (install_log) {
+            fprintf(install_log, "%s\n0\n", path);
+            fclose(install_log);
+        }
+    }
+    return result;
+}
+
 void
 set_perf_mode(bool enable) {
     property_set("recovery.perf.mode", enable ? "1" : "0");
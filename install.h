@@ -30,6 +30,20 @@ enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT, INSTALL_NONE };
 int install_package(const char *root_path, int* wipe_cache,
                     const char* install_file, bool needs_mount);
 
+// Multi-package flash sessions (ROM + gapps + su in one pass).  The
+// setup that is identical for every package -- mount configuration,
+// key loading, perf mode, calibration -- is done once in
+// install_queue_start(), and the progress bar is divided so the whole
+// queue shares a single sweep of it.  Feed each package through
+// install_queue_package() (packages served via FUSE exist one at a
+// time, which is why the queue takes them one by one), then
+// install_queue_finish() releases the shared state.  install_package()
+// is simply a one-package session.
+int install_queue_start(int num_packages);
+int install_queue_package(const char *root_path, int* wipe_cache,
+                          const char* install_file, bool needs_mount);
+void install_queue_finish();
+
 void set_perf_mode(bool enable);
 
 #ifdef __cplusplus
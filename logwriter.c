@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logwriter.h"
+
+// One batch's worth of log data; also the most that can be lost in a
+// crash the signal handler doesn't catch.
+#define LOG_BATCH_SIZE (64*1024)
+
+// How long a partial batch may sit before it is written anyway.
+#define LOG_FLUSH_INTERVAL_MS 500
+
+static int log_pipe[2] = { -1, -1 };   // log writers -> flusher
+static int ctl_pipe[2] = { -1, -1 };   // control requests -> flusher
+static int out_fd = -1;                // current log file
+static bool engine_started = false;
+
+static pthread_t flusher_thread;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static const char* pending_path = NULL;   // retarget request, under log_mutex
+static int flush_gen = 0;                 // requests issued
+static int flushed_gen = 0;               // requests completed
+
+static void write_all(int fd, const char* data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t w = write(fd, data + written, size - written);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;     // nowhere to complain about a log write failing
+        }
+        written += w;
+    }
+}
+
+// Does buf[start..start+len) begin an error-severity line?  LOGE
+// routes through ui_print with an "E:" prefix, so a line starting
+// "E:" is the error stream.
+static bool contains_error_line(const char* buf, size_t start, size_t len) {
+    size_t i;
+    for (i = start; i + 1 < start + len; ++i) {
+        if (buf[i] == 'E' && buf[i+1] == ':' &&
+                (i == 0 || buf[i-1] == '\n')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* flusher_main(void* unused) {
+    char* batch = malloc(LOG_BATCH_SIZE);
+    size_t used = 0;
+    bool urgent = false;
+
+    struct pollfd fds[2];
+    fds[0].fd = log_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = ctl_pipe[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        int timeout = (used > 0) ? LOG_FLUSH_INTERVAL_MS : -1;
+        int n = poll(fds, 2, timeout);
+        bool flush_now = (n == 0);        // timer expired on a partial batch
+        bool sync_request = false;
+
+        if (n > 0 && (fds[1].revents & POLLIN)) {
+            char req;
+            if (read(ctl_pipe[0], &req, 1) == 1) {
+                // Both requests ('f' flush, 'r' retarget) need the
+                // pipe fully drained first so earlier writes land in
+                // the file they were logged against.
+                sync_request = true;
+                flush_now = true;
+            }
+        }
+
+        // Drain whatever is available; everything the pipe holds right
+        // now must be on its way out before a sync request completes.
+        for (;;) {
+            if (used == LOG_BATCH_SIZE) {
+                write_all(out_fd, batch, used);
+                used = 0;
+                urgent = false;
+            }
+            ssize_t got = read(log_pipe[0], batch + used, LOG_BATCH_SIZE - used);
+            if (got <= 0) break;          // EAGAIN: pipe is empty
+            if (!urgent && contains_error_line(batch, used, got)) {
+                urgent = true;
+            }
+            used += got;
+            if (!sync_request) break;     // one helping per wakeup is enough
+        }
+
+        if ((flush_now || urgent) && used > 0) {
+            write_all(out_fd, batch, used);
+            used = 0;
+            urgent = false;
+        }
+
+        if (sync_request) {
+            pthread_mutex_lock(&log_mutex);
+            if (pending_path != NULL) {
+                int fd = open(pending_path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+                if (fd >= 0) {
+                    close(out_fd);
+                    out_fd = fd;
+                }
+                pending_path = NULL;
+            }
+            flushed_gen = flush_gen;
+            pthread_cond_broadcast(&log_cond);
+            pthread_mutex_unlock(&log_mutex);
+        }
+    }
+
+    return NULL;
+}
+
+// Send a control request and wait for the flusher to acknowledge it.
+// Caller holds log_mutex.
+static void control_locked(char req) {
+    int gen = ++flush_gen;
+    if (write(ctl_pipe[1], &req, 1) != 1) {
+        flushed_gen = gen;    // flusher is gone; don't wait forever
+        return;
+    }
+    while (flushed_gen < gen) {
+        pthread_cond_wait(&log_cond, &log_mutex);
+    }
+}
+
+// If recovery crashes, whatever the flusher hasn't drained yet is the
+// part of the log that explains the crash.  Pull it straight from the
+// pipe onto the file (read/write/close are async-signal-safe), then
+// let the default action run.
+static void log_crash_handler(int sig) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(log_pipe[0], buf, sizeof(buf))) > 0) {
+        write_all(out_fd, buf, n);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static int log_engine_start(const char* path) {
+    out_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (out_fd < 0) return -1;
+
+    if (pipe(log_pipe) != 0 || pipe(ctl_pipe) != 0) {
+        close(out_fd);
+        return -1;
+    }
+    // The flusher reads with the lock dropped, so its reads must not
+    // block when the pipe is empty.
+    fcntl(log_pipe[0], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) != 0) {
+        close(out_fd);
+        close(log_pipe[0]); close(log_pipe[1]);
+        close(ctl_pipe[0]); close(ctl_pipe[1]);
+        return -1;
+    }
+
+    dup2(log_pipe[1], STDOUT_FILENO);
+    dup2(log_pipe[1], STDERR_FILENO);
+
+    signal(SIGSEGV, log_crash_handler);
+    signal(SIGABRT, log_crash_handler);
+
+    engine_started = true;
+    return 0;
+}
+
+int log_engine_redirect(const char* path) {
+    pthread_mutex_lock(&log_mutex);
+    int ret = 0;
+    if (!engine_started) {
+        ret = log_engine_start(path);
+    } else {
+        pending_path = path;
+        control_locked('r');
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return ret;
+}
+
+void log_engine_flush(void) {
+    if (!engine_started) return;
+    fflush(stdout);
+    fflush(stderr);
+    pthread_mutex_lock(&log_mutex);
+    control_locked('f');
+    pthread_mutex_unlock(&log_mutex);
+}
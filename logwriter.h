@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_LOGWRITER_H_
+#define RECOVERY_LOGWRITER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Batching back end for recovery's log stream.  Everything in this
+// process logs by writing to stdout/stderr (the LOG macros, ui_print,
+// the updater child over the inherited descriptors), and those
+// streams are kept unbuffered so nothing is lost on a crash -- which
+// means every log line is its own synchronous write interleaved with
+// install I/O.
+//
+// The engine interposes a pipe: descriptors 1 and 2 point at the
+// write end, so log writes complete at memory speed, and a background
+// thread drains the pipe and batches the data into large appends on
+// the log file.  Lines of error severity (the "E:" prefix produced by
+// LOGE) are flushed as soon as they arrive; everything else waits for
+// the batch to fill or a short timer.  A last-ditch signal handler
+// drains whatever is still in the pipe if recovery crashes.
+
+// Point the engine's output at 'path', starting it on first use.
+// Returns 0 on success; on failure the caller should fall back to
+// writing the file directly.
+int log_engine_redirect(const char* path);
+
+// Synchronously drain the pipe and write out everything logged before
+// this call.  Call before reading or copying the log file.
+void log_engine_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // RECOVERY_LOGWRITER_H_
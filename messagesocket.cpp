@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -81,6 +84,9 @@ bool MessageSocket::ClientInit()
         ::close(fd);
         return false;
     }
+    // Nonblocking, so a wedged peer can't hang us in write(); sends
+    // wait a bounded time in send_command instead.
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
     _sock = fd;
     return true;
 }
@@ -97,6 +103,15 @@ bool MessageSocket::Dismiss()
     return send_command("dismiss");
 }
 
+// Structured progress record for whoever is watching the socket.
+// Receivers that only understand "dialog" commands ignore these.
+bool MessageSocket::Progress(const char* info)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "progress %s\n", info);
+    return send_line(buf);
+}
+
 void MessageSocket::Close()
 {
     if (_sock != -1) {
@@ -105,12 +120,38 @@ void MessageSocket::Close()
     }
 }
 
+// How long a send waits for the peer to drain its socket before the
+// message is dropped.  Commands here are advisory UI updates; losing
+// one to a stuck reader is better than stalling the sender.
+static const int SEND_TIMEOUT_MS = 500;
+
 bool MessageSocket::send_command(const char* command)
 {
     char buf[256];
-    int len;
-    ssize_t written;
-    len = sprintf(buf, "dialog %s\n", command);
-    written = ::write(_sock, buf, len);
-    return (written == len);
+    snprintf(buf, sizeof(buf), "dialog %s\n", command);
+    return send_line(buf);
+}
+
+bool MessageSocket::send_line(const char* line)
+{
+    int len = strlen(line);
+    int sent = 0;
+    while (sent < len) {
+        struct pollfd pfd;
+        pfd.fd = _sock;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        if (::poll(&pfd, 1, SEND_TIMEOUT_MS) <= 0) {
+            return false;
+        }
+        ssize_t written = ::write(_sock, line + sent, len - sent);
+        if (written < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return false;
+        }
+        sent += written;
+    }
+    return true;
 }
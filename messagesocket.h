@@ -20,6 +20,7 @@ public:
     bool ClientInit();
     bool Show(const char* message);
     bool Dismiss();
+    bool Progress(const char* info);
 
     void Close();
 
@@ -27,6 +28,7 @@ private:
     explicit MessageSocket(int fd) : _sock(fd) {}
 
     bool send_command(const char* command);
+    bool send_line(const char* line);
 
     int _sock;
 };
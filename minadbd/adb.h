@@ -45,6 +45,7 @@ typedef struct aservice aservice;
 typedef struct atransport atransport;
 typedef struct adisconnect  adisconnect;
 typedef struct usb_handle usb_handle;
+typedef struct tqueue tqueue;
 
 struct amessage {
     unsigned command;       /* command identifier constant      */
@@ -172,6 +173,13 @@ struct atransport
 
     int fd;
     int transport_socket;
+
+        /* eventfd-signaled packet rings between the transport threads
+        ** and the fdevent loop; fd/transport_socket above hold their
+        ** eventfds (see transport.c) */
+    tqueue *queue_to_remote;     /* fdevent loop -> input thread */
+    tqueue *queue_from_remote;   /* output thread -> fdevent loop */
+
     fdevent transport_fde;
     int ref_count;
     unsigned sync_token;
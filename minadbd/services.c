@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include "sysdeps.h"
 #include "fdevent.h"
@@ -95,6 +96,20 @@ done:
 }
 #endif
 
+// The default AF_UNIX buffers hold only a few packets, so a sustained
+// sideload stream bounces control between the transport and the
+// service every few KB.  A deeper pipe lets whole bursts land in one
+// wakeup; SO_SNDBUF governs a unix stream's capacity, but set both
+// directions for good measure.
+#define SERVICE_SOCKET_BUFSIZE (256 * 1024)
+
+static void service_socket_setbufs(int fd)
+{
+    int opt = SERVICE_SOCKET_BUFSIZE;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+}
+
 static int create_service_thread(void (*func)(int, void *), void *cookie)
 {
     stinfo *sti;
@@ -105,6 +120,8 @@ static int create_service_thread(void (*func)(int, void *), void *cookie)
         printf("cannot create service socket pair\n");
         return -1;
     }
+    service_socket_setbufs(s[0]);
+    service_socket_setbufs(s[1]);
 
     sti = malloc(sizeof(stinfo));
     if(sti == 0) fatal("cannot allocate stinfo");
@@ -28,6 +28,9 @@
 
 ADB_MUTEX_DEFINE( socket_list_lock );
 
+/* max packets drained from a local socket per FDE_READ event */
+#define LOCAL_SOCKET_READ_BATCH 16
+
 static void local_socket_close_locked(asocket *s);
 
 int sendfailmsg(int fd, const char *reason)
@@ -311,65 +314,82 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
 
 
     if(ev & FDE_READ){
-        apacket *p = get_apacket();
-        unsigned char *x = p->data;
-        size_t avail = MAX_PAYLOAD;
-        int r;
-        int is_eof = 0;
-
-        while(avail > 0) {
-            r = adb_read(fd, x, avail);
-            D("LS(%d): post adb_read(fd=%d,...) r=%d (errno=%d) avail=%zu\n",
-              s->id, s->fd, r, r<0?errno:0, avail);
-            if(r > 0) {
-                avail -= r;
-                x += r;
-                continue;
-            }
-            if(r < 0) {
-                if(errno == EAGAIN) break;
-                if(errno == EINTR) continue;
+        int batch;
+
+        /* drain several packets per event rather than taking a full
+        ** trip around the event loop for each MAX_PAYLOAD chunk; a
+        ** sustained sideload stream otherwise wakes the loop once
+        ** per 4KB.  The batch is bounded so one busy socket can't
+        ** starve the others.
+        */
+        for(batch = 0; batch < LOCAL_SOCKET_READ_BATCH; batch++) {
+            apacket *p = get_apacket();
+            unsigned char *x = p->data;
+            size_t avail = MAX_PAYLOAD;
+            int r;
+            int is_eof = 0;
+
+            while(avail > 0) {
+                r = adb_read(fd, x, avail);
+                D("LS(%d): post adb_read(fd=%d,...) r=%d (errno=%d) avail=%zu\n",
+                  s->id, s->fd, r, r<0?errno:0, avail);
+                if(r > 0) {
+                    avail -= r;
+                    x += r;
+                    continue;
+                }
+                if(r < 0) {
+                    if(errno == EAGAIN) break;
+                    if(errno == EINTR) continue;
+                }
+
+                    /* r = 0 or unhandled error */
+                is_eof = 1;
+                break;
             }
+            D("LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d\n",
+              s->id, s->fd, r, is_eof, s->fde.force_eof);
+            if((avail == MAX_PAYLOAD) || (s->peer == 0)) {
+                put_apacket(p);
+            } else {
+                p->len = MAX_PAYLOAD - avail;
 
-                /* r = 0 or unhandled error */
-            is_eof = 1;
-            break;
-        }
-        D("LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d\n",
-          s->id, s->fd, r, is_eof, s->fde.force_eof);
-        if((avail == MAX_PAYLOAD) || (s->peer == 0)) {
-            put_apacket(p);
-        } else {
-            p->len = MAX_PAYLOAD - avail;
-
-            r = s->peer->enqueue(s->peer, p);
-            D("LS(%d): fd=%d post peer->enqueue(). r=%d\n", s->id, s->fd, r);
-
-            if(r < 0) {
-                    /* error return means they closed us as a side-effect
-                    ** and we must return immediately.
-                    **
-                    ** note that if we still have buffered packets, the
-                    ** socket will be placed on the closing socket list.
-                    ** this handler function will be called again
-                    ** to process FDE_WRITE events.
-                    */
+                r = s->peer->enqueue(s->peer, p);
+                D("LS(%d): fd=%d post peer->enqueue(). r=%d\n", s->id, s->fd, r);
+
+                if(r < 0) {
+                        /* error return means they closed us as a side-effect
+                        ** and we must return immediately.
+                        **
+                        ** note that if we still have buffered packets, the
+                        ** socket will be placed on the closing socket list.
+                        ** this handler function will be called again
+                        ** to process FDE_WRITE events.
+                        */
+                    return;
+                }
+
+                if(r > 0) {
+                        /* if the remote cannot accept further events,
+                        ** we disable notification of READs.  They'll
+                        ** be enabled again when we get a call to ready()
+                        */
+                    fdevent_del(&s->fde, FDE_READ);
+                    return;
+                }
+            }
+            /* Don't allow a forced eof if data is still there */
+            if((s->fde.force_eof && !r) || is_eof) {
+                D(" closing because is_eof=%d r=%d s->fde.force_eof=%d\n", is_eof, r, s->fde.force_eof);
+                s->close(s);
                 return;
             }
 
-            if(r > 0) {
-                    /* if the remote cannot accept further events,
-                    ** we disable notification of READs.  They'll
-                    ** be enabled again when we get a call to ready()
-                    */
-                fdevent_del(&s->fde, FDE_READ);
+            if(avail > 0) {
+                /* short read: the socket is drained for now */
+                break;
             }
         }
-        /* Don't allow a forced eof if data is still there */
-        if((s->fde.force_eof && !r) || is_eof) {
-            D(" closing because is_eof=%d r=%d s->fde.force_eof=%d\n", is_eof, r, s->fde.force_eof);
-            s->close(s);
-        }
     }
 
     if(ev & FDE_ERROR){
@@ -14,11 +14,13 @@
  * limitations under the License.
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/eventfd.h>
 
 #include "sysdeps.h"
 
@@ -34,6 +36,96 @@ static atransport transport_list = {
 
 ADB_MUTEX_DEFINE( transport_lock );
 
+/* Packet handoff between the transport threads and the fdevent loop.
+**
+** Each direction used to be half of a socketpair carrying apacket
+** pointers, which cost a full socket round trip per packet and per
+** state change.  It is now a single-producer/single-consumer ring
+** plus an eventfd: the producer publishes a slot with one release
+** store and makes the consumer runnable with one eventfd write, and
+** the consumer drains with acquire loads.  Each direction has exactly
+** one producer (send_packet runs on the single-threaded fdevent pump;
+** remote packets and SYNC on the output thread), so no lock is
+** needed.
+*/
+
+#define TQ_SLOTS 64
+
+struct tqueue
+{
+    apacket  *slots[TQ_SLOTS];
+    unsigned  head;     /* consumer cursor */
+    unsigned  tail;     /* producer cursor */
+    int       efd;
+};
+
+static tqueue *tq_create(int flags)
+{
+    tqueue *q = calloc(1, sizeof(tqueue));
+    if(q == NULL) {
+        fatal("cannot allocate transport queue");
+    }
+    q->efd = eventfd(0, flags);
+    if(q->efd < 0) {
+        fatal_errno("cannot create transport eventfd");
+    }
+    return q;
+}
+
+/* The eventfd is closed by the caller (or by fdevent_remove). */
+static void tq_destroy(tqueue *q)
+{
+    free(q);
+}
+
+static void tq_push(tqueue *q, apacket *p)
+{
+    uint64_t one = 1;
+    unsigned tail = q->tail;
+
+    while(tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= TQ_SLOTS) {
+        /* Full.  adb's per-socket flow control keeps the in-flight
+        ** packet count tiny, so this is a backstop, not a steady
+        ** state worth a second eventfd. */
+        adb_sleep_ms(1);
+    }
+    q->slots[tail % TQ_SLOTS] = p;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    if(adb_write(q->efd, &one, sizeof(one)) != sizeof(one)) {
+        fatal_errno("cannot signal transport eventfd");
+    }
+}
+
+/* Non-blocking: NULL when the ring is empty. */
+static apacket *tq_pop(tqueue *q)
+{
+    unsigned head = q->head;
+    apacket *p;
+
+    if(__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head) {
+        return NULL;
+    }
+    p = q->slots[head % TQ_SLOTS];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+/* Blocking: sleeps on the eventfd until a packet is published.  A
+** push between the empty check and the read leaves the counter
+** non-zero, so the wakeup cannot be lost. */
+static apacket *tq_pop_block(tqueue *q)
+{
+    apacket  *p;
+    uint64_t  n;
+
+    while((p = tq_pop(q)) == NULL) {
+        if(adb_read(q->efd, &n, sizeof(n)) < 0 && errno != EINTR) {
+            fatal_errno("cannot read transport eventfd");
+        }
+    }
+    return p;
+}
+
 #if ADB_TRACE
 #define MAX_DUMP_HEX_LEN 16
 static void  dump_hex( const unsigned char*  ptr, size_t  len )
@@ -93,118 +185,21 @@ run_transport_disconnects(atransport*  t)
     }
 }
 
-#if ADB_TRACE
-static void
-dump_packet(const char* name, const char* func, apacket* p)
-{
-    unsigned  command = p->msg.command;
-    int       len     = p->msg.data_length;
-    char      cmd[9];
-    char      arg0[12], arg1[12];
-    int       n;
-
-    for (n = 0; n < 4; n++) {
-        int  b = (command >> (n*8)) & 255;
-        if (b < 32 || b >= 127)
-            break;
-        cmd[n] = (char)b;
-    }
-    if (n == 4) {
-        cmd[4] = 0;
-    } else {
-        /* There is some non-ASCII name in the command, so dump
-            * the hexadecimal value instead */
-        snprintf(cmd, sizeof cmd, "%08x", command);
-    }
-
-    if (p->msg.arg0 < 256U)
-        snprintf(arg0, sizeof arg0, "%d", p->msg.arg0);
-    else
-        snprintf(arg0, sizeof arg0, "0x%x", p->msg.arg0);
-
-    if (p->msg.arg1 < 256U)
-        snprintf(arg1, sizeof arg1, "%d", p->msg.arg1);
-    else
-        snprintf(arg1, sizeof arg1, "0x%x", p->msg.arg1);
-
-    D("%s: %s: [%s] arg0=%s arg1=%s (len=%d) ",
-        name, func, cmd, arg0, arg1, len);
-    dump_hex(p->data, len);
-}
-#endif /* ADB_TRACE */
-
-static int
-read_packet(int  fd, const char* name, apacket** ppacket)
-{
-    char *p = (char*)ppacket;  /* really read a packet address */
-    int   r;
-    int   len = sizeof(*ppacket);
-    char  buff[8];
-    if (!name) {
-        snprintf(buff, sizeof buff, "fd=%d", fd);
-        name = buff;
-    }
-    while(len > 0) {
-        r = adb_read(fd, p, len);
-        if(r > 0) {
-            len -= r;
-            p   += r;
-        } else {
-            D("%s: read_packet (fd=%d), error ret=%d errno=%d: %s\n", name, fd, r, errno, strerror(errno));
-            if((r < 0) && (errno == EINTR)) continue;
-            return -1;
-        }
-    }
-
-#if ADB_TRACE
-    if (ADB_TRACING) {
-        dump_packet(name, "from remote", *ppacket);
-    }
-#endif
-    return 0;
-}
-
-static int
-write_packet(int  fd, const char* name, apacket** ppacket)
-{
-    char *p = (char*) ppacket;  /* we really write the packet address */
-    int r, len = sizeof(ppacket);
-    char buff[8];
-    if (!name) {
-        snprintf(buff, sizeof buff, "fd=%d", fd);
-        name = buff;
-    }
-
-#if ADB_TRACE
-    if (ADB_TRACING) {
-        dump_packet(name, "to remote", *ppacket);
-    }
-#endif
-    len = sizeof(ppacket);
-    while(len > 0) {
-        r = adb_write(fd, p, len);
-        if(r > 0) {
-            len -= r;
-            p += r;
-        } else {
-            D("%s: write_packet (fd=%d) error ret=%d errno=%d: %s\n", name, fd, r, errno, strerror(errno));
-            if((r < 0) && (errno == EINTR)) continue;
-            return -1;
-        }
-    }
-    return 0;
-}
-
 static void transport_socket_events(int fd, unsigned events, void *_t)
 {
     atransport *t = _t;
     D("transport_socket_events(fd=%d, events=%04x,...)\n", fd, events);
     if(events & FDE_READ){
-        apacket *p = 0;
-        if(read_packet(fd, t->serial, &p)){
-            D("%s: failed to read packet from transport socket on fd %d\n", t->serial, fd);
-        } else {
-            handle_packet(p, (atransport *) _t);
+        apacket *p;
+        uint64_t n;
+        /* Drain the wakeup counter before popping, so a packet
+        ** published after the loop below re-arms this (level
+        ** triggered) event. */
+        if(adb_read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN && errno != EINTR) {
+            D("%s: failed to drain transport eventfd %d\n", t->serial, fd);
+        }
+        while((p = tq_pop(t->queue_from_remote)) != NULL) {
+            handle_packet(p, t);
         }
     }
 }
@@ -234,9 +229,7 @@ void send_packet(apacket *p, atransport *t)
         fatal_errno("Transport is null");
     }
 
-    if(write_packet(t->transport_socket, t->serial, &p)){
-        fatal_errno("cannot enqueue packet on transport socket");
-    }
+    tq_push(t->queue_to_remote, p);
 }
 
 /* The transport is opened by transport_register_func before
@@ -264,11 +257,7 @@ static void *output_thread(void *_t)
     p->msg.arg0 = 1;
     p->msg.arg1 = ++(t->sync_token);
     p->msg.magic = A_SYNC ^ 0xffffffff;
-    if(write_packet(t->fd, t->serial, &p)) {
-        put_apacket(p);
-        D("%s: failed to write SYNC packet\n", t->serial);
-        goto oops;
-    }
+    tq_push(t->queue_from_remote, p);
 
     D("%s: data pump started\n", t->serial);
     for(;;) {
@@ -277,11 +266,7 @@ static void *output_thread(void *_t)
         if(t->read_from_remote(p, t) == 0){
             D("%s: received remote packet, sending to transport\n",
               t->serial);
-            if(write_packet(t->fd, t->serial, &p)){
-                put_apacket(p);
-                D("%s: failed to write apacket to transport\n", t->serial);
-                goto oops;
-            }
+            tq_push(t->queue_from_remote, p);
         } else {
             D("%s: remote read failed for transport\n", t->serial);
             put_apacket(p);
@@ -295,12 +280,8 @@ static void *output_thread(void *_t)
     p->msg.arg0 = 0;
     p->msg.arg1 = 0;
     p->msg.magic = A_SYNC ^ 0xffffffff;
-    if(write_packet(t->fd, t->serial, &p)) {
-        put_apacket(p);
-        D("%s: failed to write SYNC apacket to transport", t->serial);
-    }
+    tq_push(t->queue_from_remote, p);
 
-oops:
     D("%s: transport output thread is exiting\n", t->serial);
     kick_transport(t);
     transport_unref(t);
@@ -317,11 +298,7 @@ static void *input_thread(void *_t)
        t->serial, t->fd);
 
     for(;;){
-        if(read_packet(t->fd, t->serial, &p)) {
-            D("%s: failed to read apacket from transport on fd %d\n",
-               t->serial, t->fd );
-            break;
-        }
+        p = tq_pop_block(t->queue_to_remote);
         if(p->msg.command == A_SYNC){
             if(p->msg.arg0 == 0) {
                 D("%s: transport SYNC offline\n", t->serial);
@@ -424,7 +401,6 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
     tmsg m;
     adb_thread_t output_thread_ptr;
     adb_thread_t input_thread_ptr;
-    int s[2];
     atransport *t;
 
     if(!(ev & FDE_READ)) {
@@ -440,11 +416,14 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
     if(m.action == 0){
         D("transport: %s removing and free'ing %d\n", t->serial, t->transport_socket);
 
-            /* IMPORTANT: the remove closes one half of the
-            ** socket pair.  The close closes the other half.
+            /* IMPORTANT: the remove closes one of the eventfds.  The
+            ** close closes the other.  Both threads have exited by
+            ** the time a remove is posted, so the rings are idle.
             */
         fdevent_remove(&(t->transport_fde));
         adb_close(t->fd);
+        tq_destroy(t->queue_to_remote);
+        tq_destroy(t->queue_from_remote);
 
         adb_mutex_lock(&transport_lock);
         t->next->prev = t->prev;
@@ -470,14 +449,17 @@ static void transport_registration_func(int _fd, unsigned ev, void *data)
         /* initial references are the two threads */
         t->ref_count = 2;
 
-        if(adb_socketpair(s)) {
-            fatal_errno("cannot open transport socketpair");
-        }
+        /* the fdevent pump must never block on an empty ring, so its
+        ** eventfd is non-blocking; the input thread's is blocking and
+        ** doubles as its sleep. */
+        t->queue_to_remote = tq_create(0);
+        t->queue_from_remote = tq_create(EFD_NONBLOCK);
 
-        D("transport: %s (%d,%d) starting\n", t->serial, s[0], s[1]);
+        t->transport_socket = t->queue_from_remote->efd;
+        t->fd = t->queue_to_remote->efd;
 
-        t->transport_socket = s[0];
-        t->fd = s[1];
+        D("transport: %s (%d,%d) starting\n", t->serial,
+          t->transport_socket, t->fd);
 
         fdevent_install(&(t->transport_fde),
                         t->transport_socket,
@@ -37,6 +37,23 @@
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
+// The transport's input thread used to issue one blocking read at a
+// time, so the OUT endpoint sat idle while each completed packet was
+// being processed.  A pump thread now keeps a read posted on the
+// endpoint at all times, landing transfers in a small ring of buffers;
+// usb_read() drains the ring as a byte stream.  The kernel gadget
+// drivers of this era offer no AIO on these endpoint files, so the
+// overlap comes from the dedicated reader rather than multiple
+// outstanding URBs, but the effect is the same: the bus never waits
+// for packet processing.
+#define USB_RING_BUFS 8
+
+struct usb_ring_buf {
+    int len;                    // bytes the transfer delivered
+    int used;                   // bytes already consumed by usb_read
+    char data[MAX_PAYLOAD];     // the host never sends more per transfer
+};
+
 struct usb_handle
 {
     int fd;
@@ -50,6 +67,18 @@ struct usb_handle
     int control;
     int bulk_out; /* "out" from the host's perspective => source for adbd */
     int bulk_in;  /* "in" from the host's perspective => sink for adbd */
+
+    // Read-ahead ring, shared between the pump thread (producer) and
+    // usb_read (consumer).  Guarded by lock; ring_cond covers both
+    // "ring not full" and "ring not empty".
+    adb_cond_t ring_cond;
+    struct usb_ring_buf* ring;
+    unsigned ring_head;         // entries filled by the pump
+    unsigned ring_tail;         // entries drained by usb_read
+    int pump_fd;                // endpoint the pump reads from
+    int pump_run;               // cleared to stop the pump
+    int pump_active;            // set while the pump thread is alive
+    int ring_error;             // pump hit a read error / disconnect
 };
 
 static const struct {
@@ -146,6 +175,123 @@ void usb_cleanup()
     // nothing to do here
 }
 
+static void *usb_pump_thread(void *x)
+{
+    struct usb_handle *h = (struct usb_handle *)x;
+
+    adb_mutex_lock(&h->lock);
+    while (h->pump_run) {
+        if (h->ring_head - h->ring_tail == USB_RING_BUFS) {
+            adb_cond_wait(&h->ring_cond, &h->lock);
+            continue;
+        }
+        struct usb_ring_buf *buf = &h->ring[h->ring_head % USB_RING_BUFS];
+        int fd = h->pump_fd;
+        adb_mutex_unlock(&h->lock);
+
+        int n = adb_read(fd, buf->data, sizeof(buf->data));
+
+        adb_mutex_lock(&h->lock);
+        if (n == 0 || (n < 0 && errno == EINTR)) {
+            continue;
+        }
+        if (n < 0) {
+            D("[ pump: read failed fd=%d errno=%d ]\n", fd, errno);
+            h->ring_error = 1;
+            break;
+        }
+        buf->len = n;
+        buf->used = 0;
+        h->ring_head++;
+        adb_cond_broadcast(&h->ring_cond);
+    }
+    h->pump_active = 0;
+    adb_cond_broadcast(&h->ring_cond);
+    adb_mutex_unlock(&h->lock);
+    return 0;
+}
+
+static void usb_pump_start(struct usb_handle *h, int fd)
+{
+    adb_thread_t tid;
+
+    adb_mutex_lock(&h->lock);
+    // wait out a pump left over from a previous session
+    while (h->pump_active)
+        adb_cond_wait(&h->ring_cond, &h->lock);
+    h->pump_fd = fd;
+    h->ring_head = h->ring_tail = 0;
+    h->ring_error = 0;
+    if (h->ring != NULL) {
+        h->pump_run = 1;
+        h->pump_active = (adb_thread_create(&tid, usb_pump_thread, h) == 0);
+        if (!h->pump_active)
+            h->pump_run = 0;
+    }
+    adb_mutex_unlock(&h->lock);
+}
+
+static void usb_pump_stop(struct usb_handle *h)
+{
+    adb_mutex_lock(&h->lock);
+    h->pump_run = 0;
+    adb_cond_broadcast(&h->ring_cond);
+    adb_mutex_unlock(&h->lock);
+    // If the pump is blocked in a read, it exits when the endpoint
+    // errors out on disconnect -- the same thing that unblocked the
+    // transport's own read before the pump existed.
+}
+
+// Satisfy a transport read from the ring, blocking until the pump has
+// delivered enough bytes.  Returns the number of bytes copied, which
+// is short of len only on error or disconnect.  If the pump isn't
+// running, reads the endpoint directly.
+static int usb_ring_read(struct usb_handle *h, void *data, int len)
+{
+    char *p = (char *)data;
+    int remain = len;
+
+    adb_mutex_lock(&h->lock);
+    if (!h->pump_active && !h->ring_error && h->ring_head == h->ring_tail) {
+        int fd = h->pump_fd;
+        adb_mutex_unlock(&h->lock);
+        size_t count = 0;
+        while (count < (size_t)len) {
+            int r = adb_read(fd, p + count, len - count);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            count += r;
+        }
+        return count;
+    }
+
+    while (remain > 0) {
+        if (h->ring_head == h->ring_tail) {
+            if (h->ring_error || !h->pump_active)
+                break;
+            adb_cond_wait(&h->ring_cond, &h->lock);
+            continue;
+        }
+        struct usb_ring_buf *buf = &h->ring[h->ring_tail % USB_RING_BUFS];
+        int chunk = buf->len - buf->used;
+        if (chunk > remain)
+            chunk = remain;
+        memcpy(p, buf->data + buf->used, chunk);
+        buf->used += chunk;
+        p += chunk;
+        remain -= chunk;
+        if (buf->used == buf->len) {
+            h->ring_tail++;
+            adb_cond_broadcast(&h->ring_cond);
+        }
+    }
+    adb_mutex_unlock(&h->lock);
+    return len - remain;
+}
+
 static void *usb_adb_open_thread(void *x)
 {
     struct usb_handle *usb = (struct usb_handle *)x;
@@ -175,6 +321,7 @@ static void *usb_adb_open_thread(void *x)
 
         close_on_exec(fd);
         usb->fd = fd;
+        usb_pump_start(usb, fd);
 
         D("[ usb_thread - registering device ]\n");
         register_usb_transport(usb, 0, 1);
@@ -204,7 +351,7 @@ static int usb_adb_read(usb_handle *h, void *data, int len)
     int n;
 
     D("about to read (fd=%d, len=%d)\n", h->fd, len);
-    n = adb_read(h->fd, data, len);
+    n = usb_ring_read(h, data, len);
     if(n != len) {
         D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
             h->fd, n, errno, strerror(errno));
@@ -217,6 +364,7 @@ static int usb_adb_read(usb_handle *h, void *data, int len)
 static void usb_adb_kick(usb_handle *h)
 {
     D("usb_kick\n");
+    usb_pump_stop(h);
     adb_mutex_lock(&h->lock);
     adb_close(h->fd);
     h->fd = -1;
@@ -241,6 +389,8 @@ static void usb_adb_init()
 
     adb_cond_init(&h->notify, 0);
     adb_mutex_init(&h->lock, 0);
+    adb_cond_init(&h->ring_cond, 0);
+    h->ring = calloc(USB_RING_BUFS, sizeof(struct usb_ring_buf));
 
     fprintf(stderr, "Starting to open usb_init()\n");
     // Open the file /dev/android_adb_enable to trigger 
@@ -337,6 +487,8 @@ static void *usb_ffs_open_thread(void *x)
             adb_sleep_ms(1000);
         }
 
+        usb_pump_start(usb, usb->bulk_out);
+
         D("[ usb_thread - registering device ]\n");
         register_usb_transport(usb, 0, 1);
     }
@@ -379,33 +531,12 @@ static int usb_ffs_write(usb_handle *h, const void *data, int len)
     return 0;
 }
 
-static int bulk_read(int bulk_out, char *buf, size_t length)
-{
-    size_t count = 0;
-    int ret;
-
-    do {
-        ret = adb_read(bulk_out, buf + count, length - count);
-        if (ret < 0) {
-            if (errno != EINTR) {
-                D("[ bulk_read failed fd=%d length=%zu count=%zu ]\n",
-                                           bulk_out, length, count);
-                return ret;
-            }
-        } else {
-            count += ret;
-        }
-    } while (count < length);
-
-    return count;
-}
-
 static int usb_ffs_read(usb_handle *h, void *data, int len)
 {
     int n;
 
     D("about to read (fd=%d, len=%d)\n", h->bulk_out, len);
-    n = bulk_read(h->bulk_out, data, len);
+    n = usb_ring_read(h, data, len);
     if (n != len) {
         D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
             h->bulk_out, n, errno, strerror(errno));
@@ -419,6 +550,8 @@ static void usb_ffs_kick(usb_handle *h)
 {
     int err;
 
+    usb_pump_stop(h);
+
     err = ioctl(h->bulk_in, FUNCTIONFS_CLEAR_HALT);
     if (err < 0)
         D("[ kick: source (fd=%d) clear halt failed (%d) ]", h->bulk_in, errno);
@@ -457,6 +590,8 @@ static void usb_ffs_init()
 
     adb_cond_init(&h->notify, 0);
     adb_mutex_init(&h->lock, 0);
+    adb_cond_init(&h->ring_cond, 0);
+    h->ring = calloc(USB_RING_BUFS, sizeof(struct usb_ring_buf));
 
     D("[ usb_init - starting thread ]\n");
     if (adb_thread_create(&tid, usb_ffs_open_thread, h)){
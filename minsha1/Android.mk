@@ -0,0 +1,24 @@
+# Copyright 2015 The CyanogenMod Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+# Accelerated SHA-1 with the same interface as mincrypt's.  Must be
+# listed before libmincrypt so these definitions win at link time.
+LOCAL_SRC_FILES := sha1.c
+LOCAL_MODULE := libminsha1
+LOCAL_C_INCLUDES := system/core/include
+
+include $(BUILD_STATIC_LIBRARY)
@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2015 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * SHA-1 engine with runtime-dispatched ARMv8 crypto-extension
+ * acceleration.
+ *
+ * This is a drop-in replacement for the mincrypt SHA-1: it defines the
+ * SHA_init/SHA_update/SHA_final/SHA_hash symbols declared by
+ * mincrypt/sha.h, so linking libminsha1 ahead of libmincrypt routes
+ * every SHA-1 computation in recovery (package verification,
+ * applypatch source checks, block_image_update range hashing) through
+ * this file with no caller changes.  On ARMv8 cores advertising the
+ * SHA1 hwcap the compression function uses the sha1c/sha1p/sha1m
+ * instructions; everywhere else a portable C implementation runs.
+ *
+ * The crypto-extension path is emitted as inline assembly rather than
+ * intrinsics so the file builds regardless of -march, with the
+ * instruction check done at runtime via getauxval().
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mincrypt/sha.h"
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#endif
+
+typedef struct {
+    uint64_t count;
+    uint32_t state[5];
+    uint8_t buf[64];
+} Sha1Ctx;
+
+// Our context must fit inside the SHA_CTX callers allocate.
+typedef char sha_ctx_size_check[(sizeof(Sha1Ctx) <= sizeof(SHA_CTX)) ? 1 : -1];
+
+#define rol(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_blocks_portable(uint32_t state[5], const uint8_t* data,
+                                 size_t nblocks) {
+    uint32_t w[80];
+    while (nblocks-- > 0) {
+        int t;
+        for (t = 0; t < 16; ++t) {
+            w[t] = ((uint32_t)data[t*4] << 24) | ((uint32_t)data[t*4+1] << 16) |
+                   ((uint32_t)data[t*4+2] << 8) | data[t*4+3];
+        }
+        for (t = 16; t < 80; ++t) {
+            uint32_t x = w[t-3] ^ w[t-8] ^ w[t-14] ^ w[t-16];
+            w[t] = rol(x, 1);
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2];
+        uint32_t d = state[3], e = state[4];
+        for (t = 0; t < 80; ++t) {
+            uint32_t f, k;
+            if (t < 20) {
+                f = (b & c) | ((~b) & d);        k = 0x5A827999;
+            } else if (t < 40) {
+                f = b ^ c ^ d;                   k = 0x6ED9EBA1;
+            } else if (t < 60) {
+                f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;                   k = 0xCA62C1D6;
+            }
+            uint32_t tmp = rol(a, 5) + f + e + k + w[t];
+            e = d; d = c; c = rol(b, 30); b = a; a = tmp;
+        }
+        state[0] += a; state[1] += b; state[2] += c;
+        state[3] += d; state[4] += e;
+        data += 64;
+    }
+}
+
+#if defined(__aarch64__)
+
+// Compression using the ARMv8 SHA1 instructions.  Register use:
+//   v0       ABCD working state        s1/s2    alternating E values
+//   v4-v7    message schedule          v16-v19  round constants
+//   v20/v21  alternating W+K values    v22/v23  saved state
+// Only called when getauxval() reports SHA1 support.
+static void sha1_blocks_ce(uint32_t state[5], const uint8_t* data,
+                           size_t nblocks) {
+    asm volatile(
+        ".arch_extension crypto\n"
+
+        "movz    w4, #0x7999\n"
+        "movk    w4, #0x5A82, lsl #16\n"
+        "dup     v16.4s, w4\n"
+        "movz    w4, #0xEBA1\n"
+        "movk    w4, #0x6ED9, lsl #16\n"
+        "dup     v17.4s, w4\n"
+        "movz    w4, #0xBCDC\n"
+        "movk    w4, #0x8F1B, lsl #16\n"
+        "dup     v18.4s, w4\n"
+        "movz    w4, #0xC1D6\n"
+        "movk    w4, #0xCA62, lsl #16\n"
+        "dup     v19.4s, w4\n"
+
+        "ld1     {v0.4s}, [%0]\n"
+        "ldr     s1, [%0, #16]\n"
+
+        "1:\n"
+        "mov     v22.16b, v0.16b\n"
+        "mov     v23.16b, v1.16b\n"
+
+        "ld1     {v4.16b-v7.16b}, [%1], #64\n"
+        "rev32   v4.16b, v4.16b\n"
+        "rev32   v5.16b, v5.16b\n"
+        "rev32   v6.16b, v6.16b\n"
+        "rev32   v7.16b, v7.16b\n"
+
+        "add     v20.4s, v4.4s, v16.4s\n"
+        "add     v21.4s, v5.4s, v16.4s\n"
+
+        "sha1h   s2, s0\n"
+        "sha1c   q0, s1, v20.4s\n"
+        "add     v20.4s, v6.4s, v16.4s\n"
+        "sha1su0 v4.4s, v5.4s, v6.4s\n"
+
+        "sha1h   s1, s0\n"
+        "sha1c   q0, s2, v21.4s\n"
+        "add     v21.4s, v7.4s, v16.4s\n"
+        "sha1su1 v4.4s, v7.4s\n"
+        "sha1su0 v5.4s, v6.4s, v7.4s\n"
+
+        "sha1h   s2, s0\n"
+        "sha1c   q0, s1, v20.4s\n"
+        "add     v20.4s, v4.4s, v16.4s\n"
+        "sha1su1 v5.4s, v4.4s\n"
+        "sha1su0 v6.4s, v7.4s, v4.4s\n"
+
+        "sha1h   s1, s0\n"
+        "sha1c   q0, s2, v21.4s\n"
+        "add     v21.4s, v5.4s, v17.4s\n"
+        "sha1su1 v6.4s, v5.4s\n"
+        "sha1su0 v7.4s, v4.4s, v5.4s\n"
+
+        "sha1h   s2, s0\n"
+        "sha1c   q0, s1, v20.4s\n"
+        "add     v20.4s, v6.4s, v17.4s\n"
+        "sha1su1 v7.4s, v6.4s\n"
+        "sha1su0 v4.4s, v5.4s, v6.4s\n"
+
+        "sha1h   s1, s0\n"
+        "sha1p   q0, s2, v21.4s\n"
+        "add     v21.4s, v7.4s, v17.4s\n"
+        "sha1su1 v4.4s, v7.4s\n"
+        "sha1su0 v5.4s, v6.4s, v7.4s\n"
+
+        "sha1h   s2, s0\n"
+        "sha1p   q0, s1, v20.4s\n"
+        "add     v20.4s, v4.4s, v17.4s\n"
+        "sha1su1 v5.4s, v4.4s\n"
+        "sha1su0 v6.4s, v7.4s, v4.4s\n"
+
+        "sha1h   s1, s0\n"
+        "sha1p   q0, s2, v21.4s\n"
+        "add     v21.4s, v5.4s, v17.4s\n"
+        "sha1su1 v6.4s, v5.4s\n"
+        "sha1su0 v7.4s, v4.4s, v5.4s\n"
+
+        "sha1h   s2, s0\n"
+        "sha1p   q0, s1, v20.4s\n"
+        "add     v20.4s, v6.4s, v18.4s\n"
+        "sha1su1 v7.4s, v6.4s\n"
+        "sha1su0 v4.4s, v5.4s, v6.4s\n"
+
+        "sha1h   s1, s0\n"
+        "sha1p   q0, s2, v21.4s\n"
+        "add     v21.4s, v7.4s, v18.4s\n"
+        "sha1su1 v4.4s, v7.4s\n"
+        "sha1su0 v5.4s, v6.4s, v7.4s\n"
+
+        "sha1h   s2, s0\n"
+        "sha1m   q0, s1, v20.4s\n"
+        "add     v20.4s, v4.4s, v18.4s\n"
+        "sha1su1 v5.4s, v4.4s\n"
+        "sha1su0 v6.4s, v7.4s, v4.4s\n"
+
+        "sha1h   s1, s0\n"
+        "sha1m   q0, s2, v21.4s\n"
+        "add     v21.4s, v5.4s, v18.4s\n"
+        "sha1su1 v6.4s, v5.4s\n"
+        "sha1su0 v7.4s, v4.4s, v5.4s\n"
+
+        "sha1h   s2, s0\n"
+        "sha1m   q0, s1, v20.4s\n"
+        "add     v20.4s, v6.4s, v18.4s\n"
+        "sha1su1 v7.4s, v6.4s\n"
+        "sha1su0 v4.4s, v5.4s, v6.4s\n"
+
+        "sha1h   s1, s0\n"
+        "sha1m   q0, s2, v21.4s\n"
+        "add     v21.4s, v7.4s, v19.4s\n"
+        "sha1su1 v4.4s, v7.4s\n"
+        "sha1su0 v5.4s, v6.4s, v7.4s\n"
+
+        "sha1h   s2, s0\n"
+        "sha1m   q0, s1, v20.4s\n"
+        "add     v20.4s, v4.4s, v19.4s\n"
+        "sha1su1 v5.4s, v4.4s\n"
+        "sha1su0 v6.4s, v7.4s, v4.4s\n"
+
+        "sha1h   s1, s0\n"
+        "sha1p   q0, s2, v21.4s\n"
+        "add     v21.4s, v5.4s, v19.4s\n"
+        "sha1su1 v6.4s, v5.4s\n"
+        "sha1su0 v7.4s, v4.4s, v5.4s\n"
+
+        "sha1h   s2, s0\n"
+        "sha1p   q0, s1, v20.4s\n"
+        "add     v20.4s, v6.4s, v19.4s\n"
+        "sha1su1 v7.4s, v6.4s\n"
+
+        "sha1h   s1, s0\n"
+        "sha1p   q0, s2, v21.4s\n"
+        "add     v21.4s, v7.4s, v19.4s\n"
+
+        "sha1h   s2, s0\n"
+        "sha1p   q0, s1, v20.4s\n"
+
+        "sha1h   s1, s0\n"
+        "sha1p   q0, s2, v21.4s\n"
+
+        "add     v0.4s, v0.4s, v22.4s\n"
+        "add     v1.4s, v1.4s, v23.4s\n"
+
+        "subs    %2, %2, #1\n"
+        "b.ne    1b\n"
+
+        "st1     {v0.4s}, [%0]\n"
+        "str     s1, [%0, #16]\n"
+        : "+r" (state), "+r" (data), "+r" (nblocks)
+        :
+        : "w4", "v0", "v1", "v2", "v4", "v5", "v6", "v7",
+          "v16", "v17", "v18", "v19", "v20", "v21", "v22", "v23",
+          "cc", "memory");
+}
+
+static int haveHwSha1(void) {
+    static int checked = 0;
+    static int have = 0;
+    if (!checked) {
+        have = (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+        checked = 1;
+    }
+    return have;
+}
+
+#endif  // __aarch64__
+
+static void sha1_blocks(uint32_t state[5], const uint8_t* data,
+                        size_t nblocks) {
+    if (nblocks == 0) return;
+#if defined(__aarch64__)
+    if (haveHwSha1()) {
+        sha1_blocks_ce(state, data, nblocks);
+        return;
+    }
+#endif
+    sha1_blocks_portable(state, data, nblocks);
+}
+
+void SHA_init(SHA_CTX* sha_ctx) {
+    Sha1Ctx* ctx = (Sha1Ctx*) sha_ctx;
+    ctx->count = 0;
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+}
+
+void SHA_update(SHA_CTX* sha_ctx, const void* data, int len) {
+    Sha1Ctx* ctx = (Sha1Ctx*) sha_ctx;
+    const uint8_t* p = (const uint8_t*) data;
+    unsigned int buffered = (unsigned int)(ctx->count & 63);
+    ctx->count += len;
+
+    if (buffered > 0) {
+        unsigned int n = 64 - buffered;
+        if (n > (unsigned int) len) n = len;
+        memcpy(ctx->buf + buffered, p, n);
+        buffered += n;
+        p += n;
+        len -= n;
+        if (buffered < 64) return;
+        sha1_blocks(ctx->state, ctx->buf, 1);
+    }
+
+    if (len >= 64) {
+        sha1_blocks(ctx->state, p, len / 64);
+        p += (size_t)(len & ~63);
+        len &= 63;
+    }
+
+    if (len > 0) {
+        memcpy(ctx->buf, p, len);
+    }
+}
+
+const uint8_t* SHA_final(SHA_CTX* sha_ctx) {
+    Sha1Ctx* ctx = (Sha1Ctx*) sha_ctx;
+    uint64_t bits = ctx->count << 3;
+    int i;
+
+    static const uint8_t pad = 0x80;
+    static const uint8_t zeroes[64];
+    SHA_update(sha_ctx, &pad, 1);
+    unsigned int buffered = (unsigned int)(ctx->count & 63);
+    SHA_update(sha_ctx, zeroes,
+               (buffered <= 56) ? 56 - buffered : 120 - buffered);
+    uint8_t length[8];
+    for (i = 0; i < 8; ++i) {
+        length[i] = (uint8_t)(bits >> (56 - i*8));
+    }
+    SHA_update(sha_ctx, length, 8);
+
+    for (i = 0; i < 5; ++i) {
+        uint32_t s = ctx->state[i];
+        ctx->buf[i*4]   = (uint8_t)(s >> 24);
+        ctx->buf[i*4+1] = (uint8_t)(s >> 16);
+        ctx->buf[i*4+2] = (uint8_t)(s >> 8);
+        ctx->buf[i*4+3] = (uint8_t)s;
+    }
+    return ctx->buf;
+}
+
+const uint8_t* SHA_hash(const void* data, int len, uint8_t* digest) {
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    SHA_update(&ctx, data, len);
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return digest;
+}
@@ -38,6 +38,18 @@ LOCAL_WHOLE_STATIC_LIBRARIES := $(common_whole_static_libraries)
 include $(BUILD_STATIC_LIBRARY)
 
 
+# Rendering benchmark; see benchmark.c for usage.
+include $(CLEAR_VARS)
+LOCAL_MODULE := minui_bench
+LOCAL_MODULE_TAGS := eng
+LOCAL_SRC_FILES := benchmark.c
+LOCAL_C_INCLUDES += $(common_c_includes)
+LOCAL_CFLAGS := $(common_cflags)
+LOCAL_STATIC_LIBRARIES := libminui libpng libz
+LOCAL_SHARED_LIBRARIES := libcutils liblog
+include $(BUILD_EXECUTABLE)
+
+
 include $(CLEAR_VARS)
 LOCAL_MODULE := libminui
 LOCAL_ARM_MODE:= arm
@@ -17,8 +17,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <dirent.h>
 #include <sys/epoll.h>
+#include <sys/inotify.h>
 
 #include <linux/input.h>
 
@@ -28,6 +30,9 @@
 #define MAX_DEVICES 16
 #define MAX_MISC_FDS 16
 
+/* input_events batch-read from a device per ev_get_input refill */
+#define EV_QUEUE_MAX 64
+
 #define BITS_PER_LONG (sizeof(unsigned long) * 8)
 #define BITS_TO_LONGS(x) (((x) + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
@@ -38,6 +43,12 @@ struct fd_info {
     int fd;
     ev_callback cb;
     void *data;
+    /* Input devices are registered edge-triggered and read in batches;
+     * ev_get_input hands out buffered events until the queue drains. */
+    bool is_device;
+    struct input_event queue[EV_QUEUE_MAX];
+    int queue_next;
+    int queue_count;
 };
 
 static int epollfd;
@@ -50,55 +61,110 @@ static unsigned ev_count = 0;
 static unsigned ev_dev_count = 0;
 static unsigned ev_misc_count = 0;
 
+/* callback and cookie handed to ev_init, so devices that hotplug in
+ * later can be registered the same way as the ones found at startup */
+static ev_callback ev_device_cb;
+static void *ev_device_data;
+
+/* Open /dev/input/<name> and register it with the epoll set if it is
+ * an input device we care about.  Returns 0 if the device was added,
+ * 1 if it was skipped, -1 if epoll_ctl failed. */
+static int ev_open_device(const char *name)
+{
+    char path[PATH_MAX];
+    unsigned long ev_bits[BITS_TO_LONGS(EV_MAX)];
+    struct epoll_event ev;
+    int fd;
+
+    if (strncmp(name, "event", 5)) return 1;
+    if (ev_count == (MAX_DEVICES + MAX_MISC_FDS) ||
+        ev_dev_count == MAX_DEVICES) return 1;
+
+    snprintf(path, sizeof(path), "/dev/input/%s", name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+
+    /* read the evbits of the input device */
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0) {
+        close(fd);
+        return 1;
+    }
+
+    /* TODO: add ability to specify event masks. For now, just assume
+     * that only EV_KEY and EV_REL event types are ever needed. */
+    if (!test_bit(EV_KEY, ev_bits) && !test_bit(EV_REL, ev_bits) && !test_bit(EV_ABS, ev_bits)) {
+        close(fd);
+        return 1;
+    }
+
+    /* Edge-triggered so a burst of events costs one wakeup;
+     * the fd must be non-blocking so it can be read to EAGAIN. */
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    ev.events = EPOLLIN | EPOLLWAKEUP | EPOLLET;
+    ev.data.ptr = (void *)&ev_fdinfo[ev_count];
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev)) {
+        close(fd);
+        return -1;
+    }
+
+    ev_fdinfo[ev_count].fd = fd;
+    ev_fdinfo[ev_count].cb = ev_device_cb;
+    ev_fdinfo[ev_count].data = ev_device_data;
+    ev_fdinfo[ev_count].is_device = true;
+    ev_fdinfo[ev_count].queue_next = 0;
+    ev_fdinfo[ev_count].queue_count = 0;
+    ev_count++;
+    ev_dev_count++;
+    return 0;
+}
+
+/* Registered against an inotify watch on /dev/input, so devices that
+ * appear after ev_init (OTG keyboards, late-probing controllers) get
+ * picked up without anyone rescanning the directory. */
+static int ev_hotplug_cb(int fd, uint32_t epevents, void *data)
+{
+    char buf[1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    int r, off;
+
+    if (!(epevents & EPOLLIN))
+        return -1;
+
+    r = read(fd, buf, sizeof(buf));
+    if (r < 0)
+        return -1;
+
+    off = 0;
+    while (off + (int) sizeof(*event) <= r) {
+        event = (struct inotify_event *)(buf + off);
+        if (event->len && (event->mask & IN_CREATE))
+            ev_open_device(event->name);
+        off += sizeof(*event) + event->len;
+    }
+    return 0;
+}
+
 int ev_init(ev_callback input_cb, void *data)
 {
     DIR *dir;
     struct dirent *de;
-    int fd;
-    struct epoll_event ev;
+    int inotifyfd;
     bool epollctlfail = false;
 
     epollfd = epoll_create(MAX_DEVICES + MAX_MISC_FDS);
     if (epollfd == -1)
         return -1;
 
+    ev_device_cb = input_cb;
+    ev_device_data = data;
+
     dir = opendir("/dev/input");
     if(dir != 0) {
         while((de = readdir(dir))) {
-            unsigned long ev_bits[BITS_TO_LONGS(EV_MAX)];
-
 //            fprintf(stderr,"/dev/input/%s\n", de->d_name);
-            if(strncmp(de->d_name,"event",5)) continue;
-            fd = openat(dirfd(dir), de->d_name, O_RDONLY);
-            if(fd < 0) continue;
-
-            /* read the evbits of the input device */
-            if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0) {
-                close(fd);
-                continue;
-            }
-
-            /* TODO: add ability to specify event masks. For now, just assume
-             * that only EV_KEY and EV_REL event types are ever needed. */
-            if (!test_bit(EV_KEY, ev_bits) && !test_bit(EV_REL, ev_bits) && !test_bit(EV_ABS, ev_bits)) {
-                close(fd);
-                continue;
-            }
-
-            ev.events = EPOLLIN | EPOLLWAKEUP;
-            ev.data.ptr = (void *)&ev_fdinfo[ev_count];
-            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev)) {
-                close(fd);
+            if (ev_open_device(de->d_name) < 0)
                 epollctlfail = true;
-                continue;
-            }
-
-            ev_fdinfo[ev_count].fd = fd;
-            ev_fdinfo[ev_count].cb = input_cb;
-            ev_fdinfo[ev_count].data = data;
-            ev_count++;
-            ev_dev_count++;
-            if (ev_dev_count == (MAX_DEVICES + MAX_MISC_FDS)) break;
         }
     }
 
@@ -108,6 +174,15 @@ int ev_init(ev_callback input_cb, void *data)
         return -1;
     }
 
+    /* watch for input devices hotplugged after the initial scan */
+    inotifyfd = inotify_init();
+    if (inotifyfd >= 0) {
+        if (inotify_add_watch(inotifyfd, "/dev/input", IN_CREATE) < 0 ||
+            ev_add_fd(inotifyfd, ev_hotplug_cb, NULL)) {
+            close(inotifyfd);
+        }
+    }
+
     return 0;
 }
 
@@ -126,6 +201,7 @@ int ev_add_fd(int fd, ev_callback cb, void *data)
         ev_fdinfo[ev_count].fd = fd;
         ev_fdinfo[ev_count].cb = cb;
         ev_fdinfo[ev_count].data = data;
+        ev_fdinfo[ev_count].is_device = false;
         ev_count++;
         ev_misc_count++;
     }
@@ -180,21 +256,57 @@ void ev_dispatch(void)
     for (n = 0; n < npolledevents; n++) {
         struct fd_info *fdi = polledevents[n].data.ptr;
         ev_callback cb = fdi->cb;
-        if (cb)
+        if (!cb)
+            continue;
+        if (fdi->is_device) {
+            /* Input devices are edge-triggered, so this wakeup is the
+             * only notification for everything currently pending: keep
+             * delivering until the queue and the device are drained. */
+            while (cb(fdi->fd, polledevents[n].events, fdi->data) == 0)
+                ;
+        } else {
             cb(fdi->fd, polledevents[n].events, fdi->data);
+        }
     }
 }
 
 int ev_get_input(int fd, uint32_t epevents, struct input_event *ev)
 {
+    struct fd_info *fdi = NULL;
+    unsigned n;
     int r;
 
-    if (epevents & EPOLLIN) {
-        r = read(fd, ev, sizeof(*ev));
-        if (r == sizeof(*ev))
-            return 0;
+    for (n = 0; n < ev_count; n++) {
+        if (ev_fdinfo[n].fd == fd) {
+            fdi = &ev_fdinfo[n];
+            break;
+        }
+    }
+
+    if (fdi == NULL || !fdi->is_device) {
+        if (epevents & EPOLLIN) {
+            r = read(fd, ev, sizeof(*ev));
+            if (r == (int) sizeof(*ev))
+                return 0;
+        }
+        return -1;
+    }
+
+    /* Refill the queue with everything the device has pending; one
+     * read covers a whole gesture instead of a syscall per event. */
+    if (fdi->queue_count == 0) {
+        if (!(epevents & EPOLLIN))
+            return -1;
+        r = read(fd, fdi->queue, sizeof(fdi->queue));
+        if (r < (int) sizeof(*ev))
+            return -1;
+        fdi->queue_next = 0;
+        fdi->queue_count = r / sizeof(*ev);
     }
-    return -1;
+
+    *ev = fdi->queue[fdi->queue_next++];
+    fdi->queue_count--;
+    return 0;
 }
 
 int ev_sync_key_state(ev_set_key_callback set_key_cb, void *data)
@@ -204,9 +316,13 @@ int ev_sync_key_state(ev_set_key_callback set_key_cb, void *data)
     unsigned i;
     int ret;
 
-    for (i = 0; i < ev_dev_count; i++) {
+    for (i = 0; i < ev_count; i++) {
         int code;
 
+        /* devices registered after startup may sit past the misc fds */
+        if (!ev_fdinfo[i].is_device)
+            continue;
+
         memset(key_bits, 0, sizeof(key_bits));
         memset(ev_bits, 0, sizeof(ev_bits));
 
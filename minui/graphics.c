@@ -16,8 +16,13 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include <fcntl.h>
 #include <stdio.h>
 
@@ -75,6 +80,46 @@ static bool outside(int x, int y)
     return x < 0 || x >= gr_draw->width || y < 0 || y >= gr_draw->height;
 }
 
+// Damage accumulated by the drawing calls since the last flip, as one
+// bounding rectangle clipped to the screen.  x2/y2 are exclusive;
+// the rectangle is empty (nothing drawn) when x1 >= x2.
+static int dirty_x1, dirty_y1, dirty_x2, dirty_y2;
+
+static void mark_dirty(int x1, int y1, int x2, int y2)
+{
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (gr_draw != NULL) {
+        if (x2 > gr_draw->width) x2 = gr_draw->width;
+        if (y2 > gr_draw->height) y2 = gr_draw->height;
+    }
+    if (x1 >= x2 || y1 >= y2) return;
+
+    if (dirty_x1 >= dirty_x2) {
+        dirty_x1 = x1;
+        dirty_y1 = y1;
+        dirty_x2 = x2;
+        dirty_y2 = y2;
+    } else {
+        if (x1 < dirty_x1) dirty_x1 = x1;
+        if (y1 < dirty_y1) dirty_y1 = y1;
+        if (x2 > dirty_x2) dirty_x2 = x2;
+        if (y2 > dirty_y2) dirty_y2 = y2;
+    }
+}
+
+void gr_get_damage(int* x, int* y, int* w, int* h)
+{
+    if (dirty_x1 >= dirty_x2 || dirty_y1 >= dirty_y2) {
+        *x = *y = *w = *h = 0;
+    } else {
+        *x = dirty_x1;
+        *y = dirty_y1;
+        *w = dirty_x2 - dirty_x1;
+        *h = dirty_y2 - dirty_y1;
+    }
+}
+
 #if defined(RECOVERY_BGRA)
 static void rgba2bgra(unsigned char *p, int w)
 {
@@ -101,32 +146,48 @@ void gr_font_size(int *x, int *y)
     *y = gr_font->cheight;
 }
 
+// Composite one row of RGBA source over RGBX dst using the source
+// alpha; on ARM, NEON blends eight pixels per iteration.
+static void icon_blend_row(const unsigned char* sx, unsigned char* px,
+                           int width)
+{
+    int i = 0;
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+    for (; i + 8 <= width; i += 8) {
+        uint8x8x4_t s = vld4_u8(sx + i*4);
+        uint8x8x4_t d = vld4_u8(px + i*4);
+        uint8x8_t a = s.val[3];
+        uint8x8_t na = vmvn_u8(a);
+        uint16x8_t t;
+        int ch;
+
+        for (ch = 0; ch < 3; ++ch) {
+            t = vmlal_u8(vmull_u8(d.val[ch], na), s.val[ch], a);
+            t = vaddq_u16(t, vdupq_n_u16(128));
+            t = vaddq_u16(t, vshrq_n_u16(t, 8));
+            d.val[ch] = vshrn_n_u16(t, 8);
+        }
+        vst4_u8(px + i*4, d);
+    }
+#endif
+    for (; i < width; ++i) {
+        const unsigned char* s = sx + i*4;
+        unsigned char* p = px + i*4;
+        unsigned char a = s[3];
+
+        p[0] = (p[0] * (255-a) + s[0] * a) / 255;
+        p[1] = (p[1] * (255-a) + s[1] * a) / 255;
+        p[2] = (p[2] * (255-a) + s[2] * a) / 255;
+    }
+}
+
 static void icon_blend_alpha(unsigned char* src_p,int src_row_bytes,
                        unsigned char* dst_p, int dst_row_bytes,
                        int width, int height){
-    int i,j;
-    unsigned char r,g,b,a;
+    int j;
 
     for (j = 0; j < height; ++j) {
-        unsigned char* sx = src_p;
-        unsigned char* px = dst_p;
-        for (i = 0; i < width; ++i) {
-             r  = *sx++;
-             g = *sx++;
-             b = *sx++;
-             a = *sx++;
-
-             *px = (*px * (255-a) + r * a )/ 255;
-             ++px;
-
-             *px = (*px * (255-a) + g * a) / 255;
-             ++px;
-
-             *px = (*px * (255-a) + b * a) / 255;
-
-             ++px;
-             ++px;
-        }
+        icon_blend_row(src_p, dst_p, width);
 #if defined(RECOVERY_BGRA)
         rgba2bgra(dst_p, width);
 #endif
@@ -134,34 +195,73 @@ static void icon_blend_alpha(unsigned char* src_p,int src_row_bytes,
         dst_p += dst_row_bytes;
     }
 }
+// Composite one row of 8-bit alpha coverage over RGBX pixels with the
+// current color; on ARM, NEON handles eight pixels per iteration.
+static void text_blend_row(const unsigned char* sx, unsigned char* px,
+                           int width)
+{
+    int i = 0;
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+    uint8x8_t vr = vdup_n_u8(gr_current_r);
+    uint8x8_t vg = vdup_n_u8(gr_current_g);
+    uint8x8_t vb = vdup_n_u8(gr_current_b);
+    uint8x8_t vga = vdup_n_u8(gr_current_a);
+    for (; i + 8 <= width; i += 8) {
+        uint8x8_t a = vld1_u8(sx + i);
+        if (gr_current_a < 255) {
+            // a = a * gr_current_a / 255, rounded.
+            uint16x8_t wa = vmull_u8(a, vga);
+            wa = vaddq_u16(wa, vdupq_n_u16(128));
+            wa = vaddq_u16(wa, vshrq_n_u16(wa, 8));
+            a = vshrn_n_u16(wa, 8);
+        }
+        uint8x8_t na = vmvn_u8(a);
+        uint8x8x4_t d = vld4_u8(px + i*4);
+
+        // ch = (dst*(255-a) + color*a) / 255 for each color channel;
+        // the divide is the usual add-high-half trick.
+        uint16x8_t t;
+        t = vmlal_u8(vmull_u8(d.val[0], na), vr, a);
+        t = vaddq_u16(t, vdupq_n_u16(128));
+        t = vaddq_u16(t, vshrq_n_u16(t, 8));
+        d.val[0] = vshrn_n_u16(t, 8);
+
+        t = vmlal_u8(vmull_u8(d.val[1], na), vg, a);
+        t = vaddq_u16(t, vdupq_n_u16(128));
+        t = vaddq_u16(t, vshrq_n_u16(t, 8));
+        d.val[1] = vshrn_n_u16(t, 8);
+
+        t = vmlal_u8(vmull_u8(d.val[2], na), vb, a);
+        t = vaddq_u16(t, vdupq_n_u16(128));
+        t = vaddq_u16(t, vshrq_n_u16(t, 8));
+        d.val[2] = vshrn_n_u16(t, 8);
+
+        vst4_u8(px + i*4, d);
+    }
+#endif
+    for (; i < width; ++i) {
+        unsigned char a = sx[i];
+        unsigned char* p = px + i*4;
+        if (gr_current_a < 255) a = ((int)a * gr_current_a) / 255;
+        if (a == 255) {
+            p[0] = gr_current_r;
+            p[1] = gr_current_g;
+            p[2] = gr_current_b;
+        } else if (a > 0) {
+            p[0] = (p[0] * (255-a) + gr_current_r * a) / 255;
+            p[1] = (p[1] * (255-a) + gr_current_g * a) / 255;
+            p[2] = (p[2] * (255-a) + gr_current_b * a) / 255;
+        }
+    }
+}
+
 static void text_blend(unsigned char* src_p, int src_row_bytes,
                        unsigned char* dst_p, int dst_row_bytes,
                        int width, int height)
 {
-    int i, j;
+    int j;
     for (j = 0; j < height; ++j) {
-        unsigned char* sx = src_p;
-        unsigned char* px = dst_p;
-        for (i = 0; i < width; ++i) {
-            unsigned char a = *sx++;
-            if (gr_current_a < 255) a = ((int)a * gr_current_a) / 255;
-            if (a == 255) {
-                *px++ = gr_current_r;
-                *px++ = gr_current_g;
-                *px++ = gr_current_b;
-                px++;
-            } else if (a > 0) {
-                *px = (*px * (255-a) + gr_current_r * a) / 255;
-                ++px;
-                *px = (*px * (255-a) + gr_current_g * a) / 255;
-                ++px;
-                *px = (*px * (255-a) + gr_current_b * a) / 255;
-                ++px;
-                ++px;
-            } else {
-                px += 4;
-            }
-        }
+        text_blend_row(src_p, dst_p, width);
 #if defined(RECOVERY_BGRA)
         rgba2bgra(dst_p, width);
 #endif
@@ -181,6 +281,7 @@ void gr_text_blend(int x,int y, GRFont* font)
     unsigned char *dst_p = gr_draw->data+offset;
 
     text_blend(src_p,font->cwidth,dst_p,gr_draw->row_bytes,font->cwidth,font->cheight);
+    mark_dirty(x, y, x+font->cwidth, y+font->cheight);
 }
 
 void gr_text(int x, int y, const char *s, int bold)
@@ -196,22 +297,91 @@ void gr_text(int x, int y, const char *s, int bold)
     x += overscan_offset_x;
     y += overscan_offset_y;
 
+    int x_start = x;
+
     while((off = *s++)) {
         off -= 32;
         if (outside(x, y) || outside(x+font->cwidth-1, y+font->cheight-1)) break;
         if (off < 96) {
 
-            unsigned char* src_p = font->texture->data + (off * font->cwidth) +
-                (bold ? font->cheight * font->texture->row_bytes : 0);
+            unsigned char* src_p;
+            int src_row_bytes;
+            if (font->glyphs != NULL) {
+                src_p = font->glyphs +
+                    ((bold ? 96 : 0) + off) * font->cwidth * font->cheight;
+                src_row_bytes = font->cwidth;
+            } else {
+                src_p = font->texture->data + (off * font->cwidth) +
+                    (bold ? font->cheight * font->texture->row_bytes : 0);
+                src_row_bytes = font->texture->row_bytes;
+            }
             unsigned char* dst_p = gr_draw->data + y*gr_draw->row_bytes + x*gr_draw->pixel_bytes;
 
-            text_blend(src_p, font->texture->row_bytes,
+            text_blend(src_p, src_row_bytes,
                        dst_p, gr_draw->row_bytes,
                        font->cwidth, font->cheight);
 
         }
         x += font->cwidth;
     }
+
+    mark_dirty(x_start, y, x, y+font->cheight);
+}
+
+// Render text into a caller-owned 4-byte surface instead of the
+// framebuffer, overwriting the destination with the current color and
+// the glyph coverage in the alpha channel.  A surface built this way
+// composites through gr_blit() exactly as if the text had been drawn
+// in place with gr_text(), which lets callers cache rendered text.
+void gr_render_text(GRSurface* dest, int x, int y, const char *s, int bold)
+{
+    GRFont *font = gr_font;
+    unsigned off;
+
+    if (dest == NULL || dest->pixel_bytes != 4) return;
+    if (!font->texture) return;
+
+    bold = bold && (font->texture->height != font->cheight);
+
+    while((off = *s++)) {
+        off -= 32;
+        if (x < 0 || y < 0 ||
+            x+font->cwidth > dest->width || y+font->cheight > dest->height) break;
+        if (off < 96) {
+
+            unsigned char* src_p;
+            int src_row_bytes;
+            if (font->glyphs != NULL) {
+                src_p = font->glyphs +
+                    ((bold ? 96 : 0) + off) * font->cwidth * font->cheight;
+                src_row_bytes = font->cwidth;
+            } else {
+                src_p = font->texture->data + (off * font->cwidth) +
+                    (bold ? font->cheight * font->texture->row_bytes : 0);
+                src_row_bytes = font->texture->row_bytes;
+            }
+            unsigned char* dst_p = dest->data + y*dest->row_bytes + x*dest->pixel_bytes;
+
+            int i, j;
+            for (j = 0; j < font->cheight; ++j) {
+                unsigned char* px = dst_p;
+                for (i = 0; i < font->cwidth; ++i) {
+                    px[0] = gr_current_r;
+                    px[1] = gr_current_g;
+                    px[2] = gr_current_b;
+                    px[3] = src_p[i] * gr_current_a / 255;
+                    px += 4;
+                }
+#if defined(RECOVERY_BGRA)
+                rgba2bgra(dst_p, font->cwidth);
+#endif
+                src_p += src_row_bytes;
+                dst_p += dest->row_bytes;
+            }
+
+        }
+        x += font->cwidth;
+    }
 }
 
 void gr_texticon(int x, int y, GRSurface* icon) {
@@ -233,6 +403,7 @@ void gr_texticon(int x, int y, GRSurface* icon) {
     text_blend(src_p, icon->row_bytes,
                dst_p, gr_draw->row_bytes,
                icon->width, icon->height);
+    mark_dirty(x, y, x+icon->width, y+icon->height);
 }
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
@@ -245,6 +416,7 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
 
 void gr_clear()
 {
+    mark_dirty(0, 0, gr_draw->width, gr_draw->height);
     if (gr_current_r == gr_current_g &&
         gr_current_r == gr_current_b) {
         memset(gr_draw->data, gr_current_r, gr_draw->height * gr_draw->row_bytes);
@@ -266,6 +438,72 @@ void gr_clear()
     }
 }
 
+// Write one row of the current color into RGBX pixels, leaving the
+// fourth byte alone like the scalar loop always has.
+static void fill_row_solid(unsigned char* px, int width)
+{
+    int i = 0;
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+    uint8x8_t vr = vdup_n_u8(gr_current_r);
+    uint8x8_t vg = vdup_n_u8(gr_current_g);
+    uint8x8_t vb = vdup_n_u8(gr_current_b);
+    for (; i + 8 <= width; i += 8) {
+        uint8x8x4_t d = vld4_u8(px + i*4);
+        d.val[0] = vr;
+        d.val[1] = vg;
+        d.val[2] = vb;
+        vst4_u8(px + i*4, d);
+    }
+#endif
+    for (; i < width; ++i) {
+        unsigned char* p = px + i*4;
+        p[0] = gr_current_r;
+        p[1] = gr_current_g;
+        p[2] = gr_current_b;
+    }
+}
+
+// Blend one row of the current color over RGBX pixels at the current
+// (constant) alpha.
+static void fill_row_blend(unsigned char* px, int width)
+{
+    int i = 0;
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+    uint8x8_t a = vdup_n_u8(gr_current_a);
+    uint8x8_t na = vdup_n_u8(255 - gr_current_a);
+    uint8x8_t vr = vdup_n_u8(gr_current_r);
+    uint8x8_t vg = vdup_n_u8(gr_current_g);
+    uint8x8_t vb = vdup_n_u8(gr_current_b);
+    for (; i + 8 <= width; i += 8) {
+        uint8x8x4_t d = vld4_u8(px + i*4);
+        uint16x8_t t;
+
+        t = vmlal_u8(vmull_u8(d.val[0], na), vr, a);
+        t = vaddq_u16(t, vdupq_n_u16(128));
+        t = vaddq_u16(t, vshrq_n_u16(t, 8));
+        d.val[0] = vshrn_n_u16(t, 8);
+
+        t = vmlal_u8(vmull_u8(d.val[1], na), vg, a);
+        t = vaddq_u16(t, vdupq_n_u16(128));
+        t = vaddq_u16(t, vshrq_n_u16(t, 8));
+        d.val[1] = vshrn_n_u16(t, 8);
+
+        t = vmlal_u8(vmull_u8(d.val[2], na), vb, a);
+        t = vaddq_u16(t, vdupq_n_u16(128));
+        t = vaddq_u16(t, vshrq_n_u16(t, 8));
+        d.val[2] = vshrn_n_u16(t, 8);
+
+        vst4_u8(px + i*4, d);
+    }
+#endif
+    for (; i < width; ++i) {
+        unsigned char* p = px + i*4;
+        p[0] = (p[0] * (255-gr_current_a) + gr_current_r * gr_current_a) / 255;
+        p[1] = (p[1] * (255-gr_current_a) + gr_current_g * gr_current_a) / 255;
+        p[2] = (p[2] * (255-gr_current_a) + gr_current_b * gr_current_a) / 255;
+    }
+}
+
 void gr_fill(int x1, int y1, int x2, int y2)
 {
     x1 += overscan_offset_x;
@@ -276,35 +514,22 @@ void gr_fill(int x1, int y1, int x2, int y2)
 
     if (outside(x1, y1) || outside(x2-1, y2-1)) return;
 
+    mark_dirty(x1, y1, x2, y2);
+
     unsigned char* p = gr_draw->data + y1 * gr_draw->row_bytes + x1 * gr_draw->pixel_bytes;
     if (gr_current_a == 255) {
-        int x, y;
+        int y;
         for (y = y1; y < y2; ++y) {
-            unsigned char* px = p;
-            for (x = x1; x < x2; ++x) {
-                *px++ = gr_current_r;
-                *px++ = gr_current_g;
-                *px++ = gr_current_b;
-                px++;
-            }
+            fill_row_solid(p, x2-x1);
 #if defined(RECOVERY_BGRA)
             rgba2bgra(p, x2-x1);
 #endif
             p += gr_draw->row_bytes;
         }
     } else if (gr_current_a > 0) {
-        int x, y;
+        int y;
         for (y = y1; y < y2; ++y) {
-            unsigned char* px = p;
-            for (x = x1; x < x2; ++x) {
-                *px = (*px * (255-gr_current_a) + gr_current_r * gr_current_a) / 255;
-                ++px;
-                *px = (*px * (255-gr_current_a) + gr_current_g * gr_current_a) / 255;
-                ++px;
-                *px = (*px * (255-gr_current_a) + gr_current_b * gr_current_a) / 255;
-                ++px;
-                ++px;
-            }
+            fill_row_blend(p, x2-x1);
 #if defined(RECOVERY_BGRA)
             rgba2bgra(p, x2-x1);
 #endif
@@ -341,6 +566,7 @@ void gr_blit(GRSurface* source, int sx, int sy, int w, int h, int dx, int dy) {
     unsigned char* dst_p = gr_draw->data + dy*gr_draw->row_bytes + dx*gr_draw->pixel_bytes;
 
     icon_blend_alpha(src_p, source->row_bytes, dst_p, gr_draw->row_bytes, w, h);
+    mark_dirty(dx, dy, dx+w, dy+h);
 }
 
 unsigned int gr_get_width(GRSurface* surface) {
@@ -357,6 +583,34 @@ unsigned int gr_get_height(GRSurface* surface) {
     return surface->height;
 }
 
+// Repack the font texture into per-glyph bitmaps so each glyph's rows
+// are contiguous; the texture stores glyphs side by side, so every
+// glyph row otherwise starts a full texture row apart.  Built once at
+// init; gr_text falls back to the texture if the allocation fails.
+static void gr_font_build_glyph_cache(GRFont* font)
+{
+    int rows = font->texture->height / font->cheight;
+    int glyph_bytes = font->cwidth * font->cheight;
+    int r, g, y;
+
+    font->glyphs = malloc(rows * 96 * glyph_bytes);
+    if (font->glyphs == NULL) return;
+
+    for (r = 0; r < rows; ++r) {
+        for (g = 0; g < 96; ++g) {
+            unsigned char* out = font->glyphs + (r*96 + g) * glyph_bytes;
+            unsigned char* in = font->texture->data +
+                    r * font->cheight * font->texture->row_bytes +
+                    g * font->cwidth;
+            for (y = 0; y < font->cheight; ++y) {
+                memcpy(out, in, font->cwidth);
+                out += font->cwidth;
+                in += font->texture->row_bytes;
+            }
+        }
+    }
+}
+
 static void gr_init_one_font(int idx)
 {
     char name[80];
@@ -376,10 +630,26 @@ static void gr_init_one_font(int idx)
 
         // fall back to the compiled-in font.
         gr_font->texture = malloc(sizeof(*gr_font->texture));
+        gr_font->texture->pixel_bytes = 1;
+
+#ifdef FONT_ATLAS
+        // mkfont pre-expanded the font into the per-glyph 8-bit
+        // layout the glyph cache uses, so point straight at it;
+        // there is nothing to unpack or repack.
+        gr_font->texture->width = font.cwidth * 96;
+        gr_font->texture->height = font.cheight * font.nrows;
+        gr_font->texture->row_bytes = font.cwidth;
+        gr_font->texture->data = (unsigned char*) font.alpha;
+
+        gr_font->cwidth = font.cwidth;
+        gr_font->cheight = font.cheight;
+        gr_font->glyphs = (unsigned char*) font.alpha;
+#else
+        // Legacy run-length format (boards shipping their own
+        // RECOVERY_FONT header): expand it once, then repack below.
         gr_font->texture->width = font.width;
         gr_font->texture->height = font.height;
         gr_font->texture->row_bytes = font.width;
-        gr_font->texture->pixel_bytes = 1;
 
         unsigned char* bits = malloc(font.width * font.height);
         gr_font->texture->data = (void*) bits;
@@ -393,6 +663,11 @@ static void gr_init_one_font(int idx)
 
         gr_font->cwidth = font.cwidth;
         gr_font->cheight = font.cheight;
+#endif
+    }
+
+    if (gr_font->glyphs == NULL) {
+        gr_font_build_glyph_cache(gr_font);
     }
 }
 
@@ -456,6 +731,15 @@ static void gr_test() {
 
 void gr_flip() {
     gr_draw = gr_backend->flip(gr_backend);
+    // The backend has consumed the accumulated damage.
+    dirty_x1 = dirty_y1 = dirty_x2 = dirty_y2 = 0;
+}
+
+int gr_wait_vsync(void)
+{
+    if (gr_backend == NULL || gr_backend->wait_vsync == NULL)
+        return -1;
+    return gr_backend->wait_vsync(gr_backend);
 }
 
 int gr_init(void)
@@ -36,6 +36,10 @@ typedef struct minui_backend {
     // Blank (or unblank) the screen.
     void (*blank)(struct minui_backend*, bool);
 
+    // Optional (may be NULL): block until the display's next vertical
+    // sync and return 0, or return -1 if the wait isn't available.
+    int (*wait_vsync)(struct minui_backend*);
+
     // Device cleanup when drawing is done.
     void (*exit)(struct minui_backend*);
 } minui_backend;
@@ -43,6 +47,12 @@ typedef struct minui_backend {
 minui_backend* open_fbdev();
 minui_backend* open_adf();
 
+// Bounding rectangle of everything drawn since the last flip, clipped
+// to the screen; *w and *h are zero if nothing was drawn.  Backends
+// may use this to push only the changed region (or skip an empty
+// flip); gr_flip() resets it after the backend returns.
+void gr_get_damage(int* x, int* y, int* w, int* h);
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,6 +43,7 @@ struct adf_pdata {
 
     unsigned int current_surface;
     unsigned int n_surfaces;
+    bool posted;
     struct adf_surface_pdata surfaces[2];
 };
 
@@ -195,6 +196,14 @@ static gr_surface adf_flip(struct minui_backend *backend)
 {
     struct adf_pdata *pdata = (struct adf_pdata *)backend;
     struct adf_surface_pdata *surf = &pdata->surfaces[pdata->current_surface];
+    int dx, dy, dw, dh;
+
+    // ADF's simple post has no damage parameter, so a dirty frame is
+    // always pushed whole; but once something is on screen, a flip
+    // with no damage at all can be elided entirely.
+    gr_get_damage(&dx, &dy, &dw, &dh);
+    if (pdata->posted && (dw == 0 || dh == 0))
+        return &surf->base;
 
     int fence_fd = adf_interface_simple_post(pdata->intf_fd, pdata->eng_id,
             surf->base.width, surf->base.height, pdata->format, surf->fd,
@@ -202,10 +211,34 @@ static gr_surface adf_flip(struct minui_backend *backend)
     if (fence_fd >= 0)
         close(fence_fd);
 
+    pdata->posted = true;
     pdata->current_surface = (pdata->current_surface + 1) % pdata->n_surfaces;
     return &pdata->surfaces[pdata->current_surface].base;
 }
 
+static int adf_wait_vsync(struct minui_backend *backend)
+{
+    struct adf_pdata *pdata = (struct adf_pdata *)backend;
+    struct adf_event *event;
+    int err;
+
+    if (adf_set_event(pdata->intf_fd, ADF_EVENT_VSYNC, true) < 0)
+        return -1;
+
+    // the interface fd delivers other event types too; keep reading
+    // until the vsync arrives
+    do {
+        err = adf_read_event(pdata->intf_fd, &event);
+        if (err < 0)
+            break;
+        err = (event->type == ADF_EVENT_VSYNC) ? 0 : 1;
+        free(event);
+    } while (err > 0);
+
+    adf_set_event(pdata->intf_fd, ADF_EVENT_VSYNC, false);
+    return (err < 0) ? -1 : 0;
+}
+
 static void adf_blank(struct minui_backend *backend, bool blank)
 {
     struct adf_pdata *pdata = (struct adf_pdata *)backend;
@@ -242,6 +275,7 @@ minui_backend *open_adf()
     pdata->base.init = adf_init;
     pdata->base.flip = adf_flip;
     pdata->base.blank = adf_blank;
+    pdata->base.wait_vsync = adf_wait_vsync;
     pdata->base.exit = adf_exit;
     return &pdata->base;
 }
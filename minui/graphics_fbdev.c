@@ -35,6 +35,7 @@
 static gr_surface fbdev_init(minui_backend*);
 static gr_surface fbdev_flip(minui_backend*);
 static void fbdev_blank(minui_backend*, bool);
+static int fbdev_wait_vsync(minui_backend*);
 static void fbdev_exit(minui_backend*);
 
 static GRSurface gr_framebuffer[2];
@@ -49,6 +50,7 @@ static minui_backend my_backend = {
     .init = fbdev_init,
     .flip = fbdev_flip,
     .blank = fbdev_blank,
+    .wait_vsync = fbdev_wait_vsync,
     .exit = fbdev_exit,
 };
 
@@ -56,6 +58,27 @@ minui_backend* open_fbdev() {
     return &my_backend;
 }
 
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, __u32)
+#endif
+
+static int fbdev_wait_vsync(minui_backend* backend __unused)
+{
+    // Plenty of fbdev drivers never implemented the vsync ioctl; note
+    // the first failure and stop asking, so callers fall back to
+    // timer-based pacing without an ioctl per frame.
+    static bool unsupported = false;
+    __u32 crtc = 0;
+
+    if (unsupported || fb_fd < 0)
+        return -1;
+    if (ioctl(fb_fd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+        unsupported = true;
+        return -1;
+    }
+    return 0;
+}
+
 static void fbdev_blank(minui_backend* backend __unused, bool blank)
 {
     int ret;
@@ -207,29 +230,43 @@ static gr_surface fbdev_init(minui_backend* backend) {
 }
 
 static gr_surface fbdev_flip(minui_backend* backend __unused) {
+    int dx, dy, dw, dh;
+    gr_get_damage(&dx, &dy, &dw, &dh);
+
     if (double_buffered) {
+        // Nothing was drawn since the last flip; keep displaying the
+        // current buffer instead of panning to the stale back buffer.
+        if (dw == 0 || dh == 0) return gr_draw;
+
         // Change gr_draw to point to the buffer currently displayed,
         // then flip the driver so we're displaying the other buffer
         // instead.
         gr_draw = gr_framebuffer + displayed_buffer;
         set_displayed_framebuffer(1-displayed_buffer);
-    } else {
-        // Copy from the in-memory surface to the framebuffer.
-
+    } else if (dw > 0 && dh > 0) {
+        // Copy from the in-memory surface to the framebuffer.  The
+        // framebuffer still holds the previous frame and the surface
+        // persists across flips, so only the damaged region needs to
+        // be copied.
+        int row;
+        size_t offset = dy * gr_draw->row_bytes + dx * gr_draw->pixel_bytes;
+        unsigned char* fb_p = gr_framebuffer[0].data + offset;
+        unsigned char* mem_p = gr_draw->data + offset;
+        for (row = 0; row < dh; ++row) {
 #if defined(RECOVERY_BGRA)
-        unsigned int idx;
-        unsigned char* ucfb_vaddr = (unsigned char*)gr_framebuffer[0].data;
-        unsigned char* ucbuffer_vaddr = (unsigned char*)gr_draw->data;
-        for (idx = 0 ; idx < (gr_draw->height * gr_draw->row_bytes); idx += 4) {
-            ucfb_vaddr[idx    ] = ucbuffer_vaddr[idx + 2];
-            ucfb_vaddr[idx + 1] = ucbuffer_vaddr[idx + 1];
-            ucfb_vaddr[idx + 2] = ucbuffer_vaddr[idx    ];
-            ucfb_vaddr[idx + 3] = ucbuffer_vaddr[idx + 3];
-        }
+            int idx;
+            for (idx = 0; idx < dw * 4; idx += 4) {
+                fb_p[idx    ] = mem_p[idx + 2];
+                fb_p[idx + 1] = mem_p[idx + 1];
+                fb_p[idx + 2] = mem_p[idx    ];
+                fb_p[idx + 3] = mem_p[idx + 3];
+            }
 #else
-        memcpy(gr_framebuffer[0].data, gr_draw->data,
-               gr_draw->height * gr_draw->row_bytes);
+            memcpy(fb_p, mem_p, dw * gr_draw->pixel_bytes);
 #endif
+            fb_p += gr_draw->row_bytes;
+            mem_p += gr_draw->row_bytes;
+        }
     }
     return gr_draw;
 }
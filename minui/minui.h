@@ -37,6 +37,11 @@ typedef struct {
     GRSurface* texture;
     int cwidth;
     int cheight;
+    // Per-glyph repack of the texture: 96 printable-ASCII glyphs per
+    // texture row (regular, then bold when present), each glyph's rows
+    // stored contiguously.  NULL if the cache couldn't be built, in
+    // which case rendering falls back to the texture.
+    unsigned char* glyphs;
 } GRFont;
 
 typedef GRSurface* gr_surface;
@@ -44,6 +49,11 @@ typedef GRSurface* gr_surface;
 int gr_init(void);
 void gr_exit(void);
 
+// Block until the display's next vertical sync.  Returns 0 after a
+// real vsync, or -1 if the backend can't provide one (callers should
+// fall back to timer-based pacing).
+int gr_wait_vsync(void);
+
 int gr_fb_width(void);
 int gr_fb_height(void);
 
@@ -55,6 +65,7 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
 void gr_fill(int x1, int y1, int x2, int y2);
 void gr_set_font(const char* name);
 void gr_text(int x, int y, const char *s, int bold);
+void gr_render_text(gr_surface dest, int x, int y, const char *s, int bold);
 void gr_texticon(int x, int y, gr_surface icon);
 int gr_measure(const char *s);
 void gr_font_size(int *x, int *y);
@@ -1,53 +1,64 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-int main(int argc, char *argv)
+/* Writes a font header on stdout from a GIMP C-source export
+ * (gimp_image) included ahead of this file when the tool is built.
+ * The image is a 96-column strip of fixed-size character cells for
+ * printable ASCII 0x20-0x7f, with one row of cells per face (regular,
+ * then bold when present); pass the number of face rows as argv[1].
+ *
+ * The output is a pre-expanded 8-bit alpha atlas stored glyph-major:
+ * each glyph's rows are contiguous, and since the cells are fixed
+ * size, glyph i of face r begins at (r*96 + i) * glyph_bytes.
+ * gr_text blits rows straight out of this, so the run-length
+ * unpacking the old format needed is done here at build time.
+ */
+
+int main(int argc, char **argv)
 {
-    unsigned n;
-    unsigned char *x;
+    unsigned nrows = (argc > 1) ? atoi(argv[1]) : 1;
+    unsigned cwidth = gimp_image.width / 96;
+    unsigned cheight = gimp_image.height / nrows;
+    unsigned r, g, x, y;
     unsigned m;
-    unsigned run_val;
-    unsigned run_count;
- 
-    n = gimp_image.width * gimp_image.height;
-    m = 0;
-    x = gimp_image.pixel_data;
 
+    printf("/* Generated by minui/mkfont.c; do not edit by hand.\n");
+    printf(" * Pre-expanded 8-bit alpha glyph atlas, stored glyph-major:\n");
+    printf(" * glyph i of face r begins at (r*96 + i) * glyph_bytes and\n");
+    printf(" * its rows are contiguous (stride cwidth).\n");
+    printf(" */\n");
+    printf("#define FONT_ATLAS 1\n");
+    printf("\n");
     printf("struct {\n");
-    printf("  unsigned width;\n");
-    printf("  unsigned height;\n");
     printf("  unsigned cwidth;\n");
     printf("  unsigned cheight;\n");
-    printf("  unsigned char rundata[];\n");
+    printf("  unsigned nrows;\n");
+    printf("  unsigned glyph_bytes;\n");
+    printf("  unsigned char alpha[];\n");
     printf("} font = {\n");
-    printf("  .width = %d,\n  .height = %d,\n  .cwidth = %d,\n  .cheight = %d,\n", gimp_image.width, gimp_image.height,
-           gimp_image.width / 96, gimp_image.height);
-    printf("  .rundata = {\n");
-   
-    run_val = (*x ? 0 : 255);
-    run_count = 1;
-    n--;
-    x+=3;
+    printf("  .cwidth = %d,\n  .cheight = %d,\n  .nrows = %d,\n  .glyph_bytes = %d,\n",
+           cwidth, cheight, nrows, cwidth * cheight);
+    printf("  .alpha = {\n");
 
-    while(n-- > 0) {
-        unsigned val = (*x ? 0 : 255);
-        x+=3;
-        if((val == run_val) && (run_count < 127)) {
-            run_count++;
-        } else {
-eject:
-            printf("0x%02x,",run_count | (run_val ? 0x80 : 0x00));
-            run_val = val;
-            run_count = 1;
-            m += 5;
-            if(m >= 75) {
-                printf("\n");
-                m = 0;
+    m = 0;
+    for (r = 0; r < nrows; r++) {
+        for (g = 0; g < 96; g++) {
+            for (y = 0; y < cheight; y++) {
+                for (x = 0; x < cwidth; x++) {
+                    const unsigned char *px = gimp_image.pixel_data +
+                        (((r * cheight + y) * gimp_image.width) +
+                         g * cwidth + x) * 3;
+                    printf("0x%02x,", *px ? 0x00 : 0xff);
+                    m += 5;
+                    if (m >= 75) {
+                        printf("\n");
+                        m = 0;
+                    }
+                }
             }
         }
     }
-    printf("0x%02x,",run_count | (run_val ? 0x80 : 0x00));
-    printf("\n0x00,");
+
     printf("\n");
     printf("  }\n};\n");
     return 0;
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -22,6 +24,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -49,6 +52,89 @@ static gr_surface malloc_surface(size_t data_size) {
     return surface;
 }
 
+// Precompiled resource images: a <name>.raw file alongside the PNG,
+// written at build time by mkrawres.py.  A small header followed by
+// raw RGBX frames lets recovery mmap the pixels with no decode work:
+//
+//   bytes  0-3   magic "MRAW"
+//   bytes  4-7   width (little-endian uint32)
+//   bytes  8-11  height of one frame
+//   bytes 12-15  frame count (1 for still images)
+//
+// followed by each frame's width*height*4 RGBX bytes in turn.  The
+// returned surfaces point straight into the mapping, which stays
+// mapped for the life of the process; res_free_surface() on such a
+// surface frees only the GRSurface header.
+
+#define RAW_RES_MAGIC "MRAW"
+#define RAW_RES_HEADER_SIZE 16
+
+static uint32_t raw_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Map /res/images/<name>.raw and build one GRSurface per frame into a
+// malloc'd array stored in *pSurface.  Returns 0 on success or -1 if
+// no usable raw file exists (the caller then decodes the PNG).
+static int load_raw_resource(const char* name, int* frames,
+                             gr_surface** pSurface) {
+    char resPath[256];
+    struct stat st;
+    unsigned char* map = MAP_FAILED;
+    gr_surface* surface = NULL;
+    uint32_t width, height, count = 0;
+    uint32_t i;
+
+    if (*name == '/') return -1;    // only packaged resources are compiled
+    snprintf(resPath, sizeof(resPath), "/res/images/%s.raw", name);
+
+    int fd = open(resPath, O_RDONLY);
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &st) < 0 || st.st_size < RAW_RES_HEADER_SIZE) goto fail;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) goto fail;
+
+    if (memcmp(map, RAW_RES_MAGIC, 4) != 0) goto fail;
+    width = raw_le32(map + 4);
+    height = raw_le32(map + 8);
+    count = raw_le32(map + 12);
+    if (width == 0 || height == 0 || count == 0 ||
+        (uint64_t)st.st_size != RAW_RES_HEADER_SIZE +
+            (uint64_t)count * width * height * 4) {
+        fprintf(stderr, "ignoring malformed raw resource %s\n", resPath);
+        goto fail;
+    }
+
+    surface = calloc(count, sizeof(gr_surface));
+    if (surface == NULL) goto fail;
+    for (i = 0; i < count; ++i) {
+        surface[i] = malloc(sizeof(GRSurface));
+        if (surface[i] == NULL) goto fail;
+        surface[i]->width = width;
+        surface[i]->height = height;
+        surface[i]->row_bytes = width * 4;
+        surface[i]->pixel_bytes = 4;
+        surface[i]->data = map + RAW_RES_HEADER_SIZE +
+                (size_t)i * width * height * 4;
+    }
+
+    close(fd);
+    *frames = count;
+    *pSurface = surface;
+    return 0;
+
+  fail:
+    if (surface != NULL) {
+        for (i = 0; i < count; ++i) free(surface[i]);
+        free(surface);
+    }
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    close(fd);
+    return -1;
+}
+
 static int open_png(const char* name, png_structp* png_ptr, png_infop* info_ptr,
                     png_uint_32* width, png_uint_32* height, png_byte* channels) {
     char resPath[256] = {0};
@@ -147,6 +233,57 @@ static int open_png(const char* name, png_structp* png_ptr, png_infop* info_ptr,
     return result;
 }
 
+// Theme resolution cache.  Themes rarely override every image, so
+// without it each surface load pays a failed open() on the theme
+// directory before falling back to /res/images -- and the UI init
+// batch loads dozens of surfaces.  The theme directory is read once
+// per theme and lookups are answered from the in-memory listing; the
+// cache rebuilds when the theme name changes (a theme switch reloads
+// every surface anyway), and an unreadable theme directory caches as
+// empty so every lookup short-circuits to the stock fallback.
+
+#define THEME_CACHE_ENTRIES 128
+
+static char theme_cache_theme[64] = "";
+static char* theme_cache[THEME_CACHE_ENTRIES];
+static int theme_cache_count = 0;
+
+static void build_theme_cache(const char* themename) {
+    int i;
+    for (i = 0; i < theme_cache_count; ++i) {
+        free(theme_cache[i]);
+    }
+    theme_cache_count = 0;
+    strlcpy(theme_cache_theme, themename, sizeof(theme_cache_theme));
+
+    char dirPath[256];
+    snprintf(dirPath, sizeof(dirPath), "/cache/cot/themes/%s", themename);
+    DIR* d = opendir(dirPath);
+    if (d == NULL) return;
+
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL && theme_cache_count < THEME_CACHE_ENTRIES) {
+        char* dot = strrchr(de->d_name, '.');
+        if (dot == NULL || strcmp(dot, ".png") != 0) continue;
+        theme_cache[theme_cache_count] = strndup(de->d_name, dot - de->d_name);
+        if (theme_cache[theme_cache_count] != NULL) {
+            ++theme_cache_count;
+        }
+    }
+    closedir(d);
+}
+
+static int theme_has_resource(const char* name, const char* themename) {
+    if (strcmp(theme_cache_theme, themename) != 0) {
+        build_theme_cache(themename);
+    }
+    int i;
+    for (i = 0; i < theme_cache_count; ++i) {
+        if (strcmp(theme_cache[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
 static int open_theme_png(const char* name, const char* themename, png_structp* png_ptr, png_infop* info_ptr,
         png_uint_32* width, png_uint_32* height, png_byte* channels) {
     char resPath[256] = {0};
@@ -154,6 +291,9 @@ static int open_theme_png(const char* name, const char* themename, png_structp*
     int result = 0;
 
     if(*name != '/') {
+        if (!theme_has_resource(name, themename)) {
+            return -1;      // same result as a failed open, minus the syscall
+        }
         snprintf(resPath, sizeof(resPath), "/cache/cot/themes/%s/%s.png", themename, name);
     }else{
         strlcpy(resPath,name,sizeof(resPath));
@@ -324,6 +464,20 @@ int res_create_display_surface(const char* name, gr_surface* pSurface) {
 
     *pSurface = NULL;
 
+    int raw_frames;
+    gr_surface* raw;
+    if (load_raw_resource(name, &raw_frames, &raw) == 0) {
+        if (raw_frames == 1) {
+            *pSurface = raw[0];
+            free(raw);
+            return 0;
+        }
+        // Wrong shape for a still image; fall back to the PNG.
+        int i;
+        for (i = 0; i < raw_frames; ++i) free(raw[i]);
+        free(raw);
+    }
+
     result = open_png(name, &png_ptr, &info_ptr, &width, &height, &channels);
     if (result < 0) return result;
 
@@ -396,6 +550,10 @@ int res_create_multi_display_surface(const char* name, int* frames, gr_surface**
     *pSurface = NULL;
     *frames = -1;
 
+    if (load_raw_resource(name, frames, pSurface) == 0) {
+        return 0;
+    }
+
     result = open_png(name, &png_ptr, &info_ptr, &width, &height, &channels);
     if (result < 0) return result;
 
@@ -783,5 +941,8 @@ int res_create_theme_localized_alpha_surface(const char* name,
 }
 
 void res_free_surface(gr_surface surface) {
+    // PNG-decoded surfaces carry their pixels in the same allocation;
+    // raw-resource surfaces point into a file mapping that stays
+    // mapped, so freeing the header is right in both cases.
     free(surface);
 }
@@ -1,14 +1,21 @@
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
+# trace.c and allocstats.c live here (rather than in the recovery
+# binary) so that everything linking libminzip — recovery, updater,
+# verifier_test — gets the recorders without extra wiring.
 LOCAL_SRC_FILES := \
 	Hash.c \
 	SysUtil.c \
 	DirUtil.c \
 	Inlines.c \
-	Zip.c
+	Crc32.c \
+	Zip.c \
+	../allocstats.c \
+	../trace.c
 
 LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/.. \
 	external/zlib \
 	external/safe-iop/include
 
@@ -19,3 +26,22 @@ LOCAL_MODULE := libminzip
 LOCAL_CFLAGS += -Wall
 
 include $(BUILD_STATIC_LIBRARY)
+
+# On-device extraction benchmark; see Benchmark.c for usage.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := minzip_bench
+LOCAL_MODULE_TAGS := eng
+
+LOCAL_SRC_FILES := Benchmark.c
+
+LOCAL_C_INCLUDES := \
+	external/zlib \
+	external/safe-iop/include
+
+LOCAL_STATIC_LIBRARIES := libminzip libz libselinux
+LOCAL_SHARED_LIBRARIES := libcutils liblog
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * CRC-32 with an optional hardware-accelerated path.
+ *
+ * The ARMv8 CRC32B/CRC32X instructions implement the same reflected
+ * polynomial (0x04C11DB7) as zlib's crc32(), so the two paths are
+ * interchangeable; we pick at runtime based on the CPU's hwcaps.
+ */
+#include "zlib.h"
+
+#include <stdbool.h>
+#include <stdint.h>     // for uintptr_t
+
+#include "Crc32.h"
+
+#if defined(__aarch64__)
+
+#include <sys/auxv.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+/* The assembler needs the crc extension enabled for these mnemonics;
+ * do it inside the template so the rest of the file can be built for
+ * plain armv8-a.
+ */
+static inline unsigned int hwCrc32d(unsigned int crc, unsigned long long data)
+{
+    __asm__(".arch_extension crc\n"
+            "crc32x %w0, %w1, %2"
+            : "=r" (crc) : "r" (crc), "r" (data));
+    return crc;
+}
+
+static inline unsigned int hwCrc32b(unsigned int crc, unsigned char data)
+{
+    __asm__(".arch_extension crc\n"
+            "crc32b %w0, %w1, %w2"
+            : "=r" (crc) : "r" (crc), "r" (data));
+    return crc;
+}
+
+static bool haveHwCrc32(void)
+{
+    static int cached = -1;
+    if (cached < 0) {
+        cached = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+    }
+    return cached != 0;
+}
+
+static unsigned long armv8Crc32(unsigned long crc, const unsigned char *buf,
+        size_t len)
+{
+    unsigned int c = (unsigned int)crc ^ 0xffffffffu;
+
+    /* Align to 8 bytes, then go a doubleword at a time. */
+    while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+        c = hwCrc32b(c, *buf++);
+        len--;
+    }
+    while (len >= 8) {
+        c = hwCrc32d(c, *(const unsigned long long *)buf);
+        buf += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = hwCrc32b(c, *buf++);
+        len--;
+    }
+
+    return c ^ 0xffffffffu;
+}
+
+#endif /* __aarch64__ */
+
+unsigned long mzCrc32(unsigned long crc, const unsigned char *buf, size_t len)
+{
+    if (buf == NULL) {
+        return 0;
+    }
+#if defined(__aarch64__)
+    if (haveHwCrc32()) {
+        return armv8Crc32(crc, buf, len);
+    }
+#endif
+    return crc32(crc, buf, len);
+}
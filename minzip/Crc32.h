@@ -0,0 +1,28 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * CRC-32 with an optional hardware-accelerated path.
+ */
+#ifndef _MINZIP_CRC32
+#define _MINZIP_CRC32
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Update a running CRC-32 (same polynomial and conventions as zlib's
+ * crc32()).  Uses the ARMv8 CRC32 instructions when the CPU advertises
+ * them, and falls back to zlib otherwise.
+ *
+ * Pass 0 as the initial crc.
+ */
+unsigned long mzCrc32(unsigned long crc, const unsigned char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_MINZIP_CRC32*/
@@ -17,8 +17,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
@@ -28,6 +30,81 @@
 
 typedef enum { DMISSING, DDIR, DILLEGAL } DirStatus;
 
+/* Cache of paths recently confirmed to be directories.  Bulk extraction
+ * calls dirCreateHierarchy once per archive entry, and siblings share
+ * almost all of their path components; remembering the components we've
+ * already stat()ed or mkdir()ed turns those repeat walks into string
+ * compares.  Flushed whenever we delete directories.
+ */
+#define DIR_CACHE_SIZE 16
+
+static struct {
+    pthread_mutex_t lock;
+    char paths[DIR_CACHE_SIZE][PATH_MAX];
+    int next;               // round-robin eviction cursor
+} gDirCache = { PTHREAD_MUTEX_INITIALIZER, {{0}}, 0 };
+
+/* Length of "path" ignoring any trailing slashes, so "a/b" and "a/b/"
+ * land on the same cache entry.
+ */
+static size_t
+dirCacheKeyLen(const char *path)
+{
+    size_t len = strlen(path);
+    while (len > 1 && path[len-1] == '/') {
+        len--;
+    }
+    return len;
+}
+
+static bool
+dirCacheContains(const char *path)
+{
+    size_t len = dirCacheKeyLen(path);
+    int i;
+    bool found = false;
+
+    pthread_mutex_lock(&gDirCache.lock);
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (gDirCache.paths[i][0] != '\0' &&
+                strncmp(gDirCache.paths[i], path, len) == 0 &&
+                gDirCache.paths[i][len] == '\0') {
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gDirCache.lock);
+    return found;
+}
+
+static void
+dirCacheAdd(const char *path)
+{
+    size_t len = dirCacheKeyLen(path);
+
+    if (len >= PATH_MAX) {
+        return;
+    }
+    pthread_mutex_lock(&gDirCache.lock);
+    memcpy(gDirCache.paths[gDirCache.next], path, len);
+    gDirCache.paths[gDirCache.next][len] = '\0';
+    gDirCache.next = (gDirCache.next + 1) % DIR_CACHE_SIZE;
+    pthread_mutex_unlock(&gDirCache.lock);
+}
+
+static void
+dirCacheFlush(void)
+{
+    int i;
+
+    pthread_mutex_lock(&gDirCache.lock);
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        gDirCache.paths[i][0] = '\0';
+    }
+    gDirCache.next = 0;
+    pthread_mutex_unlock(&gDirCache.lock);
+}
+
 static DirStatus
 getPathDirStatus(const char *path)
 {
@@ -100,12 +177,19 @@ dirCreateHierarchy(const char *path, int mode,
         cpath[pathLen + 1] = '\0';
     }
 
-    /* See if it already exists.
+    /* See if it already exists; check the cache before hitting disk.
      */
+    if (dirCacheContains(cpath)) {
+        free(cpath);
+        return 0;
+    }
     ds = getPathDirStatus(cpath);
     if (ds == DDIR) {
+        dirCacheAdd(cpath);
+        free(cpath);
         return 0;
     } else if (ds == DILLEGAL) {
+        free(cpath);
         return -1;
     }
 
@@ -133,8 +217,12 @@ dirCreateHierarchy(const char *path, int mode,
         *p = '\0';
 
         /* Check this part of the path and make a new directory
-         * if necessary.
+         * if necessary.  Components we've seen recently skip the stat.
          */
+        if (dirCacheContains(cpath)) {
+            *p = '/';
+            continue;
+        }
         ds = getPathDirStatus(cpath);
         if (ds == DILLEGAL) {
             /* Could happen if some other process/thread is
@@ -169,7 +257,8 @@ dirCreateHierarchy(const char *path, int mode,
             }
         }
         // else, this directory already exists.
-        
+        dirCacheAdd(cpath);
+
         /* Repair the path and continue.
          */
         *p = '/';
@@ -179,13 +268,162 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
+/* Parallel delete engine behind dirUnlinkHierarchy.  Tree deletion is
+ * almost pure metadata latency, so a few threads servicing a shared
+ * queue of directories overlap those waits.  Each worker scans one
+ * directory at a time, unlinking files through the directory fd with
+ * unlinkat and queueing subdirectories for whichever thread is free.
+ * A directory can only be rmdir'd once all of its subdirectories are
+ * gone, so every node counts its live children and the last child
+ * removed walks the chain of finished ancestors upward.
+ */
+#define DEL_THREADS 4
+
+struct del_dir {
+    char *path;
+    struct del_dir *parent;
+    int pending;            // live subdirectories not yet removed
+    int scanned;            // all entries processed
+    struct del_dir *next;   // queue link
+};
+
+struct del_engine {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct del_dir *queue_head;
+    struct del_dir *queue_tail;
+    int live;               // nodes allocated and not yet removed
+    int failed;
+};
+
+/* Remove a fully-emptied directory, then any ancestors that this
+ * removal leaves both scanned and childless.
+ */
+static void
+delComplete(struct del_engine *e, struct del_dir *node)
+{
+    while (node != NULL) {
+        if (rmdir(node->path) < 0) {
+            e->failed = 1;
+        }
+        struct del_dir *parent = node->parent;
+        free(node->path);
+        free(node);
+
+        pthread_mutex_lock(&e->lock);
+        e->live--;
+        if (e->live == 0) {
+            pthread_cond_broadcast(&e->cond);
+        }
+        int parent_done = parent != NULL &&
+                --parent->pending == 0 && parent->scanned;
+        pthread_mutex_unlock(&e->lock);
+
+        node = parent_done ? parent : NULL;
+    }
+}
+
+static void
+delScan(struct del_engine *e, struct del_dir *node)
+{
+    DIR *dir = opendir(node->path);
+    if (dir == NULL) {
+        e->failed = 1;
+    } else {
+        int dfd = dirfd(dir);
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL) {
+            if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+                continue;
+            }
+            struct stat st;
+            if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                e->failed = 1;
+                continue;
+            }
+            if (!S_ISDIR(st.st_mode)) {
+                if (unlinkat(dfd, de->d_name, 0) < 0) {
+                    e->failed = 1;
+                }
+                continue;
+            }
+
+            struct del_dir *child = malloc(sizeof(*child));
+            char dn[PATH_MAX];
+            snprintf(dn, sizeof(dn), "%s/%s", node->path, de->d_name);
+            if (child == NULL || (child->path = strdup(dn)) == NULL) {
+                free(child);
+                e->failed = 1;
+                continue;
+            }
+            child->parent = node;
+            child->pending = 0;
+            child->scanned = 0;
+            child->next = NULL;
+
+            pthread_mutex_lock(&e->lock);
+            node->pending++;
+            e->live++;
+            if (e->queue_tail != NULL) {
+                e->queue_tail->next = child;
+            } else {
+                e->queue_head = child;
+            }
+            e->queue_tail = child;
+            pthread_cond_signal(&e->cond);
+            pthread_mutex_unlock(&e->lock);
+        }
+        closedir(dir);
+    }
+
+    pthread_mutex_lock(&e->lock);
+    node->scanned = 1;
+    int done = (node->pending == 0);
+    pthread_mutex_unlock(&e->lock);
+
+    if (done) {
+        delComplete(e, node);
+    }
+}
+
+static void *
+delWorker(void *arg)
+{
+    struct del_engine *e = (struct del_engine *)arg;
+
+    pthread_mutex_lock(&e->lock);
+    for (;;) {
+        struct del_dir *node = e->queue_head;
+        if (node == NULL) {
+            if (e->live == 0) {
+                break;
+            }
+            pthread_cond_wait(&e->cond, &e->lock);
+            continue;
+        }
+        e->queue_head = node->next;
+        if (e->queue_head == NULL) {
+            e->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&e->lock);
+
+        delScan(e, node);
+
+        pthread_mutex_lock(&e->lock);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
 int
 dirUnlinkHierarchy(const char *path)
 {
     struct stat st;
-    DIR *dir;
-    struct dirent *de;
-    int fail = 0;
+
+    /* We're about to remove directories; don't let the create-path
+     * cache claim they still exist.
+     */
+    dirCacheFlush();
 
     /* is it a file or directory? */
     if (lstat(path, &st) < 0) {
@@ -197,40 +435,40 @@ dirUnlinkHierarchy(const char *path)
         return unlink(path);
     }
 
-    /* a directory, so open handle */
-    dir = opendir(path);
-    if (dir == NULL) {
+    struct del_engine e;
+    memset(&e, 0, sizeof(e));
+    pthread_mutex_init(&e.lock, NULL);
+    pthread_cond_init(&e.cond, NULL);
+
+    struct del_dir *root = malloc(sizeof(*root));
+    if (root == NULL || (root->path = strdup(path)) == NULL) {
+        free(root);
         return -1;
     }
+    root->parent = NULL;
+    root->pending = 0;
+    root->scanned = 0;
+    root->next = NULL;
+    e.queue_head = e.queue_tail = root;
+    e.live = 1;
 
-    /* recurse over components */
-    errno = 0;
-    while ((de = readdir(dir)) != NULL) {
-//TODO: don't blow the stack
-        char dn[PATH_MAX];
-        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-            continue;
-        }
-        snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-        if (dirUnlinkHierarchy(dn) < 0) {
-            fail = 1;
-            break;
+    /* the calling thread works too, so this degrades to a serial
+     * delete if thread creation fails */
+    pthread_t threads[DEL_THREADS - 1];
+    int nthreads = 0;
+    int i;
+    for (i = 0; i < DEL_THREADS - 1; i++) {
+        if (pthread_create(&threads[nthreads], NULL, delWorker, &e) == 0) {
+            nthreads++;
         }
-        errno = 0;
     }
-    /* in case readdir or unlink_recursive failed */
-    if (fail || errno < 0) {
-        int save = errno;
-        closedir(dir);
-        errno = save;
-        return -1;
+    delWorker(&e);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
     }
 
-    /* close directory handle */
-    if (closedir(dir) < 0) {
-        return -1;
-    }
+    pthread_mutex_destroy(&e.lock);
+    pthread_cond_destroy(&e.cond);
 
-    /* delete target directory */
-    return rmdir(path);
+    return e.failed ? -1 : 0;
 }
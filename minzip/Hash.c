@@ -62,7 +62,7 @@ HashTable* mzHashTableCreate(size_t initialSize, HashFreeFunc freeFunc)
     pHashTable->numEntries = pHashTable->numDeadEntries = 0;
     pHashTable->freeFunc = freeFunc;
     pHashTable->pEntries =
-        (HashEntry*) calloc((size_t)pHashTable->tableSize, sizeof(HashTable));
+        (HashEntry*) calloc((size_t)pHashTable->tableSize, sizeof(HashEntry));
     if (pHashTable->pEntries == NULL) {
         free(pHashTable);
         return NULL;
@@ -142,7 +142,7 @@ static bool resizeHash(HashTable* pHashTable, int newSize)
     assert(countTombStones(pHashTable) == pHashTable->numDeadEntries);
     //LOGI("before: dead=%d\n", pHashTable->numDeadEntries);
 
-    pNewEntries = (HashEntry*) calloc(newSize, sizeof(HashTable));
+    pNewEntries = (HashEntry*) calloc(newSize, sizeof(HashEntry));
     if (pNewEntries == NULL)
         return false;
 
@@ -48,6 +48,13 @@ static int getFileStartAndLength(int fd, off_t *start_, size_t *length_)
     return 0;
 }
 
+/* Mappings at or below this size are paged in eagerly with
+ * MAP_POPULATE; anything bigger just gets an asynchronous readahead
+ * hint so we don't stall (or swamp memory) populating a whole OTA zip
+ * up front.
+ */
+#define POPULATE_LIMIT (32 * 1024 * 1024)
+
 /*
  * Map a file (from fd's current offset) into a private, read-only memory
  * segment.  The file offset must be a multiple of the page size.
@@ -60,19 +67,38 @@ static int sysMapFD(int fd, MemMapping* pMap)
     off_t start;
     size_t length;
     void* memPtr;
+    int flags = MAP_PRIVATE;
 
     assert(pMap != NULL);
 
     if (getFileStartAndLength(fd, &start, &length) < 0)
         return -1;
 
-    memPtr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, start);
+    /* Tell the kernel we'll be walking the file mostly front to back,
+     * so it can double the readahead window.
+     */
+    (void) posix_fadvise(fd, start, length, POSIX_FADV_SEQUENTIAL);
+
+#ifdef MAP_POPULATE
+    if (length <= POPULATE_LIMIT) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+
+    memPtr = mmap(NULL, length, PROT_READ, flags, fd, start);
     if (memPtr == MAP_FAILED) {
         LOGW("mmap(%d, R, PRIVATE, %d, %d) failed: %s\n", (int) length,
             fd, (int) start, strerror(errno));
         return -1;
     }
 
+    if (length > POPULATE_LIMIT) {
+        /* Kick off readahead for the tail pages we didn't populate;
+         * purely advisory, so ignore failures.
+         */
+        (void) madvise(memPtr, length, MADV_WILLNEED);
+    }
+
     pMap->addr = memPtr;
     pMap->length = length;
     pMap->range_count = 1;
@@ -147,6 +173,9 @@ static int sysMapBlockFile(FILE* mapf, MemMapping* pMap)
         pMap->ranges[i].addr = addr;
         pMap->ranges[i].length = (end-start)*blksize;
 
+        /* Advisory readahead; the ranges will be read roughly in order. */
+        (void) madvise(addr, pMap->ranges[i].length, MADV_WILLNEED);
+
         next += pMap->ranges[i].length;
     }
 
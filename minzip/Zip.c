@@ -3,12 +3,18 @@
  *
  * Simple Zip file support.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for vmsplice/splice
+#endif
+
 #include "safe_iop.h"
 #include "zlib.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
@@ -17,8 +23,11 @@
 #define LOG_TAG "minzip"
 #include "Zip.h"
 #include "Bits.h"
+#include "Crc32.h"
 #include "Log.h"
 #include "DirUtil.h"
+#include "allocstats.h"
+#include "trace.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
@@ -84,6 +93,112 @@ enum {
 };
 
 
+/*
+ * Scratch-buffer arena shared by all inflate calls against one archive.
+ *
+ * processDeflatedEntry needs a sizeable output buffer per call; rather
+ * than putting it on the stack (and being limited to small chunks) or
+ * hitting malloc for every entry, each archive keeps a freelist of
+ * buffers that concurrent extraction workers check out and return.
+ */
+#define MZ_SCRATCH_BUF_SIZE (256 * 1024)
+#define MZ_SCRATCH_MAX_BUFS 8
+
+/* Maximum number of worker threads (extraction, CRC verification);
+ * bounded by the online CPU count.
+ */
+#define MZ_EXTRACT_MAX_THREADS 4
+
+/* Caller-requested worker count; 0 means size the pool from the online
+ * CPU count.  See mzSetExtractThreadCount().
+ */
+static int gExtractThreadCount = 0;
+
+void mzSetExtractThreadCount(int numThreads)
+{
+    if (numThreads < 0) {
+        numThreads = 0;
+    } else if (numThreads > MZ_EXTRACT_MAX_THREADS) {
+        numThreads = MZ_EXTRACT_MAX_THREADS;
+    }
+    gExtractThreadCount = numThreads;
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned char* bufs[MZ_SCRATCH_MAX_BUFS];
+    int count;                  // buffers currently in the freelist
+} ScratchArena;
+
+/* A buffer counts as live from its malloc until its free; parking it
+ * in the freelist doesn't release it, so the counter reflects what the
+ * arena actually holds.
+ */
+static AllocCounter gScratchAlloc = { "minzip.scratch", 0, 0, 0, 0, NULL };
+static AllocCounter gEntryAlloc = { "minzip.entries", 0, 0, 0, 0, NULL };
+
+static unsigned char* acquireScratchBuf(const ZipArchive* pArchive)
+{
+    ScratchArena* arena = (ScratchArena*)pArchive->scratch;
+    unsigned char* buf = NULL;
+
+    if (arena != NULL) {
+        pthread_mutex_lock(&arena->lock);
+        if (arena->count > 0) {
+            buf = arena->bufs[--arena->count];
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    if (buf == NULL) {
+        buf = (unsigned char*)malloc(MZ_SCRATCH_BUF_SIZE);
+        if (buf != NULL) {
+            alloc_counter_add(&gScratchAlloc, MZ_SCRATCH_BUF_SIZE);
+        }
+    }
+    return buf;
+}
+
+static void releaseScratchBuf(const ZipArchive* pArchive, unsigned char* buf)
+{
+    ScratchArena* arena = (ScratchArena*)pArchive->scratch;
+
+    if (arena != NULL) {
+        pthread_mutex_lock(&arena->lock);
+        if (arena->count < MZ_SCRATCH_MAX_BUFS) {
+            arena->bufs[arena->count++] = buf;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    if (buf != NULL) {
+        alloc_counter_sub(&gScratchAlloc, MZ_SCRATCH_BUF_SIZE);
+        free(buf);      // freelist full, or archive has no arena
+    }
+}
+
+static ScratchArena* createScratchArena(void)
+{
+    ScratchArena* arena = (ScratchArena*)calloc(1, sizeof(ScratchArena));
+    if (arena != NULL) {
+        pthread_mutex_init(&arena->lock, NULL);
+    }
+    return arena;
+}
+
+static void freeScratchArena(ScratchArena* arena)
+{
+    int i;
+
+    if (arena == NULL)
+        return;
+    for (i = 0; i < arena->count; i++) {
+        alloc_counter_sub(&gScratchAlloc, MZ_SCRATCH_BUF_SIZE);
+        free(arena->bufs[i]);
+    }
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
 /*
  * For debugging, dump the contents of a ZipEntry.
  */
@@ -242,14 +357,16 @@ static bool parseZipArchive(ZipArchive* pArchive)
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
     pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL || pArchive->pHash == NULL) {
+        alloc_stats_dump();
         goto bail;
+    }
+    alloc_counter_add(&gEntryAlloc, numEntries * sizeof(ZipEntry));
 
     ptr = pArchive->addr + cdOffset;
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
         unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
         const char *fileName;
 
         if (ptr + CENHDR > (const unsigned char*)pArchive->addr + pArchive->length) {
@@ -352,32 +469,18 @@ static bool parseZipArchive(ZipArchive* pArchive)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pArchive->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pArchive->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pArchive->addr + pArchive->length) {
+        /* Only bounds-check the local header offset here.  Actually
+         * reading the local header would fault in pages scattered
+         * across the whole archive, which for a multi-thousand-entry
+         * OTA zip dominates open time; defer it until the entry is
+         * first looked up (see materializeZipEntry).
+         */
+        if ((uintptr_t)localHdrOffset + LOCHDR > pArchive->length) {
             LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
             goto bail;
         }
-        if (get4LE(localHdr) != LOCSIG) {
-            LOGW("Missed a local header sig (at %d)\n", i);
-            goto bail;
-        }
-        pEntry->offset = localHdrOffset + LOCHDR
-            + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pArchive->length) {
-            LOGW("Data ran off the end (at %d)\n", i);
-            goto bail;
-        }
+        pEntry->localHdrOffset = localHdrOffset;
+        pEntry->offset = -1;
 
 #if !SORT_ENTRIES
         /* Add to hash table; no need to lock here.
@@ -439,6 +542,7 @@ int mzOpenZipArchive(unsigned char* addr, size_t length, ZipArchive* pArchive)
 
     pArchive->addr = addr;
     pArchive->length = length;
+    pArchive->scratch = createScratchArena();    // NULL is tolerated
 
     if (!parseZipArchive(pArchive)) {
         err = -1;
@@ -463,26 +567,83 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 {
     LOGV("Closing archive %p\n", pArchive);
 
+    if (pArchive->pEntries != NULL) {
+        alloc_counter_sub(&gEntryAlloc,
+                pArchive->numEntries * sizeof(ZipEntry));
+    }
     free(pArchive->pEntries);
 
     mzHashTableFree(pArchive->pHash);
 
+    freeScratchArena((ScratchArena*)pArchive->scratch);
+
     pArchive->pHash = NULL;
     pArchive->pEntries = NULL;
+    pArchive->scratch = NULL;
+}
+
+/*
+ * Finish the lazy half of central-directory parsing for one entry:
+ * read its local header and compute the file data offset.  The central
+ * directory fields were parsed at open time; this touches the archive
+ * page holding the local header, so it's deferred until the entry is
+ * actually used.
+ *
+ * Idempotent; returns false if the local header is corrupt.
+ */
+static bool materializeZipEntry(const ZipArchive* pArchive, ZipEntry* pEntry)
+{
+    const unsigned char* localHdr;
+
+    if (pEntry->offset >= 0) {
+        return true;
+    }
+
+    // Perform pArchive->addr + localHdrOffset, ensuring that it won't
+    // overflow. This is needed because localHdrOffset is untrusted.
+    if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pArchive->addr,
+        (uintptr_t)pEntry->localHdrOffset)) {
+        LOGW("Integer overflow adding in materializeZipEntry\n");
+        return false;
+    }
+    if (get4LE(localHdr) != LOCSIG) {
+        LOGW("Missed a local header sig for '%.*s'\n",
+                pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    long offset = pEntry->localHdrOffset + LOCHDR
+        + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
+    if (!safe_add(NULL, offset, pEntry->compLen)) {
+        LOGW("Integer overflow adding in materializeZipEntry\n");
+        return false;
+    }
+    if ((size_t)offset + pEntry->compLen > pArchive->length) {
+        LOGW("Data ran off the end for '%.*s'\n",
+                pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+
+    pEntry->offset = offset;
+    return true;
 }
 
 /*
  * Find a matching entry.
  *
- * Returns NULL if no matching entry found.
+ * Returns NULL if no matching entry found, or if the entry's local
+ * header turns out to be corrupt.
  */
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
     unsigned int itemHash = computeHash(entryName, strlen(entryName));
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
+    ZipEntry* pEntry = (ZipEntry*)mzHashTableLookup(pArchive->pHash,
                 itemHash, (char*) entryName, hashcmpZipName, false);
+    if (pEntry != NULL && !materializeZipEntry(pArchive, pEntry)) {
+        return NULL;
+    }
+    return pEntry;
 }
 
 /*
@@ -510,13 +671,15 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     void *cookie)
 {
     long result = -1;
-    unsigned char readBuf[32 * 1024];
-    unsigned char procBuf[32 * 1024];
+    unsigned char* procBuf;
     z_stream zstream;
     int zerr;
-    long compRemaining;
 
-    compRemaining = pEntry->compLen;
+    procBuf = acquireScratchBuf(pArchive);
+    if (procBuf == NULL) {
+        LOGE("Can't allocate inflate scratch buffer\n");
+        return false;
+    }
 
     /*
      * Initialize the zlib stream.
@@ -528,7 +691,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     zstream.next_in = pArchive->addr + pEntry->offset;
     zstream.avail_in = pEntry->compLen;
     zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
+    zstream.avail_out = MZ_SCRATCH_BUF_SIZE;
     zstream.data_type = Z_UNKNOWN;
 
     /*
@@ -559,7 +722,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
 
         /* write when we're full or when we're done */
         if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
+            (zerr == Z_STREAM_END && zstream.avail_out != MZ_SCRATCH_BUF_SIZE))
         {
             long procSize = zstream.next_out - procBuf;
             LOGVV("+++ processing %d bytes\n", (int) procSize);
@@ -570,7 +733,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
             }
 
             zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
+            zstream.avail_out = MZ_SCRATCH_BUF_SIZE;
         }
     } while (zerr == Z_OK);
 
@@ -583,6 +746,7 @@ z_bail:
     inflateEnd(&zstream);        /* free up any allocated structures */
 
 bail:
+    releaseScratchBuf(pArchive, procBuf);
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
             LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
@@ -607,7 +771,10 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
+
+    if (!materializeZipEntry(pArchive, (ZipEntry*)pEntry)) {
+        return false;
+    }
 
     switch (pEntry->compression) {
     case STORED:
@@ -628,7 +795,7 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
 static bool crcProcessFunction(const unsigned char *data, int dataLen,
         void *crc)
 {
-    *(unsigned long *)crc = crc32(*(unsigned long *)crc, data, dataLen);
+    *(unsigned long *)crc = mzCrc32(*(unsigned long *)crc, data, dataLen);
     return true;
 }
 
@@ -641,7 +808,7 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
     unsigned long crc;
     bool ret;
 
-    crc = crc32(0L, Z_NULL, 0);
+    crc = mzCrc32(0L, Z_NULL, 0);
     ret = mzProcessZipEntryContents(pArchive, pEntry, crcProcessFunction,
             (void *)&crc);
     if (!ret) {
@@ -656,6 +823,88 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
     return true;
 }
 
+/* Shared state for mzVerifyArchiveCrcs workers. */
+typedef struct {
+    const ZipArchive *pArchive;
+    unsigned int nextEntry;     // protected by lock
+    bool ok;                    // protected by lock
+    pthread_mutex_t lock;
+} CrcVerifyState;
+
+static void *crcVerifyWorker(void *arg)
+{
+    CrcVerifyState *state = (CrcVerifyState *)arg;
+
+    while (true) {
+        pthread_mutex_lock(&state->lock);
+        if (!state->ok || state->nextEntry >= state->pArchive->numEntries) {
+            pthread_mutex_unlock(&state->lock);
+            break;
+        }
+        const ZipEntry *pEntry =
+                &state->pArchive->pEntries[state->nextEntry++];
+        pthread_mutex_unlock(&state->lock);
+
+        /* Directory entries have no data to check. */
+        if (pEntry->uncompLen == 0) {
+            continue;
+        }
+
+        if (!mzIsZipEntryIntact(state->pArchive, pEntry)) {
+            LOGE("CRC mismatch on entry '%.*s'\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+            pthread_mutex_lock(&state->lock);
+            state->ok = false;
+            pthread_mutex_unlock(&state->lock);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * CRC-check every entry, in parallel.  See Zip.h.
+ */
+bool mzVerifyArchiveCrcs(const ZipArchive *pArchive)
+{
+    pthread_t threads[MZ_EXTRACT_MAX_THREADS];
+    int threadCount = 0;
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wantThreads = MZ_EXTRACT_MAX_THREADS;
+    int i;
+
+    CrcVerifyState state;
+    state.pArchive = pArchive;
+    state.nextEntry = 0;
+    state.ok = true;
+    pthread_mutex_init(&state.lock, NULL);
+
+    if (numCpus > 0 && numCpus < wantThreads) {
+        wantThreads = numCpus;
+    }
+    if (gExtractThreadCount > 0) {
+        wantThreads = gExtractThreadCount;
+    }
+    for (i = 1; i < wantThreads; i++) {
+        if (pthread_create(&threads[threadCount], NULL, crcVerifyWorker,
+                &state) != 0) {
+            LOGW("Can't create CRC worker: %s\n", strerror(errno));
+            break;
+        }
+        threadCount++;
+    }
+
+    crcVerifyWorker(&state);
+
+    for (i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&state.lock);
+    return state.ok;
+}
+
 typedef struct {
     char *buf;
     int bufLen;
@@ -722,12 +971,98 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
     }
 }
 
+/*
+ * Write a STORED entry to "fd" without copying it through a heap buffer.
+ *
+ * The archive is already mapped, so we gift the mapped pages to a pipe
+ * with vmsplice() and splice() them to the output fd; the data never
+ * round-trips through userspace.  Returns false if the kernel refuses
+ * (e.g. the fd doesn't support splice), in which case the caller should
+ * fall back to the ordinary write path.
+ */
+static bool spliceStoredEntryToFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    int pipefd[2];
+    size_t remaining = pEntry->uncompLen;
+    unsigned char *addr = pArchive->addr + pEntry->offset;
+
+    if (remaining == 0) {
+        return true;
+    }
+
+    if (pipe(pipefd) != 0) {
+        LOGW("Can't create pipe for splice: %s\n", strerror(errno));
+        return false;
+    }
+
+    bool ok = true;
+    while (remaining > 0) {
+        struct iovec iov;
+        iov.iov_base = addr;
+        iov.iov_len = remaining;
+
+        ssize_t spliced = vmsplice(pipefd[1], &iov, 1, 0);
+        if (spliced <= 0) {
+            if (errno == EINTR) continue;
+            LOGV("vmsplice failed: %s\n", strerror(errno));
+            if (remaining != (size_t)pEntry->uncompLen) {
+                /* Part of the entry is already on disk; finish with
+                 * plain writes rather than letting the caller restart.
+                 */
+                ok = writeProcessFunction(addr, remaining,
+                        (void*)(intptr_t)fd);
+            } else {
+                ok = false;
+            }
+            break;
+        }
+
+        ssize_t pending = spliced;
+        while (pending > 0) {
+            ssize_t written = splice(pipefd[0], NULL, fd, NULL, pending,
+                    SPLICE_F_MOVE);
+            if (written <= 0) {
+                if (errno == EINTR) continue;
+                LOGV("splice failed: %s\n", strerror(errno));
+                /* Everything up to (addr + spliced - pending) made it to
+                 * the fd; finish the rest with plain writes.
+                 */
+                ok = writeProcessFunction(addr + (spliced - pending),
+                        remaining - (spliced - pending),
+                        (void*)(intptr_t)fd);
+                break;
+            }
+            pending -= written;
+        }
+        if (pending > 0 || !ok) break;
+
+        addr += spliced;
+        remaining -= spliced;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return ok;
+}
+
 /*
  * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
+ *
+ * STORED entries take a zero-copy path straight from the archive
+ * mapping; everything else streams through the process function.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
+    if (pEntry->compression == STORED &&
+            materializeZipEntry(pArchive, (ZipEntry*)pEntry)) {
+        if (spliceStoredEntryToFile(pArchive, pEntry, fd)) {
+            return true;
+        }
+        /* Fall through to the copying path. */
+    }
+
     bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
                                          (void*)(intptr_t)fd);
     if (!ret) {
@@ -749,6 +1084,10 @@ bool mzGetStoredEntry(const ZipArchive *pArchive,
         return false;
     }
 
+    if (!materializeZipEntry(pArchive, (ZipEntry*)pEntry)) {
+        return false;
+    }
+
     *addr = pArchive->addr + pEntry->offset;
     *length = pEntry->uncompLen;
     return true;
@@ -791,6 +1130,176 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
 }
 
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/* A single regular-file entry queued for extraction by the worker pool.
+ */
+typedef struct {
+    ZipEntry *pEntry;
+    char *targetFile;           // malloc'd copy; freed by the pool
+} MzExtractJob;
+
+/* Shared state for the extraction worker pool.  Workers pull the next
+ * job index under "lock"; the first failure aborts the remaining work.
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    MzExtractJob *jobs;
+    int jobCount;
+    int nextJob;                // protected by lock
+    bool ok;                    // protected by lock
+    const struct utimbuf *timestamp;
+    void (*callback)(const char *fn, void *);
+    void *cookie;
+    struct selabel_handle *sehnd;
+    pthread_mutex_t lock;
+} MzExtractPool;
+
+/* Extract one regular file entry to its target path.  Used both by the
+ * worker pool and by the single-threaded fallback.
+ */
+static bool extractEntryToPath(const ZipArchive *pArchive, ZipEntry *pEntry,
+        const char *targetFile, const struct utimbuf *timestamp,
+        struct selabel_handle *sehnd)
+{
+    char *secontext = NULL;
+
+    if (sehnd) {
+        selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
+        setfscreatecon(secontext);
+    }
+
+    /* No O_SYNC here: the caller issues one sync() for the whole batch
+     * once every entry has been written, which lets the filesystem
+     * commit the journal once instead of per file.
+     */
+    int fd = open(targetFile, O_CREAT|O_WRONLY|O_TRUNC, UNZIP_FILEMODE);
+
+    if (secontext) {
+        freecon(secontext);
+        setfscreatecon(NULL);
+    }
+
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    /* Preallocate so the filesystem can hand us contiguous extents and
+     * we find out about ENOSPC before writing.  Advisory: not all
+     * filesystems support it.
+     */
+    if (pEntry->uncompLen > 0) {
+        if (fallocate(fd, 0, 0, pEntry->uncompLen) != 0 &&
+                errno == ENOSPC) {
+            LOGE("Can't preallocate %ld bytes for \"%s\": %s\n",
+                    pEntry->uncompLen, targetFile, strerror(errno));
+            close(fd);
+            return false;
+        }
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    if (close(fd) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGV("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/* Worker thread body: repeatedly claim the next queued entry and
+ * extract it.  Stops early if another worker has failed.
+ */
+static void *extractWorker(void *arg)
+{
+    MzExtractPool *pool = (MzExtractPool *)arg;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->ok || pool->nextJob >= pool->jobCount) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        MzExtractJob *job = &pool->jobs[pool->nextJob++];
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = extractEntryToPath(pool->pArchive, job->pEntry,
+                job->targetFile, pool->timestamp, pool->sehnd);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!ok) {
+            pool->ok = false;
+        } else if (pool->callback != NULL) {
+            /* Serialize callbacks; callers don't expect reentrancy. */
+            pool->callback(job->targetFile, pool->cookie);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+/* Run the queued extraction jobs on a pool of worker threads.  Falls
+ * back to extracting on the calling thread if thread creation fails or
+ * only one CPU is online.
+ *
+ * Returns true if every job extracted successfully.
+ */
+static bool runExtractPool(MzExtractPool *pool)
+{
+    pthread_t threads[MZ_EXTRACT_MAX_THREADS];
+    int threadCount = 0;
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wantThreads = MZ_EXTRACT_MAX_THREADS;
+    int i;
+
+    if (numCpus > 0 && numCpus < wantThreads) {
+        wantThreads = numCpus;
+    }
+    if (gExtractThreadCount > 0) {
+        wantThreads = gExtractThreadCount;
+    }
+    if (pool->jobCount < wantThreads) {
+        wantThreads = pool->jobCount;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    if (wantThreads > 1) {
+        for (i = 0; i < wantThreads; i++) {
+            if (pthread_create(&threads[i], NULL, extractWorker, pool) != 0) {
+                LOGW("Can't create extraction worker: %s\n", strerror(errno));
+                break;
+            }
+            threadCount++;
+        }
+    }
+
+    /* The calling thread works too, and covers the fallback case where
+     * no workers could be started.
+     */
+    extractWorker(pool);
+
+    for (i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    return pool->ok;
+}
+
 /* Helper state to make path translation easier and less malloc-happy.
  */
 typedef struct {
@@ -911,6 +1420,8 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     }
     zpath[zipDirLen] = '\0';
 
+    trace_begin("mzExtractRecursive");
+
     /* Set up the helper structure that we'll use to assemble paths.
      */
     MzPathHelper helper;
@@ -926,6 +1437,14 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 //TODO: since the entries are sorted, binary search for the first match
 //      and stop after the first non-match.
      */
+    /* Directories and symlinks are created inline (in entry order, so
+     * parents exist before children); regular files are queued here and
+     * handed to the worker pool once the walk is complete.
+     */
+    MzExtractJob *jobs = NULL;
+    int jobCount = 0;
+    int jobAlloc = 0;
+
     unsigned int i;
     bool seenMatch = false;
     int ok = true;
@@ -986,8 +1505,6 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
                 int ret = dirCreateHierarchy(
@@ -1056,63 +1573,72 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                         targetFile, linkTarget);
                 free(linkTarget);
             } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
+                /* The entry is a regular file.  Queue it for the
+                 * worker pool rather than extracting it here.
                  */
-
-                char *secontext = NULL;
-
-                if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                    setfscreatecon(secontext);
-                }
-
-                int fd = open(targetFile, O_CREAT|O_WRONLY|O_TRUNC|O_SYNC
-                        , UNZIP_FILEMODE);
-
-                if (secontext) {
-                    freecon(secontext);
-                    setfscreatecon(NULL);
-                }
-
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                if (ok) {
-                    ok = (fsync(fd) == 0);
+                if (jobCount == jobAlloc) {
+                    jobAlloc = (jobAlloc == 0) ? 64 : jobAlloc * 2;
+                    MzExtractJob *newJobs = (MzExtractJob *)realloc(jobs,
+                            jobAlloc * sizeof(MzExtractJob));
+                    if (newJobs == NULL) {
+                        LOGE("Can't allocate extraction job queue\n");
+                        alloc_stats_dump();
+                        ok = false;
+                        break;
+                    }
+                    jobs = newJobs;
                 }
-                if (close(fd) != 0) {
-                    ok = false;
-                }
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
+                jobs[jobCount].pEntry = pEntry;
+                jobs[jobCount].targetFile = strdup(targetFile);
+                if (jobs[jobCount].targetFile == NULL) {
                     ok = false;
                     break;
                 }
+                ++jobCount;
 
-                LOGV("Extracted file \"%s\"\n", targetFile);
-                ++extractCount;
+                /* The callback for queued files fires from the pool,
+                 * after the file has actually been written.
+                 */
+                continue;
             }
         }
 
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (ok && jobCount > 0) {
+        MzExtractPool pool;
+        pool.pArchive = pArchive;
+        pool.jobs = jobs;
+        pool.jobCount = jobCount;
+        pool.nextJob = 0;
+        pool.ok = true;
+        pool.timestamp = timestamp;
+        pool.callback = callback;
+        pool.cookie = cookie;
+        pool.sehnd = sehnd;
+
+        ok = runExtractPool(&pool);
+        if (ok) {
+            extractCount += jobCount;
+            /* One batched flush for everything the pool wrote; the
+             * per-file writes above are buffered.
+             */
+            sync();
+        }
+    }
+
+    for (i = 0; i < (unsigned int)jobCount; i++) {
+        free(jobs[i].targetFile);
+    }
+    free(jobs);
+
     LOGD("Extracted %d file(s)\n", extractCount);
 
     free(helper.buf);
     free(zpath);
 
+    trace_end();
+
     return ok;
 }
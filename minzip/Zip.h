@@ -32,7 +32,8 @@ extern "C" {
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
+    long         offset;         // -1 until the local header is parsed
+    long         localHdrOffset;
     long         compLen;
     long         uncompLen;
     int          compression;
@@ -51,6 +52,7 @@ typedef struct ZipArchive {
     HashTable*     pHash;          // maps file name to ZipEntry
     unsigned char* addr;
     size_t         length;
+    void*          scratch;        // inflate scratch arena; see Zip.c
 } ZipArchive;
 
 /*
@@ -133,6 +135,9 @@ INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
 INLINE long mzGetZipEntryCrc32(const ZipEntry* pEntry) {
     return pEntry->crc32;
 }
+INLINE bool mzIsZipEntryStored(const ZipEntry* pEntry) {
+    return pEntry->compression == 0;    // STORED
+}
 bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
 
 
@@ -169,6 +174,16 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
  */
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
+/*
+ * CRC-check every entry in the archive up front, fanning the work out
+ * across worker threads.  Returns true only if all entries are intact;
+ * the first bad entry is logged and aborts the remaining checks.
+ *
+ * Useful before a long install to fail fast on a corrupt package
+ * instead of discovering the damage partway through extraction.
+ */
+bool mzVerifyArchiveCrcs(const ZipArchive *pArchive);
+
 /*
  * Inflate and write an entry to a file.
  */
@@ -223,6 +238,16 @@ bool mzGetStoredEntry(const ZipArchive *pArchive,
  * Returns true on success, false on failure.
  */
 enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+
+/*
+ * Override the number of worker threads used for parallel extraction
+ * and CRC verification.  0 (the default) sizes the pool from the
+ * online CPU count; other values are clamped to the compiled-in
+ * maximum.  The setting is global and sticky; callers that want a
+ * one-shot override should reset it to 0 afterward.
+ */
+void mzSetExtractThreadCount(int numThreads);
+
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
@@ -0,0 +1,133 @@
+# Copyright (C) 2015 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Script to compile a textual /res/keys listing (the DumpPublicKey
+output parsed by load_keys in verifier.cpp) into the binary key store
+that loads with a single read:
+
+    mkkeystore.py input.txt output.store
+
+The output is the magic "RKS1" and a little-endian 32-bit key count,
+then for each key a 32-bit key type (0 = RSA, 1 = EC) and 32-bit hash
+length followed by the payload: the raw little-endian RSAPublicKey
+fields (len, n0inv, n[64], rr[64], exponent) for RSA keys, or the
+32-byte x and y coordinates, most-significant byte first, for EC
+keys.  (The text format lists coordinate bytes least-significant
+first, so they are reversed here.)"""
+
+import re
+import struct
+import sys
+
+RSANUMWORDS = 64
+P256_NBYTES = 32
+SHA_DIGEST_SIZE = 20
+SHA256_DIGEST_SIZE = 32
+
+if len(sys.argv) != 3:
+  print "usage: mkkeystore.py input.txt output.store"
+  sys.exit(1)
+
+text = open(sys.argv[1]).read()
+toks = re.findall(r"v\d+|0x[0-9a-fA-F]+|-?\d+|[{},]", text)
+pos = [0]
+
+def next_tok():
+  if pos[0] >= len(toks):
+    raise ValueError("unexpected end of key file")
+  tok = toks[pos[0]]
+  pos[0] += 1
+  return tok
+
+def expect(what):
+  tok = next_tok()
+  if tok != what:
+    raise ValueError("expected %r, got %r" % (what, tok))
+
+def number():
+  return int(next_tok(), 0) & 0xffffffff
+
+def numbers(count):
+  out = []
+  for i in range(count):
+    if i > 0:
+      expect(",")
+    out.append(number())
+  return out
+
+records = []
+while pos[0] < len(toks):
+  version = 1
+  tok = next_tok()
+  if tok.startswith("v"):
+    version = int(tok[1:])
+    tok = next_tok()
+  if tok != "{":
+    raise ValueError("expected '{', got %r" % tok)
+
+  if version == 5:
+    length = number()
+    if length != P256_NBYTES:
+      raise ValueError("EC key length %d != %d" % (length, P256_NBYTES))
+    expect(",")
+    expect("{")
+    x = numbers(P256_NBYTES)
+    expect("}")
+    expect(",")
+    expect("{")
+    y = numbers(P256_NBYTES)
+    expect("}")
+    expect("}")
+    payload = struct.pack("<II", 1, SHA256_DIGEST_SIZE)
+    # the text lists the bytes least-significant first; p256_from_bin
+    # takes them most-significant first, so reverse each coordinate
+    payload += struct.pack("%dB" % P256_NBYTES, *x[::-1])
+    payload += struct.pack("%dB" % P256_NBYTES, *y[::-1])
+    records.append(payload)
+  elif version in (1, 2, 3, 4):
+    exponent = 3 if version in (1, 3) else 65537
+    hash_len = SHA_DIGEST_SIZE if version in (1, 2) else SHA256_DIGEST_SIZE
+    length = number()
+    if length != RSANUMWORDS:
+      raise ValueError("RSA key length %d != %d" % (length, RSANUMWORDS))
+    expect(",")
+    n0inv = number()
+    expect(",")
+    expect("{")
+    n = numbers(RSANUMWORDS)
+    expect("}")
+    expect(",")
+    expect("{")
+    rr = numbers(RSANUMWORDS)
+    expect("}")
+    expect("}")
+    payload = struct.pack("<IIiI", 0, hash_len, RSANUMWORDS, n0inv)
+    payload += struct.pack("<%dI" % RSANUMWORDS, *n)
+    payload += struct.pack("<%dI" % RSANUMWORDS, *rr)
+    payload += struct.pack("<i", exponent)
+    records.append(payload)
+  else:
+    raise ValueError("unsupported key version %d" % version)
+
+  if pos[0] < len(toks):
+    expect(",")
+
+out = open(sys.argv[2], "wb")
+out.write("RKS1")
+out.write(struct.pack("<I", len(records)))
+for record in records:
+  out.write(record)
+out.close()
+
+print "wrote %d key(s) to %s" % (len(records), sys.argv[2])
@@ -0,0 +1,62 @@
+# Copyright (C) 2015 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Script to compile a recovery resource PNG into the raw mmap-able
+format loaded by minui/resources.c, so recovery can display it without
+running libpng at boot.  For still images:
+
+    mkrawres.py input.png output.raw
+
+For the row-interlaced animations produced by interlace-frames.py,
+pass the frame count so the rows can be deinterlaced back into whole
+frames:
+
+    mkrawres.py --frames N input.png output.raw
+
+The output is a 16-byte header (magic "MRAW", then width, frame height
+and frame count as little-endian 32-bit integers) followed by each
+frame's RGBX pixels in turn."""
+
+import struct
+import sys
+try:
+  import Image
+except ImportError:
+  print "This script requires the Python Imaging Library to be installed."
+  sys.exit(1)
+
+args = sys.argv[1:]
+frames = 1
+if args and args[0] == "--frames":
+  frames = int(args[1])
+  args = args[2:]
+assert len(args) == 2, "Usage: mkrawres.py [--frames N] input.png output.raw"
+
+im = Image.open(args[0]).convert("RGBA")
+width, height = im.size
+assert height % frames == 0, "image height must be a multiple of the frame count"
+frame_height = height / frames
+
+data = im.tostring()
+row_bytes = width * 4
+
+out = open(args[1], "wb")
+out.write("MRAW")
+out.write(struct.pack("<III", width, frame_height, frames))
+for frame in range(frames):
+  for y in range(frame_height):
+    # interlace-frames.py stores row y of frame f at row y*frames+f.
+    offset = (y * frames + frame) * row_bytes
+    out.write(data[offset:offset + row_bytes])
+out.close()
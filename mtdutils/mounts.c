@@ -19,6 +19,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/mount.h>
 
 #include "mounts.h"
@@ -56,14 +57,46 @@ free_volume_internals(const MountedVolume *volume, int zero)
 
 #define PROC_MOUNTS_FILENAME   "/proc/mounts"
 
+/* The parsed table is kept between calls.  The kernel flags a
+ * /proc/mounts fd with POLLERR|POLLPRI whenever the mount table
+ * changes, so a zero-timeout poll on a persistent fd tells us whether
+ * the cached records are still current without reading or parsing
+ * anything.  Our own unmount/remount entry points below also mark the
+ * cache dirty directly.  Callers hammer scan_mounted_volumes (roots
+ * and the backup paths call it before nearly every operation), and
+ * with this nearly all of those calls return without touching proc.
+ */
+static int g_mounts_fd = -1;
+static int g_mounts_dirty = 1;
+
 int
 scan_mounted_volumes()
 {
     char buf[2048];
     const char *bufp;
-    int fd;
     ssize_t nbytes;
 
+    if (g_mounts_fd < 0) {
+        g_mounts_fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
+        if (g_mounts_fd < 0) {
+            goto bail;
+        }
+        g_mounts_dirty = 1;
+    } else {
+        struct pollfd pfd;
+        pfd.fd = g_mounts_fd;
+        pfd.events = POLLPRI;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) < 0 ||
+                (pfd.revents & (POLLERR | POLLPRI))) {
+            g_mounts_dirty = 1;
+        }
+    }
+
+    if (!g_mounts_dirty && g_mounts_state.volumes != NULL) {
+        return 0;
+    }
+
     if (g_mounts_state.volumes == NULL) {
         const int numv = 32;
         MountedVolume *volumes = malloc(numv * sizeof(*volumes));
@@ -84,14 +117,12 @@ scan_mounted_volumes()
     }
     g_mounts_state.volume_count = 0;
 
-    /* Open and read the file contents.
+    /* Read the file contents through the persistent fd.
      */
-    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
-    if (fd < 0) {
+    if (lseek(g_mounts_fd, 0, SEEK_SET) != 0) {
         goto bail;
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
+    nbytes = read(g_mounts_fd, buf, sizeof(buf) - 1);
     if (nbytes < 0) {
         goto bail;
     }
@@ -152,11 +183,13 @@ printf("matches was %d on <<%.40s>>\n", matches, bufp);
         }
     }
 
+    g_mounts_dirty = 0;
     return 0;
 
 bail:
 //TODO: free the strings we've allocated.
     g_mounts_state.volume_count = 0;
+    g_mounts_dirty = 1;
     return -1;
 }
 
@@ -208,6 +241,7 @@ unmount_mounted_volume(const MountedVolume *volume)
     int ret = umount(volume->mount_point);
     if (ret == 0) {
         free_volume_internals(volume, 1);
+        g_mounts_dirty = 1;
         return 0;
     }
     return ret;
@@ -223,6 +257,7 @@ unmount_mounted_volume_detach(const MountedVolume *volume)
     int ret = umount2(volume->mount_point, MNT_DETACH);
     if (ret == 0) {
         free_volume_internals(volume, 1);
+        g_mounts_dirty = 1;
         return 0;
     }
     return ret;
@@ -231,7 +266,11 @@ unmount_mounted_volume_detach(const MountedVolume *volume)
 int
 remount_read_only(const MountedVolume* volume)
 {
-    return mount(volume->device, volume->mount_point, volume->filesystem,
-                 MS_NOATIME | MS_NODEV | MS_NODIRATIME |
-                 MS_RDONLY | MS_REMOUNT, 0);
+    int ret = mount(volume->device, volume->mount_point, volume->filesystem,
+                    MS_NOATIME | MS_NODEV | MS_NODIRATIME |
+                    MS_RDONLY | MS_REMOUNT, 0);
+    if (ret == 0) {
+        g_mounts_dirty = 1;
+    }
+    return ret;
 }
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,6 +46,12 @@ struct MtdReadContext {
     int fd;
 };
 
+/* Write-behind queue depth, in runs of up to MTD_WRITE_BATCH erase
+ * blocks each: enough for decompression to stay a few flash programs
+ * ahead without holding more than a few megabytes of image data.
+ */
+#define MTD_WB_QUEUE 4
+
 struct MtdWriteContext {
     const MtdPartition *partition;
     char *buffer;
@@ -54,6 +61,25 @@ struct MtdWriteContext {
     off_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    /* Write-behind state (see mtd_write_behind): full erase-block
+     * runs are copied into the queue and programmed by the worker
+     * thread, in order, using the shared fd's file position; only the
+     * worker moves that position while the queue is active.  A write
+     * failure is sticky and reported at the next caller entry point.
+     */
+    int wb_enabled;
+    int wb_error;
+    int wb_stop;
+    struct {
+        char *data;
+        int nblocks;
+    } wb_queue[MTD_WB_QUEUE];
+    int wb_head;
+    int wb_count;
+    pthread_t wb_thread;
+    pthread_mutex_t wb_lock;
+    pthread_cond_t wb_cond;
 };
 
 typedef struct {
@@ -70,6 +96,77 @@ static MtdState g_mtd_state = {
 
 #define MTD_PROC_FILENAME   "/proc/mtd"
 
+/*
+ * Factory bad-block tables, one per MTD device.  Probing with
+ * MEMGETBADBLOCK as the write loop goes costs an ioctl per erase
+ * block and is repeated on every write session to the partition.
+ * Instead the table is built once per device -- a single sequential
+ * scan on first use -- and every later session consults it in memory,
+ * so the hot write/erase/read paths take no bad-block ioctls at all.
+ * Blocks that go bad during a write are added to the table so later
+ * sessions pre-skip them too.
+ */
+#define MTD_MAX_DEVICES 32
+
+typedef struct {
+    unsigned char *map;     /* one bit per erase block, 1 = bad */
+    int nblocks;
+} BadBlockTable;
+
+static BadBlockTable g_bad_block_tables[MTD_MAX_DEVICES];
+
+static BadBlockTable *bbt_get(const MtdPartition *partition, int fd)
+{
+    if (partition->device_index < 0 ||
+            partition->device_index >= MTD_MAX_DEVICES) {
+        return NULL;
+    }
+    BadBlockTable *t = &g_bad_block_tables[partition->device_index];
+    int nblocks = partition->size / partition->erase_size;
+    if (t->map != NULL && t->nblocks == nblocks) {
+        return t;
+    }
+    free(t->map);
+    t->map = calloc((nblocks + 7) / 8, 1);
+    if (t->map == NULL) {
+        t->nblocks = 0;
+        return NULL;
+    }
+    t->nblocks = nblocks;
+    int i;
+    for (i = 0; i < nblocks; ++i) {
+        loff_t bpos = (loff_t)i * partition->erase_size;
+        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+        if (ret == -1 && errno == EOPNOTSUPP) {
+            break;  /* device has no bad-block concept; all good */
+        }
+        if (ret != 0) {
+            t->map[i >> 3] |= 1 << (i & 7);
+        }
+    }
+    return t;
+}
+
+static int bbt_is_bad(const BadBlockTable *t, off_t pos, int erase_size)
+{
+    int i = pos / erase_size;
+    if (i < 0 || i >= t->nblocks) {
+        return 0;
+    }
+    return (t->map[i >> 3] >> (i & 7)) & 1;
+}
+
+static void bbt_mark_bad(BadBlockTable *t, off_t pos, int erase_size)
+{
+    if (t == NULL) {
+        return;
+    }
+    int i = pos / erase_size;
+    if (i >= 0 && i < t->nblocks) {
+        t->map[i >> 3] |= 1 << (i & 7);
+    }
+}
+
 int
 mtd_scan_partitions()
 {
@@ -301,6 +398,8 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
 
     loff_t pos = lseek64(fd, 0, SEEK_CUR);
 
+    BadBlockTable *bbt = bbt_get(partition, fd);
+
     ssize_t size = partition->erase_size;
     int mgbb;
 
@@ -317,10 +416,11 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
                     after.failed - before.failed, pos);
             // copy the comparison baseline for the next read.
             memcpy(&before, &after, sizeof(struct mtd_ecc_stats));
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
+        } else if ((mgbb = (bbt != NULL ?
+                bbt_is_bad(bbt, pos, partition->erase_size) :
+                ioctl(fd, MEMGETBADBLOCK, &pos)))) {
             fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
+                    "mtd: bad block at 0x%08llx (mgbb=%d)\n", pos, mgbb);
         } else {
             return 0;  // Success!
         }
@@ -332,6 +432,55 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
     return -1;
 }
 
+// Read up to nblocks consecutive erase blocks in a single syscall.
+// The happy path -- no bad blocks in the span, no new ECC failures --
+// costs one read() and two ECCGETSTATS for the whole batch instead of
+// per block.  Any trouble rewinds and hands one block to read_block(),
+// which localizes the damage and skips past it; the caller's loop then
+// resumes batching.  Returns bytes read, or -1.
+static ssize_t read_blocks(const MtdPartition *partition, int fd,
+                           char *data, int nblocks)
+{
+    ssize_t erase_size = partition->erase_size;
+    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+
+    while (nblocks > 1 &&
+           pos + (loff_t)nblocks * erase_size > (loff_t)partition->size) {
+        --nblocks;
+    }
+
+    // Batching is only safe when the bad-block table can vouch for
+    // the whole span up front; without one, probing each block costs
+    // the ioctls the batch was meant to save.
+    BadBlockTable *bbt = bbt_get(partition, fd);
+    if (nblocks > 1 && bbt != NULL) {
+        int i;
+        int clean = 1;
+        for (i = 0; i < nblocks; ++i) {
+            if (bbt_is_bad(bbt, pos + (loff_t)i * erase_size, erase_size)) {
+                clean = 0;
+                break;
+            }
+        }
+
+        struct mtd_ecc_stats before, after;
+        if (clean && ioctl(fd, ECCGETSTATS, &before) == 0) {
+            ssize_t want = (ssize_t)nblocks * erase_size;
+            if (read(fd, data, want) == want &&
+                ioctl(fd, ECCGETSTATS, &after) == 0 &&
+                after.failed == before.failed) {
+                return want;
+            }
+            printf("mtd: batch read failed at 0x%08llx; retrying per block\n",
+                   (long long)pos);
+            lseek64(fd, pos, SEEK_SET);
+        }
+    }
+
+    if (read_block(partition, fd, data)) return -1;
+    return erase_size;
+}
+
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
     size_t read = 0;
@@ -344,11 +493,14 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
             read += copy;
         }
 
-        // Read complete blocks directly into the user's buffer
+        // Read complete blocks directly into the user's buffer,
+        // batching as many as the request covers into one syscall.
         while (ctx->consumed == ctx->partition->erase_size &&
                len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
+            ssize_t got = read_blocks(ctx->partition, ctx->fd, data + read,
+                                      (len - read) / ctx->partition->erase_size);
+            if (got < 0) return -1;
+            read += got;
         }
 
         if (read >= len) {
@@ -398,6 +550,12 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 
     ctx->partition = partition;
     ctx->stored = 0;
+
+    ctx->wb_enabled = 0;
+    ctx->wb_error = 0;
+    ctx->wb_stop = 0;
+    ctx->wb_head = 0;
+    ctx->wb_count = 0;
     return ctx;
 }
 
@@ -418,15 +576,23 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     off_t pos = lseek(fd, 0, SEEK_CUR);
     if (pos == (off_t) -1) return 1;
 
+    BadBlockTable *bbt = bbt_get(partition, fd);
+
     ssize_t size = partition->erase_size;
     while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+        int bad;
+        if (bbt != NULL) {
+            bad = bbt_is_bad(bbt, pos, partition->erase_size);
+        } else {
+            // Table allocation failed; fall back to probing.
+            loff_t bpos = pos;
+            int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+            bad = (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP));
+        }
+        if (bad) {
             add_bad_block_offset(ctx, pos);
             fprintf(stderr,
-                    "mtd: not writing bad block at 0x%08lx (ret %d errno %d)\n",
-                    pos, ret, errno);
+                    "mtd: not writing bad block at 0x%08lx\n", pos);
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
@@ -469,6 +635,7 @@ static int write_block(MtdWriteContext *ctx, const char *data)
 
         // Try to erase it once more as we give up on this block
         add_bad_block_offset(ctx, pos);
+        bbt_mark_bad(bbt, pos, partition->erase_size);
         printf("mtd: skipping write block at 0x%08lx\n", pos);
         ioctl(fd, MEMERASE, &erase_info);
         pos += partition->erase_size;
@@ -479,6 +646,180 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     return -1;
 }
 
+/*
+ * Batched variant of write_block.  When the bad-block table shows a
+ * run of consecutive good blocks at the current position, the run is
+ * erased with a single MEMERASE and written with a single write(),
+ * paying the syscall and MTD setup cost once per run instead of once
+ * per erase block.  Any failure replays the run through write_block()
+ * so its retry and bad-block skip handling is preserved.  Consumes
+ * exactly nblocks blocks of data; returns nonzero on error.
+ */
+#define MTD_WRITE_BATCH 8
+
+static int write_blocks(MtdWriteContext *ctx, const char *data, int nblocks)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
+    ssize_t bsize = partition->erase_size;
+    char *verify = NULL;
+
+    while (nblocks > 0) {
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        if (pos == (off_t) -1) break;
+
+        // Count the consecutive good blocks ahead of us.
+        BadBlockTable *bbt = bbt_get(partition, fd);
+        int run = 0;
+        if (bbt != NULL) {
+            while (run < nblocks && run < MTD_WRITE_BATCH &&
+                    pos + (off_t)(run + 1) * bsize <= (off_t) partition->size &&
+                    !bbt_is_bad(bbt, pos + (off_t)run * bsize,
+                                partition->erase_size)) {
+                ++run;
+            }
+        }
+        if (run < 2) {
+            // Bad block ahead (or no table): the single-block path
+            // handles skipping and retries.
+            if (write_block(ctx, data)) break;
+            data += bsize;
+            --nblocks;
+            continue;
+        }
+
+        if (verify == NULL) {
+            verify = malloc(MTD_WRITE_BATCH * bsize);
+            if (verify == NULL) {
+                if (write_block(ctx, data)) break;
+                data += bsize;
+                --nblocks;
+                continue;
+            }
+        }
+
+        ssize_t span = (ssize_t)run * bsize;
+        struct erase_info_user erase_info;
+        erase_info.start = pos;
+        erase_info.length = span;
+        int ok = ioctl(fd, MEMERASE, &erase_info) == 0 &&
+                lseek(fd, pos, SEEK_SET) == pos &&
+                write(fd, data, span) == span &&
+                lseek(fd, pos, SEEK_SET) == pos &&
+                read(fd, verify, span) == span &&
+                memcmp(data, verify, span) == 0;
+        if (!ok) {
+            // Replay the span block by block so the failure gets the
+            // standard retry and skip handling.
+            printf("mtd: batched write failed at 0x%08lx, replaying\n", pos);
+            if (lseek(fd, pos, SEEK_SET) != pos) break;
+            int i;
+            for (i = 0; i < run; ++i) {
+                if (write_block(ctx, data + (ssize_t)i * bsize)) {
+                    free(verify);
+                    return 1;
+                }
+            }
+        }
+        data += span;
+        nblocks -= run;
+    }
+
+    free(verify);
+    return nblocks > 0;
+}
+
+static void *mtd_write_behind_thread(void *cookie)
+{
+    MtdWriteContext *ctx = (MtdWriteContext*) cookie;
+
+    pthread_mutex_lock(&ctx->wb_lock);
+    for (;;) {
+        while (ctx->wb_count == 0 && !ctx->wb_stop) {
+            pthread_cond_wait(&ctx->wb_cond, &ctx->wb_lock);
+        }
+        if (ctx->wb_count == 0) break;
+
+        char *data = ctx->wb_queue[ctx->wb_head].data;
+        int nblocks = ctx->wb_queue[ctx->wb_head].nblocks;
+        int err = 0;
+        if (!ctx->wb_error) {
+            pthread_mutex_unlock(&ctx->wb_lock);
+            err = write_blocks(ctx, data, nblocks);
+            pthread_mutex_lock(&ctx->wb_lock);
+        }
+        free(data);
+        if (err) ctx->wb_error = 1;
+        ctx->wb_head = (ctx->wb_head + 1) % MTD_WB_QUEUE;
+        --ctx->wb_count;
+        pthread_cond_broadcast(&ctx->wb_cond);
+    }
+    pthread_mutex_unlock(&ctx->wb_lock);
+    return NULL;
+}
+
+/* Copy nblocks complete blocks into the write-behind queue, waiting
+ * for space if the worker is behind.  Returns nonzero on error (out
+ * of memory, or a sticky asynchronous write failure).
+ */
+static int wb_enqueue(MtdWriteContext *ctx, const char *data, int nblocks)
+{
+    size_t bytes = (size_t)nblocks * ctx->partition->erase_size;
+    char *copy = malloc(bytes);
+    if (copy == NULL) return 1;
+    memcpy(copy, data, bytes);
+
+    pthread_mutex_lock(&ctx->wb_lock);
+    while (ctx->wb_count == MTD_WB_QUEUE && !ctx->wb_error) {
+        pthread_cond_wait(&ctx->wb_cond, &ctx->wb_lock);
+    }
+    if (ctx->wb_error) {
+        pthread_mutex_unlock(&ctx->wb_lock);
+        free(copy);
+        return 1;
+    }
+    int tail = (ctx->wb_head + ctx->wb_count) % MTD_WB_QUEUE;
+    ctx->wb_queue[tail].data = copy;
+    ctx->wb_queue[tail].nblocks = nblocks;
+    ++ctx->wb_count;
+    pthread_cond_broadcast(&ctx->wb_cond);
+    pthread_mutex_unlock(&ctx->wb_lock);
+    return 0;
+}
+
+/* Wait until every queued run has been programmed.  Returns the
+ * sticky error state.
+ */
+static int wb_drain(MtdWriteContext *ctx)
+{
+    if (!ctx->wb_enabled) return 0;
+    pthread_mutex_lock(&ctx->wb_lock);
+    while (ctx->wb_count > 0) {
+        pthread_cond_wait(&ctx->wb_cond, &ctx->wb_lock);
+    }
+    int err = ctx->wb_error;
+    pthread_mutex_unlock(&ctx->wb_lock);
+    return err;
+}
+
+int mtd_write_behind(MtdWriteContext *ctx)
+{
+    if (ctx->wb_enabled) return 0;
+    if (pthread_mutex_init(&ctx->wb_lock, NULL) != 0) return -1;
+    if (pthread_cond_init(&ctx->wb_cond, NULL) != 0) {
+        pthread_mutex_destroy(&ctx->wb_lock);
+        return -1;
+    }
+    if (pthread_create(&ctx->wb_thread, NULL,
+                       mtd_write_behind_thread, ctx) != 0) {
+        pthread_cond_destroy(&ctx->wb_cond);
+        pthread_mutex_destroy(&ctx->wb_lock);
+        return -1;
+    }
+    ctx->wb_enabled = 1;
+    return 0;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
     size_t wrote = 0;
@@ -494,22 +835,62 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 
         // If a complete block was accumulated, write it
         if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx, ctx->buffer)) return -1;
+            if (ctx->wb_enabled ? wb_enqueue(ctx, ctx->buffer, 1)
+                                : write_block(ctx, ctx->buffer)) return -1;
             ctx->stored = 0;
         }
 
         // Write complete blocks directly from the user's buffer
-        while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx, data + wrote)) return -1;
-            wrote += ctx->partition->erase_size;
+        if (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
+            int nblocks = (len - wrote) / ctx->partition->erase_size;
+            if (ctx->wb_enabled) {
+                // Queue in worker-sized runs so one entry never holds
+                // more than a batch.
+                if (nblocks > MTD_WRITE_BATCH) nblocks = MTD_WRITE_BATCH;
+                if (wb_enqueue(ctx, data + wrote, nblocks)) return -1;
+            } else {
+                if (write_blocks(ctx, data + wrote, nblocks)) return -1;
+            }
+            wrote += (size_t)nblocks * ctx->partition->erase_size;
         }
     }
 
     return wrote;
 }
 
+static int erase_block_is_bad(MtdWriteContext *ctx, BadBlockTable *bbt,
+        off_t pos)
+{
+    if (bbt != NULL)
+        return bbt_is_bad(bbt, pos, ctx->partition->erase_size);
+    loff_t bpos = pos;
+    return ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0;
+}
+
+/*
+ * Returns 1 if the block at bpos needs erasing, 0 if it already reads
+ * back as all 0xff.  A NAND erase costs an order of magnitude more
+ * than reading the block, so on mostly-blank partitions skipping the
+ * no-op erases is a large win.  Any read problem reports the block as
+ * needing erase so we never skip a block we couldn't check.
+ */
+static int block_needs_erase(int fd, off_t bpos, ssize_t size, char *buf)
+{
+    if (lseek(fd, bpos, SEEK_SET) != bpos) return 1;
+    if (read(fd, buf, size) != size) return 1;
+    ssize_t i;
+    for (i = 0; i < size; ++i) {
+        if (buf[i] != (char) 0xff) return 1;
+    }
+    return 0;
+}
+
 off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 {
+    // Write-behind: every queued run must reach the flash before the
+    // tail flush and the erase below reuse the fd's file position.
+    if (wb_drain(ctx)) return -1;
+
     // Zero-pad and write any pending data to get us to a block boundary
     if (ctx->stored > 0) {
         size_t zero = ctx->partition->erase_size - ctx->stored;
@@ -528,24 +909,68 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         return -1;
     }
 
-    // Erase the specified number of blocks
-    while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+    BadBlockTable *bbt = bbt_get(ctx->partition, ctx->fd);
+    const off_t start = pos;
+    const ssize_t esz = ctx->partition->erase_size;
+    char *blank = malloc(esz);
+    int skipped = 0;
+
+    // Erase the specified number of blocks, skipping blocks that are
+    // already blank and batching runs of blocks that aren't into
+    // single MEMERASE calls.
+    while (blocks > 0) {
+        if (erase_block_is_bad(ctx, bbt, pos)) {
             printf("mtd: not erasing bad block at 0x%08lx\n", pos);
-            pos += ctx->partition->erase_size;
+            pos += esz;
+            --blocks;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
+        if (blank != NULL && !block_needs_erase(ctx->fd, pos, esz, blank)) {
+            ++skipped;
+            pos += esz;
+            --blocks;
+            continue;
+        }
+
+        int run = 1;
+        while (run < blocks &&
+                !erase_block_is_bad(ctx, bbt, pos + (off_t)run * esz) &&
+                (blank == NULL ||
+                 block_needs_erase(ctx->fd, pos + (off_t)run * esz,
+                                   esz, blank))) {
+            ++run;
+        }
+
         struct erase_info_user erase_info;
         erase_info.start = pos;
-        erase_info.length = ctx->partition->erase_size;
+        erase_info.length = (size_t)run * esz;
         if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            printf("mtd: erase failure at 0x%08lx\n", pos);
+            // Retry block by block so one bad region doesn't leave
+            // the rest of the run unerased.
+            int i;
+            for (i = 0; i < run; ++i) {
+                erase_info.start = pos + (off_t)i * esz;
+                erase_info.length = esz;
+                if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
+                    printf("mtd: erase failure at 0x%08lx\n",
+                            (long) erase_info.start);
+                }
+            }
         }
-        pos += ctx->partition->erase_size;
+        pos += (off_t)run * esz;
+        blocks -= run;
     }
 
+    if (skipped > 0) {
+        printf("mtd: skipped %d already-erased blocks\n", skipped);
+    }
+    free(blank);
+
+    // The blank checks moved the fd offset; put it back where the
+    // caller left it.
+    lseek(ctx->fd, start, SEEK_SET);
+
     return pos;
 }
 
@@ -554,6 +979,16 @@ int mtd_write_close(MtdWriteContext *ctx)
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
+    if (ctx->wb_enabled) {
+        pthread_mutex_lock(&ctx->wb_lock);
+        ctx->wb_stop = 1;
+        pthread_cond_broadcast(&ctx->wb_cond);
+        pthread_mutex_unlock(&ctx->wb_lock);
+        pthread_join(ctx->wb_thread, NULL);
+        if (ctx->wb_error) r = -1;
+        pthread_cond_destroy(&ctx->wb_cond);
+        pthread_mutex_destroy(&ctx->wb_lock);
+    }
     if (close(ctx->fd)) r = -1;
     free(ctx->bad_block_offsets);
     free(ctx->buffer);
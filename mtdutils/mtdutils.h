@@ -52,6 +52,14 @@ void mtd_read_close(MtdReadContext *);
 void mtd_read_skip_to(const MtdReadContext *, size_t offset);
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
+/* Opt into write-behind: mtd_write_data queues erase-block runs for a
+ * background thread instead of programming them inline, so the caller
+ * (e.g. image decompression) overlaps NAND program time.  Returns 0 on
+ * success; on failure the context keeps writing synchronously.  An
+ * asynchronous write error surfaces at the next mtd_write_data,
+ * mtd_erase_blocks or mtd_write_close call.
+ */
+int mtd_write_behind(MtdWriteContext *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
 off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
@@ -21,20 +21,25 @@
 #include <getopt.h>
 #include <limits.h>
 #include <linux/input.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "bootloader.h"
+#include "bootprofile.h"
 #include "common.h"
 #include "cutils/properties.h"
 #include "cutils/android_reboot.h"
 #include "install.h"
+#include "logwriter.h"
 #include "minui/minui.h"
 #include "minzip/DirUtil.h"
 #include "roots.h"
@@ -122,6 +127,9 @@ static const char *TEMPORARY_INSTALL_FILE = "/tmp/last_install";
 
 #define KEEP_LOG_COUNT 10
 
+// Most packages a single "Apply update" pass will queue up.
+#define MAX_INSTALL_QUEUE 8
+
 RecoveryUI* ui = NULL;
 char* locale = NULL;
 char recovery_version[PROPERTY_VALUE_MAX+1];
@@ -210,7 +218,17 @@ fopen_path(const char *path, const char *mode) {
 }
 
 static void redirect_stdio(const char* filename) {
-    // If these fail, there's not really anywhere to complain...
+    // Route both streams through the batching log engine: writes land
+    // in a pipe at memory speed and a background thread batches them
+    // into large appends on 'filename' (see logwriter.h).  Unbuffered
+    // so a log line reaches the engine the moment it is printed.
+    if (log_engine_redirect(filename) == 0) {
+        setbuf(stdout, NULL);
+        setbuf(stderr, NULL);
+        return;
+    }
+    // If the engine can't start, there's not really anywhere to
+    // complain; fall back to writing the file directly.
     freopen(filename, "a", stdout); setbuf(stdout, NULL);
     freopen(filename, "a", stderr); setbuf(stderr, NULL);
 }
@@ -321,21 +339,48 @@ copy_log_file(const char* source, const char* destination, int append) {
     FILE *log = fopen_path(destination, append ? "a" : "w");
     if (log == NULL) {
         LOGE("Can't open %s\n", destination);
-    } else {
-        FILE *tmplog = fopen(source, "r");
-        if (tmplog != NULL) {
-            if (append) {
-                fseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
-            }
-            char buf[4096];
-            while (fgets(buf, sizeof(buf), tmplog)) fputs(buf, log);
-            if (append) {
-                tmplog_offset = ftell(tmplog);
+        return;
+    }
+
+    int in_fd = open(source, O_RDONLY);
+    if (in_fd >= 0) {
+        struct stat st;
+        off_t off = append ? tmplog_offset : 0;
+
+        if (append) {
+            // sendfile refuses an O_APPEND destination; seek to the
+            // end and clear the flag instead.
+            fcntl(fileno(log), F_SETFL, 0);
+            lseek(fileno(log), 0, SEEK_END);
+        }
+
+        if (fstat(in_fd, &st) == 0 && off < st.st_size) {
+            ssize_t sent = sendfile(fileno(log), in_fd, &off,
+                                    st.st_size - off);
+            if (sent < 0) {
+                // old kernels only accept a socket destination; fall
+                // back to a plain read/write loop
+                char buf[4096];
+                ssize_t n;
+                lseek(in_fd, off, SEEK_SET);
+                while ((n = read(in_fd, buf, sizeof(buf))) > 0) {
+                    if (fwrite(buf, 1, n, log) != (size_t) n) break;
+                    off += n;
+                }
+            } else {
+                while (sent > 0 && off < st.st_size) {
+                    sent = sendfile(fileno(log), in_fd, &off,
+                                    st.st_size - off);
+                }
             }
-            check_and_fclose(tmplog, source);
         }
-        check_and_fclose(log, destination);
+
+        if (append) {
+            tmplog_offset = off;  // Since last write
+        }
+        close(in_fd);
     }
+    check_and_fclose(log, destination);
 }
 
 // Rename last_log -> last_log.1 -> last_log.2 -> ... -> last_log.$max
@@ -356,6 +401,9 @@ rotate_last_logs(int max) {
 
 static void
 copy_logs() {
+    // Anything still sitting in the log engine belongs in the copies.
+    log_engine_flush();
+
     // Copy logs to cache so the system can find out what happened.
     copy_log_file(TEMPORARY_LOG_FILE, LOG_FILE, true);
     copy_log_file(TEMPORARY_LOG_FILE, LAST_LOG_FILE, false);
@@ -364,7 +412,17 @@ copy_logs() {
     chown(LOG_FILE, 1000, 1000);   // system user
     chmod(LAST_LOG_FILE, 0640);
     chmod(LAST_INSTALL_FILE, 0644);
-    sync();
+
+    // One fsync of the directory publishes the rotated/rewritten
+    // entries; the file data itself reaches disk when /cache is
+    // unmounted on the way out (plus finish_recovery's final sync()),
+    // so a global sync() here would just stall the reboot behind every
+    // dirty page in the system.
+    int dfd = open("/cache/recovery", O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
 }
 
 // clear the recovery command and prepare to boot a (hopefully working) system,
@@ -617,25 +675,18 @@ static int compare_string(const void* a, const void* b) {
     return strcmp(*(const char**)a, *(const char**)b);
 }
 
-// Returns a malloc'd path, or NULL.
-static char*
-browse_directory(const char* path, Device* device) {
-    ensure_path_mounted(path);
-
-    const char* MENU_HEADERS[] = { "Choose a package to install:",
-                                   path,
-                                   "",
-                                   NULL };
+// Read and sort one directory into a menu-ready, NULL-terminated item
+// list: "../" first, then zips, then subdirectories (marked with a
+// trailing '/'), each group sorted.  Returns NULL if the directory
+// can't be opened.
+static char** scan_directory(const char* path) {
     DIR* d;
     struct dirent* de;
     d = opendir(path);
     if (d == NULL) {
-        LOGE("error opening %s: %s\n", path, strerror(errno));
         return NULL;
     }
 
-    const char** headers = prepend_title(MENU_HEADERS);
-
     int d_size = 0;
     int d_alloc = 10;
     char** dirs = (char**)malloc(d_alloc * sizeof(char*));
@@ -687,6 +738,191 @@ browse_directory(const char* path, Device* device) {
     z_size += d_size;
     zips[z_size] = NULL;
 
+    return zips;
+}
+
+static void free_listing(char** items) {
+    if (items == NULL) return;
+    int i;
+    for (i = 0; items[i] != NULL; ++i) free(items[i]);
+    free(items);
+}
+
+static char** copy_listing(char** items) {
+    int count;
+    for (count = 0; items[count] != NULL; ++count) { }
+    char** copy = (char**)malloc((count + 1) * sizeof(char*));
+    int i;
+    for (i = 0; i < count; ++i) copy[i] = strdup(items[i]);
+    copy[count] = NULL;
+    return copy;
+}
+
+// Package-browser listing cache.  Scanning and sorting a sdcard
+// folder with hundreds of zips is a visible freeze per keypress, and
+// the browser's most common motion is backing out of a directory and
+// re-entering it.  Listings are keyed by path and invalidated by the
+// directory's mtime (which changes when entries are added or
+// removed); a background thread warms the subdirectories of the
+// listing on screen while the user reads the menu, so descending is
+// usually served from the cache too.
+#define BROWSE_CACHE_DIRS 8
+
+struct browse_listing {
+    char* path;
+    time_t mtime;
+    char** items;
+};
+
+static struct browse_listing browse_cache[BROWSE_CACHE_DIRS];
+static int browse_cache_count = 0;
+static pthread_mutex_t browse_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns a caller-owned copy of the cached listing for path, or NULL
+// on a miss.  A stale entry (directory modified since the scan) is
+// dropped on the way.
+static char** browse_cache_get(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return NULL;
+
+    char** result = NULL;
+    pthread_mutex_lock(&browse_cache_lock);
+    int i;
+    for (i = 0; i < browse_cache_count; ++i) {
+        if (strcmp(browse_cache[i].path, path) != 0) continue;
+        if (browse_cache[i].mtime == st.st_mtime) {
+            result = copy_listing(browse_cache[i].items);
+        } else {
+            free(browse_cache[i].path);
+            free_listing(browse_cache[i].items);
+            memmove(&browse_cache[i], &browse_cache[i+1],
+                    (browse_cache_count - i - 1) * sizeof(browse_cache[0]));
+            --browse_cache_count;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&browse_cache_lock);
+    return result;
+}
+
+static void browse_cache_put(const char* path, char** items) {
+    struct stat st;
+    if (stat(path, &st) != 0) return;
+
+    pthread_mutex_lock(&browse_cache_lock);
+    int i;
+    for (i = 0; i < browse_cache_count; ++i) {
+        if (strcmp(browse_cache[i].path, path) == 0) {
+            // Another thread beat us to it.
+            pthread_mutex_unlock(&browse_cache_lock);
+            return;
+        }
+    }
+    if (browse_cache_count == BROWSE_CACHE_DIRS) {
+        // Evict the oldest listing.
+        free(browse_cache[0].path);
+        free_listing(browse_cache[0].items);
+        memmove(&browse_cache[0], &browse_cache[1],
+                (BROWSE_CACHE_DIRS - 1) * sizeof(browse_cache[0]));
+        --browse_cache_count;
+    }
+    browse_cache[browse_cache_count].path = strdup(path);
+    browse_cache[browse_cache_count].mtime = st.st_mtime;
+    browse_cache[browse_cache_count].items = copy_listing(items);
+    ++browse_cache_count;
+    pthread_mutex_unlock(&browse_cache_lock);
+}
+
+struct browse_prefetch_work {
+    char** paths;       // NULL-terminated list of absolute dir paths
+};
+
+static void* browse_prefetch_thread(void* cookie) {
+    struct browse_prefetch_work* work = (struct browse_prefetch_work*)cookie;
+    int i;
+    for (i = 0; work->paths[i] != NULL; ++i) {
+        char** cached = browse_cache_get(work->paths[i]);
+        if (cached != NULL) {
+            free_listing(cached);
+            continue;
+        }
+        char** items = scan_directory(work->paths[i]);
+        if (items != NULL) {
+            browse_cache_put(work->paths[i], items);
+            free_listing(items);
+        }
+    }
+    free_listing(work->paths);
+    free(work);
+    return NULL;
+}
+
+// Scan the subdirectories of the listing just shown into the cache
+// while the user is reading the menu.
+static void start_browse_prefetch(const char* parent, char** items) {
+    int count = 0;
+    int i;
+    for (i = 0; items[i] != NULL; ++i) {
+        int len = strlen(items[i]);
+        if (len > 0 && items[i][len-1] == '/' &&
+            strcmp(items[i], "../") != 0) {
+            ++count;
+        }
+    }
+    if (count == 0) return;
+
+    struct browse_prefetch_work* work = (struct browse_prefetch_work*)
+            malloc(sizeof(*work));
+    work->paths = (char**)malloc((count + 1) * sizeof(char*));
+    int n = 0;
+    for (i = 0; items[i] != NULL; ++i) {
+        int len = strlen(items[i]);
+        if (len > 0 && items[i][len-1] == '/' &&
+            strcmp(items[i], "../") != 0) {
+            char sub[PATH_MAX];
+            strlcpy(sub, parent, PATH_MAX);
+            strlcat(sub, "/", PATH_MAX);
+            strlcat(sub, items[i], PATH_MAX);
+            sub[strlen(sub)-1] = '\0';  // drop the trailing '/'
+            work->paths[n++] = strdup(sub);
+        }
+    }
+    work->paths[n] = NULL;
+
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&t, &attr, browse_prefetch_thread, work) != 0) {
+        free_listing(work->paths);
+        free(work);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Returns a malloc'd path, or NULL.
+static char*
+browse_directory(const char* path, Device* device) {
+    ensure_path_mounted(path);
+
+    const char* MENU_HEADERS[] = { "Choose a package to install:",
+                                   path,
+                                   "",
+                                   NULL };
+
+    char** zips = browse_cache_get(path);
+    if (zips == NULL) {
+        zips = scan_directory(path);
+        if (zips == NULL) {
+            LOGE("error opening %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+        browse_cache_put(path, zips);
+    }
+    start_browse_prefetch(path, zips);
+
+    const char** headers = prepend_title(MENU_HEADERS);
+
     char* result;
     int chosen_item = 0;
     while (true) {
@@ -718,14 +954,20 @@ browse_directory(const char* path, Device* device) {
         }
     }
 
-    int i;
-    for (i = 0; i < z_size; ++i) free(zips[i]);
-    free(zips);
+    free_listing(zips);
     free(headers);
 
     return result;
 }
 
+// /data is formatted on its own thread so the wipe of /cache (and the
+// persistent partition) overlaps it; the volumes are separate block
+// devices, and the mount-table funnels in roots.cpp are serialized.
+static void* wipe_data_thread(void* cookie) {
+    erase_volume("/data");
+    return NULL;
+}
+
 static void
 wipe_data(int confirm, Device* device) {
     if (confirm) {
@@ -753,32 +995,115 @@ wipe_data(int confirm, Device* device) {
 
     ui->Print("\n-- Wiping data...\n");
     device->WipeData();
-    erase_volume("/data");
+    pthread_t data_t;
+    bool parallel = (pthread_create(&data_t, NULL, wipe_data_thread, NULL) == 0);
+    if (!parallel) erase_volume("/data");
     erase_volume("/cache");
     erase_persistent_partition();
+    if (parallel) pthread_join(data_t, NULL);
     ui->Print("Data wipe complete.\n");
 }
 
-static void file_to_ui(const char* fn) {
-    FILE *fp = fopen_path(fn, "re");
-    if (fp == NULL) {
+// The log viewer maps the file and pages through it by byte offset, so
+// a multi-megabyte last_log opens instantly instead of being pushed
+// through the UI text path line by line.  Line offsets are found with
+// memchr/memrchr only for the lines a page actually touches, and the
+// head and tail of the file are reachable without walking the rest.
+#define PAGER_LINES 30
+
+// Offset of the line start `lines` lines before the line starting at
+// pos (0 if the head is reached first).
+static size_t pager_back(const char* data, size_t pos, int lines) {
+    while (lines-- > 0 && pos > 0) {
+        const char* nl = (const char*)memrchr(data, '\n', pos - 1);
+        pos = nl ? (nl - data) + 1 : 0;
+    }
+    return pos;
+}
+
+// Offset just past `lines` newlines after pos (size if the tail is
+// reached first).
+static size_t pager_fwd(const char* data, size_t size, size_t pos, int lines) {
+    while (lines-- > 0 && pos < size) {
+        const char* nl = (const char*)memchr(data + pos, '\n', size - pos);
+        pos = nl ? (nl - data) + 1 : size;
+    }
+    return pos;
+}
+
+static void pager_show(const char* fn, const char* data, size_t size, size_t pos) {
+    size_t end = pager_fwd(data, size, pos, PAGER_LINES);
+
+    ui->ClearLog();
+    ui->Print("%s  %d%%  (Up/Down page, Select top/end, Back exits)\n\n",
+              fn, (int)(end * 100 / size));
+    // Print formats into a fixed 256-byte buffer, so feed it the
+    // window in smaller chunks; it wraps long lines itself.
+    while (pos < end) {
+        int chunk = (end - pos > 200) ? 200 : (int)(end - pos);
+        ui->Print("%.*s", chunk, data + pos);
+        pos += chunk;
+    }
+}
+
+static void file_to_ui(const char* fn, Device* device) {
+    if (ensure_path_mounted(fn) != 0) {
+        ui->Print("  Unable to mount %s\n", fn);
+        return;
+    }
+    int fd = open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         ui->Print("  Unable to open %s: %s\n", fn, strerror(errno));
         return;
     }
-    char line[1024];
-    int ct = 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ui->Print("  %s is empty\n", fn);
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    char* data = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        ui->Print("  Unable to map %s: %s\n", fn, strerror(errno));
+        return;
+    }
+
     ui->SetBackground(RecoveryUI::VIEWING_LOG);
     redirect_stdio("/dev/null");
-    while(fgets(line, sizeof(line), fp) != NULL) {
-        ui->Print("%s", line);
-        ct++;
-        if (ct % 30 == 0) {
-            // give the user time to glance at the entries
-            ui->WaitKey();
+
+    // Open on the tail: the interesting part of a log is its end.
+    size_t tail = pager_back(data, size, PAGER_LINES);
+    size_t pos = tail;
+    bool done = false;
+    while (!done) {
+        pager_show(fn, data, size, pos);
+        int key = ui->WaitKey();
+        if (key == -1 || key == -2) {
+            break;
+        }
+        switch (device->HandleMenuKey(key, 1)) {
+            case Device::kHighlightUp:
+                pos = pager_back(data, pos, PAGER_LINES);
+                break;
+            case Device::kHighlightDown:
+                pos = pager_fwd(data, size, pos, PAGER_LINES);
+                if (pos > tail) pos = tail;
+                break;
+            case Device::kInvokeItem:
+                // Jump to the other end of the file.
+                pos = (pos == 0) ? tail : 0;
+                break;
+            case Device::kGoBack:
+                done = true;
+                break;
         }
     }
+    ui->ClearLog();
+
     redirect_stdio(TEMPORARY_LOG_FILE);
-    fclose(fp);
+    munmap(data, size);
 }
 
 static void choose_recovery_file(Device* device) {
@@ -811,7 +1136,7 @@ static void choose_recovery_file(Device* device) {
     while(1) {
         int chosen_item = get_menu_selection(title_headers, entries, 1, 0, device);
         if (chosen_item == 0) break;
-        file_to_ui(entries[chosen_item]);
+        file_to_ui(entries[chosen_item], device);
     }
 
     for (i = 0; i < KEEP_LOG_COUNT + 1; i++) {
@@ -912,22 +1237,51 @@ show_apply_update_menu(Device* device) {
         storage_item* item = &items[chosen-1];
         status = ensure_volume_mounted(item->vol);
         if (status == 0) {
-            char* path = browse_directory(item->path, device);
-            if (path != NULL) {
-                ui->Print("\n-- Install %s ...\n", path);
+            // Let the user queue several zips (ROM + gapps + su is the
+            // common case) and flash them in one session: keys, mounts
+            // and perf state are set up once and the progress bar
+            // covers the whole batch.
+            char* queue[MAX_INSTALL_QUEUE];
+            int queued = 0;
+            while (queued < MAX_INSTALL_QUEUE) {
+                char* path = browse_directory(item->path, device);
+                if (path == NULL) break;
+                queue[queued++] = path;
+                if (queued == MAX_INSTALL_QUEUE) break;
+
+                static const char* queue_headers[] = { "Install queue",
+                                                       "",
+                                                       NULL };
+                const char* queue_items[] = { "Install now",
+                                              "Add another zip",
+                                              NULL };
+                ui->Print("\n%d package(s) queued.\n", queued);
+                if (get_menu_selection(queue_headers, queue_items,
+                                       1, 0, device) != 1) {
+                    break;
+                }
+            }
+            if (queued > 0) {
                 ui->ClearLog();
                 ui->SetBackground(RecoveryUI::INSTALLING_UPDATE);
                 set_sdcard_update_bootloader_message();
-                void* token = start_sdcard_fuse(path);
-                status = install_package(FUSE_SIDELOAD_HOST_PATHNAME, &wipe_cache,
-                                         TEMPORARY_INSTALL_FILE, false);
-                finish_sdcard_fuse(token);
+                status = install_queue_start(queued);
+                int i;
+                for (i = 0; i < queued && status == INSTALL_SUCCESS; ++i) {
+                    ui->Print("\n-- Install %s ...\n", queue[i]);
+                    void* token = start_sdcard_fuse(queue[i]);
+                    status = install_queue_package(FUSE_SIDELOAD_HOST_PATHNAME,
+                                                   &wipe_cache,
+                                                   TEMPORARY_INSTALL_FILE, false);
+                    finish_sdcard_fuse(token);
+                }
+                install_queue_finish();
                 if (status != INSTALL_SUCCESS) {
                     ui->DialogShowErrorLog("Install failed");
                 }
             }
             else {
-                 ui->Print("\n-- No package file selected.\n", path);
+                 ui->Print("\n-- No package file selected.\n");
                  status = INSTALL_NONE;
             }
         }
@@ -1163,6 +1517,9 @@ static int handle_volume_hotswap(char* label, char* path) {
 static int handle_volume_state_changed(char* label, char* path, int state) {
     LOGV("%s: %s\n", path, volume_state_to_string(state));
 
+    // vold changed mount state behind roots.cpp's cached table
+    invalidate_mount_state();
+
     return 0;
 }
 
@@ -1172,6 +1529,32 @@ static struct vold_callbacks v_callbacks = {
     .disk_removed = handle_volume_hotswap,
 };
 
+// vold bring-up (socket connect with retries, volume scan, automount)
+// runs on its own thread so UI init and resource loading proceed
+// concurrently: the menu renders immediately and storage entries
+// materialize once the scan completes.  Paths that need vold state
+// join through vold_init_wait().
+static pthread_t vold_init_t;
+static bool vold_init_async = false;
+
+static void* vold_init_thread(void* cookie) {
+    uint64_t start = boot_profile_now();
+    vold_client_start(&v_callbacks, 0);
+    vold_set_automount(1);
+    boot_profile_report("vold connect", start, boot_profile_now());
+    if (gCurrentUI != NULL) {
+        gCurrentUI->NotifyVolumesChanged();
+    }
+    return NULL;
+}
+
+static void vold_init_wait() {
+    if (vold_init_async) {
+        pthread_join(vold_init_t, NULL);
+        vold_init_async = false;
+    }
+}
+
 int
 main(int argc, char **argv) {
     time_t start = time(NULL);
@@ -1223,11 +1606,17 @@ main(int argc, char **argv) {
 
     printf("Starting recovery (pid %d) on %s", getpid(), ctime(&start));
 
+    boot_profile_phase("volume table");
     load_volume_table();
-    vold_client_start(&v_callbacks, 0);
-    vold_set_automount(1);
+    vold_init_async = (pthread_create(&vold_init_t, NULL, vold_init_thread, NULL) == 0);
+    if (!vold_init_async) {
+        vold_client_start(&v_callbacks, 0);
+        vold_set_automount(1);
+    }
+    boot_profile_phase("log rotation");
     ensure_path_mounted(LAST_LOG_FILE);
     rotate_last_logs(KEEP_LOG_COUNT);
+    boot_profile_phase("get_args");
     get_args(&argc, &argv);
 
     const char *send_intent = NULL;
@@ -1266,6 +1655,7 @@ main(int argc, char **argv) {
         }
     }
 
+    boot_profile_phase("locale");
     if (locale == NULL) {
         load_locale_from_cache();
     }
@@ -1273,6 +1663,7 @@ main(int argc, char **argv) {
     printf("stage is [%s]\n", stage);
     printf("reason is [%s]\n", reason);
 
+    boot_profile_phase("ui init");
     Device* device = make_device();
     ui = device->GetUI();
     gCurrentUI = ui;
@@ -1301,7 +1692,9 @@ main(int argc, char **argv) {
         ui->Print("Warning: No file_contexts\n");
     }
 
+    boot_profile_phase("device start");
     device->StartRecovery();
+    boot_profile_done();
 
     printf("Command:");
     for (arg = 0; arg < argc; arg++) {
@@ -1331,6 +1724,13 @@ main(int argc, char **argv) {
 
     int status = INSTALL_SUCCESS;
 
+    // Commanded actions may touch vold-managed storage; the
+    // interactive menu path below doesn't wait, its storage entries
+    // refresh when the scan lands.
+    if (update_package != NULL || wipe_data || wipe_cache || wipe_media || sideload) {
+        vold_init_wait();
+    }
+
 #ifdef HAVE_OEMLOCK
     if (oem_lock == OEM_LOCK_UNLOCK) {
         if (device->WipeData()) status = INSTALL_ERROR;
@@ -1402,6 +1802,7 @@ main(int argc, char **argv) {
     // Save logs and clean up before rebooting or shutting down.
     finish_recovery(send_intent);
 
+    vold_init_wait();
     vold_unmount_all();
 
     sync();
@@ -38,6 +38,9 @@ int make_f2fs_main(int argc, char **argv);
 int fsck_f2fs_main(int argc, char **argv);
 int fibmap_main(int argc, char **argv);
 #endif
+#ifdef RECOVERY_BENCH
+int recovery_bench_main(int argc, char **argv);
+#endif
 
 int busybox_driver(int argc, char **argv);
 
@@ -46,36 +49,51 @@ struct recovery_cmd {
     int (*main_func)(int argc, char **argv);
 };
 
+/* Kept sorted by name ('.' < '_' < letters) so lookup is a binary
+ * search; the multi-call binary pays this dispatch on every exec.
+ */
 static const struct recovery_cmd recovery_cmds[] = {
-    { "minizip",        minizip_main },
-    { "make_ext4fs",    make_ext4fs_main },
-    { "reboot",         reboot_main },
-    { "poweroff",       reboot_main },
-    { "setprop",        setprop_main },
-    { "getprop",        getprop_main },
+#ifdef USE_F2FS
+    { "fibmap.f2fs",    fibmap_main },
+    { "fsck.f2fs",      fsck_f2fs_main },
+#endif
     { "fsck_msdos",     fsck_msdos_main },
+    { "getprop",        getprop_main },
+    { "make_ext4fs",    make_ext4fs_main },
+    { "minizip",        minizip_main },
+#ifdef USE_F2FS
+    { "mkfs.f2fs",      make_f2fs_main },
+#endif
     { "newfs_msdos",    newfs_msdos_main },
-    { "vdc",            vdc_main },
     { "pigz",           pigz_main },
+    { "poweroff",       reboot_main },
+    { "reboot",         reboot_main },
+#ifdef RECOVERY_BENCH
+    { "recovery_bench", recovery_bench_main },
+#endif
     { "sdcard",         sdcard_main },
+    { "setprop",        setprop_main },
     { "start",          start_main },
     { "stop",           stop_main },
-#ifdef USE_F2FS
-    { "mkfs.f2fs",      make_f2fs_main },
-    { "fsck.f2fs",      fsck_f2fs_main },
-    { "fibmap.f2fs",    fibmap_main },
-#endif
-    { NULL, NULL },
+    { "vdc",            vdc_main },
+    { NULL, NULL },     /* returned on lookup miss */
 };
 
 struct recovery_cmd get_command(char* command) {
-    int i;
+    int lo = 0;
+    int hi = (int)(sizeof(recovery_cmds) / sizeof(recovery_cmds[0])) - 2;
 
-    for (i = 0; recovery_cmds[i].name; i++) {
-        if (strcmp(command, recovery_cmds[i].name) == 0)
-            break;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(command, recovery_cmds[mid].name);
+        if (cmp == 0)
+            return recovery_cmds[mid];
+        if (cmp > 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
     }
 
-    return recovery_cmds[i];
+    return recovery_cmds[sizeof(recovery_cmds) / sizeof(recovery_cmds[0]) - 1];
 }
 #endif
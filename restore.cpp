@@ -9,9 +9,13 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/vfs.h>
+#include <utime.h>
 
 #include <cutils/properties.h>
 
+#include <selinux/label.h>
+#include <selinux/selinux.h>
+
 #include <lib/libtar.h>
 #include <zlib.h>
 
@@ -21,6 +25,10 @@
 
 using namespace android;
 
+// set from the SOD: archive is a delta cut against a previous index,
+// so partitions are layered onto, not formatted
+static int restore_incremental = 0;
+
 static int verify_sod()
 {
     const char* key;
@@ -57,6 +65,9 @@ static int verify_sod()
             if (strcmp(key, "ro.product.device") == 0) {
                 strncpy(val_product, val, sizeof(val_product));
             }
+            if (strcmp(key, "incremental") == 0) {
+                restore_incremental = atoi(val);
+            }
             if (strncmp(key, "fs.", 3) == 0) {
                 char* name = key+3;
                 char* attr = strchr(name, '.');
@@ -162,6 +173,79 @@ static int verify_eod(size_t actual_hash_datalen,
     return rc;
 }
 
+extern struct selabel_handle *sehandle;
+
+/*
+ * Sparse-aware extraction.  tar_extract_file writes every byte of the
+ * entry, so the zeros of a mostly-empty database or image file are
+ * all written back to flash.  For large regular files we extract
+ * manually: runs of all-zero archive blocks are skipped with a seek
+ * and ftruncate pins the final size, so the holes never hit storage.
+ * Metadata comes from the tar header; the security context is
+ * relabeled from file_contexts, which is where a fresh extraction
+ * would get it anyway.
+ */
+#define SPARSE_EXTRACT_MIN (1024 * 1024)
+
+static int tar_extract_file_sparse(TAR* t, const char* pathname)
+{
+    static const char zeros[T_BLOCKSIZE] = { 0 };
+    char buf[T_BLOCKSIZE];
+    uint64_t size = th_get_size(t);
+
+    unlink(pathname);
+    int fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        logmsg("tar_extract_file_sparse: cannot create %s\n", pathname);
+        return -1;
+    }
+
+    uint64_t pos = 0;
+    int rc = 0;
+    while (pos < size) {
+        if (tar_block_read(t, buf) != T_BLOCKSIZE) {
+            logmsg("tar_extract_file_sparse: short read in %s\n", pathname);
+            rc = -1;
+            break;
+        }
+        size_t valid = min(size - pos, (uint64_t)T_BLOCKSIZE);
+        if (memcmp(buf, zeros, T_BLOCKSIZE) != 0) {
+            if (lseek(fd, pos, SEEK_SET) < 0 ||
+                    write(fd, buf, valid) != (ssize_t)valid) {
+                logmsg("tar_extract_file_sparse: write %s failed\n", pathname);
+                rc = -1;
+                break;
+            }
+        }
+        pos += valid;
+    }
+
+    if (rc == 0 && ftruncate(fd, size) != 0) {
+        logmsg("tar_extract_file_sparse: ftruncate %s failed\n", pathname);
+        rc = -1;
+    }
+    if (rc == 0) {
+        fchown(fd, th_get_uid(t), th_get_gid(t));
+        fchmod(fd, th_get_mode(t));
+    }
+    close(fd);
+
+    if (rc == 0) {
+        struct utimbuf times;
+        times.actime = times.modtime = th_get_mtime(t);
+        utime(pathname, &times);
+        if (sehandle) {
+            char* secontext = NULL;
+            if (selabel_lookup(sehandle, &secontext, pathname,
+                    th_get_mode(t)) == 0) {
+                lsetfilecon(pathname, secontext);
+                freecon(secontext);
+            }
+        }
+    }
+    return rc;
+}
+
 static int do_restore_tree()
 {
     int rc = 0;
@@ -223,16 +307,18 @@ static int do_restore_tree()
 
                 // XXX: Assume paths are not interspersed
                 logmsg("do_restore_tree: switching to %s\n", cur_mount);
-                rc = ensure_path_unmounted(cur_mount);
-                if (rc != 0) {
-                    logmsg("do_restore_tree: cannot unmount %s\n", cur_mount);
-                    break;
-                }
-                logmsg("do_restore_tree: formatting %s\n", cur_mount);
-                rc = format_volume(cur_mount);
-                if (rc != 0) {
-                    logmsg("do_restore_tree: cannot format %s\n", cur_mount);
-                    break;
+                if (!restore_incremental) {
+                    rc = ensure_path_unmounted(cur_mount);
+                    if (rc != 0) {
+                        logmsg("do_restore_tree: cannot unmount %s\n", cur_mount);
+                        break;
+                    }
+                    logmsg("do_restore_tree: formatting %s\n", cur_mount);
+                    rc = format_volume(cur_mount);
+                    if (rc != 0) {
+                        logmsg("do_restore_tree: cannot format %s\n", cur_mount);
+                        break;
+                    }
                 }
                 rc = ensure_path_mounted(cur_mount);
                 if (rc != 0) {
@@ -251,6 +337,17 @@ static int do_restore_tree()
             rc = verify_eod(save_hash_datalen, &save_sha_ctx, &save_md5_ctx);
             logmsg("do_restore_tree: tar_verify_eod returned %d\n", rc);
         }
+        else if (!strncmp(pathname, "DEDUP", 5) || !strncmp(pathname, "CHUNK/", 6)) {
+            // deduplicated archives carry recipes and content-addressed
+            // chunks; they must be rehydrated on the host first
+            logmsg("do_restore_tree: dedup archive, rehydrate on host before restoring\n");
+            rc = -1;
+        }
+        else if (!strcmp(pathname, "MANIFEST")) {
+            // full-tree index an incremental was cut against; keep it
+            // out of the restored tree but available for inspection
+            rc = tar_extract_file(tar, "/tmp/bu.manifest");
+        }
         else if (!strcmp(pathname, "boot") || !strcmp(pathname, "recovery")) {
             char mnt[20];
             sprintf(mnt, "/%s", pathname);
@@ -266,7 +363,12 @@ static int do_restore_tree()
         }
         else {
             uint64_t len = th_get_size(tar);
-            rc = tar_extract_file(tar, pathname);
+            if (TH_ISREG(tar) && len >= SPARSE_EXTRACT_MIN) {
+                rc = tar_extract_file_sparse(tar, pathname);
+            }
+            else {
+                rc = tar_extract_file(tar, pathname);
+            }
         }
         free(pathname);
         if (rc != 0) {
@@ -15,7 +15,10 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -120,6 +123,100 @@ static int is_volume_primary_storage(fstab_rec* v)
     return 0;
 }
 
+// volume_for_path backs every ensure_path_mounted call, and the backup
+// and install paths make one of those per file operation.  fs_mgr
+// answers it with a linear strncmp scan of the fstab, and a multi-fs
+// entry (ext4/f2fs lines sharing a mount point) adds a blkid probe of
+// the block device on every call.  Index the table once after the
+// fstab is read: a table sorted by mount point answers a lookup with a
+// binary search, and the entry a blkid probe settles on is remembered
+// so the probe runs once per mount point.
+struct VolumeIndexEntry {
+    const char* mount_point;
+    size_t len;
+    fstab_rec* rec;         // first fstab entry for this mount point
+    fstab_rec* resolved;    // entry picked after fs type detection
+};
+
+static struct VolumeIndexEntry* volume_index = NULL;
+static int volume_index_count = 0;
+
+static int volume_index_cmp(const void* a, const void* b) {
+    const struct VolumeIndexEntry* va = (const struct VolumeIndexEntry*)a;
+    const struct VolumeIndexEntry* vb = (const struct VolumeIndexEntry*)b;
+    int cmp = strcmp(va->mount_point, vb->mount_point);
+    if (cmp == 0) {
+        // Entries sharing a mount point keep fstab order (the recs
+        // array is contiguous) so the resolution walk in
+        // volume_for_path starts where fs_mgr's scan would.
+        return (va->rec < vb->rec) ? -1 : 1;
+    }
+    return cmp;
+}
+
+static void build_volume_index() {
+    int i;
+    int n = 0;
+    int out;
+
+    free(volume_index);
+    volume_index = (struct VolumeIndexEntry*)calloc(fstab->num_entries,
+            sizeof(struct VolumeIndexEntry));
+    volume_index_count = 0;
+    if (volume_index == NULL) {
+        // Lookups fall back to fs_mgr's scan.
+        return;
+    }
+
+    for (i = 0; i < fstab->num_entries; ++i) {
+        volume_index[n].mount_point = fstab->recs[i].mount_point;
+        volume_index[n].len = strlen(fstab->recs[i].mount_point);
+        volume_index[n].rec = &fstab->recs[i];
+        ++n;
+    }
+    qsort(volume_index, n, sizeof(volume_index[0]), volume_index_cmp);
+
+    // Collapse duplicate mount points to their first fstab entry; the
+    // rest are reached through fs_mgr_get_entry_for_mount_point_after.
+    out = 0;
+    for (i = 0; i < n; ++i) {
+        if (out > 0 && strcmp(volume_index[out-1].mount_point,
+                              volume_index[i].mount_point) == 0) {
+            continue;
+        }
+        volume_index[out++] = volume_index[i];
+    }
+    volume_index_count = out;
+}
+
+// Find the longest mount point that prefixes path, where the prefix
+// ends exactly at a '/' or at the end of the path.  A binary search
+// finds where path itself would sort; every mount point prefixing path
+// sorts at or before that spot with the longest one nearest, so walk
+// back from it.  Recovery fstabs don't nest static mount points, which
+// makes this the same entry fs_mgr's first-match scan returns.
+static struct VolumeIndexEntry* volume_index_lookup(const char* path) {
+    int lo = 0;
+    int hi = volume_index_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(volume_index[mid].mount_point, path) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    // hi is now the last entry sorting at or before path.
+    for (; hi >= 0; --hi) {
+        struct VolumeIndexEntry* e = &volume_index[hi];
+        if (strncmp(path, e->mount_point, e->len) == 0 &&
+                (path[e->len] == '/' || path[e->len] == '\0')) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
 void load_volume_table()
 {
     int i;
@@ -139,6 +236,8 @@ void load_volume_table()
         return;
     }
 
+    build_volume_index();
+
     // Create a boring /etc/fstab so tools like Busybox work
     FILE *file = fopen("/etc/fstab", "w");
     if (file == NULL) {
@@ -225,26 +324,44 @@ void free_storage_items(storage_item* items) {
 }
 
 fstab_rec* volume_for_path(const char* path) {
-    fstab_rec *rec = fs_mgr_get_entry_for_mount_point(fstab, path);
-
-    if (rec == NULL)
-        return rec;
+    fstab_rec *rec;
+    struct VolumeIndexEntry* e = NULL;
+
+    if (volume_index != NULL) {
+        e = volume_index_lookup(path);
+        if (e == NULL)
+            return NULL;
+        if (e->resolved != NULL)
+            return e->resolved;
+        rec = e->rec;
+    } else {
+        rec = fs_mgr_get_entry_for_mount_point(fstab, path);
+        if (rec == NULL)
+            return rec;
+    }
 
     if (strcmp(rec->fs_type, "ext4") == 0 || strcmp(rec->fs_type, "f2fs") == 0 ||
             strcmp(rec->fs_type, "vfat") == 0) {
         char *detected_fs_type = blkid_get_tag_value(NULL, "TYPE", rec->blk_device);
 
+        // A failed probe (device not up yet) isn't cached, so the next
+        // lookup tries again.
         if (detected_fs_type == NULL)
             return rec;
 
         fstab_rec *fetched_rec = rec;
         while (rec != NULL && strcmp(rec->fs_type, detected_fs_type) != 0)
             rec = fs_mgr_get_entry_for_mount_point_after(rec, fstab, path);
+        free(detected_fs_type);
 
         if (rec == NULL)
-            return fetched_rec;
+            rec = fetched_rec;
     }
 
+    // format_volume rebuilds a volume with the fs type of the entry
+    // this lookup returned, so a cached answer stays valid across it.
+    if (e != NULL)
+        e->resolved = rec;
     return rec;
 }
 
@@ -284,7 +401,48 @@ int ensure_path_mounted(const char* path) {
     return ensure_volume_mounted(v);
 }
 
+// scan_mounted_volumes keeps a process-global mount table, so the
+// mount/unmount funnels are serialized; wipe_data formats independent
+// volumes on concurrent threads.
+static pthread_mutex_t mount_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The table is re-read from /proc/mounts only after something has
+// changed it: backup and install paths call ensure_path_mounted per
+// file operation, and the common already-mounted answer should not
+// cost a parse of /proc/mounts every time.  Guarded by
+// mount_state_mutex.
+static bool mount_table_fresh = false;
+
+// Call with mount_state_mutex held.
+static int rescan_mounted_volumes() {
+    if (mount_table_fresh) {
+        return 0;
+    }
+    int result = scan_mounted_volumes();
+    if (result == 0) {
+        mount_table_fresh = true;
+    }
+    return result;
+}
+
+// Mount state changed behind our back (vold events, the updater's own
+// mounts): drop the cache so the next lookup rescans.
+void invalidate_mount_state() {
+    pthread_mutex_lock(&mount_state_mutex);
+    mount_table_fresh = false;
+    pthread_mutex_unlock(&mount_state_mutex);
+}
+
+static int ensure_volume_mounted_locked(fstab_rec* v);
+
 int ensure_volume_mounted(fstab_rec* v) {
+    pthread_mutex_lock(&mount_state_mutex);
+    int result = ensure_volume_mounted_locked(v);
+    pthread_mutex_unlock(&mount_state_mutex);
+    return result;
+}
+
+static int ensure_volume_mounted_locked(fstab_rec* v) {
     if (v == NULL) {
         LOGE("cannot mount unknown volume\n");
         return -1;
@@ -295,7 +453,7 @@ int ensure_volume_mounted(fstab_rec* v) {
     }
 
     int result;
-    result = scan_mounted_volumes();
+    result = rescan_mounted_volumes();
     if (result < 0) {
         LOGE("failed to scan mounted volumes\n");
         return -1;
@@ -312,6 +470,9 @@ int ensure_volume_mounted(fstab_rec* v) {
 
     mkdir_p(v->mount_point, 0755);  // in case it doesn't already exist
 
+    // we're about to change the mount state
+    mount_table_fresh = false;
+
     if (fs_mgr_is_voldmanaged(v)) {
         if (!strcmp(v->mount_point, "auto")) {
             return vold_mount_auto_volume(v->label, 1);
@@ -369,7 +530,16 @@ int ensure_path_unmounted(const char* path, bool detach) {
     return ensure_volume_unmounted(v, detach);
 }
 
+static int ensure_volume_unmounted_locked(fstab_rec* v, bool detach);
+
 int ensure_volume_unmounted(fstab_rec* v, bool detach) {
+    pthread_mutex_lock(&mount_state_mutex);
+    int result = ensure_volume_unmounted_locked(v, detach);
+    pthread_mutex_unlock(&mount_state_mutex);
+    return result;
+}
+
+static int ensure_volume_unmounted_locked(fstab_rec* v, bool detach) {
     if (v == NULL) {
         LOGE("cannot unmount unknown volume\n");
         return -1;
@@ -380,13 +550,14 @@ int ensure_volume_unmounted(fstab_rec* v, bool detach) {
     }
 
     int result;
-    result = scan_mounted_volumes();
+    result = rescan_mounted_volumes();
     if (result < 0) {
         LOGE("failed to scan mounted volumes\n");
         return -1;
     }
 
     if (fs_mgr_is_voldmanaged(v)) {
+        mount_table_fresh = false;
         if (!strcmp(v->mount_point, "auto")) {
             return vold_unmount_auto_volume(v->label, 0, 1, detach);
         }
@@ -400,6 +571,7 @@ int ensure_volume_unmounted(fstab_rec* v, bool detach) {
         return 0;
     }
 
+    mount_table_fresh = false;
     if (detach) {
         result = unmount_mounted_volume_detach(mv);
     }
@@ -463,6 +635,37 @@ static int rmtree_except(const char* path, const char* except)
     return rc;
 }
 
+// Hand a block device's whole extent back to the flash translation
+// layer before rebuilding a filesystem on it.  On eMMC a discard of the
+// full span completes in seconds where overwriting would take minutes,
+// the old data becomes unreadable, and mkfs then lays its metadata onto
+// pre-erased blocks.  BLKSECDISCARD additionally purges remapped copies
+// when the caller needs a guaranteed erase; it falls back to a plain
+// discard where the device doesn't support it.  Failure is not fatal:
+// the mkfs that follows still produces a correct (if slower) wipe.
+static void discard_blk_device(const char* blk_device, bool secure) {
+    int fd = open(blk_device, O_RDWR);
+    if (fd < 0) {
+        LOGW("failed to open %s for discard: %s\n", blk_device, strerror(errno));
+        return;
+    }
+    uint64_t range[2] = { 0, get_file_size(fd) };
+    if (range[1] == 0) {
+        close(fd);
+        return;
+    }
+    int request = secure ? BLKSECDISCARD : BLKDISCARD;
+    if (ioctl(fd, request, &range) < 0) {
+        if (secure && ioctl(fd, BLKDISCARD, &range) == 0) {
+            LOGW("secure discard unsupported on %s, used plain discard\n",
+                 blk_device);
+        } else {
+            LOGW("discard failed on %s: %s\n", blk_device, strerror(errno));
+        }
+    }
+    close(fd);
+}
+
 int format_volume(const char* volume, bool force) {
     if (strcmp(volume, "media") == 0) {
         if (!is_data_media()) {
@@ -584,6 +787,9 @@ int format_volume(const char* volume, bool force) {
         }
         int result;
         if (strcmp(v->fs_type, "ext4") == 0) {
+            // mkfs.f2fs below trims for itself ("-t"); for ext4 discard
+            // the extent here so the wipe doesn't wait on block writes.
+            discard_blk_device(v->blk_device, false);
             result = make_ext4fs(v->blk_device, length, volume, sehandle);
         } else {   /* Has to be f2fs because we checked earlier. */
             char bytes_reserved[10] = {0};
@@ -40,6 +40,10 @@ int ensure_path_mounted(const char* path);
 int ensure_volume_unmounted(fstab_rec *v, bool detach=false);
 int ensure_path_unmounted(const char* path, bool detach=false);
 
+// Drop the cached mount table after something outside the functions
+// above changes mount state (e.g. a vold event).
+void invalidate_mount_state();
+
 // Reformat the given volume (must be the mount point only, eg
 // "/cache"), no paths permitted.  Attempts to unmount the volume if
 // it is mounted.
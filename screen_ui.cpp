@@ -28,6 +28,7 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "bootprofile.h"
 #include "common.h"
 #include "device.h"
 #include "minui/minui.h"
@@ -83,12 +84,28 @@ ScreenRecoveryUI::ScreenRecoveryUI() :
     max_stage(-1) {
 
     headerIcon = NULL;
-    for (int i = 0; i < NR_ICONS; i++)
+    installation = NULL;
+    progressBarEmpty = NULL;
+    progressBarFill = NULL;
+    stageMarkerEmpty = NULL;
+    stageMarkerFill = NULL;
+    for (int i = 0; i < NR_ICONS; i++) {
         backgroundIcon[i] = NULL;
+        backgroundText[i] = NULL;
+    }
 
     memset(text, 0, sizeof(text));
 
+    console_surface = NULL;
+    for (int i = 0; i < kMaxRows; i++) {
+        console_row_dirty[i] = true;
+    }
+    menu_text_surface[0] = NULL;
+    menu_text_surface[1] = NULL;
+    update_pending = false;
+
     pthread_mutex_init(&updateMutex, NULL);
+    pthread_cond_init(&progressCond, NULL);
     self = this;
 }
 
@@ -102,7 +119,8 @@ void ScreenRecoveryUI::draw_background_locked(Icon icon)
 
     if (icon) {
         gr_surface surface = backgroundIcon[icon];
-        if (icon == INSTALLING_UPDATE || icon == ERASING) {
+        if ((icon == INSTALLING_UPDATE || icon == ERASING) &&
+            installation != NULL) {
             surface = installation[installingFrame];
         }
         gr_surface text_surface = backgroundText[icon];
@@ -138,18 +156,26 @@ void ScreenRecoveryUI::draw_background_locked(Icon icon)
     }
 }
 
-// Draw the progress bar (if any) on the screen.  Does not flip pages.
-// Should only be called with updateMutex locked.
+// Redraw just the progress layer: the animation frame and the bar
+// strip.  The rest of the scene (background icon, its caption, stage
+// markers) is retained from the last full draw, so a progress tick
+// only dirties these few rows instead of recomposing the screen.
+// Does not flip pages.  Should only be called with updateMutex locked.
 void ScreenRecoveryUI::draw_progress_locked()
 {
     if (currentIcon == ERROR) return;
 
-    gr_color(0, 0, 0, 255);
-    gr_clear();
-
-    if (currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) {
+    if ((currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) &&
+        installation != NULL) {
         gr_surface icon = installation[installingFrame];
-        gr_blit(icon, 0, 0, gr_get_width(icon), gr_get_height(icon), iconX, iconY);
+        int iconWidth = gr_get_width(icon);
+        int iconHeight = gr_get_height(icon);
+
+        // The frames share one bounding box; repaint all of it so a
+        // partial update can never leave a mix of two frames visible.
+        SetColor(TEXT_FILL);
+        gr_fill(iconX, iconY, iconX+iconWidth, iconY+iconHeight);
+        gr_blit(icon, 0, 0, iconWidth, iconHeight, iconX, iconY);
     }
 
     if (progressBarType != EMPTY) {
@@ -162,7 +188,7 @@ void ScreenRecoveryUI::draw_progress_locked()
 
         // Erase behind the progress bar (in case this was a progress-only update)
         SetColor(TEXT_FILL);
-        gr_fill(dx, dy, width, height);
+        gr_fill(dx, dy, dx+width, dy+height);
 
         if (progressBarType == DETERMINATE) {
             float p = progressScopeStart + progress * progressScopeSize;
@@ -230,19 +256,57 @@ int ScreenRecoveryUI::draw_header_icon()
     return ih;
 }
 
-void ScreenRecoveryUI::draw_menu_item(int textrow, const char *text, int selected)
+// Allocate a 4-byte surface for pre-rendered text, or NULL on failure.
+static gr_surface alloc_text_surface(int width, int height)
 {
+    gr_surface surface = (gr_surface) malloc(sizeof(GRSurface));
+    if (surface == NULL) return NULL;
+    surface->width = width;
+    surface->height = height;
+    surface->row_bytes = width * 4;
+    surface->pixel_bytes = 4;
+    surface->data = (unsigned char*) calloc(height, surface->row_bytes);
+    if (surface->data == NULL) {
+        free(surface);
+        return NULL;
+    }
+    return surface;
+}
+
+static void free_text_surface(gr_surface surface)
+{
+    if (surface == NULL) return;
+    free(surface->data);
+    free(surface);
+}
+
+void ScreenRecoveryUI::draw_menu_item(int textrow, int item, int selected)
+{
+    // The item text was pre-rendered by StartMenu, so moving the
+    // highlight only costs fills and blits.
+    gr_surface strip = menu_text_surface[selected ? 1 : 0];
+
     if (selected) {
         SetColor(MENU_SEL_BG);
         gr_fill(0, (textrow)*char_height,
                 gr_fb_width(), (textrow+3)*char_height-1);
-        SetColor(MENU_SEL_FG);
-        gr_text(4, (textrow+1)*char_height-1, text, 0);
+        if (strip != NULL) {
+            gr_blit(strip, 0, item*char_height, strip->width, char_height,
+                    0, (textrow+1)*char_height-1);
+        } else {
+            SetColor(MENU_SEL_FG);
+            gr_text(4, (textrow+1)*char_height-1, menu[item], 0);
+        }
         SetColor(MENU);
     }
     else {
-        SetColor(MENU);
-        gr_text(4, (textrow+1)*char_height-1, text, 0);
+        if (strip != NULL) {
+            gr_blit(strip, 0, item*char_height, strip->width, char_height,
+                    0, (textrow+1)*char_height-1);
+        } else {
+            SetColor(MENU);
+            gr_text(4, (textrow+1)*char_height-1, menu[item], 0);
+        }
     }
 
     gr_color(SEPARATOR_COLOR);
@@ -339,6 +403,27 @@ void ScreenRecoveryUI::draw_screen_locked()
             int cx, cy;
             gr_set_font("log");
             gr_font_size(&cx, &cy);
+
+            // Each scrollback row is rendered once into a strip of the
+            // cache surface and composited from there, so appending a
+            // line only re-blends that line; scrolling just blits the
+            // unchanged strips at their new positions.
+            if (console_surface == NULL) {
+                console_surface = (gr_surface) malloc(sizeof(GRSurface));
+                if (console_surface != NULL) {
+                    console_surface->width = gr_fb_width();
+                    console_surface->height = log_text_rows * cy;
+                    console_surface->row_bytes = console_surface->width * 4;
+                    console_surface->pixel_bytes = 4;
+                    console_surface->data = (unsigned char*)
+                            malloc(console_surface->row_bytes * console_surface->height);
+                    if (console_surface->data == NULL) {
+                        free(console_surface);
+                        console_surface = NULL;
+                    }
+                }
+            }
+
             // display from the bottom up, until we hit the top of the
             // screen or we've displayed the entire text buffer.
             int ty;
@@ -346,7 +431,18 @@ void ScreenRecoveryUI::draw_screen_locked()
             for (int ty = gr_fb_height() - cy, count = 0;
                  ty > y+2 && count < log_text_rows;
                  ty -= (cy+2), ++count) {
-                gr_text(4, ty, text[row], 0);
+                if (console_surface != NULL) {
+                    if (console_row_dirty[row]) {
+                        memset(console_surface->data + row*cy*console_surface->row_bytes,
+                               0, cy*console_surface->row_bytes);
+                        gr_render_text(console_surface, 4, row*cy, text[row], 0);
+                        console_row_dirty[row] = false;
+                    }
+                    gr_blit(console_surface, 0, row*cy,
+                            console_surface->width, cy, 0, ty);
+                } else {
+                    gr_text(4, ty, text[row], 0);
+                }
                 --row;
                 if (row < 0) row = log_text_rows-1;
             }
@@ -360,7 +456,7 @@ void ScreenRecoveryUI::draw_screen_locked()
             if (nr_items > max_menu_rows)
                 nr_items = max_menu_rows;
             for (int i = 0; i < nr_items; ++i) {
-                draw_menu_item(text_first_row + 3*i, menu[menu_show_start+i],
+                draw_menu_item(text_first_row + 3*i, menu_show_start+i,
                         ((menu_show_start+i) == menu_sel));
             }
         }
@@ -374,65 +470,133 @@ void ScreenRecoveryUI::update_screen_locked()
     draw_screen_locked();
     LOGV("%s: flip %p\n", __func__, __builtin_return_address(0));
     gr_flip();
+    // One flip leaves the other page holding the old scene, so
+    // progress-only updates must re-establish identical pages first.
+    pagesIdentical = false;
 }
 
-// Updates only the progress bar, if possible, otherwise redraws the screen.
+// Updates only the progress layer, if possible, otherwise redraws the
+// screen.  Under double buffering a partial draw lands in the back
+// buffer, so both pages must first hold the identical full scene;
+// after that partial draws can ping-pong between the pages because
+// they repaint their rectangles completely, and each flip copies or
+// pans only the dirtied rows.
 // Should only be called with updateMutex locked.
 void ScreenRecoveryUI::update_progress_locked()
 {
+    if (show_text) {
+        // The text screens don't show the bar; repaint the scene.
+        update_screen_locked();
+        return;
+    }
+    if (!pagesIdentical) {
+        draw_screen_locked();
+        gr_flip();
+        draw_screen_locked();
+        pagesIdentical = true;
+    }
     draw_progress_locked();
     LOGV("%s: flip %p\n", __func__, __builtin_return_address(0));
     gr_flip();
 }
 
-// Keeps the progress bar updated, even when the process is otherwise busy.
-void* ScreenRecoveryUI::progress_thread(void *cookie) {
-    self->progress_loop();
+// Keeps the screen updated (animation, progress bar, queued prints),
+// even when the process is otherwise busy.
+void* ScreenRecoveryUI::render_thread(void *cookie) {
+    self->render_loop();
     return NULL;
 }
 
-void ScreenRecoveryUI::progress_loop() {
+void ScreenRecoveryUI::render_loop() {
+    // minimum of 20ms between frames
     double interval = 1.0 / animation_fps;
-    for (;;) {
-        double start = now();
-        pthread_mutex_lock(&updateMutex);
+    if (interval < 0.02) interval = 0.02;
 
-        int redraw = 0;
+    // pace animation frames off the display until the backend says it
+    // can't (fbdev without the vsync ioctl falls back to the timer)
+    bool use_vsync = true;
 
-        // update the installation animation, if active
-        // skip this if we have a text overlay (too expensive to update)
-        if ((currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) &&
-            installing_frames > 0) {
-            installingFrame = (installingFrame + 1) % installing_frames;
-            redraw = 1;
+    pthread_mutex_lock(&updateMutex);
+    double deadline = now() + interval;
+    for (;;) {
+        // Only the installation animation and a timed progress bar
+        // advance on their own; everything else redraws at the point
+        // where the state changes, or queues an update_pending repaint.
+        bool animating = (currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) &&
+                         progressBarType != EMPTY && installing_frames > 0;
+        bool timed = (progressBarType == DETERMINATE && progressScopeDuration > 0);
+
+        if (!animating && !timed && !update_pending) {
+            // Nothing is moving; sleep until somebody changes the state.
+            pthread_cond_wait(&progressCond, &updateMutex);
+            deadline = now() + interval;
+            continue;
         }
 
-        // move the progress bar forward on timed intervals, if configured
-        int duration = progressScopeDuration;
-        if (progressBarType == DETERMINATE && duration > 0) {
-            double elapsed = now() - progressScopeTime;
-            float p = 1.0 * elapsed / duration;
-            if (p > 1.0) p = 1.0;
-            if (p > progress) {
-                progress = p;
-                redraw = 1;
+        double start = now();
+        if (!update_pending && start < deadline) {
+            if (animating && use_vsync) {
+                // Align animation frames with the display: drop the
+                // lock so Print isn't blocked behind the wait.
+                pthread_mutex_unlock(&updateMutex);
+                if (gr_wait_vsync() < 0) use_vsync = false;
+                pthread_mutex_lock(&updateMutex);
+            } else {
+                // Sleep off the rest of this frame, but let state
+                // changes (e.g. the bar being turned off) wake us early.
+                struct timespec ts;
+                ts.tv_sec = (time_t) deadline;
+                ts.tv_nsec = (long) ((deadline - ts.tv_sec) * 1e9);
+                pthread_cond_timedwait(&progressCond, &updateMutex, &ts);
             }
+            continue;
         }
 
-        if (redraw) update_progress_locked();
-
-        pthread_mutex_unlock(&updateMutex);
+        int redraw = 0;
 
-        if (progressBarType == EMPTY)
-            break;
+        if ((animating || timed) && start >= deadline) {
+            // Absolute deadlines keep the animation from drifting when
+            // a frame is delivered late; don't try to catch up by more
+            // than one frame, though.
+            deadline += interval;
+            if (deadline < start) deadline = start + interval;
+
+            // update the installation animation, if active
+            // skip this if we have a text overlay (too expensive to update)
+            if (animating) {
+                // Derive the frame from the clock so a late wakeup
+                // under I/O load drops frames instead of sliding the
+                // whole animation.
+                int frame = ((int) (start * animation_fps)) % installing_frames;
+                if (frame != installingFrame) {
+                    installingFrame = frame;
+                    redraw = 1;
+                }
+            }
 
-        double end = now();
-        // minimum of 20ms delay between frames
-        double delay = interval - (end-start);
-        if (delay < 0.02) delay = 0.02;
-        usleep((long)(delay * 1000000));
+            // move the progress bar forward on timed intervals, if configured
+            int duration = progressScopeDuration;
+            if (progressBarType == DETERMINATE && duration > 0) {
+                double elapsed = now() - progressScopeTime;
+                float p = 1.0 * elapsed / duration;
+                if (p > 1.0) p = 1.0;
+                if (p > progress) {
+                    progress = p;
+                    redraw = 1;
+                }
+            }
+        }
 
+        if (update_pending) {
+            // However many Print calls queued up since the last pass
+            // coalesce into this one repaint.
+            update_pending = false;
+            update_screen_locked();
+        } else if (redraw) {
+            update_progress_locked();
+        }
     }
+    pthread_mutex_unlock(&updateMutex);
 }
 
 void ScreenRecoveryUI::LoadBitmap(const char* filename, gr_surface* surface, const char* theme_name = "default") {
@@ -476,8 +640,11 @@ void ScreenRecoveryUI::LoadLocalizedBitmap(const char* filename, gr_surface* sur
 
 void ScreenRecoveryUI::ResetIcons()
 {
-    pthread_mutex_lock(&updateMutex);
+    // InitIcons takes updateMutex itself as it publishes each group of
+    // surfaces, so it must not be called with the lock held.
     ScreenRecoveryUI::InitIcons();
+
+    pthread_mutex_lock(&updateMutex);
     update_screen_locked();
     pthread_mutex_unlock(&updateMutex);
 
@@ -493,28 +660,82 @@ void ScreenRecoveryUI::InitIcons()
     /*
     Battery icon stuff will go here later
      */
+    LoadRemainingIcons();
+}
+
+// Load everything except the header icon, decoding outside updateMutex
+// and publishing each group of surfaces under it, so early frames can
+// be drawn while the rest of the images are still decoding.  The draw
+// paths treat a surface that hasn't arrived yet as absent.
+void ScreenRecoveryUI::LoadRemainingIcons()
+{
+    int frames = 0;
+    gr_surface* anim = NULL;
+    gr_surface info = NULL;
+    gr_surface error = NULL;
+
+    LoadBitmapArray("icon_installing", &frames, &anim);
+    LoadBitmap("icon_info", &info);
+    LoadBitmap("icon_error", &error);
+
+    pthread_mutex_lock(&updateMutex);
     backgroundIcon[NONE] = NULL;
-    LoadBitmapArray("icon_installing", &installing_frames, &installation);
-    backgroundIcon[INSTALLING_UPDATE] = installing_frames ? installation[0] : NULL;
+    installation = anim;
+    installing_frames = frames;
+    backgroundIcon[INSTALLING_UPDATE] = frames ? anim[0] : NULL;
     backgroundIcon[ERASING] = backgroundIcon[INSTALLING_UPDATE];
-    LoadBitmap("icon_info", &backgroundIcon[INFO]);
-    LoadBitmap("icon_error", &backgroundIcon[ERROR]);
-    backgroundIcon[NO_COMMAND] = backgroundIcon[ERROR];
+    backgroundIcon[INFO] = info;
+    backgroundIcon[ERROR] = error;
+    backgroundIcon[NO_COMMAND] = error;
+    pthread_mutex_unlock(&updateMutex);
+
+    gr_surface progress_empty = NULL;
+    gr_surface progress_fill = NULL;
+    gr_surface stage_empty = NULL;
+    gr_surface stage_fill = NULL;
+
+    LoadBitmap("progress_empty", &progress_empty);
+    LoadBitmap("progress_fill", &progress_fill);
+    LoadBitmap("stage_empty", &stage_empty);
+    LoadBitmap("stage_fill", &stage_fill);
+
+    pthread_mutex_lock(&updateMutex);
+    progressBarEmpty = progress_empty;
+    progressBarFill = progress_fill;
+    stageMarkerEmpty = stage_empty;
+    stageMarkerFill = stage_fill;
+    pthread_mutex_unlock(&updateMutex);
+
+    gr_surface installing_text = NULL;
+    gr_surface erasing_text = NULL;
+    gr_surface no_command_text = NULL;
+    gr_surface error_text = NULL;
 
-    LoadBitmap("progress_empty", &progressBarEmpty);
-    LoadBitmap("progress_fill", &progressBarFill);
-    LoadBitmap("stage_empty", &stageMarkerEmpty);
-    LoadBitmap("stage_fill", &stageMarkerFill);
+    LoadLocalizedBitmap("installing_text", &installing_text);
+    LoadLocalizedBitmap("erasing_text", &erasing_text);
+    LoadLocalizedBitmap("no_command_text", &no_command_text);
+    LoadLocalizedBitmap("error_text", &error_text);
 
-    LoadLocalizedBitmap("installing_text", &backgroundText[INSTALLING_UPDATE]);
-    LoadLocalizedBitmap("erasing_text", &backgroundText[ERASING]);
-    LoadLocalizedBitmap("no_command_text", &backgroundText[NO_COMMAND]);
-    LoadLocalizedBitmap("error_text", &backgroundText[ERROR]);
+    pthread_mutex_lock(&updateMutex);
+    backgroundText[INSTALLING_UPDATE] = installing_text;
+    backgroundText[ERASING] = erasing_text;
+    backgroundText[NO_COMMAND] = no_command_text;
+    backgroundText[ERROR] = error_text;
+    pthread_mutex_unlock(&updateMutex);
+}
+
+void* ScreenRecoveryUI::icons_thread(void* cookie)
+{
+    ScreenRecoveryUI* self = (ScreenRecoveryUI*)cookie;
+    self->LoadRemainingIcons();
+    return NULL;
 }
 
 void ScreenRecoveryUI::Init()
 {
+    uint64_t gr_start = boot_profile_now();
     gr_init();
+    boot_profile_report("minui gr_init", gr_start, boot_profile_now());
 
     gr_set_font("log");
     gr_font_size(&log_char_width, &log_char_height);
@@ -534,12 +755,25 @@ void ScreenRecoveryUI::Init()
     text_cols = gr_fb_width() / char_width;
     if (text_cols > kMaxCols - 1) text_cols = kMaxCols - 1;
 
-    ScreenRecoveryUI::InitIcons();
+    // Load the header now -- the text layout below depends on its
+    // size -- and stream the remaining surfaces in on a background
+    // thread so the first frame isn't waiting behind dozens of PNG
+    // decodes.
+    uint64_t res_start = boot_profile_now();
+    LoadBitmap("icon_header", &headerIcon);
+    header_height = gr_get_height(headerIcon);
+    header_width = gr_get_width(headerIcon);
+    boot_profile_report("minui resources", res_start, boot_profile_now());
+    if (pthread_create(&icons_t, NULL, icons_thread, this) != 0) {
+        LoadRemainingIcons();
+    }
 
     text_first_row = (header_height / char_height) + 1;
     menu_item_start = text_first_row * char_height;
     max_menu_rows = (text_rows - text_first_row) / 3;
 
+    pthread_create(&render_t, NULL, render_thread, NULL);
+
     RecoveryUI::Init();
 }
 
@@ -576,6 +810,8 @@ void ScreenRecoveryUI::SetBackground(Icon icon)
     currentIcon = icon;
     update_screen_locked();
 
+    // the icon change may start or stop the installation animation
+    pthread_cond_broadcast(&progressCond);
     pthread_mutex_unlock(&updateMutex);
 }
 
@@ -584,14 +820,14 @@ void ScreenRecoveryUI::SetProgressType(ProgressType type)
     pthread_mutex_lock(&updateMutex);
     if (progressBarType != type) {
         progressBarType = type;
-        if (progressBarType != EMPTY) {
-            pthread_create(&progress_t, NULL, progress_thread, NULL);
-        }
     }
     progressScopeStart = 0;
     progressScopeSize = 0;
     progress = 0;
     update_progress_locked();
+    // wake the progress thread so it notices the new type (and exits,
+    // if the bar was just turned off)
+    pthread_cond_broadcast(&progressCond);
     pthread_mutex_unlock(&updateMutex);
 }
 
@@ -605,6 +841,7 @@ void ScreenRecoveryUI::ShowProgress(float portion, float seconds)
     progressScopeDuration = seconds;
     progress = 0;
     update_progress_locked();
+    pthread_cond_broadcast(&progressCond);
     pthread_mutex_unlock(&updateMutex);
 }
 
@@ -646,17 +883,23 @@ void ScreenRecoveryUI::Print(const char *fmt, ...)
     pthread_mutex_lock(&updateMutex);
     if (log_text_rows > 0 && log_text_cols > 0) {
         char *ptr;
+        console_row_dirty[text_row] = true;
         for (ptr = buf; *ptr != '\0'; ++ptr) {
             if (*ptr == '\n' || text_col >= log_text_cols) {
                 text[text_row][text_col] = '\0';
                 text_col = 0;
                 text_row = (text_row + 1) % log_text_rows;
                 if (text_row == text_top) text_top = (text_top + 1) % log_text_rows;
+                console_row_dirty[text_row] = true;
             }
             if (*ptr != '\n') text[text_row][text_col++] = *ptr;
         }
         text[text_row][text_col] = '\0';
-        update_screen_locked();
+        // Queue the repaint for the render thread rather than drawing
+        // here: a chatty updater-script isn't throttled by the panel,
+        // and a burst of lines coalesces into one redraw.
+        update_pending = true;
+        pthread_cond_broadcast(&progressCond);
     }
     pthread_mutex_unlock(&updateMutex);
 }
@@ -665,6 +908,9 @@ void ScreenRecoveryUI::ClearLog()
 {
     memset(text, 0, sizeof(text));
     text_col = text_row = 0;
+    for (int i = 0; i < kMaxRows; i++) {
+        console_row_dirty[i] = true;
+    }
 }
 
 void ScreenRecoveryUI::DialogShowInfo(const char* text)
@@ -731,6 +977,30 @@ void ScreenRecoveryUI::StartMenu(const char* const * headers, const char* const
             menu[i][text_cols-1] = '\0';
         }
         menu_items = i;
+
+        // Pre-render every item in both the normal and highlighted
+        // colors; draw_menu_item composites from these so navigating
+        // doesn't re-render any text.
+        gr_set_font("menu");
+        for (int v = 0; v < 2; ++v) {
+            free_text_surface(menu_text_surface[v]);
+            menu_text_surface[v] =
+                    alloc_text_surface(gr_fb_width(), menu_items * char_height);
+        }
+        if (menu_text_surface[0] != NULL && menu_text_surface[1] != NULL) {
+            for (int j = 0; j < menu_items; ++j) {
+                SetColor(MENU);
+                gr_render_text(menu_text_surface[0], 4, j*char_height, menu[j], 0);
+                SetColor(MENU_SEL_FG);
+                gr_render_text(menu_text_surface[1], 4, j*char_height, menu[j], 0);
+            }
+        } else {
+            free_text_surface(menu_text_surface[0]);
+            free_text_surface(menu_text_surface[1]);
+            menu_text_surface[0] = NULL;
+            menu_text_surface[1] = NULL;
+        }
+
         show_menu = 1;
         menu_sel = initial_selection;
         if (menu_show_start <= menu_sel - max_menu_rows ||
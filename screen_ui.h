@@ -81,6 +81,7 @@ class ScreenRecoveryUI : public RecoveryUI {
     bool rtl_locale;
 
     pthread_mutex_t updateMutex;
+    pthread_cond_t progressCond;
     gr_surface headerIcon;
     gr_surface backgroundIcon[NR_ICONS];
     gr_surface backgroundText[NR_ICONS];
@@ -107,6 +108,10 @@ class ScreenRecoveryUI : public RecoveryUI {
 
     // Log text overlay, displayed when a magic key is pressed
     char text[kMaxRows][kMaxCols];
+    // Cache of the rendered scrollback: one strip per text row, so a
+    // redraw only re-blends rows whose contents changed.
+    gr_surface console_surface;
+    bool console_row_dirty[kMaxRows];
     int log_text_cols, log_text_rows;
     int text_cols, text_rows;
     int text_col, text_row, text_top;
@@ -118,6 +123,11 @@ class ScreenRecoveryUI : public RecoveryUI {
     bool dialog_show_log;
 
     char menu[kMaxMenuRows][kMaxMenuCols];
+    // Pre-rendered menu item text, one strip per item, in the normal
+    // ([0]) and highlighted ([1]) colors; rebuilt by StartMenu.  NULL
+    // when the allocation failed, in which case draw_menu_item falls
+    // back to gr_text.
+    gr_surface menu_text_surface[2];
     bool show_menu;
     int menu_items, menu_sel;
     int menu_show_start;
@@ -125,7 +135,11 @@ class ScreenRecoveryUI : public RecoveryUI {
 
     int menu_item_start;
 
-    pthread_t progress_t;
+    pthread_t render_t;
+    pthread_t icons_t;
+    // set under updateMutex when the scrollback changed; tells the
+    // render thread to repaint (coalescing any number of prints)
+    bool update_pending;
 
     int animation_fps;
     int installing_frames;
@@ -146,13 +160,15 @@ class ScreenRecoveryUI : public RecoveryUI {
     void draw_background_locked(Icon icon);
     void draw_progress_locked();
     int  draw_header_icon();
-    void draw_menu_item(int textrow, const char *text, int selected);
+    void draw_menu_item(int textrow, int item, int selected);
     void draw_dialog();
     void draw_screen_locked();
     void update_screen_locked();
     void update_progress_locked();
-    static void* progress_thread(void* cookie);
-    void progress_loop();
+    static void* render_thread(void* cookie);
+    void render_loop();
+    static void* icons_thread(void* cookie);
+    void LoadRemainingIcons();
 
     void LoadBitmap(const char* filename, gr_surface* surface, const char* theme_name);
     void LoadBitmapArray(const char* filename, int* frames, gr_surface** surface, const char* theme_name);
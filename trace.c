@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define TRACE_FILE "/tmp/recovery-trace.json"
+
+// Per-thread event capacity.  At ~100 spans per install this is
+// generous; once a buffer fills, further events on that thread are
+// dropped rather than flushed (keeps the hot path to one store and
+// one counter increment, no locks, no I/O).
+#define TRACE_EVENTS_PER_THREAD 4096
+#define TRACE_MAX_THREADS 16
+
+typedef struct {
+    const char* name;    // literal; NULL for 'E' events
+    uint64_t ts_us;
+    char phase;          // 'B' begin, 'E' end, 'i' instant
+} TraceEvent;
+
+typedef struct {
+    pid_t tid;
+    int count;
+    TraceEvent events[TRACE_EVENTS_PER_THREAD];
+} TraceBuffer;
+
+// The registry mutex guards buffer creation and the dump; appends only
+// touch the calling thread's own buffer.
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer* trace_buffers[TRACE_MAX_THREADS];
+static int trace_buffer_count = 0;
+
+static __thread TraceBuffer* t_buffer = NULL;
+
+static uint64_t trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static TraceBuffer* trace_get_buffer(void) {
+    if (t_buffer != NULL) return t_buffer;
+
+    TraceBuffer* buf = calloc(1, sizeof(TraceBuffer));
+    if (buf == NULL) return NULL;
+    buf->tid = syscall(__NR_gettid);
+
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_buffer_count < TRACE_MAX_THREADS) {
+        if (trace_buffer_count == 0) {
+            // Normal process exit still gets a dump; reboot paths must
+            // call trace_dump() themselves (see trace.h).
+            atexit(trace_dump);
+        }
+        trace_buffers[trace_buffer_count++] = buf;
+        t_buffer = buf;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+
+    if (t_buffer == NULL) free(buf);   // registry full; drop events
+    return t_buffer;
+}
+
+static void trace_event(const char* name, char phase) {
+    TraceBuffer* buf = trace_get_buffer();
+    if (buf == NULL || buf->count >= TRACE_EVENTS_PER_THREAD) return;
+
+    TraceEvent* ev = &buf->events[buf->count];
+    ev->name = name;
+    ev->ts_us = trace_now_us();
+    ev->phase = phase;
+    ++buf->count;
+}
+
+void trace_begin(const char* name) {
+    trace_event(name, 'B');
+}
+
+void trace_end(void) {
+    trace_event(NULL, 'E');
+}
+
+void trace_instant(const char* name) {
+    trace_event(name, 'i');
+}
+
+// Writes everything recorded so far as a chrome://tracing JSON array.
+// Reentrant-safe via the registry mutex; each call rewrites the whole
+// file, so the last dumper wins (updater runs and exits before
+// recovery does, so recovery's file is the one left behind; the
+// updater's view survives in its own dump until then).
+void trace_dump(void) {
+    pthread_mutex_lock(&trace_mutex);
+
+    FILE* f = fopen(TRACE_FILE, "w");
+    if (f == NULL) {
+        pthread_mutex_unlock(&trace_mutex);
+        return;
+    }
+
+    pid_t pid = getpid();
+    int first = 1;
+    int i, j;
+
+    fputs("{\"traceEvents\":[", f);
+    for (i = 0; i < trace_buffer_count; ++i) {
+        TraceBuffer* buf = trace_buffers[i];
+        for (j = 0; j < buf->count; ++j) {
+            TraceEvent* ev = &buf->events[j];
+            if (!first) fputc(',', f);
+            first = 0;
+            fprintf(f, "\n{\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%d",
+                    ev->phase, (unsigned long long)ev->ts_us, pid, buf->tid);
+            if (ev->name != NULL) {
+                fprintf(f, ",\"name\":\"%s\"", ev->name);
+            }
+            if (ev->phase == 'i') {
+                fputs(",\"s\":\"t\"", f);
+            }
+            fputs("}", f);
+        }
+    }
+    fputs("\n]}\n", f);
+    fclose(f);
+
+    pthread_mutex_unlock(&trace_mutex);
+}
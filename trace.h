@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_TRACE_H
+#define RECOVERY_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Lightweight trace-event recorder.  Events go into a per-thread
+// buffer with no locking on the hot path; trace_dump() (registered
+// with atexit on first use, and callable explicitly before a reboot
+// since atexit handlers don't run then) writes everything as
+// chrome://tracing JSON to /tmp/recovery-trace.json.  Load that file
+// in chrome://tracing or Perfetto to see the install timeline.
+//
+// Name strings must outlive the process (string literals).
+
+void trace_begin(const char* name);
+void trace_end(void);
+void trace_instant(const char* name);
+void trace_dump(void);
+
+#ifdef __cplusplus
+}
+
+// Scoped span for C++ callers.
+class ScopedTrace {
+  public:
+    explicit ScopedTrace(const char* name) { trace_begin(name); }
+    ~ScopedTrace() { trace_end(); }
+};
+
+#define TRACE_SCOPE(name) ScopedTrace _trace_scope_(name)
+#endif
+
+#endif  // RECOVERY_TRACE_H
@@ -28,6 +28,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include <cutils/android_reboot.h>
 #include <cutils/properties.h>
@@ -236,7 +237,8 @@ RecoveryUI::RecoveryUI() :
     enable_reboot(true),
     consecutive_power_keys(0),
     consecutive_alternate_keys(0),
-    last_key(-1) {
+    last_key(-1),
+    long_press_timer(-1) {
     pthread_mutex_init(&key_queue_mutex, NULL);
     pthread_cond_init(&key_queue_cond, NULL);
 
@@ -253,6 +255,10 @@ void RecoveryUI::Init() {
     ev_init(input_callback, NULL);
     message_socket.ServerInit();
     ev_add_fd(message_socket.fd(), message_socket_listen_event, &message_socket);
+    long_press_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (long_press_timer >= 0) {
+        ev_add_fd(long_press_timer, long_press_cb, this);
+    }
     pthread_create(&input_t, NULL, input_thread, NULL);
 }
 
@@ -338,19 +344,25 @@ void RecoveryUI::process_key(input_device* dev, int key_code, int updown) {
         ++key_down_count;
         key_last_down = key_code;
         key_long_press = false;
-        pthread_t th;
-        key_timer_t* info = new key_timer_t;
-        info->ui = this;
-        info->key_code = key_code;
-        info->count = key_down_count;
-        pthread_create(&th, NULL, &RecoveryUI::time_key_helper, info);
-        pthread_detach(th);
+        // (re)arm the long-press timer; arming for a new key
+        // supersedes whatever deadline the previous key had
+        if (long_press_timer >= 0) {
+            struct itimerspec its;
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_nsec = 750000000;  // 750 ms == "long"
+            timerfd_settime(long_press_timer, 0, &its, NULL);
+        }
     } else {
         if (key_last_down == key_code) {
             long_press = key_long_press;
             register_key = true;
         }
         key_last_down = -1;
+        if (long_press_timer >= 0) {
+            struct itimerspec its;
+            memset(&its, 0, sizeof(its));
+            timerfd_settime(long_press_timer, 0, &its, NULL);  // disarm
+        }
     }
     reboot_enabled = enable_reboot;
     pthread_mutex_unlock(&key_queue_mutex);
@@ -526,22 +538,25 @@ void RecoveryUI::process_rel(input_device* dev, int code, int value) {
 #endif
 }
 
-void* RecoveryUI::time_key_helper(void* cookie) {
-    key_timer_t* info = (key_timer_t*) cookie;
-    info->ui->time_key(info->key_code, info->count);
-    delete info;
-    return NULL;
-}
+// Fires in the input epoll loop 750ms after a key-down that was never
+// followed by a key-up (which disarms the timer).
+int RecoveryUI::long_press_cb(int fd, uint32_t epevents, void* data) {
+    RecoveryUI* ui = (RecoveryUI*) data;
+    uint64_t ticks;
+    int key = -1;
 
-void RecoveryUI::time_key(int key_code, int count) {
-    usleep(750000);  // 750 ms == "long"
-    bool long_press = false;
-    pthread_mutex_lock(&key_queue_mutex);
-    if (key_last_down == key_code && key_down_count == count) {
-        long_press = key_long_press = true;
+    if (read(fd, &ticks, sizeof(ticks)) != (ssize_t) sizeof(ticks))
+        return -1;
+
+    pthread_mutex_lock(&ui->key_queue_mutex);
+    if (ui->key_last_down >= 0) {
+        ui->key_long_press = true;
+        key = ui->key_last_down;
     }
-    pthread_mutex_unlock(&key_queue_mutex);
-    if (long_press) KeyLongPress(key_code);
+    pthread_mutex_unlock(&ui->key_queue_mutex);
+
+    if (key >= 0) ui->KeyLongPress(key);
+    return 0;
 }
 
 void RecoveryUI::calibrate_touch(input_device* dev) {
@@ -731,10 +746,26 @@ void RecoveryUI::EnqueueKey(int key_code) {
         }
         return;
     }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    double t = tv.tv_sec + tv.tv_usec / 1000000.0;
+
     pthread_mutex_lock(&key_queue_mutex);
     const int queue_max = sizeof(key_queue) / sizeof(key_queue[0]);
-    if (key_queue_len < queue_max) {
-        key_queue[key_queue_len++] = key_code;
+    // Coalesce key repeats: if the same key is already waiting at the
+    // tail and this one arrived within the auto-repeat window, fold it
+    // into the pending one.  A held volume key then scrolls as fast as
+    // the menu can repaint instead of piling up a backlog that keeps
+    // scrolling after release; distinct presses (or an empty queue)
+    // are never folded.
+    if (key_queue_len > 0 &&
+        key_queue[key_queue_len-1] == key_code &&
+        t - key_queue_time[key_queue_len-1] < 0.25) {
+        key_queue_time[key_queue_len-1] = t;
+    } else if (key_queue_len < queue_max) {
+        key_queue[key_queue_len] = key_code;
+        key_queue_time[key_queue_len] = t;
+        key_queue_len++;
         pthread_cond_signal(&key_queue_cond);
     }
     pthread_mutex_unlock(&key_queue_mutex);
@@ -753,8 +784,12 @@ void* RecoveryUI::input_thread(void *cookie)
 
 void RecoveryUI::CancelWaitKey()
 {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
     pthread_mutex_lock(&key_queue_mutex);
     key_queue[key_queue_len] = -2;
+    key_queue_time[key_queue_len] = tv.tv_sec + tv.tv_usec / 1000000.0;
     key_queue_len++;
     pthread_cond_signal(&key_queue_cond);
     pthread_mutex_unlock(&key_queue_mutex);
@@ -790,7 +825,9 @@ int RecoveryUI::WaitKey()
     int key = -1;
     if (key_queue_len > 0) {
         key = key_queue[0];
-        memcpy(&key_queue[0], &key_queue[1], sizeof(int) * --key_queue_len);
+        --key_queue_len;
+        memcpy(&key_queue[0], &key_queue[1], sizeof(int) * key_queue_len);
+        memcpy(&key_queue_time[0], &key_queue_time[1], sizeof(double) * key_queue_len);
     }
     pthread_mutex_unlock(&key_queue_mutex);
     return key;
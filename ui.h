@@ -213,6 +213,7 @@ private:
     pthread_mutex_t key_queue_mutex;
     pthread_cond_t key_queue_cond;
     int key_queue[256], key_queue_len;
+    double key_queue_time[256];        // enqueue time, for repeat coalescing
     char key_pressed[KEY_MAX + 1];     // under key_queue_mutex
     int key_last_down;                 // under key_queue_mutex
     bool key_long_press;               // under key_queue_mutex
@@ -232,11 +233,9 @@ private:
 
     MessageSocket message_socket;
 
-    typedef struct {
-        RecoveryUI* ui;
-        int key_code;
-        int count;
-    } key_timer_t;
+    // One-shot timerfd in the input epoll loop, armed on key-down to
+    // detect long presses; -1 if it couldn't be created.
+    int long_press_timer;
 
     pthread_t input_t;
 
@@ -249,8 +248,7 @@ private:
     bool usb_connected();
     bool VolumesChanged();
 
-    static void* time_key_helper(void* cookie);
-    void time_key(int key_code, int count);
+    static int long_press_cb(int fd, uint32_t epevents, void* data);
 
     void process_touch(int fd, struct input_event *ev);
     void calibrate_touch(input_device* dev);
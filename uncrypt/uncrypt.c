@@ -39,13 +39,16 @@
 // Recovery can take this block map file and retrieve the underlying
 // file data to use as an update package.
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <linux/fs.h>
+#include <linux/fiemap.h>
 #include <sys/mman.h>
 
 #define LOG_TAG "uncrypt"
@@ -105,6 +108,283 @@ void add_block_to_ranges(int** ranges, int* range_alloc, int* range_used, int ne
     }
 }
 
+// Append the half-open block range [start, start+count) to the range
+// list, merging with the current range when contiguous.
+static void add_range_to_ranges(int** ranges, int* range_alloc, int* range_used,
+                                int start, int count)
+{
+    if ((*ranges)[*range_used*2-2] < 0) {
+        (*ranges)[*range_used*2-2] = start;
+        (*ranges)[*range_used*2-1] = start + count;
+        return;
+    }
+    if (start == (*ranges)[*range_used*2-1]) {
+        (*ranges)[*range_used*2-1] += count;
+        return;
+    }
+    if (*range_used >= *range_alloc) {
+        *range_alloc *= 2;
+        *ranges = realloc(*ranges, *range_alloc * 2 * sizeof(int));
+    }
+    ++*range_used;
+    (*ranges)[*range_used*2-2] = start;
+    (*ranges)[*range_used*2-1] = start + count;
+}
+
+// One-shot extent map.  A single FIEMAP pass yields the contiguous
+// ranges directly, where FIBMAP costs one ioctl per block.  Returns 0
+// and fills the range list when the kernel hands back a complete,
+// plainly-mapped file; -1 means the caller should fall back to
+// FIBMAP.
+#define FIEMAP_CHUNK 128
+
+static int map_blocks_fiemap(int fd, const struct stat* sb,
+                             int** ranges, int* range_alloc, int* range_used)
+{
+    struct {
+        struct fiemap fm;
+        struct fiemap_extent extents[FIEMAP_CHUNK];
+    } query;
+
+    int blocks = ((sb->st_size-1) / sb->st_blksize) + 1;
+    uint64_t pos = 0;
+    int mapped = 0;
+    int last = 0;
+
+    while (pos < (uint64_t)sb->st_size && !last) {
+        memset(&query, 0, sizeof(query));
+        query.fm.fm_start = pos;
+        query.fm.fm_length = sb->st_size - pos;
+        query.fm.fm_flags = FIEMAP_FLAG_SYNC;
+        query.fm.fm_extent_count = FIEMAP_CHUNK;
+        if (ioctl(fd, FS_IOC_FIEMAP, &query.fm) != 0) {
+            ALOGI("FIEMAP failed (%s), falling back to FIBMAP\n", strerror(errno));
+            return -1;
+        }
+        if (query.fm.fm_mapped_extents == 0) {
+            ALOGE("FIEMAP returned no extents at %llu\n", (unsigned long long)pos);
+            return -1;
+        }
+        uint32_t i;
+        for (i = 0; i < query.fm.fm_mapped_extents; ++i) {
+            struct fiemap_extent* e = &query.fm.fm_extents[i];
+            // Only plain, fully materialized extents translate into
+            // block-device reads; anything else needs the per-block
+            // path (which will hit the same wall and fail loudly).
+            if (e->fe_flags & (FIEMAP_EXTENT_UNKNOWN |
+                               FIEMAP_EXTENT_DELALLOC |
+                               FIEMAP_EXTENT_ENCODED |
+                               FIEMAP_EXTENT_DATA_INLINE |
+                               FIEMAP_EXTENT_UNWRITTEN)) {
+                ALOGI("extent flags %x not mappable, falling back to FIBMAP\n",
+                      e->fe_flags);
+                return -1;
+            }
+            if (e->fe_logical != pos ||
+                (e->fe_logical % sb->st_blksize) != 0 ||
+                (e->fe_physical % sb->st_blksize) != 0) {
+                ALOGE("unaligned or discontiguous extent at %llu\n",
+                      (unsigned long long)e->fe_logical);
+                return -1;
+            }
+            int count = (e->fe_length + sb->st_blksize - 1) / sb->st_blksize;
+            if (mapped + count > blocks) {
+                count = blocks - mapped;
+            }
+            add_range_to_ranges(ranges, range_alloc, range_used,
+                                e->fe_physical / sb->st_blksize, count);
+            mapped += count;
+            pos = e->fe_logical + e->fe_length;
+            if (e->fe_flags & FIEMAP_EXTENT_LAST) {
+                last = 1;
+                break;
+            }
+        }
+    }
+
+    if (mapped != blocks) {
+        ALOGE("FIEMAP mapped %d of %d blocks\n", mapped, blocks);
+        return -1;
+    }
+    return 0;
+}
+
+// With the whole map known up front, the encrypted-device rewrite can
+// copy the file onto its own blocks range by range in large chunks
+// instead of a block at a time.  Each write is pushed into writeback
+// immediately and a blocking sync bounds the dirty data every
+// SYNC_INTERVAL bytes, so the page cache never balloons and the
+// device stays busy instead of absorbing one giant flush at close.
+//
+// The copy is double-buffered across two threads: the main thread
+// reads (and decrypts, on an encrypted device) chunk N+1 into one
+// buffer while a writer thread drains chunk N from the other onto the
+// raw device.  The read path through dm-crypt and the write path to
+// the raw device don't contend, so overlapping them hides the cheaper
+// side entirely instead of strictly alternating.
+#define COPY_CHUNK (4 * 1024 * 1024)
+#define SYNC_INTERVAL (16 * 1024 * 1024)
+
+struct copy_pipeline {
+    int wfd;
+    unsigned char* buf[2];
+    size_t len[2];          // padded byte count ready in buf[n]
+    off64_t offset[2];      // device offset for buf[n]
+    int ready[2];           // buf[n] belongs to the writer
+    int done;               // no more chunks coming
+    int error;              // sticky failure from either side
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void* copy_writer_thread(void* cookie)
+{
+    struct copy_pipeline* p = (struct copy_pipeline*)cookie;
+    uint64_t dirty = 0;
+    int idx = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->ready[idx] && !p->done) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (!p->ready[idx]) {
+            break;      // done, and the last chunk has been drained
+        }
+        int rc = 0;
+        if (!p->error) {
+            size_t len = p->len[idx];
+            off64_t offset = p->offset[idx];
+            unsigned char* buf = p->buf[idx];
+            pthread_mutex_unlock(&p->lock);
+            rc = write_at_offset(buf, len, p->wfd, offset);
+            if (rc == 0) {
+                sync_file_range(p->wfd, offset, len, SYNC_FILE_RANGE_WRITE);
+                dirty += len;
+                if (dirty >= SYNC_INTERVAL) {
+                    sync_file_range(p->wfd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+                            SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                    dirty = 0;
+                }
+            }
+            pthread_mutex_lock(&p->lock);
+        }
+        if (rc != 0) {
+            p->error = 1;
+        }
+        p->ready[idx] = 0;
+        pthread_cond_signal(&p->cond);
+        idx ^= 1;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static int copy_ranges_to_dev(int fd, int wfd, const struct stat* sb,
+                              const int* ranges, int range_used)
+{
+    size_t bufsize = COPY_CHUNK;
+    if (bufsize % sb->st_blksize) {
+        bufsize = sb->st_blksize * 16;
+    }
+
+    struct copy_pipeline pl;
+    memset(&pl, 0, sizeof(pl));
+    pl.wfd = wfd;
+    pl.buf[0] = malloc(bufsize + sb->st_blksize);
+    pl.buf[1] = malloc(bufsize + sb->st_blksize);
+    if (pl.buf[0] == NULL || pl.buf[1] == NULL) {
+        free(pl.buf[0]);
+        free(pl.buf[1]);
+        return -1;
+    }
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.cond, NULL);
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, copy_writer_thread, &pl) != 0) {
+        ALOGE("failed to start writer thread: %s\n", strerror(errno));
+        free(pl.buf[0]);
+        free(pl.buf[1]);
+        return -1;
+    }
+
+    lseek64(fd, 0, SEEK_SET);
+    uint64_t remain = sb->st_size;
+    int idx = 0;
+    int result = 0;
+    int i;
+    for (i = 0; i < range_used && remain > 0 && result == 0; ++i) {
+        uint64_t range_bytes = (uint64_t)(ranges[i*2+1] - ranges[i*2]) * sb->st_blksize;
+        off64_t offset = (off64_t)ranges[i*2] * sb->st_blksize;
+        while (range_bytes > 0 && remain > 0) {
+            // Claim the buffer the writer isn't using.
+            pthread_mutex_lock(&pl.lock);
+            while (pl.ready[idx] && !pl.error) {
+                pthread_cond_wait(&pl.cond, &pl.lock);
+            }
+            int error = pl.error;
+            pthread_mutex_unlock(&pl.lock);
+            if (error) {
+                result = -1;
+                break;
+            }
+
+            unsigned char* buffer = pl.buf[idx];
+            size_t want = bufsize;
+            if (want > range_bytes) want = range_bytes;
+            if (want > remain) want = remain;
+            size_t so_far = 0;
+            while (so_far < want) {
+                ssize_t this_read = read(fd, buffer + so_far, want - so_far);
+                if (this_read <= 0) {
+                    ALOGE("failed to read: %s\n", strerror(errno));
+                    result = -1;
+                    break;
+                }
+                so_far += this_read;
+            }
+            if (result != 0) {
+                break;
+            }
+            size_t out = want;
+            if (out % sb->st_blksize) {
+                // pad the final partial block
+                size_t pad = sb->st_blksize - (out % sb->st_blksize);
+                memset(buffer + out, 0, pad);
+                out += pad;
+            }
+
+            pthread_mutex_lock(&pl.lock);
+            pl.len[idx] = out;
+            pl.offset[idx] = offset;
+            pl.ready[idx] = 1;
+            pthread_cond_signal(&pl.cond);
+            pthread_mutex_unlock(&pl.lock);
+            idx ^= 1;
+
+            offset += out;
+            range_bytes -= out;
+            remain -= want;
+        }
+    }
+
+    pthread_mutex_lock(&pl.lock);
+    pl.done = 1;
+    pthread_cond_broadcast(&pl.cond);
+    pthread_mutex_unlock(&pl.lock);
+    pthread_join(writer, NULL);
+    if (pl.error) {
+        result = -1;
+    }
+
+    pthread_mutex_destroy(&pl.lock);
+    pthread_cond_destroy(&pl.cond);
+    free(pl.buf[0]);
+    free(pl.buf[1]);
+    return result;
+}
+
 static struct fstab* read_fstab()
 {
     fstab = NULL;
@@ -239,6 +519,25 @@ int produce_block_map(const char* path, const char* map_file, const char* blk_de
         }
     }
 
+    if (map_blocks_fiemap(fd, &sb, &ranges, &range_alloc, &range_used) == 0) {
+        ALOGI("mapped %d ranges with one FIEMAP pass\n", range_used);
+        if (encrypted) {
+            if (copy_ranges_to_dev(fd, wfd, &sb, ranges, range_used) != 0) {
+                return -1;
+            }
+        }
+        goto write_map;
+    }
+
+    // A failed FIEMAP pass can bail after appending some extents (a
+    // later chunk's ioctl failing, or an unmappable extent showing up
+    // after valid ones).  Reset the list to its initial sentinel state
+    // so the per-block fallback starts clean instead of emitting the
+    // stale ranges in front of its own.
+    range_used = 1;
+    ranges[0] = -1;
+    ranges[1] = -1;
+
     while (pos < sb.st_size) {
         if ((tail+1) % WINDOW_SIZE == head) {
             // write out head buffer
@@ -297,6 +596,7 @@ int produce_block_map(const char* path, const char* map_file, const char* blk_de
         ++head_block;
     }
 
+write_map:
     fprintf(mapf, "%d\n", range_used);
     for (i = 0; i < range_used; ++i) {
         fprintf(mapf, "%d %d\n", ranges[i*2], ranges[i*2+1]);
@@ -305,6 +605,9 @@ int produce_block_map(const char* path, const char* map_file, const char* blk_de
     fclose(mapf);
     close(fd);
     if (encrypted) {
+        // the rewritten blocks must be on the medium before recovery
+        // reads them from the raw device
+        fsync(wfd);
         close(wfd);
     }
 
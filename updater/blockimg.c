@@ -18,11 +18,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
@@ -33,6 +35,7 @@
 #include "edify/expr.h"
 #include "mincrypt/sha.h"
 #include "minzip/DirUtil.h"
+#include "trace.h"
 #include "updater.h"
 
 #define BLOCKSIZE 4096
@@ -46,6 +49,10 @@
 #define BLKDISCARD _IO(0x12,119)
 #endif
 
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+
 char* PrintSha1(const uint8_t* digest);
 
 typedef struct {
@@ -177,6 +184,26 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
     return written;
 }
 
+// Sink that accumulates patcher output in memory instead of writing
+// it to the device, for commands whose target writes are handed off
+// to the write-back thread.
+typedef struct {
+    uint8_t* buffer;
+    size_t size;
+    size_t pos;
+} MemorySinkState;
+
+static ssize_t MemorySinkWrite(const uint8_t* data, ssize_t size, void* token) {
+    MemorySinkState* mss = (MemorySinkState*) token;
+    if ((size_t)size > mss->size - mss->pos) {
+        fprintf(stderr, "range sink write overrun");
+        exit(1);
+    }
+    memcpy(mss->buffer + mss->pos, data, size);
+    mss->pos += size;
+    return size;
+}
+
 // All of the data for all the 'new' transfers is contained in one
 // file in the update package, concatenated together in the order in
 // which transfers.list will need it.  We want to stream it out of the
@@ -184,25 +211,28 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
 // can't write each section until it's that transfer's turn to go.
 //
 // To achieve this, we expand the new data from the archive in a
-// background thread, and block that threads 'receive uncompressed
-// data' function until the main thread has reached a point where we
-// want some new data to be written.  We signal the background thread
-// with the destination for the data and block the main thread,
-// waiting for the background thread to complete writing that section.
-// Then it signals the main thread to wake up and goes back to
-// blocking waiting for a transfer.
+// background thread which deposits it into a ring buffer, running
+// ahead of the transfer commands by up to the ring size.  When a
+// 'new' transfer's turn comes, the executing thread drains the ring
+// into the target blocks.  Decompression and device writes overlap;
+// the two threads only block against each other when the ring is
+// completely full or completely empty.
 //
-// NewThreadInfo is the struct used to pass information back and forth
-// between the two threads.  When the main thread wants some data
-// written, it sets rss to the destination location and signals the
-// condition.  When the background thread is done writing, it clears
-// rss and signals the condition again.
+// NewThreadInfo is the struct shared between the two threads.  head
+// is the next byte the decompressor will fill, tail the next byte
+// the writer will drain; both are only advanced under mu.
+
+#define NEW_DATA_RING_SIZE (8*1024*1024)
 
 typedef struct {
     ZipArchive* za;
     const ZipEntry* entry;
 
-    RangeSinkState* rss;
+    uint8_t* ring;
+    size_t head;
+    size_t tail;
+    size_t used;
+    bool eof;
 
     pthread_mutex_t mu;
     pthread_cond_t cv;
@@ -212,36 +242,756 @@ static bool receive_new_data(const unsigned char* data, int size, void* cookie)
     NewThreadInfo* nti = (NewThreadInfo*) cookie;
 
     while (size > 0) {
-        // Wait for nti->rss to be non-NULL, indicating some of this
-        // data is wanted.
+        // Wait for room in the ring, then copy in as much as fits
+        // contiguously.  The copy itself happens outside the lock;
+        // only the writer moves tail, so the space we claimed here
+        // can't be overwritten.
         pthread_mutex_lock(&nti->mu);
-        while (nti->rss == NULL) {
+        while (nti->used == NEW_DATA_RING_SIZE) {
             pthread_cond_wait(&nti->cv, &nti->mu);
         }
+        size_t head = nti->head;
+        size_t space = NEW_DATA_RING_SIZE - nti->used;
         pthread_mutex_unlock(&nti->mu);
 
-        // At this point nti->rss is set, and we own it.  The main
-        // thread is waiting for it to disappear from nti.
-        ssize_t written = RangeSinkWrite(data, size, nti->rss);
-        data += written;
-        size -= written;
+        size_t copy = NEW_DATA_RING_SIZE - head;
+        if (copy > space) copy = space;
+        if (copy > (size_t)size) copy = size;
+        memcpy(nti->ring + head, data, copy);
+        data += copy;
+        size -= copy;
+
+        pthread_mutex_lock(&nti->mu);
+        nti->head = (head + copy) % NEW_DATA_RING_SIZE;
+        nti->used += copy;
+        pthread_cond_broadcast(&nti->cv);
+        pthread_mutex_unlock(&nti->mu);
+    }
 
-        if (nti->rss->p_block == nti->rss->tgt->count) {
-            // we have written all the bytes desired by this rss.
+    return true;
+}
 
-            pthread_mutex_lock(&nti->mu);
-            nti->rss = NULL;
-            pthread_cond_broadcast(&nti->cv);
+// Drain new data from the ring into rss until the target ranges are
+// full.  Called by whichever thread is executing a 'new' command;
+// those commands are chained so there is never more than one drainer.
+static void drain_new_data(NewThreadInfo* nti, RangeSinkState* rss) {
+    while (rss->p_block < rss->tgt->count) {
+        pthread_mutex_lock(&nti->mu);
+        while (nti->used == 0 && !nti->eof) {
+            pthread_cond_wait(&nti->cv, &nti->mu);
+        }
+        if (nti->used == 0) {
             pthread_mutex_unlock(&nti->mu);
+            fprintf(stderr, "new data ran out with %zu bytes of target left\n",
+                    rss->p_remain);
+            return;
         }
+        size_t tail = nti->tail;
+        size_t avail = nti->used;
+        pthread_mutex_unlock(&nti->mu);
+
+        size_t run = NEW_DATA_RING_SIZE - tail;
+        if (run > avail) run = avail;
+
+        ssize_t written = RangeSinkWrite(nti->ring + tail, run, rss);
+
+        pthread_mutex_lock(&nti->mu);
+        nti->tail = (tail + written) % NEW_DATA_RING_SIZE;
+        nti->used -= written;
+        pthread_cond_broadcast(&nti->cv);
+        pthread_mutex_unlock(&nti->mu);
     }
+}
 
-    return true;
+// Consume and discard 'size' bytes from the ring.  Used when a 'new'
+// command is skipped on resume: its target blocks are already on
+// disk, but its bytes still have to be drained so the sequential
+// package stream stays aligned for the commands that follow.
+static void discard_new_data(NewThreadInfo* nti, size_t size) {
+    while (size > 0) {
+        pthread_mutex_lock(&nti->mu);
+        while (nti->used == 0 && !nti->eof) {
+            pthread_cond_wait(&nti->cv, &nti->mu);
+        }
+        if (nti->used == 0) {
+            pthread_mutex_unlock(&nti->mu);
+            fprintf(stderr, "new data ran out with %zu bytes left to skip\n",
+                    size);
+            return;
+        }
+        size_t chunk = nti->used;
+        if (chunk > size) chunk = size;
+        nti->tail = (nti->tail + chunk) % NEW_DATA_RING_SIZE;
+        nti->used -= chunk;
+        size -= chunk;
+        pthread_cond_broadcast(&nti->cv);
+        pthread_mutex_unlock(&nti->mu);
+    }
 }
 
 static void* unzip_new_data(void* cookie) {
     NewThreadInfo* nti = (NewThreadInfo*) cookie;
     mzProcessZipEntryContents(nti->za, nti->entry, receive_new_data, nti);
+    pthread_mutex_lock(&nti->mu);
+    nti->eof = true;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
+    return NULL;
+}
+
+// Most transfer-list commands touch disjoint block ranges, so instead
+// of replaying the list serially we parse every command up front,
+// build a dependency graph from range overlaps, and dispatch
+// independent commands to a small worker pool.  A command depends on
+// an earlier one if their accesses conflict (write-after-read,
+// read-after-write or write-after-write on any shared block), which
+// preserves the serial semantics for overlapping ranges.  'new'
+// commands are additionally chained to each other because they
+// consume a single sequential stream from the package.
+//
+// Each worker opens its own descriptor on the block device and keeps
+// its own scratch buffer, so seeks and patch scratch space never
+// race.
+
+#define BLOCKIMG_MAX_THREADS 4
+
+// If power drops partway through a transfer list, the next attempt
+// shouldn't start over from scratch.  We periodically record which
+// commands have durably completed.  Workers finish commands out of
+// order, so the checkpoint is the full per-command done set (a
+// bitmap), not a prefix: the flags are snapshotted, then the target
+// device is fsync'd, then the snapshot is persisted, so every command
+// the checkpoint claims is on stable storage.  On re-execution with
+// the same transfer list (matched by SHA-1) exactly those commands
+// are skipped.  Skipping the exact done set is safe: any command that
+// writes a pending command's source is ordered after it by the
+// dependency graph (write-after-read), so it cannot have completed --
+// and been recorded -- before that pending command did, and a resumed
+// run always finds its pending commands' sources intact.
+//
+// The checkpoint lives on /cache, which survives the install.  It is
+// deleted on successful completion and ignored (and replaced) if the
+// transfer list hash doesn't match.
+
+#define CHECKPOINT_FILE "/cache/recovery/blockimg.checkpoint"
+#define CHECKPOINT_FILE_TMP CHECKPOINT_FILE ".tmp"
+
+// Persist a new checkpoint after this many blocks have been committed
+// past the last one (64 MiB of progress at 4K blocks): frequent
+// enough to bound lost work, rare enough that the fsyncs don't show
+// up in the install time.
+#define CHECKPOINT_BLOCKS 16384
+
+typedef enum {
+    CMD_MOVE,
+    CMD_ZERO,
+    CMD_NEW,
+    CMD_BSDIFF,
+    CMD_IMGDIFF,
+    CMD_ERASE,
+} CommandType;
+
+typedef struct {
+    CommandType type;
+    RangeSet* src;            // NULL except move/bsdiff/imgdiff
+    RangeSet* tgt;
+    size_t patch_offset;
+    size_t patch_len;
+    bool report_progress;
+    bool skipped;             // committed by a previous attempt
+
+    // span over all blocks the command touches, for cheap overlap
+    // rejection before the exact rangeset comparison.
+    int min_block;
+    int max_block;
+
+    int* dependents;          // commands waiting on this one
+    int num_dependents;
+    int dependents_alloc;
+    int num_deps;             // outstanding prerequisites
+} Command;
+
+// Wall time, bytes and invocation counts bucketed by command type,
+// reported at the end of the transfer list so slow installs can be
+// attributed to patching, inflate or raw writes from the log alone.
+typedef struct {
+    int count;
+    long long blocks;
+    long long usec;
+} CommandStat;
+
+static long long now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// A finished target image waiting to be written to the device.
+typedef struct {
+    uint8_t* data;            // malloc'd; write-back thread frees
+    Command* cmd;
+} WriteJob;
+
+#define WRITE_QUEUE_DEPTH 2
+
+typedef struct {
+    Command* commands;
+    int num_commands;
+
+    int* ready;               // indices of dispatchable commands
+    int ready_count;
+    int completed;
+
+    const char* blockdev;
+    uint8_t* patch_start;
+    NewThreadInfo* nti;
+
+    FILE* cmd_pipe;
+    int total_blocks;
+    int blocks_so_far;
+
+    size_t max_alloc;
+
+    // Checkpoint state (see the comment above CHECKPOINT_FILE).
+    // done is guarded by 'lock'; the persist itself runs under
+    // cp_lock so at most one thread is in fsync at a time.
+    bool* done;               // per-command completion flags
+    long long blocks_since_cp;
+    int cp_fd;                // dedicated descriptor for fsync; -1 disables
+    const char* tl_sha1;      // hex SHA-1 of the transfer list
+    pthread_mutex_t cp_lock;
+
+    CommandStat stats[CMD_ERASE+1];
+    CommandStat write_stat;   // deferred writes on the write-back thread
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Deferred target writes: workers deposit finished target images
+    // here and move on to their next command's source reads while the
+    // write-back thread drains them to the device.
+    WriteJob wq[WRITE_QUEUE_DEPTH];
+    int wq_head;
+    int wq_count;
+    bool wq_done;
+    bool writer_off;          // no write-back thread; write inline
+    int writer_fd;
+
+    pthread_mutex_t wq_lock;
+    pthread_cond_t wq_cond;
+} BlockScheduler;
+
+static void command_span(Command* c) {
+    c->min_block = INT_MAX;
+    c->max_block = 0;
+    RangeSet* sets[2] = { c->src, c->tgt };
+    int s, i;
+    for (s = 0; s < 2; ++s) {
+        RangeSet* rs = sets[s];
+        if (rs == NULL) continue;
+        for (i = 0; i < rs->count; ++i) {
+            if (rs->pos[i*2] < c->min_block) c->min_block = rs->pos[i*2];
+            if (rs->pos[i*2+1] > c->max_block) c->max_block = rs->pos[i*2+1];
+        }
+    }
+}
+
+static bool ranges_overlap(const RangeSet* a, const RangeSet* b) {
+    if (a == NULL || b == NULL) return false;
+    int i, j;
+    for (i = 0; i < a->count; ++i) {
+        for (j = 0; j < b->count; ++j) {
+            if (a->pos[i*2] < b->pos[j*2+1] && b->pos[j*2] < a->pos[i*2+1]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Does "later" have to wait for "earlier"?  Conflicts are write vs
+// read, read vs write, and write vs write; two commands that only
+// read the same blocks could run together (no such pairs exist in
+// practice, since sources are consumed once).
+static bool commands_conflict(const Command* earlier, const Command* later) {
+    if (later->min_block >= earlier->max_block ||
+        earlier->min_block >= later->max_block) {
+        return false;
+    }
+    return ranges_overlap(later->tgt, earlier->tgt) ||
+           ranges_overlap(later->tgt, earlier->src) ||
+           ranges_overlap(later->src, earlier->tgt);
+}
+
+static void add_dependent(Command* c, int index) {
+    if (c->num_dependents >= c->dependents_alloc) {
+        c->dependents_alloc = (c->dependents_alloc == 0) ? 4 : c->dependents_alloc*2;
+        c->dependents = realloc(c->dependents,
+                                c->dependents_alloc * sizeof(int));
+        if (c->dependents == NULL) {
+            fprintf(stderr, "failed to grow dependent list\n");
+            exit(1);
+        }
+    }
+    c->dependents[c->num_dependents++] = index;
+}
+
+// Make all committed work durable and record the done set in
+// CHECKPOINT_FILE.  The flags are snapshotted before the device sync:
+// a command's flag is only ever set after its target write returned,
+// so the fsync puts every snapshotted command on stable storage.
+// Commands completing after the snapshot wait for the next pass.
+static void persist_checkpoint(BlockScheduler* bs) {
+    pthread_mutex_lock(&bs->cp_lock);
+
+    int n = bs->num_commands;
+    char* bitmap = malloc(n/4 + 2);
+    if (bitmap == NULL) {
+        pthread_mutex_unlock(&bs->cp_lock);
+        return;
+    }
+
+    const char* alphabet = "0123456789abcdef";
+    int i;
+    pthread_mutex_lock(&bs->lock);
+    for (i = 0; i < n; i += 4) {
+        int val = 0;
+        int j;
+        for (j = 0; j < 4 && i+j < n; ++j) {
+            if (bs->done[i+j]) val |= 1 << j;
+        }
+        bitmap[i/4] = alphabet[val];
+    }
+    bitmap[(n+3)/4] = '\0';
+    pthread_mutex_unlock(&bs->lock);
+
+    if (fsync(bs->cp_fd) < 0) {
+        fprintf(stderr, "checkpoint fsync failed: %s\n", strerror(errno));
+        free(bitmap);
+        pthread_mutex_unlock(&bs->cp_lock);
+        return;
+    }
+
+    FILE* f = fopen(CHECKPOINT_FILE_TMP, "w");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n",
+                CHECKPOINT_FILE_TMP, strerror(errno));
+        free(bitmap);
+        pthread_mutex_unlock(&bs->cp_lock);
+        return;
+    }
+    fprintf(f, "%s\n%d\n%s\n", bs->tl_sha1, n, bitmap);
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    free(bitmap);
+    if (rename(CHECKPOINT_FILE_TMP, CHECKPOINT_FILE) != 0) {
+        fprintf(stderr, "failed to rename checkpoint: %s\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&bs->cp_lock);
+}
+
+// Read CHECKPOINT_FILE and mark the commands it records as already
+// committed.  Returns the number of commands marked, 0 if there is no
+// usable checkpoint.  A checkpoint for a different transfer list (a
+// different OTA, or the same OTA against a different partition) is
+// deleted rather than applied.
+static int load_checkpoint(const char* tl_sha1, Command* commands,
+                           int num_commands) {
+    FILE* f = fopen(CHECKPOINT_FILE, "r");
+    if (f == NULL) return 0;
+
+    char sha[SHA_DIGEST_SIZE*2 + 2];
+    int n = 0;
+    bool ok = fgets(sha, sizeof(sha), f) != NULL &&
+              fscanf(f, "%d\n", &n) == 1;
+    if (ok) {
+        sha[strcspn(sha, "\n")] = '\0';
+        ok = strcmp(sha, tl_sha1) == 0;
+        if (!ok) {
+            printf("stale checkpoint (transfer list changed); discarding\n");
+        }
+    }
+    ok = ok && n == num_commands;
+
+    // Decode the full bitmap before touching any skipped flag so a
+    // truncated or corrupt record is discarded whole, not applied in
+    // part.
+    bool* done = NULL;
+    if (ok) {
+        done = calloc(num_commands, sizeof(bool));
+        ok = done != NULL;
+    }
+    int i;
+    for (i = 0; ok && i < num_commands; i += 4) {
+        int c = fgetc(f);
+        int val;
+        if (c >= '0' && c <= '9') val = c - '0';
+        else if (c >= 'a' && c <= 'f') val = c - 'a' + 10;
+        else { ok = false; break; }
+        int j;
+        for (j = 0; j < 4 && i+j < num_commands; ++j) {
+            done[i+j] = (val >> j) & 1;
+        }
+    }
+    fclose(f);
+
+    if (!ok) {
+        free(done);
+        unlink(CHECKPOINT_FILE);
+        return 0;
+    }
+
+    int skipped = 0;
+    for (i = 0; i < num_commands; ++i) {
+        if (done[i]) {
+            commands[i].skipped = true;
+            ++skipped;
+        }
+    }
+    free(done);
+    return skipped;
+}
+
+// Run one command against the worker's own descriptor and buffer.
+// Mark a command finished: release its dependents into the ready
+// list and report its progress.  Called by the executing worker, or
+// by the write-back thread once a deferred target write has landed.
+static void complete_command(BlockScheduler* bs, Command* c) {
+    bool do_cp = false;
+
+    pthread_mutex_lock(&bs->lock);
+    ++bs->completed;
+    int i;
+    for (i = 0; i < c->num_dependents; ++i) {
+        Command* dep = bs->commands + c->dependents[i];
+        if (--dep->num_deps == 0) {
+            bs->ready[bs->ready_count++] = c->dependents[i];
+        }
+    }
+    if (c->report_progress) {
+        bs->blocks_so_far += c->tgt->size;
+        SendSetProgress(bs->cmd_pipe,
+                (float)bs->blocks_so_far / bs->total_blocks);
+    }
+
+    // Record the completion and decide (still under the lock) whether
+    // enough new work has landed to checkpoint.
+    bs->done[c - bs->commands] = true;
+    if (!c->skipped) {
+        bs->blocks_since_cp += c->tgt->size;
+    }
+    if (bs->cp_fd >= 0 && bs->blocks_since_cp >= CHECKPOINT_BLOCKS) {
+        bs->blocks_since_cp = 0;
+        do_cp = true;
+    }
+
+    pthread_cond_broadcast(&bs->cond);
+    pthread_mutex_unlock(&bs->lock);
+
+    if (do_cp) {
+        persist_checkpoint(bs);
+    }
+}
+
+// Coalesce adjacent ranges of tgt into maximal extents and issue one
+// ioctl (BLKDISCARD or BLKZEROOUT) per extent.  Returns 0 if every
+// extent succeeded; the caller falls back to buffered writes
+// otherwise (eg, the device doesn't support the request).
+static int blk_ioctl_extents(int fd, RangeSet* tgt, int request) {
+    int i = 0;
+    while (i < tgt->count) {
+        int begin = tgt->pos[i*2];
+        int end = tgt->pos[i*2+1];
+        while (i+1 < tgt->count && tgt->pos[(i+1)*2] == end) {
+            ++i;
+            end = tgt->pos[i*2+1];
+        }
+        ++i;
+
+        uint64_t range[2];
+        range[0] = begin * (uint64_t)BLOCKSIZE;
+        range[1] = (end - begin) * (uint64_t)BLOCKSIZE;
+        if (ioctl(fd, request, &range) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void write_target(int fd, RangeSet* tgt, const uint8_t* data) {
+    size_t p = 0;
+    int i;
+    for (i = 0; i < tgt->count; ++i) {
+        check_lseek(fd, (off64_t)tgt->pos[i*2] * BLOCKSIZE, SEEK_SET);
+        size_t sz = (tgt->pos[i*2+1] - tgt->pos[i*2]) * BLOCKSIZE;
+        writeblock(fd, data+p, sz);
+        p += sz;
+    }
+}
+
+// Hand a finished target image to the write-back thread (or write it
+// here if there isn't one).  Blocks while both queue slots are full,
+// which bounds deferred memory to two target images.  Completion of
+// the command passes to whoever performs the write.
+static void enqueue_write(BlockScheduler* bs, Command* c, uint8_t* data, int fd) {
+    if (bs->writer_off) {
+        write_target(fd, c->tgt, data);
+        free(data);
+        complete_command(bs, c);
+        return;
+    }
+
+    pthread_mutex_lock(&bs->wq_lock);
+    while (bs->wq_count == WRITE_QUEUE_DEPTH) {
+        pthread_cond_wait(&bs->wq_cond, &bs->wq_lock);
+    }
+    WriteJob* job = &bs->wq[(bs->wq_head + bs->wq_count) % WRITE_QUEUE_DEPTH];
+    job->data = data;
+    job->cmd = c;
+    ++bs->wq_count;
+    pthread_cond_broadcast(&bs->wq_cond);
+    pthread_mutex_unlock(&bs->wq_lock);
+}
+
+static void* writeback_worker(void* cookie) {
+    BlockScheduler* bs = (BlockScheduler*) cookie;
+
+    for (;;) {
+        pthread_mutex_lock(&bs->wq_lock);
+        while (bs->wq_count == 0 && !bs->wq_done) {
+            pthread_cond_wait(&bs->wq_cond, &bs->wq_lock);
+        }
+        if (bs->wq_count == 0) {
+            pthread_mutex_unlock(&bs->wq_lock);
+            break;
+        }
+        WriteJob job = bs->wq[bs->wq_head];
+        bs->wq_head = (bs->wq_head + 1) % WRITE_QUEUE_DEPTH;
+        --bs->wq_count;
+        pthread_cond_broadcast(&bs->wq_cond);
+        pthread_mutex_unlock(&bs->wq_lock);
+
+        long long t0 = now_usec();
+        write_target(bs->writer_fd, job.cmd->tgt, job.data);
+        long long dt = now_usec() - t0;
+        free(job.data);
+
+        pthread_mutex_lock(&bs->lock);
+        ++bs->write_stat.count;
+        bs->write_stat.blocks += job.cmd->tgt->size;
+        bs->write_stat.usec += dt;
+        pthread_mutex_unlock(&bs->lock);
+
+        complete_command(bs, job.cmd);
+    }
+
+    return NULL;
+}
+
+// Execute one transfer command.  Returns true if completion was
+// handed off (the target write is in flight); the caller must not
+// complete the command itself in that case.
+static bool execute_command(BlockScheduler* bs, Command* c,
+                            int fd, uint8_t** buffer, size_t* buffer_alloc) {
+    int i, j;
+    size_t p;
+
+    // Commands recorded in a previous attempt's checkpoint were
+    // committed by it.  A skipped 'new' still has to drain its share of the
+    // sequential package stream so later 'new' commands read from the
+    // right offset; everything else is simply a no-op.
+    if (c->skipped) {
+        if (c->type == CMD_NEW) {
+            printf("  skipping %d blocks of new data (already committed)\n",
+                   c->tgt->size);
+            discard_new_data(bs->nti, (size_t)c->tgt->size * BLOCKSIZE);
+        }
+        return false;
+    }
+
+    switch (c->type) {
+        case CMD_MOVE: {
+            RangeSet* src = c->src;
+            printf("  moving %d blocks\n", src->size);
+
+            uint8_t* data = malloc(src->size * BLOCKSIZE);
+            if (data == NULL) {
+                fprintf(stderr, "failed to allocate %d bytes\n",
+                        src->size * BLOCKSIZE);
+                exit(1);
+            }
+            p = 0;
+            for (i = 0; i < src->count; ++i) {
+                check_lseek(fd, (off64_t)src->pos[i*2] * BLOCKSIZE, SEEK_SET);
+                size_t sz = (src->pos[i*2+1] - src->pos[i*2]) * BLOCKSIZE;
+                readblock(fd, data+p, sz);
+                p += sz;
+            }
+
+            enqueue_write(bs, c, data, fd);
+            return true;
+        }
+
+        case CMD_ZERO: {
+            RangeSet* tgt = c->tgt;
+            printf("  zeroing %d blocks\n", tgt->size);
+
+            // Zeroing through the kernel skips the page cache and
+            // lets the device deallocate the blocks instead of
+            // programming them.
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+                blk_ioctl_extents(fd, tgt, BLKZEROOUT) == 0) {
+                break;
+            }
+
+            allocate(BLOCKSIZE, buffer, buffer_alloc);
+            memset(*buffer, 0, BLOCKSIZE);
+            for (i = 0; i < tgt->count; ++i) {
+                check_lseek(fd, (off64_t)tgt->pos[i*2] * BLOCKSIZE, SEEK_SET);
+                for (j = tgt->pos[i*2]; j < tgt->pos[i*2+1]; ++j) {
+                    writeblock(fd, *buffer, BLOCKSIZE);
+                }
+            }
+            break;
+        }
+
+        case CMD_NEW: {
+            RangeSet* tgt = c->tgt;
+            printf("  writing %d blocks of new data\n", tgt->size);
+
+            RangeSinkState rss;
+            rss.fd = fd;
+            rss.tgt = tgt;
+            rss.p_block = 0;
+            rss.p_remain = (tgt->pos[1] - tgt->pos[0]) * BLOCKSIZE;
+            check_lseek(fd, (off64_t)tgt->pos[0] * BLOCKSIZE, SEEK_SET);
+
+            drain_new_data(bs->nti, &rss);
+            break;
+        }
+
+        case CMD_BSDIFF:
+        case CMD_IMGDIFF: {
+            RangeSet* src = c->src;
+            RangeSet* tgt = c->tgt;
+            printf("  patching %d blocks to %d\n", src->size, tgt->size);
+
+            // Read the source into memory.
+            allocate(src->size * BLOCKSIZE, buffer, buffer_alloc);
+            p = 0;
+            for (i = 0; i < src->count; ++i) {
+                check_lseek(fd, (off64_t)src->pos[i*2] * BLOCKSIZE, SEEK_SET);
+                size_t sz = (src->pos[i*2+1] - src->pos[i*2]) * BLOCKSIZE;
+                readblock(fd, *buffer+p, sz);
+                p += sz;
+            }
+
+            Value patch_value;
+            patch_value.type = VAL_BLOB;
+            patch_value.size = c->patch_len;
+            patch_value.data = (char*)(bs->patch_start + c->patch_offset);
+
+            MemorySinkState mss;
+            mss.size = tgt->size * BLOCKSIZE;
+            mss.pos = 0;
+            mss.buffer = malloc(mss.size);
+            if (mss.buffer == NULL) {
+                fprintf(stderr, "failed to allocate %zu bytes\n", mss.size);
+                exit(1);
+            }
+
+            if (c->type == CMD_IMGDIFF) {
+                ApplyImagePatch(*buffer, src->size * BLOCKSIZE,
+                                &patch_value,
+                                &MemorySinkWrite, &mss, NULL, NULL);
+            } else {
+                ApplyBSDiffPatch(*buffer, src->size * BLOCKSIZE,
+                                 &patch_value, 0,
+                                 &MemorySinkWrite, &mss, NULL);
+            }
+
+            // We expect the output of the patcher to fill the tgt ranges exactly.
+            if (mss.pos != mss.size) {
+                fprintf(stderr, "range sink underrun?\n");
+            }
+
+            enqueue_write(bs, c, mss.buffer, fd);
+            return true;
+        }
+
+        case CMD_ERASE: {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+                RangeSet* tgt = c->tgt;
+                printf("  erasing %d blocks\n", tgt->size);
+
+                if (blk_ioctl_extents(fd, tgt, BLKDISCARD) < 0) {
+                    printf("    blkdiscard failed: %s\n", strerror(errno));
+                }
+            } else {
+                printf("  ignoring erase (not block device)\n");
+            }
+            break;
+        }
+    }
+
+    return false;
+}
+
+static void scheduler_run(BlockScheduler* bs, int fd) {
+    uint8_t* buffer = NULL;
+    size_t buffer_alloc = 0;
+    bool own_fd = false;
+
+    if (fd < 0) {
+        fd = open(bs->blockdev, O_RDWR);
+        if (fd < 0) {
+            // this worker can't contribute; the others (at minimum the
+            // calling thread) will pick up its share.
+            fprintf(stderr, "worker failed to open %s: %s\n",
+                    bs->blockdev, strerror(errno));
+            return;
+        }
+        own_fd = true;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&bs->lock);
+        while (bs->ready_count == 0 && bs->completed < bs->num_commands) {
+            pthread_cond_wait(&bs->cond, &bs->lock);
+        }
+        if (bs->completed == bs->num_commands) {
+            pthread_mutex_unlock(&bs->lock);
+            break;
+        }
+        int index = bs->ready[--bs->ready_count];
+        pthread_mutex_unlock(&bs->lock);
+
+        Command* c = bs->commands + index;
+        long long t0 = now_usec();
+        bool deferred = execute_command(bs, c, fd, &buffer, &buffer_alloc);
+        long long dt = now_usec() - t0;
+
+        pthread_mutex_lock(&bs->lock);
+        if (buffer_alloc > bs->max_alloc) bs->max_alloc = buffer_alloc;
+        ++bs->stats[c->type].count;
+        bs->stats[c->type].blocks += c->tgt->size;
+        bs->stats[c->type].usec += dt;
+        pthread_mutex_unlock(&bs->lock);
+
+        if (!deferred) {
+            complete_command(bs, c);
+        }
+    }
+
+    free(buffer);
+    if (own_fd) close(fd);
+}
+
+static void* scheduler_worker(void* cookie) {
+    scheduler_run((BlockScheduler*) cookie, -1);
     return NULL;
 }
 
@@ -255,6 +1005,7 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
     Value* blockdev_filename;
     Value* transfer_list_value;
     char* transfer_list = NULL;
+    char* tl_sha1 = NULL;
     Value* new_data_fn;
     Value* patch_data_fn;
     bool success = false;
@@ -264,6 +1015,8 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
         return NULL;
     }
 
+    trace_begin("BlockImageUpdate");
+
     if (blockdev_filename->type != VAL_STRING) {
         ErrorAbort(state, "blockdev_filename argument to %s must be string", name);
         goto done;
@@ -286,7 +1039,7 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
 
     ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
 
-    const ZipEntry* patch_entry = mzFindZipEntry(za, patch_data_fn->data);
+    const ZipEntry* patch_entry = FindPackageEntry(ui, patch_data_fn->data);
     if (patch_entry == NULL) {
         ErrorAbort(state, "%s(): no file \"%s\" in package", name, patch_data_fn->data);
         goto done;
@@ -295,7 +1048,7 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
     uint8_t* patch_start = ((UpdaterInfo*)(state->cookie))->package_zip_addr +
         mzGetZipEntryOffset(patch_entry);
 
-    const ZipEntry* new_entry = mzFindZipEntry(za, new_data_fn->data);
+    const ZipEntry* new_entry = FindPackageEntry(ui, new_data_fn->data);
     if (new_entry == NULL) {
         ErrorAbort(state, "%s(): no file \"%s\" in package", name, new_data_fn->data);
         goto done;
@@ -342,7 +1095,13 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
     NewThreadInfo nti;
     nti.za = za;
     nti.entry = new_entry;
-    nti.rss = NULL;
+    nti.ring = malloc(NEW_DATA_RING_SIZE);
+    if (nti.ring == NULL) {
+        fprintf(stderr, "failed to allocate new data ring\n");
+        exit(1);
+    }
+    nti.head = nti.tail = nti.used = 0;
+    nti.eof = false;
     pthread_mutex_init(&nti.mu, NULL);
     pthread_cond_init(&nti.cv, NULL);
 
@@ -377,6 +1136,13 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
     memcpy(transfer_list, transfer_list_value->data, transfer_list_value->size);
     transfer_list[transfer_list_value->size] = '\0';
 
+    // Hash the transfer list before tokenizing destroys the copy.
+    // The checkpoint is keyed on this, so a resume only ever applies
+    // to a retry of the very same transfer.
+    uint8_t tl_digest[SHA_DIGEST_SIZE];
+    SHA_hash(transfer_list, transfer_list_value->size, tl_digest);
+    tl_sha1 = PrintSha1(tl_digest);
+
     line = strtok_r(transfer_list, "\n", &linesave);
 
     // first line in transfer list is the version number; currently
@@ -392,195 +1158,236 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
     int total_blocks = strtol(line, NULL, 0);
     // shouldn't happen, but avoid divide by zero.
     if (total_blocks == 0) ++total_blocks;
-    int blocks_so_far = 0;
 
-    uint8_t* buffer = NULL;
-    size_t buffer_alloc = 0;
+    // Third and subsequent lines are all individual transfer
+    // commands.  Parse them all before executing anything so the
+    // scheduler can see which commands conflict.
+    Command* commands = NULL;
+    int num_commands = 0;
+    int commands_alloc = 0;
+    int last_new = -1;
 
-    // third and subsequent lines are all individual transfer commands.
     for (line = strtok_r(NULL, "\n", &linesave); line;
          line = strtok_r(NULL, "\n", &linesave)) {
         char* style;
         style = strtok_r(line, " ", &wordsave);
 
+        if (num_commands >= commands_alloc) {
+            commands_alloc = (commands_alloc == 0) ? 64 : commands_alloc*2;
+            commands = realloc(commands, commands_alloc * sizeof(Command));
+            if (commands == NULL) {
+                fprintf(stderr, "failed to allocate command list\n");
+                exit(1);
+            }
+        }
+        Command* c = commands + num_commands;
+        memset(c, 0, sizeof(Command));
+
         if (strcmp("move", style) == 0) {
+            c->type = CMD_MOVE;
             word = strtok_r(NULL, " ", &wordsave);
-            RangeSet* src = parse_range(word);
+            c->src = parse_range(word);
             word = strtok_r(NULL, " ", &wordsave);
-            RangeSet* tgt = parse_range(word);
-
-            printf("  moving %d blocks\n", src->size);
-
-            allocate(src->size * BLOCKSIZE, &buffer, &buffer_alloc);
-            size_t p = 0;
-            for (i = 0; i < src->count; ++i) {
-                check_lseek(fd, (off64_t)src->pos[i*2] * BLOCKSIZE, SEEK_SET);
-                size_t sz = (src->pos[i*2+1] - src->pos[i*2]) * BLOCKSIZE;
-                readblock(fd, buffer+p, sz);
-                p += sz;
-            }
-
-            p = 0;
-            for (i = 0; i < tgt->count; ++i) {
-                check_lseek(fd, (off64_t)tgt->pos[i*2] * BLOCKSIZE, SEEK_SET);
-                size_t sz = (tgt->pos[i*2+1] - tgt->pos[i*2]) * BLOCKSIZE;
-                writeblock(fd, buffer+p, sz);
-                p += sz;
-            }
-
-            blocks_so_far += tgt->size;
-            fprintf(cmd_pipe, "set_progress %.4f\n", (double)blocks_so_far / total_blocks);
-            fflush(cmd_pipe);
-
-            free(src);
-            free(tgt);
-
+            c->tgt = parse_range(word);
+            c->report_progress = true;
         } else if (strcmp("zero", style) == 0 ||
                    (DEBUG_ERASE && strcmp("erase", style) == 0)) {
+            c->type = CMD_ZERO;
             word = strtok_r(NULL, " ", &wordsave);
-            RangeSet* tgt = parse_range(word);
-
-            printf("  zeroing %d blocks\n", tgt->size);
-
-            allocate(BLOCKSIZE, &buffer, &buffer_alloc);
-            memset(buffer, 0, BLOCKSIZE);
-            for (i = 0; i < tgt->count; ++i) {
-                check_lseek(fd, (off64_t)tgt->pos[i*2] * BLOCKSIZE, SEEK_SET);
-                for (j = tgt->pos[i*2]; j < tgt->pos[i*2+1]; ++j) {
-                    writeblock(fd, buffer, BLOCKSIZE);
-                }
-            }
-
-            if (style[0] == 'z') {   // "zero" but not "erase"
-                blocks_so_far += tgt->size;
-                fprintf(cmd_pipe, "set_progress %.4f\n", (double)blocks_so_far / total_blocks);
-                fflush(cmd_pipe);
-            }
-
-            free(tgt);
+            c->tgt = parse_range(word);
+            c->report_progress = (style[0] == 'z');   // "zero" but not "erase"
         } else if (strcmp("new", style) == 0) {
-
+            c->type = CMD_NEW;
             word = strtok_r(NULL, " ", &wordsave);
-            RangeSet* tgt = parse_range(word);
-
-            printf("  writing %d blocks of new data\n", tgt->size);
-
-            RangeSinkState rss;
-            rss.fd = fd;
-            rss.tgt = tgt;
-            rss.p_block = 0;
-            rss.p_remain = (tgt->pos[1] - tgt->pos[0]) * BLOCKSIZE;
-            check_lseek(fd, (off64_t)tgt->pos[0] * BLOCKSIZE, SEEK_SET);
-
-            pthread_mutex_lock(&nti.mu);
-            nti.rss = &rss;
-            pthread_cond_broadcast(&nti.cv);
-            while (nti.rss) {
-                pthread_cond_wait(&nti.cv, &nti.mu);
-            }
-            pthread_mutex_unlock(&nti.mu);
-
-            blocks_so_far += tgt->size;
-            fprintf(cmd_pipe, "set_progress %.4f\n", (double)blocks_so_far / total_blocks);
-            fflush(cmd_pipe);
-
-            free(tgt);
-
+            c->tgt = parse_range(word);
+            c->report_progress = true;
         } else if (strcmp("bsdiff", style) == 0 ||
                    strcmp("imgdiff", style) == 0) {
+            c->type = (style[0] == 'i') ? CMD_IMGDIFF : CMD_BSDIFF;
             word = strtok_r(NULL, " ", &wordsave);
-            size_t patch_offset = strtoul(word, NULL, 0);
+            c->patch_offset = strtoul(word, NULL, 0);
             word = strtok_r(NULL, " ", &wordsave);
-            size_t patch_len = strtoul(word, NULL, 0);
-
+            c->patch_len = strtoul(word, NULL, 0);
             word = strtok_r(NULL, " ", &wordsave);
-            RangeSet* src = parse_range(word);
+            c->src = parse_range(word);
             word = strtok_r(NULL, " ", &wordsave);
-            RangeSet* tgt = parse_range(word);
-
-            printf("  patching %d blocks to %d\n", src->size, tgt->size);
-
-            // Read the source into memory.
-            allocate(src->size * BLOCKSIZE, &buffer, &buffer_alloc);
-            size_t p = 0;
-            for (i = 0; i < src->count; ++i) {
-                check_lseek(fd, (off64_t)src->pos[i*2] * BLOCKSIZE, SEEK_SET);
-                size_t sz = (src->pos[i*2+1] - src->pos[i*2]) * BLOCKSIZE;
-                readblock(fd, buffer+p, sz);
-                p += sz;
-            }
-
-            Value patch_value;
-            patch_value.type = VAL_BLOB;
-            patch_value.size = patch_len;
-            patch_value.data = (char*)(patch_start + patch_offset);
+            c->tgt = parse_range(word);
+            c->report_progress = true;
+        } else if (!DEBUG_ERASE && strcmp("erase", style) == 0) {
+            c->type = CMD_ERASE;
+            word = strtok_r(NULL, " ", &wordsave);
+            c->tgt = parse_range(word);
+        } else {
+            fprintf(stderr, "unknown transfer style \"%s\"\n", style);
+            exit(1);
+        }
 
-            RangeSinkState rss;
-            rss.fd = fd;
-            rss.tgt = tgt;
-            rss.p_block = 0;
-            rss.p_remain = (tgt->pos[1] - tgt->pos[0]) * BLOCKSIZE;
-            check_lseek(fd, (off64_t)tgt->pos[0] * BLOCKSIZE, SEEK_SET);
+        command_span(c);
+        ++num_commands;
+    }
 
-            if (style[0] == 'i') {      // imgdiff
-                ApplyImagePatch(buffer, src->size * BLOCKSIZE,
-                                &patch_value,
-                                &RangeSinkWrite, &rss, NULL, NULL);
-            } else {
-                ApplyBSDiffPatch(buffer, src->size * BLOCKSIZE,
-                                 &patch_value, 0,
-                                 &RangeSinkWrite, &rss, NULL);
+    // Build the dependency graph: a command waits for every earlier
+    // command it conflicts with, and 'new' commands are chained so the
+    // package stream is consumed in order.
+    for (j = 0; j < num_commands; ++j) {
+        for (i = 0; i < j; ++i) {
+            bool depends = commands_conflict(commands+i, commands+j);
+            if (!depends && commands[j].type == CMD_NEW && i == last_new) {
+                depends = true;
             }
-
-            // We expect the output of the patcher to fill the tgt ranges exactly.
-            if (rss.p_block != tgt->count || rss.p_remain != 0) {
-                fprintf(stderr, "range sink underrun?\n");
+            if (depends) {
+                add_dependent(commands+i, j);
+                ++commands[j].num_deps;
             }
+        }
+        if (commands[j].type == CMD_NEW) last_new = j;
+    }
 
-            blocks_so_far += tgt->size;
-            fprintf(cmd_pipe, "set_progress %.4f\n", (double)blocks_so_far / total_blocks);
-            fflush(cmd_pipe);
-
-            free(src);
-            free(tgt);
-        } else if (!DEBUG_ERASE && strcmp("erase", style) == 0) {
-            struct stat st;
-            if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
-                word = strtok_r(NULL, " ", &wordsave);
-                RangeSet* tgt = parse_range(word);
+    // Pre-mark the durably-committed commands from a checkpoint left
+    // by an interrupted run of this same transfer list.  The commands
+    // still flow through the scheduler (keeping the dependency graph
+    // and the new-data stream consistent) but execute as no-ops.
+    int resume_skipped = load_checkpoint(tl_sha1, commands, num_commands);
+    if (resume_skipped > 0) {
+        printf("resuming interrupted update: %d of %d commands "
+               "already committed\n", resume_skipped, num_commands);
+        fprintf(cmd_pipe, "log resume: skipping %d of %d commands\n",
+                resume_skipped, num_commands);
+    }
 
-                printf("  erasing %d blocks\n", tgt->size);
+    BlockScheduler bs;
+    bs.commands = commands;
+    bs.num_commands = num_commands;
+    bs.ready = malloc(num_commands * sizeof(int));
+    bs.ready_count = 0;
+    bs.completed = 0;
+    bs.blockdev = blockdev_filename->data;
+    bs.patch_start = patch_start;
+    bs.nti = &nti;
+    bs.cmd_pipe = cmd_pipe;
+    bs.total_blocks = total_blocks;
+    bs.blocks_so_far = 0;
+    bs.max_alloc = 0;
+    bs.done = calloc(num_commands, sizeof(bool));
+    if (bs.done == NULL) {
+        fprintf(stderr, "failed to allocate completion flags\n");
+        exit(1);
+    }
+    // Resumed commands count as done from the start so they stay in
+    // any checkpoint this run persists.
+    for (i = 0; i < num_commands; ++i) {
+        bs.done[i] = commands[i].skipped;
+    }
+    bs.blocks_since_cp = 0;
+    bs.tl_sha1 = tl_sha1;
+    bs.cp_fd = open(blockdev_filename->data, O_RDWR);  // -1 disables checkpoints
+    pthread_mutex_init(&bs.cp_lock, NULL);
+    memset(bs.stats, 0, sizeof(bs.stats));
+    memset(&bs.write_stat, 0, sizeof(bs.write_stat));
+    bs.wq_head = 0;
+    bs.wq_count = 0;
+    bs.wq_done = false;
+    bs.writer_off = false;
+    bs.writer_fd = -1;
+    pthread_mutex_init(&bs.lock, NULL);
+    pthread_cond_init(&bs.cond, NULL);
+    pthread_mutex_init(&bs.wq_lock, NULL);
+    pthread_cond_init(&bs.wq_cond, NULL);
+
+    pthread_t writer_thread;
+    bool have_writer = false;
+    bs.writer_fd = open(blockdev_filename->data, O_RDWR);
+    if (bs.writer_fd >= 0 &&
+        pthread_create(&writer_thread, NULL, writeback_worker, &bs) == 0) {
+        have_writer = true;
+    } else {
+        // no write-back thread; workers write their own targets.
+        if (bs.writer_fd >= 0) close(bs.writer_fd);
+        bs.writer_fd = -1;
+        bs.writer_off = true;
+    }
 
-                for (i = 0; i < tgt->count; ++i) {
-                    uint64_t range[2];
-                    // offset in bytes
-                    range[0] = tgt->pos[i*2] * (uint64_t)BLOCKSIZE;
-                    // len in bytes
-                    range[1] = (tgt->pos[i*2+1] - tgt->pos[i*2]) * (uint64_t)BLOCKSIZE;
+    for (i = 0; i < num_commands; ++i) {
+        if (commands[i].num_deps == 0) {
+            bs.ready[bs.ready_count++] = i;
+        }
+    }
 
-                    if (ioctl(fd, BLKDISCARD, &range) < 0) {
-                        printf("    blkdiscard failed: %s\n", strerror(errno));
-                    }
-                }
+    int num_threads = BLOCKIMG_MAX_THREADS;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 0 && ncpu < num_threads) num_threads = ncpu;
+    if (num_threads > num_commands) num_threads = num_commands;
+    if (num_threads < 1) num_threads = 1;
 
-                free(tgt);
-            } else {
-                printf("  ignoring erase (not block device)\n");
-            }
-        } else {
-            fprintf(stderr, "unknown transfer style \"%s\"\n", style);
-            exit(1);
+    pthread_t workers[BLOCKIMG_MAX_THREADS];
+    int started = 0;
+    for (i = 0; i < num_threads-1; ++i) {
+        if (pthread_create(workers+started, NULL, scheduler_worker, &bs) != 0) {
+            break;
         }
+        ++started;
+    }
+    scheduler_run(&bs, fd);   // this thread works too, on the original fd
+    for (i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // every command is complete, so the write queue is already empty.
+    pthread_mutex_lock(&bs.wq_lock);
+    bs.wq_done = true;
+    pthread_cond_broadcast(&bs.wq_cond);
+    pthread_mutex_unlock(&bs.wq_lock);
+    if (have_writer) {
+        pthread_join(writer_thread, NULL);
+        close(bs.writer_fd);
     }
 
     pthread_join(new_data_thread, NULL);
+    free(nti.ring);
     success = true;
 
-    free(buffer);
-    printf("wrote %d blocks; expected %d\n", blocks_so_far, total_blocks);
-    printf("max alloc needed was %zu\n", buffer_alloc);
+    // A finished install makes the checkpoint stale.
+    unlink(CHECKPOINT_FILE);
+
+    for (i = 0; i < num_commands; ++i) {
+        free(commands[i].src);
+        free(commands[i].tgt);
+        free(commands[i].dependents);
+    }
+    free(commands);
+    free(bs.ready);
+    free(bs.done);
+    if (bs.cp_fd >= 0) close(bs.cp_fd);
+    pthread_mutex_destroy(&bs.lock);
+    pthread_cond_destroy(&bs.cond);
+    pthread_mutex_destroy(&bs.wq_lock);
+    pthread_cond_destroy(&bs.wq_cond);
+    pthread_mutex_destroy(&bs.cp_lock);
+
+    printf("wrote %d blocks; expected %d\n", bs.blocks_so_far, total_blocks);
+    printf("max alloc needed was %zu\n", bs.max_alloc);
+
+    // one summary line per command type; recovery copies "log" lines
+    // into /tmp/recovery.log.
+    static const char* const stat_names[CMD_ERASE+1] = {
+        "move", "zero", "new", "bsdiff", "imgdiff", "erase"
+    };
+    for (i = 0; i <= CMD_ERASE; ++i) {
+        CommandStat* cs = &bs.stats[i];
+        if (cs->count == 0) continue;
+        fprintf(cmd_pipe, "log perf: cmd=%s count=%d blocks=%lld ms=%lld\n",
+                stat_names[i], cs->count, cs->blocks, cs->usec / 1000);
+    }
+    if (bs.write_stat.count > 0) {
+        fprintf(cmd_pipe, "log perf: cmd=write count=%d blocks=%lld ms=%lld\n",
+                bs.write_stat.count, bs.write_stat.blocks,
+                bs.write_stat.usec / 1000);
+    }
+    fflush(cmd_pipe);
 
   done:
+    trace_end();
+    free(tl_sha1);
     free(transfer_list);
     FreeValue(blockdev_filename);
     FreeValue(transfer_list_value);
@@ -589,6 +1396,57 @@ Value* BlockImageUpdateFn(const char* name, State* state, int argc, Expr* argv[]
     return StringValue(success ? strdup("t") : strdup(""));
 }
 
+// range_sha1 hashes large spans of the partition, so reading it
+// block-by-block wastes most of the time in syscalls.  Reads are done
+// in multi-megabyte chunks by a separate thread, double-buffered so
+// the device is kept busy while the previous chunk is being hashed.
+// (The digest has to consume the ranges in listed order, so we can't
+// reorder reads beyond what the buffers hold.)
+
+#define RANGE_SHA_CHUNK (2*1024*1024)
+
+typedef struct {
+    int fd;
+    RangeSet* rs;
+    uint8_t* buf[2];
+    size_t len[2];            // bytes filled; 0 means the slot is free
+    bool done;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+} RangeShaPipeline;
+
+static void* range_sha_reader(void* cookie) {
+    RangeShaPipeline* p = (RangeShaPipeline*) cookie;
+    int slot = 0;
+    int i;
+    for (i = 0; i < p->rs->count; ++i) {
+        check_lseek(p->fd, (off64_t)p->rs->pos[i*2] * BLOCKSIZE, SEEK_SET);
+        size_t remain = (p->rs->pos[i*2+1] - p->rs->pos[i*2]) * (size_t)BLOCKSIZE;
+        while (remain > 0) {
+            size_t chunk = (remain < RANGE_SHA_CHUNK) ? remain : RANGE_SHA_CHUNK;
+            pthread_mutex_lock(&p->mu);
+            while (p->len[slot] != 0) {
+                pthread_cond_wait(&p->cv, &p->mu);
+            }
+            pthread_mutex_unlock(&p->mu);
+
+            readblock(p->fd, p->buf[slot], chunk);
+
+            pthread_mutex_lock(&p->mu);
+            p->len[slot] = chunk;
+            pthread_cond_broadcast(&p->cv);
+            pthread_mutex_unlock(&p->mu);
+            slot ^= 1;
+            remain -= chunk;
+        }
+    }
+    pthread_mutex_lock(&p->mu);
+    p->done = true;
+    pthread_cond_broadcast(&p->cv);
+    pthread_mutex_unlock(&p->mu);
+    return NULL;
+}
+
 Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
     Value* blockdev_filename;
     Value* ranges;
@@ -613,20 +1471,67 @@ Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     RangeSet* rs = parse_range(ranges->data);
-    uint8_t buffer[BLOCKSIZE];
 
     SHA_CTX ctx;
     SHA_init(&ctx);
 
-    int i, j;
-    for (i = 0; i < rs->count; ++i) {
-        check_lseek(fd, (off64_t)rs->pos[i*2] * BLOCKSIZE, SEEK_SET);
-        for (j = rs->pos[i*2]; j < rs->pos[i*2+1]; ++j) {
-            readblock(fd, buffer, BLOCKSIZE);
-            SHA_update(&ctx, buffer, BLOCKSIZE);
+    RangeShaPipeline pipe;
+    pipe.fd = fd;
+    pipe.rs = rs;
+    pipe.buf[0] = malloc(RANGE_SHA_CHUNK);
+    pipe.buf[1] = malloc(RANGE_SHA_CHUNK);
+    if (pipe.buf[0] == NULL || pipe.buf[1] == NULL) {
+        fprintf(stderr, "failed to allocate range sha1 buffers\n");
+        exit(1);
+    }
+    pipe.len[0] = pipe.len[1] = 0;
+    pipe.done = false;
+    pthread_mutex_init(&pipe.mu, NULL);
+    pthread_cond_init(&pipe.cv, NULL);
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, range_sha_reader, &pipe) == 0) {
+        int slot = 0;
+        for (;;) {
+            pthread_mutex_lock(&pipe.mu);
+            while (pipe.len[slot] == 0 && !pipe.done) {
+                pthread_cond_wait(&pipe.cv, &pipe.mu);
+            }
+            size_t len = pipe.len[slot];
+            pthread_mutex_unlock(&pipe.mu);
+            if (len == 0) break;     // done and drained
+
+            SHA_update(&ctx, pipe.buf[slot], len);
+
+            pthread_mutex_lock(&pipe.mu);
+            pipe.len[slot] = 0;
+            pthread_cond_broadcast(&pipe.cv);
+            pthread_mutex_unlock(&pipe.mu);
+            slot ^= 1;
+        }
+        pthread_join(reader, NULL);
+    } else {
+        // no reader thread; chunked reads still beat block-by-block.
+        int i;
+        for (i = 0; i < rs->count; ++i) {
+            check_lseek(fd, (off64_t)rs->pos[i*2] * BLOCKSIZE, SEEK_SET);
+            size_t remain = (rs->pos[i*2+1] - rs->pos[i*2]) * (size_t)BLOCKSIZE;
+            while (remain > 0) {
+                size_t chunk = (remain < RANGE_SHA_CHUNK) ? remain : RANGE_SHA_CHUNK;
+                readblock(fd, pipe.buf[0], chunk);
+                SHA_update(&ctx, pipe.buf[0], chunk);
+                remain -= chunk;
+            }
         }
     }
+
+    free(pipe.buf[0]);
+    free(pipe.buf[1]);
+    pthread_mutex_destroy(&pipe.mu);
+    pthread_cond_destroy(&pipe.cv);
+
     digest = SHA_final(&ctx);
+    free(rs);
     close(fd);
 
   done:
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -28,7 +29,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <selinux/selinux.h>
-#include <ftw.h>
+#include <fts.h>
 #include <sys/capability.h>
 #include <sys/xattr.h>
 #include <linux/xattr.h>
@@ -59,13 +60,8 @@ static int totalbaks = 0;
 #endif
 
 void uiPrint(State* state, char* buffer) {
-    char* line = strtok(buffer, "\n");
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    while (line) {
-        fprintf(ui->cmd_pipe, "ui_print %s\n", line);
-        line = strtok(NULL, "\n");
-    }
-    fprintf(ui->cmd_pipe, "ui_print\n");
+    SendUiPrint(ui->cmd_pipe, buffer);
 }
 
 __attribute__((__format__(printf, 2, 3))) __nonnull((2))
@@ -175,6 +171,7 @@ Value* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
             uiPrintf(state, "detected filesystem %s for %s\n",
                     detected_fs_type, location);
             fs_type = detected_fs_type;
+            EvalArenaAdopt(detected_fs_type);
         } else {
             uiPrintf(state, "could not detect filesystem for %s, assuming %s\n",
                     location, fs_type);
@@ -192,11 +189,6 @@ Value* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
 done:
-    free(fs_type);
-    free(partition_type);
-    free(location);
-    if (result != mount_point) free(mount_point);
-    if (has_mount_options) free(mount_options);
     return StringValue(result);
 }
 
@@ -225,7 +217,6 @@ Value* IsMountedFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
 done:
-    if (result != mount_point) free(mount_point);
     return StringValue(result);
 }
 
@@ -259,7 +250,6 @@ Value* UnmountFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
 done:
-    if (result != mount_point) free(mount_point);
     return StringValue(result);
 }
 
@@ -387,9 +377,6 @@ Value* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
 done:
-    free(fs_type);
-    free(partition_type);
-    if (result != location) free(location);
     return StringValue(result);
 }
 
@@ -427,8 +414,6 @@ Value* RenameFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
 done:
-    free(src_name);
-    if (result != dst_name) free(dst_name);
     return StringValue(result);
 }
 
@@ -439,10 +424,6 @@ Value* DeleteFn(const char* name, State* state, int argc, Expr* argv[]) {
     for (i = 0; i < argc; ++i) {
         paths[i] = Evaluate(state, argv[i]);
         if (paths[i] == NULL) {
-            int j;
-            for (j = 0; j < i; ++i) {
-                free(paths[j]);
-            }
             free(paths);
             return NULL;
         }
@@ -454,7 +435,6 @@ Value* DeleteFn(const char* name, State* state, int argc, Expr* argv[]) {
     for (i = 0; i < argc; ++i) {
         if ((recursive ? dirUnlinkHierarchy(paths[i]) : unlink(paths[i])) == 0)
             ++success;
-        free(paths[i]);
     }
     free(paths);
 
@@ -478,9 +458,8 @@ Value* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     int sec = strtol(sec_str, NULL, 10);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    SendProgress(ui->cmd_pipe, frac, sec);
 
-    free(sec_str);
     return StringValue(frac_str);
 }
 
@@ -496,31 +475,49 @@ Value* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     double frac = strtod(frac_str, NULL);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    SendSetProgress(ui->cmd_pipe, frac);
 
     return StringValue(frac_str);
 }
 
 // package_extract_dir(package_path, destination_path)
+//   or
+// package_extract_dir(package_path, destination_path, threads)
+//   to pin the extraction worker-pool size instead of letting minzip
+//   pick one thread per online CPU.
 Value* PackageExtractDirFn(const char* name, State* state,
                           int argc, Expr* argv[]) {
-    if (argc != 2) {
-        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    if (argc < 2 || argc > 3) {
+        return ErrorAbort(state, "%s() expects 2 or 3 args, got %d",
+                          name, argc);
     }
     char* zip_path;
     char* dest_path;
-    if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
+    char* threads_str = NULL;
+    if (argc == 3) {
+        if (ReadArgs(state, argv, 3, &zip_path, &dest_path,
+                     &threads_str) < 0) return NULL;
+    } else {
+        if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
+    }
 
     ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
 
     // To create a consistent system image, never use the clock for timestamps.
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
+    if (threads_str != NULL) {
+        mzSetExtractThreadCount(strtol(threads_str, NULL, 10));
+    }
+
     bool success = mzExtractRecursive(za, zip_path, dest_path,
                                       MZ_EXTRACT_FILES_ONLY, &timestamp,
                                       NULL, NULL, sehandle);
-    free(zip_path);
-    free(dest_path);
+
+    // The override is global; don't let it leak into later extractions.
+    if (threads_str != NULL) {
+        mzSetExtractThreadCount(0);
+    }
     return StringValue(strdup(success ? "t" : ""));
 }
 
@@ -549,7 +546,7 @@ Value* PackageExtractFileFn(const char* name, State* state,
         char* dest_path;
         if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
 
-        const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+        const ZipEntry* entry = FindPackageEntry(ui, zip_path);
         if (entry == NULL) {
             printf("%s: no %s in package\n", name, zip_path);
             goto done2;
@@ -565,8 +562,6 @@ Value* PackageExtractFileFn(const char* name, State* state,
         fclose(f);
 
       done2:
-        free(zip_path);
-        free(dest_path);
         return StringValue(strdup(success ? "t" : ""));
     } else {
         // The one-argument version returns the contents of the file
@@ -581,12 +576,31 @@ Value* PackageExtractFileFn(const char* name, State* state,
         if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
 
         ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
-        const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+        const ZipEntry* entry = FindPackageEntry(ui, zip_path);
         if (entry == NULL) {
             printf("%s: no %s in package\n", name, zip_path);
             goto done1;
         }
 
+        // STORED entries (boot images and other already-compressed
+        // payloads) are returned as a borrowed blob pointing straight
+        // into the package mapping, so a multi-hundred-MB image never
+        // transits the heap on its way to the device.  The mapping
+        // outlives every Value (it's released at updater exit), and
+        // blob consumers (WriteRawImageFn, sha1_check, ...) treat the
+        // data as read-only, so borrowing is safe.  Borrowed data is
+        // deliberately NOT adopted by the evaluation arena; only
+        // heap-backed blobs are.
+        unsigned char* stored_addr;
+        size_t stored_len;
+        if (mzIsZipEntryStored(entry) &&
+                mzGetStoredEntry(za, entry, &stored_addr, &stored_len)) {
+            v->size = stored_len;
+            v->data = (char*)stored_addr;
+            EvalArenaAdopt(v);
+            return v;
+        }
+
         v->size = mzGetZipEntryUncompLen(entry);
         v->data = malloc(v->size);
         if (v->data == NULL) {
@@ -599,12 +613,13 @@ Value* PackageExtractFileFn(const char* name, State* state,
                                             (unsigned char *)v->data);
 
       done1:
-        free(zip_path);
         if (!success) {
             free(v->data);
             v->data = NULL;
             v->size = -1;
         }
+        EvalArenaAdopt(v);
+        EvalArenaAdopt(v->data);
         return v;
     }
 }
@@ -630,6 +645,10 @@ static int make_parents(char* name) {
     return 0;
 }
 
+static int path_compare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
 // symlink target src1 src2 ...
 //    unlinks any previously existing src1, src2, etc before creating symlinks.
 Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -642,10 +661,18 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     char** srcs = ReadVarArgs(state, argc-1, argv+1);
     if (srcs == NULL) {
-        free(target);
         return NULL;
     }
 
+    // Scripts list thousands of links in arbitrary order.  Sorting
+    // groups paths that share a directory, which keeps the dentry
+    // cache hot for the unlink/symlink pair and lets us skip the
+    // parent-directory walk when it matches the previous entry's.
+    qsort(srcs, argc-1, sizeof(char*), path_compare);
+
+    char last_parent[PATH_MAX];
+    last_parent[0] = '\0';
+
     int bad = 0;
     int i;
     for (i = 0; i < argc-1; ++i) {
@@ -656,7 +683,21 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
                 ++bad;
             }
         }
-        if (make_parents(srcs[i])) {
+        bool need_parents = true;
+        char* slash = strrchr(srcs[i], '/');
+        if (slash != NULL) {
+            size_t dlen = slash - srcs[i];
+            if (dlen < sizeof(last_parent)) {
+                if (strncmp(last_parent, srcs[i], dlen) == 0 &&
+                    last_parent[dlen] == '\0') {
+                    need_parents = false;
+                } else {
+                    memcpy(last_parent, srcs[i], dlen);
+                    last_parent[dlen] = '\0';
+                }
+            }
+        }
+        if (need_parents && make_parents(srcs[i])) {
             printf("%s: failed to symlink %s to %s: making parents failed\n",
                     name, srcs[i], target);
             ++bad;
@@ -666,9 +707,7 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
                     name, srcs[i], target, strerror(errno));
             ++bad;
         }
-        free(srcs[i]);
     }
-    free(srcs);
     if (bad) {
         return ErrorAbort(state, "%s: some symlinks failed", name);
     }
@@ -876,18 +915,19 @@ static int ApplyParsedPerms(
     return bad;
 }
 
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
-static State* recursive_state;
-
-static int do_SetMetadataRecursive(const char* filename, const struct stat *statptr,
-        int fileflags, struct FTW *pfwt) {
-    return ApplyParsedPerms(recursive_state, filename, statptr, recursive_parsed_args);
+// Visit each directory's entries in inode order, so the metadata
+// updates walk the inode table sequentially instead of in readdir
+// hash order.  Entries fts couldn't stat sort first and are reported
+// from the read loop.
+static int fts_inode_cmp(const FTSENT** a, const FTSENT** b) {
+    ino_t ia = ((*a)->fts_info == FTS_NS) ? 0 : (*a)->fts_statp->st_ino;
+    ino_t ib = ((*b)->fts_info == FTS_NS) ? 0 : (*b)->fts_statp->st_ino;
+    if (ia < ib) return -1;
+    if (ia > ib) return 1;
+    return 0;
 }
 
 static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
-    int i;
     int bad = 0;
     static int nwarnings = 0;
     struct stat sb;
@@ -911,21 +951,42 @@ static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv
     struct perm_parsed_args parsed = ParsePermArgs(state, argc, args);
 
     if (recursive) {
-        recursive_parsed_args = parsed;
-        recursive_state = state;
-        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-        memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
-        recursive_state = NULL;
+        // One fts pass applies every requested change while an entry
+        // is visited; a failed entry is counted and the walk goes on,
+        // where nftw stopped at the first one.
+        char* roots[] = { args[0], NULL };
+        FTS* fts = fts_open(roots, FTS_PHYSICAL | FTS_NOCHDIR, fts_inode_cmp);
+        if (fts == NULL) {
+            result = ErrorAbort(state, "%s: fts_open of \"%s\" failed: %s",
+                                name, args[0], strerror(errno));
+            goto done;
+        }
+        FTSENT* ent;
+        while ((ent = fts_read(fts)) != NULL) {
+            switch (ent->fts_info) {
+                case FTS_D:         // directory, preorder visit
+                case FTS_F:         // regular file
+                case FTS_SL:        // symlink
+                case FTS_SLNONE:    // dangling symlink
+                case FTS_DEFAULT:   // device, fifo, socket, ...
+                    bad += ApplyParsedPerms(state, ent->fts_path,
+                                            ent->fts_statp, parsed);
+                    break;
+                case FTS_DP:        // directory again in postorder
+                    break;
+                default:            // FTS_DNR, FTS_NS, FTS_ERR
+                    uiPrintf(state, "%s: error visiting %s: %s\n", name,
+                             ent->fts_path, strerror(ent->fts_errno));
+                    ++bad;
+                    break;
+            }
+        }
+        fts_close(fts);
     } else {
         bad += ApplyParsedPerms(state, args[0], &sb, parsed);
     }
 
 done:
-    for (i = 0; i < argc; ++i) {
-        free(args[i]);
-    }
-    free(args);
-
     if (result != NULL) {
         return result;
     }
@@ -947,66 +1008,126 @@ Value* GetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     char value[PROPERTY_VALUE_MAX];
     property_get(key, value, "");
-    free(key);
 
     return StringValue(strdup(value));
 }
 
 
-// file_getprop(file, key)
-//
-//   interprets 'file' as a getprop-style file (key=value pairs, one
-//   per line. # comment lines,blank lines, lines without '=' ignored),
-//   and returns the value for 'key' (or "" if it isn't defined).
-Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* result = NULL;
-    char* buffer = NULL;
-    char* filename;
+// Parse cache for file_getprop.  Updater-scripts' assert preambles
+// call file_getprop("/system/build.prop", ...) a dozen times before
+// any progress UI is up, and each call used to re-read and re-parse
+// the whole file.  Parse each file once into a sorted key table and
+// serve later lookups with a binary search; a cached file is re-read
+// if its size or mtime changes (scripts can rewrite prop files
+// mid-install).
+#define MAX_FILE_GETPROP_SIZE    65536
+#define PROP_CACHE_FILES 4
+
+typedef struct {
     char* key;
-    if (ReadArgs(state, argv, 2, &filename, &key) < 0) {
-        return NULL;
+    char* value;
+    int order;      // position in the file, to keep first-wins on
+                    // duplicate keys after sorting
+} PropEntry;
+
+typedef struct {
+    char* filename;
+    time_t mtime;
+    off_t size;
+    PropEntry* entries;
+    int num_entries;
+} PropFile;
+
+static PropFile prop_cache[PROP_CACHE_FILES];
+static int prop_cache_count = 0;
+
+static int prop_entry_sort_cmp(const void* a, const void* b) {
+    const PropEntry* pa = (const PropEntry*)a;
+    const PropEntry* pb = (const PropEntry*)b;
+    int cmp = strcmp(pa->key, pb->key);
+    if (cmp != 0) return cmp;
+    return pa->order - pb->order;
+}
+
+static int prop_entry_find_cmp(const void* key, const void* entry) {
+    return strcmp((const char*)key, ((const PropEntry*)entry)->key);
+}
+
+static void prop_file_free(PropFile* pf) {
+    int i;
+    for (i = 0; i < pf->num_entries; ++i) {
+        free(pf->entries[i].key);
+        free(pf->entries[i].value);
     }
+    free(pf->entries);
+    free(pf->filename);
+    memset(pf, 0, sizeof(*pf));
+}
 
+// Return the parsed table for filename, loading it on a cache miss.
+// On failure, sets the error in state and returns NULL.
+static PropFile* prop_file_get(const char* name, State* state,
+                               const char* filename) {
     struct stat st;
     if (stat(filename, &st) < 0) {
         ErrorAbort(state, "%s: failed to stat \"%s\": %s",
                    name, filename, strerror(errno));
-        goto done;
+        return NULL;
     }
 
-#define MAX_FILE_GETPROP_SIZE    65536
+    int i;
+    for (i = 0; i < prop_cache_count; ++i) {
+        if (strcmp(prop_cache[i].filename, filename) != 0) continue;
+        if (prop_cache[i].mtime == st.st_mtime &&
+            prop_cache[i].size == st.st_size) {
+            return &prop_cache[i];
+        }
+        // Stale: the file changed since it was parsed.
+        prop_file_free(&prop_cache[i]);
+        memmove(&prop_cache[i], &prop_cache[i+1],
+                (prop_cache_count - i - 1) * sizeof(PropFile));
+        --prop_cache_count;
+        break;
+    }
 
     if (st.st_size > MAX_FILE_GETPROP_SIZE) {
         ErrorAbort(state, "%s too large for %s (max %d)",
                    filename, name, MAX_FILE_GETPROP_SIZE);
-        goto done;
+        return NULL;
     }
 
-    buffer = malloc(st.st_size+1);
+    char* buffer = malloc(st.st_size+1);
     if (buffer == NULL) {
-        ErrorAbort(state, "%s: failed to alloc %lld bytes", name, (long long)st.st_size+1);
-        goto done;
+        ErrorAbort(state, "%s: failed to alloc %lld bytes", name,
+                   (long long)st.st_size+1);
+        return NULL;
     }
 
     FILE* f = fopen(filename, "rb");
     if (f == NULL) {
         ErrorAbort(state, "%s: failed to open %s: %s",
                    name, filename, strerror(errno));
-        goto done;
+        free(buffer);
+        return NULL;
     }
 
     if (fread(buffer, 1, st.st_size, f) != st.st_size) {
         ErrorAbort(state, "%s: failed to read %lld bytes from %s",
                    name, (long long)st.st_size+1, filename);
         fclose(f);
-        goto done;
+        free(buffer);
+        return NULL;
     }
     buffer[st.st_size] = '\0';
 
     fclose(f);
 
+    PropEntry* entries = NULL;
+    int num_entries = 0;
+    int alloc_entries = 0;
+
     char* line = strtok(buffer, "\n");
-    do {
+    if (line != NULL) do {
         // skip whitespace at start of line
         while (*line && isspace(*line)) ++line;
 
@@ -1023,9 +1144,6 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
         while (key_end > line && isspace(*key_end)) --key_end;
         key_end[1] = '\0';
 
-        // not the key we're looking for
-        if (strcmp(key, line) != 0) continue;
-
         // skip whitespace after the '=' to the start of the value
         char* val_start = equal+1;
         while(*val_start && isspace(*val_start)) ++val_start;
@@ -1035,18 +1153,66 @@ Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
         while (val_end > val_start && isspace(*val_end)) --val_end;
         val_end[1] = '\0';
 
-        result = strdup(val_start);
-        break;
+        if (num_entries >= alloc_entries) {
+            alloc_entries = alloc_entries ? alloc_entries * 2 : 64;
+            entries = realloc(entries, alloc_entries * sizeof(PropEntry));
+        }
+        entries[num_entries].key = strdup(line);
+        entries[num_entries].value = strdup(val_start);
+        entries[num_entries].order = num_entries;
+        ++num_entries;
 
     } while ((line = strtok(NULL, "\n")));
 
-    if (result == NULL) result = strdup("");
-
-  done:
-    free(filename);
-    free(key);
     free(buffer);
-    return StringValue(result);
+
+    qsort(entries, num_entries, sizeof(PropEntry), prop_entry_sort_cmp);
+
+    // Evict the oldest file when the cache is full.
+    if (prop_cache_count == PROP_CACHE_FILES) {
+        prop_file_free(&prop_cache[0]);
+        memmove(&prop_cache[0], &prop_cache[1],
+                (PROP_CACHE_FILES - 1) * sizeof(PropFile));
+        --prop_cache_count;
+    }
+
+    PropFile* pf = &prop_cache[prop_cache_count++];
+    pf->filename = strdup(filename);
+    pf->mtime = st.st_mtime;
+    pf->size = st.st_size;
+    pf->entries = entries;
+    pf->num_entries = num_entries;
+    return pf;
+}
+
+// file_getprop(file, key)
+//
+//   interprets 'file' as a getprop-style file (key=value pairs, one
+//   per line. # comment lines,blank lines, lines without '=' ignored),
+//   and returns the value for 'key' (or "" if it isn't defined).
+Value* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
+    char* filename;
+    char* key;
+    if (ReadArgs(state, argv, 2, &filename, &key) < 0) {
+        return NULL;
+    }
+
+    PropFile* pf = prop_file_get(name, state, filename);
+    if (pf == NULL) {
+        return NULL;
+    }
+
+    PropEntry* hit = bsearch(key, pf->entries, pf->num_entries,
+                             sizeof(PropEntry), prop_entry_find_cmp);
+    if (hit == NULL) {
+        return StringValue(strdup(""));
+    }
+    // bsearch may land on any duplicate; the file's first occurrence
+    // is the one the old line scan returned.
+    while (hit > pf->entries && strcmp(key, (hit-1)->key) == 0) {
+        --hit;
+    }
+    return StringValue(strdup(hit->value));
 }
 
 
@@ -1058,6 +1224,84 @@ static bool write_raw_image_cb(const unsigned char* data,
     return false;
 }
 
+#define RAW_IMAGE_BLOCK 4096
+#define RAW_IMAGE_CHUNK (1024*1024)
+
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+
+static bool data_is_zero(const unsigned char* data, size_t len) {
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        if (data[i] != 0) return false;
+    }
+    return true;
+}
+
+// Write one chunk of a raw image to an EMMC-style block device at
+// *offset, advancing it.  Runs of all-zero blocks are passed to
+// BLKZEROOUT instead of being written; if the ioctl isn't supported
+// (*zero_ok cleared on first failure) they are written normally.
+// Factory images are mostly zeros, so this skips the bulk of the
+// transfer.  (The MTD path below can't do this: its write context is
+// strictly sequential and erased flash reads back as 0xFF, so zero
+// blocks must actually be programmed.)
+static bool write_image_chunk(int fd, const unsigned char* data, size_t len,
+                              off64_t* offset, bool* zero_ok) {
+    size_t p = 0;
+    while (p < len) {
+        size_t run = 0;
+        if (*zero_ok) {
+            while (p + run + RAW_IMAGE_BLOCK <= len &&
+                   data_is_zero(data + p + run, RAW_IMAGE_BLOCK)) {
+                run += RAW_IMAGE_BLOCK;
+            }
+        }
+        if (run > 0) {
+            uint64_t range[2];
+            range[0] = *offset;
+            range[1] = run;
+            if (ioctl(fd, BLKZEROOUT, &range) == 0) {
+                *offset += run;
+                p += run;
+                continue;
+            }
+            // fall back to plain writes from here on.
+            *zero_ok = false;
+        }
+
+        // write up to the next zero run (or the rest of the chunk if
+        // zeroout is unavailable).
+        size_t span = RAW_IMAGE_BLOCK;
+        if (span > len - p) span = len - p;
+        if (*zero_ok) {
+            while (p + span + RAW_IMAGE_BLOCK <= len &&
+                   !data_is_zero(data + p + span, RAW_IMAGE_BLOCK)) {
+                span += RAW_IMAGE_BLOCK;
+            }
+            if (p + span + RAW_IMAGE_BLOCK > len) span = len - p;
+        } else {
+            span = len - p;
+        }
+
+        size_t written = 0;
+        while (written < span) {
+            ssize_t w = pwrite64(fd, data + p + written, span - written,
+                                 *offset + written);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                printf("write failed: %s\n", strerror(errno));
+                return false;
+            }
+            written += w;
+        }
+        *offset += span;
+        p += span;
+    }
+    return true;
+}
+
 // write_raw_image(filename_or_blob, partition)
 Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
@@ -1083,6 +1327,54 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    // A partition given as an absolute path is an EMMC-style block
+    // device: stream to it with the zero-skipping writer.
+    if (partition[0] == '/') {
+        int fd = open(partition, O_WRONLY);
+        if (fd < 0) {
+            printf("%s: can't open %s: %s\n", name, partition, strerror(errno));
+            result = strdup("");
+            goto done;
+        }
+
+        bool ok = true;
+        bool zero_ok = true;
+        off64_t offset = 0;
+
+        if (contents->type == VAL_STRING) {
+            FILE* f = fopen(contents->data, "rb");
+            if (f == NULL) {
+                printf("%s: can't open %s: %s\n",
+                        name, contents->data, strerror(errno));
+                close(fd);
+                result = strdup("");
+                goto done;
+            }
+            unsigned char* buffer = malloc(RAW_IMAGE_CHUNK);
+            size_t read;
+            while (ok && (read = fread(buffer, 1, RAW_IMAGE_CHUNK, f)) > 0) {
+                ok = write_image_chunk(fd, buffer, read, &offset, &zero_ok);
+            }
+            free(buffer);
+            fclose(f);
+        } else {
+            ok = write_image_chunk(fd, (unsigned char*)contents->data,
+                                   contents->size, &offset, &zero_ok);
+        }
+
+        if (fsync(fd) != 0) {
+            printf("%s: fsync of %s failed: %s\n",
+                    name, partition, strerror(errno));
+            ok = false;
+        }
+        close(fd);
+
+        printf("%s %s partition\n",
+               ok ? "wrote" : "failed to write", partition);
+        result = ok ? partition : strdup("");
+        goto done;
+    }
+
     mtd_scan_partitions();
     const MtdPartition* mtd = mtd_find_partition_by_name(partition);
     if (mtd == NULL) {
@@ -1099,6 +1391,10 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    // Let flash programming run behind the data source (file reads or
+    // zip decompression); on failure the context just writes inline.
+    mtd_write_behind(ctx);
+
     bool success;
 
     if (contents->type == VAL_STRING) {
@@ -1162,7 +1458,6 @@ Value* ApplyPatchSpaceFn(const char* name, State* state,
     if (bytes == 0 && endptr == bytes_str) {
         ErrorAbort(state, "%s(): can't parse \"%s\" as byte count\n\n",
                    name, bytes_str);
-        free(bytes_str);
         return NULL;
     }
 
@@ -1206,10 +1501,6 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (target_size == 0 && endptr == target_size_str) {
         ErrorAbort(state, "%s(): can't parse \"%s\" as byte count",
                    name, target_size_str);
-        free(source_filename);
-        free(target_filename);
-        free(target_sha1);
-        free(target_size_str);
         return NULL;
     }
 
@@ -1230,7 +1521,6 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
         for (i = 0; i < patchcount*2; ++i) {
             FreeValue(patches[i]);
         }
-        free(patches);
         return NULL;
     }
 
@@ -1250,7 +1540,6 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
         FreeValue(patches[i]);
     }
     free(patch_sha_str);
-    free(patches);
 
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
@@ -1292,11 +1581,6 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
         result = 0;
     }
 
-    for (i = 0; i < patchcount; ++i) {
-        free(sha1s[i]);
-    }
-    free(sha1s);
-
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
 
@@ -1316,9 +1600,7 @@ Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     for (i = 0; i < argc; ++i) {
         strcpy(buffer+size, args[i]);
         size += strlen(args[i]);
-        free(args[i]);
     }
-    free(args);
     buffer[size] = '\0';
     uiPrint(state, buffer);
     return StringValue(buffer);
@@ -1403,10 +1685,12 @@ Value* RunProgramFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     printf("about to run program [%s] with %d args\n", args2[0], argc);
 
-    pid_t child = fork();
+    // vfork: the updater runs with the package mapped, so a full fork
+    // would duplicate those page tables just to throw them away on
+    // the execv.
+    pid_t child = vfork();
     if (child == 0) {
         execv(args2[0], args2);
-        printf("run_program: execv failed: %s\n", strerror(errno));
         _exit(1);
     }
     int status;
@@ -1421,11 +1705,6 @@ Value* RunProgramFn(const char* name, State* state, int argc, Expr* argv[]) {
                 WTERMSIG(status));
     }
 
-    int i;
-    for (i = 0; i < argc; ++i) {
-        free(args[i]);
-    }
-    free(args);
     free(args2);
 
     char buffer[20];
@@ -1442,6 +1721,39 @@ Value* RunProgramFn(const char* name, State* state, int argc, Expr* argv[]) {
 //    returns the sha1 of the file if it matches any of the hex
 //    strings passed, or "" if it does not equal any of them.
 //
+// Verification-heavy scripts call sha1_check several times on the
+// same blob (eg, one read_file result checked against different
+// candidate digests in a chain of ||s).  Hashing is the expensive
+// part, so remember the digests of the last few blobs seen; arena
+// ownership guarantees a (data, size) pair identifies the same bytes
+// for the whole script run.
+#define SHA1_MEMO_SIZE 4
+
+typedef struct {
+    const char* data;
+    ssize_t size;
+    uint8_t digest[SHA_DIGEST_SIZE];
+} Sha1Memo;
+
+static Sha1Memo sha1_memo[SHA1_MEMO_SIZE];
+static int sha1_memo_next = 0;
+
+static void memoized_sha1(const Value* v, uint8_t* digest) {
+    int i;
+    for (i = 0; i < SHA1_MEMO_SIZE; ++i) {
+        if (sha1_memo[i].data == v->data && sha1_memo[i].size == v->size) {
+            memcpy(digest, sha1_memo[i].digest, SHA_DIGEST_SIZE);
+            return;
+        }
+    }
+    SHA_hash(v->data, v->size, digest);
+    i = sha1_memo_next;
+    sha1_memo[i].data = v->data;
+    sha1_memo[i].size = v->size;
+    memcpy(sha1_memo[i].digest, digest, SHA_DIGEST_SIZE);
+    sha1_memo_next = (i+1) % SHA1_MEMO_SIZE;
+}
+
 Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc < 1) {
         return ErrorAbort(state, "%s() expects at least 1 arg", name);
@@ -1456,15 +1768,14 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
         return StringValue(strdup(""));
     }
     uint8_t digest[SHA_DIGEST_SIZE];
-    SHA_hash(args[0]->data, args[0]->size, digest);
-    FreeValue(args[0]);
+    memoized_sha1(args[0], digest);
 
     if (argc == 1) {
         return StringValue(PrintSha1(digest));
     }
 
     int i;
-    uint8_t* arg_digest = malloc(SHA_DIGEST_SIZE);
+    uint8_t arg_digest[SHA_DIGEST_SIZE];
     for (i = 1; i < argc; ++i) {
         if (args[i]->type != VAL_STRING) {
             printf("%s(): arg %d is not a string; skipping",
@@ -1476,18 +1787,12 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
         } else if (memcmp(digest, arg_digest, SHA_DIGEST_SIZE) == 0) {
             break;
         }
-        FreeValue(args[i]);
     }
     if (i >= argc) {
         // Didn't match any of the hex strings; return false.
         return StringValue(strdup(""));
     }
-    // Found a match; free all the remaining arguments and return the
-    // matched one.
-    int j;
-    for (j = i+1; j < argc; ++j) {
-        FreeValue(args[j]);
-    }
+    // Found a match; return the matched one.
     return args[i];
 }
 
@@ -1502,10 +1807,10 @@ Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     Value* v = malloc(sizeof(Value));
     v->type = VAL_BLOB;
+    EvalArenaAdopt(v);
 
     FileContents fc;
     if (LoadFileContents(filename, &fc) != 0) {
-        free(filename);
         v->size = -1;
         v->data = NULL;
         free(fc.data);
@@ -1514,8 +1819,8 @@ Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     v->size = fc.size;
     v->data = (char*)fc.data;
+    EvalArenaAdopt(v->data);
 
-    free(filename);
     return v;
 }
 
@@ -1549,7 +1854,6 @@ Value* RebootNowFn(const char* name, State* state, int argc, Expr* argv[]) {
 #endif
     fwrite(buffer, sizeof(((struct bootloader_message*)0)->command), 1, f);
     fclose(f);
-    free(filename);
 
     strcpy(buffer, "reboot,");
     if (property != NULL) {
@@ -1564,7 +1868,6 @@ Value* RebootNowFn(const char* name, State* state, int argc, Expr* argv[]) {
     android_reboot(ANDROID_RB_RESTART, 0, 0);
 
     sleep(5);
-    free(property);
     ErrorAbort(state, "%s() failed to reboot", name);
     return NULL;
 }
@@ -1606,7 +1909,6 @@ Value* SetStageFn(const char* name, State* state, int argc, Expr* argv[]) {
     fwrite(stagestr, to_write, 1, f);
     fclose(f);
 
-    free(stagestr);
     return StringValue(filename);
 }
 
@@ -1646,9 +1948,6 @@ Value* WipeBlockDeviceFn(const char* name, State* state, int argc, Expr* argv[])
     int fd = open(filename, O_WRONLY, 0644);
     int success = wipe_block_device(fd, len);
 
-    free(filename);
-    free(len_str);
-
     close(fd);
 
     return StringValue(strdup(success ? "t" : ""));
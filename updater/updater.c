@@ -14,12 +14,17 @@
  * limitations under the License.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "edify/expr.h"
 #include "updater.h"
+#include "updater_protocol.h"
 #include "install.h"
 #include "blockimg.h"
 #include "minzip/Zip.h"
@@ -36,6 +41,122 @@
 
 struct selabel_handle *sehandle;
 
+const ZipEntry* FindPackageEntry(UpdaterInfo* ui, const char* name) {
+    int i;
+    for (i = 0; i < PACKAGE_ENTRY_CACHE_SIZE; ++i) {
+        if (ui->entry_cache_names[i] != NULL &&
+            strcmp(ui->entry_cache_names[i], name) == 0) {
+            return ui->entry_cache_entries[i];
+        }
+    }
+
+    const ZipEntry* entry = mzFindZipEntry(ui->package_zip, name);
+    if (entry != NULL) {
+        i = ui->entry_cache_next;
+        free(ui->entry_cache_names[i]);
+        ui->entry_cache_names[i] = strdup(name);
+        ui->entry_cache_entries[i] = entry;
+        ui->entry_cache_next = (i+1) % PACKAGE_ENTRY_CACHE_SIZE;
+    }
+    return entry;
+}
+
+// Minimum change and interval between set_progress messages; updates
+// below both thresholds are dropped (coalesced into the next one).
+#define PROGRESS_MIN_DELTA 0.005f
+#define PROGRESS_MIN_USEC  50000
+
+// Last set_progress actually emitted, for the rate limiter.  There is
+// only one command pipe per process, so plain statics suffice; callers
+// that report from multiple threads already serialize on their own
+// locks (see blockimg.c).
+static float last_set_progress = -1.0f;
+static long long last_set_progress_usec = 0;
+
+static bool pipe_framed() {
+    static int enabled = -1;
+    if (enabled < 0) {
+        enabled = (getenv(UPDATER_FRAME_ENV) != NULL);
+    }
+    return enabled;
+}
+
+static long long pipe_now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void send_frame(FILE* cmd_pipe, int opcode,
+                       const void* payload, size_t len) {
+    unsigned char header[4];
+    header[0] = UPDATER_FRAME_MAGIC;
+    header[1] = opcode;
+    header[2] = len & 0xff;
+    header[3] = (len >> 8) & 0xff;
+    fwrite(header, 1, sizeof(header), cmd_pipe);
+    fwrite(payload, 1, len, cmd_pipe);
+    // The pipe is line-buffered and frames don't end in a newline.
+    fflush(cmd_pipe);
+}
+
+void SendProgress(FILE* cmd_pipe, float frac, int secs) {
+    // A new progress segment resets the set_progress limiter.
+    last_set_progress = -1.0f;
+    last_set_progress_usec = 0;
+
+    if (pipe_framed()) {
+        unsigned char payload[8];
+        int32_t s = secs;
+        memcpy(payload, &frac, 4);
+        memcpy(payload+4, &s, 4);
+        send_frame(cmd_pipe, UPDATER_FRAME_PROGRESS, payload, sizeof(payload));
+    } else {
+        fprintf(cmd_pipe, "progress %f %d\n", frac, secs);
+    }
+}
+
+void SendSetProgress(FILE* cmd_pipe, float frac) {
+    long long now = pipe_now_usec();
+    float delta = frac - last_set_progress;
+    if (delta < 0) delta = -delta;
+
+    // Drop updates the bar couldn't visibly show anyway; the terminal
+    // 1.0 always goes out so the segment is seen to finish.
+    if (frac < 1.0f &&
+        (now - last_set_progress_usec < PROGRESS_MIN_USEC ||
+         delta < PROGRESS_MIN_DELTA)) {
+        return;
+    }
+    last_set_progress = frac;
+    last_set_progress_usec = now;
+
+    if (pipe_framed()) {
+        send_frame(cmd_pipe, UPDATER_FRAME_SET_PROGRESS, &frac, 4);
+    } else {
+        fprintf(cmd_pipe, "set_progress %f\n", frac);
+    }
+}
+
+void SendUiPrint(FILE* cmd_pipe, const char* text) {
+    if (pipe_framed()) {
+        // One frame carries the whole (possibly multi-line) message.
+        send_frame(cmd_pipe, UPDATER_FRAME_UI_PRINT, text, strlen(text));
+        return;
+    }
+
+    const char* line = text;
+    while (*line) {
+        const char* nl = strchr(line, '\n');
+        size_t len = (nl != NULL) ? (size_t)(nl - line) : strlen(line);
+        if (len > 0) {
+            fprintf(cmd_pipe, "ui_print %.*s\n", (int)len, line);
+        }
+        line += len + (nl != NULL ? 1 : 0);
+    }
+    fprintf(cmd_pipe, "ui_print\n");
+}
+
 int main(int argc, char** argv) {
     // Various things log information to stdout or stderr more or less
     // at random (though we've tried to standardize on stdout).  The
@@ -113,6 +234,8 @@ int main(int argc, char** argv) {
         return 6;
     }
 
+    FoldConstants(root);
+
     struct selinux_opt seopts[] = {
       { SELABEL_OPT_PATH, "/file_contexts" }
     };
@@ -126,6 +249,7 @@ int main(int argc, char** argv) {
     // Evaluate the parsed script.
 
     UpdaterInfo updater_info;
+    memset(&updater_info, 0, sizeof(updater_info));
     updater_info.cmd_pipe = cmd_pipe;
     updater_info.package_zip = &za;
     updater_info.version = atoi(version);
@@ -144,18 +268,14 @@ int main(int argc, char** argv) {
             fprintf(cmd_pipe, "ui_print script aborted (no error message)\n");
         } else {
             printf("script aborted: %s\n", state.errmsg);
-            char* line = strtok(state.errmsg, "\n");
-            while (line) {
-                fprintf(cmd_pipe, "ui_print %s\n", line);
-                line = strtok(NULL, "\n");
-            }
-            fprintf(cmd_pipe, "ui_print\n");
+            SendUiPrint(cmd_pipe, state.errmsg);
         }
         free(state.errmsg);
+        EvalArenaReset();
         return 7;
     } else {
         fprintf(cmd_pipe, "ui_print script succeeded: result was [%s]\n", result);
-        free(result);
+        EvalArenaReset();
     }
 
     if (updater_info.package_zip) {
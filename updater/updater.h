@@ -23,6 +23,10 @@
 #include <selinux/selinux.h>
 #include <selinux/label.h>
 
+// Number of resolved package entries remembered per run; scripts
+// rarely touch more than a handful of names repeatedly.
+#define PACKAGE_ENTRY_CACHE_SIZE 8
+
 typedef struct {
     FILE* cmd_pipe;
     ZipArchive* package_zip;
@@ -30,8 +34,28 @@ typedef struct {
 
     uint8_t* package_zip_addr;
     size_t package_zip_len;
+
+    // MRU cache of resolved package entries, so builtins that look up
+    // the same name more than once (eg, repeated package_extract_file
+    // of one blob) skip the archive name search.
+    char* entry_cache_names[PACKAGE_ENTRY_CACHE_SIZE];
+    const ZipEntry* entry_cache_entries[PACKAGE_ENTRY_CACHE_SIZE];
+    int entry_cache_next;
 } UpdaterInfo;
 
+// Look up an entry in the package, consulting and maintaining the
+// cache above.  Returns NULL if the name isn't in the archive.
+const ZipEntry* FindPackageEntry(UpdaterInfo* ui, const char* name);
+
+// Command-pipe emitters.  These speak the framed binary protocol when
+// recovery advertises support (see updater_protocol.h) and fall back
+// to the classic text commands otherwise.  set_progress updates are
+// rate-limited here, so callers may report progress as often as they
+// like without flooding the pipe.
+void SendProgress(FILE* cmd_pipe, float frac, int secs);
+void SendSetProgress(FILE* cmd_pipe, float frac);
+void SendUiPrint(FILE* cmd_pipe, const char* text);
+
 extern struct selabel_handle *sehandle;
 
 #endif
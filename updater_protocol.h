@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PROTOCOL_H_
+#define _UPDATER_PROTOCOL_H_
+
+/*
+ * The update binary talks to recovery over a pipe.  The classic
+ * encoding is newline-delimited text commands ("set_progress 0.25\n");
+ * see the comment in install.cpp for the full command list.  That
+ * encoding is chatty: full-ROM scripts emit thousands of tiny progress
+ * lines, each of which wakes recovery for parsing and a redraw.
+ *
+ * When recovery sets UPDATER_FRAME_ENV in the updater's environment, an
+ * updater built from this tree may also emit framed binary messages:
+ *
+ *     0x1e <opcode> <len_lo> <len_hi> <len bytes of payload>
+ *
+ * 0x1e (ASCII record separator) never begins a text command, so the two
+ * encodings can be freely interleaved on one stream, and update
+ * binaries that only speak text keep working unchanged.  Multi-byte
+ * payload fields are little-endian, floats in native format -- the two
+ * processes always run on the same machine.
+ */
+
+#define UPDATER_FRAME_ENV    "RECOVERY_FRAME_PIPE"
+#define UPDATER_FRAME_MAGIC  0x1e
+
+enum {
+    UPDATER_FRAME_PROGRESS = 1,      // payload: float frac, int32 secs
+    UPDATER_FRAME_SET_PROGRESS = 2,  // payload: float frac
+    UPDATER_FRAME_UI_PRINT = 3,      // payload: UTF-8 text, may span lines
+};
+
+#endif
@@ -26,12 +26,25 @@
 #include "mincrypt/sha.h"
 #include "mincrypt/sha256.h"
 
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
 extern RecoveryUI* ui;
 
+VerifyTiming gVerifyTiming;
+
+static uint64_t verify_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /*
  * Simple version of PKCS#7 SignedData extraction. This extracts the
  * signature OCTET STRING to be used for signature verification.
@@ -104,6 +117,204 @@ static bool read_pkcs7(uint8_t* pkcs7_der, size_t pkcs7_der_len, uint8_t** sig_d
     return *sig_der != NULL;
 }
 
+// Hash in few-MB chunks: big enough that per-chunk overhead (progress
+// math, the follower handoff below) vanishes, small enough that the
+// progress bar still advances smoothly on large packages.
+#define BUFFER_SIZE (4 * 1024 * 1024)
+
+// How many chunks the leader may run ahead of the follower.  On
+// fuse-backed sideload packages the kernel can evict pages the leader
+// already faulted in, and the further the follower trails, the
+// likelier it refaults one (and takes a SIGBUS on the wrong thread);
+// a small bound keeps the follower inside the leader's hot window.
+#define DUAL_HASH_MAX_LEAD 2
+
+// State shared between the main hashing loop and the SHA-256 follower
+// thread when the key list needs both digests.  The main thread hashes
+// SHA-1 over each chunk, then publishes the new high-water mark; the
+// follower hashes SHA-256 over everything up to that mark, posting the
+// lead semaphore once per chunk to release the leader's throttle.
+//
+// Everything the follower touches -- this struct and its embedded
+// SHA-256 context -- lives on the heap, never in verify_file's stack
+// frame, because a SIGBUS abort longjmps out of that frame while the
+// follower may still be running.  The abort path (verify_file_abort)
+// sets 'aborted', wakes the follower and joins it before the package
+// mapping is released; 'aborted' is also the only thing the SIGBUS
+// handler may set when the fault lands on the follower itself.
+typedef struct {
+    SHA256_CTX ctx;
+    const unsigned char* data;
+    size_t length;
+    size_t ready;           // bytes hashed (and faulted in) by the leader
+    volatile sig_atomic_t aborted;
+    sem_t lead;             // slots the leader may advance before waiting
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} DualHashStream;
+
+// The in-flight stream, registered for the duration of the follower's
+// life so the abort paths below can reach it from outside verify_file.
+// verify_file only ever runs on one thread at a time.
+static DualHashStream* g_active_stream = NULL;
+static pthread_t g_follower_thread;
+
+static void* sha256_follower(void* cookie) {
+    DualHashStream* stream = (DualHashStream*) cookie;
+    size_t done = 0;
+    while (done < stream->length && !stream->aborted) {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->ready == done && !stream->aborted) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        size_t ready = stream->ready;
+        pthread_mutex_unlock(&stream->lock);
+
+        while (done < ready && !stream->aborted) {
+            size_t size = ready - done;
+            if (size > BUFFER_SIZE) size = BUFFER_SIZE;
+            SHA256_update(&stream->ctx, stream->data + done, size);
+            done += size;
+            sem_post(&stream->lead);
+        }
+    }
+    return NULL;
+}
+
+// Poison the in-flight stream from a SIGBUS handler running on the
+// follower thread itself.  Only async-signal-safe operations: the flag
+// stops both threads' loops, and the sem_post unsticks a leader parked
+// in the throttle (it rechecks 'aborted' before waiting again).  The
+// caller must then take the faulting thread out with pthread_exit; the
+// leader will fault on the same dead mapping and abort properly.
+void verify_file_sigbus() {
+    DualHashStream* stream = g_active_stream;
+    if (stream == NULL) return;
+    stream->aborted = 1;
+    sem_post(&stream->lead);
+}
+
+// Abort and reclaim the follower after a SIGBUS longjmp.  Must run
+// before the package mapping is released: the follower hashes straight
+// out of the mapping and has to be joined before munmap.  A no-op when
+// no dual-hash stream is in flight.
+void verify_file_abort() {
+    DualHashStream* stream = g_active_stream;
+    if (stream == NULL) return;
+
+    pthread_mutex_lock(&stream->lock);
+    stream->aborted = 1;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(g_follower_thread, NULL);
+
+    g_active_stream = NULL;
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->cond);
+    sem_destroy(&stream->lead);
+    free(stream);
+}
+
+// One signature trial against key i once the digests are done.
+// Returns true if the signature verified.
+static bool try_key(const Certificate* cert, size_t i,
+                    const uint8_t* sig_der, size_t sig_der_length,
+                    const uint8_t* sha1, const uint8_t* sha256) {
+    const uint8_t* hash;
+    switch (cert->hash_len) {
+        case SHA_DIGEST_SIZE: hash = sha1; break;
+        case SHA256_DIGEST_SIZE: hash = sha256; break;
+        default: return false;
+    }
+
+    if (cert->key_type == Certificate::RSA) {
+        if (sig_der_length < RSANUMBYTES) {
+            // "signature" block isn't big enough to contain an RSA block.
+            LOGI("signature is too short for RSA key %zu\n", i);
+            return false;
+        }
+
+        if (!RSA_verify(cert->rsa, sig_der, RSANUMBYTES,
+                        hash, cert->hash_len)) {
+            LOGI("failed to verify against RSA key %zu\n", i);
+            return false;
+        }
+
+        LOGI("whole-file signature verified against RSA key %zu\n", i);
+        return true;
+    } else if (cert->key_type == Certificate::EC
+            && cert->hash_len == SHA256_DIGEST_SIZE) {
+        p256_int r, s;
+        if (!dsa_sig_unpack((uint8_t*) sig_der, sig_der_length, &r, &s)) {
+            LOGI("Not a DSA signature block for EC key %zu\n", i);
+            return false;
+        }
+
+        p256_int p256_hash;
+        p256_from_bin(hash, &p256_hash);
+        if (!p256_ecdsa_verify(&(cert->ec->x), &(cert->ec->y),
+                               &p256_hash, &r, &s)) {
+            LOGI("failed to verify against EC key %zu\n", i);
+            return false;
+        }
+
+        LOGI("whole-file signature verified against EC key %zu\n", i);
+        return true;
+    }
+
+    LOGI("Unknown key type %d\n", cert->key_type);
+    return false;
+}
+
+// Trial pool shared by the worker threads that try candidate keys
+// concurrently.  Workers claim the next position under the lock, stop
+// once someone records a hit, and each position maps to a key index
+// through the hint below.
+#define VERIFY_MAX_THREADS 4
+
+typedef struct {
+    const Certificate* keys;
+    unsigned int numKeys;
+    const uint8_t* sha1;
+    const uint8_t* sha256;
+    const uint8_t* sig_der;
+    size_t sig_der_length;
+    int hint;            // key to try first (last session hit), or -1
+    int next;            // next trial position to claim
+    int hit;             // index of the key that verified, or -1
+    pthread_mutex_t lock;
+} VerifyPool;
+
+// Map a trial position to a key index: position 0 is the hinted key,
+// the rest are the remaining keys in file order.
+static size_t position_to_key(unsigned int position, int hint) {
+    if (hint < 0) return position;
+    if (position == 0) return hint;
+    size_t i = position - 1;
+    if (i >= (size_t)hint) i = position;
+    return i;
+}
+
+static void* verify_pool_worker(void* cookie) {
+    VerifyPool* pool = (VerifyPool*) cookie;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        int position = (pool->hit >= 0) ? -1 : pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (position < 0 || (unsigned int)position >= pool->numKeys) break;
+
+        size_t i = position_to_key(position, pool->hint);
+        if (try_key(&pool->keys[i], i, pool->sig_der, pool->sig_der_length,
+                    pool->sha1, pool->sha256)) {
+            pthread_mutex_lock(&pool->lock);
+            pool->hit = i;
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
 // Look for an RSA signature embedded in the .ZIP file comment given
 // the path to the zip.  Verify it matches one of the given public
 // keys.
@@ -113,6 +324,9 @@ static bool read_pkcs7(uint8_t* pkcs7_der, size_t pkcs7_der_len, uint8_t** sig_d
 
 int verify_file(unsigned char* addr, size_t length,
                 const Certificate* pKeys, unsigned int numKeys) {
+    uint64_t t_mark = verify_now_us();
+    memset(&gVerifyTiming, 0, sizeof(gVerifyTiming));
+
     ui->SetProgress(0.0);
 
     // An archive with a whole-file signature will end in six bytes:
@@ -188,7 +402,8 @@ int verify_file(unsigned char* addr, size_t length,
         }
     }
 
-#define BUFFER_SIZE 4096
+    gVerifyTiming.parse_us = verify_now_us() - t_mark;
+    t_mark = verify_now_us();
 
     bool need_sha1 = false;
     bool need_sha256 = false;
@@ -204,6 +419,40 @@ int verify_file(unsigned char* addr, size_t length,
     SHA_init(&sha1_ctx);
     SHA256_init(&sha256_ctx);
 
+    // When the key list mixes hash types, compute the two digests in
+    // parallel instead of back to back in one thread: this thread
+    // hashes SHA-1 and drives the progress bar while a follower thread
+    // hashes SHA-256 just behind it over the same mapping (see the
+    // DualHashStream comment for the abort contract).
+    pthread_t sha256_thread;
+    DualHashStream* stream = NULL;
+    if (need_sha1 && need_sha256) {
+        stream = (DualHashStream*) malloc(sizeof(DualHashStream));
+        if (stream != NULL) {
+            SHA256_init(&stream->ctx);
+            stream->data = addr;
+            stream->length = signed_len;
+            stream->ready = 0;
+            stream->aborted = 0;
+            sem_init(&stream->lead, 0, DUAL_HASH_MAX_LEAD);
+            pthread_mutex_init(&stream->lock, NULL);
+            pthread_cond_init(&stream->cond, NULL);
+            // register before the thread exists so a fault on its very
+            // first page already finds the stream to poison
+            g_active_stream = stream;
+            if (pthread_create(&sha256_thread, NULL, sha256_follower, stream) != 0) {
+                g_active_stream = NULL;
+                pthread_mutex_destroy(&stream->lock);
+                pthread_cond_destroy(&stream->cond);
+                sem_destroy(&stream->lead);
+                free(stream);
+                stream = NULL;   // fall back to hashing both here
+            } else {
+                g_follower_thread = sha256_thread;
+            }
+        }
+    }
+
     double frac = -1.0;
     size_t so_far = 0;
     while (so_far < signed_len) {
@@ -211,9 +460,21 @@ int verify_file(unsigned char* addr, size_t length,
         if (size > BUFFER_SIZE) size = BUFFER_SIZE;
 
         if (need_sha1) SHA_update(&sha1_ctx, addr + so_far, size);
-        if (need_sha256) SHA256_update(&sha256_ctx, addr + so_far, size);
+        if (need_sha256 && stream == NULL) SHA256_update(&sha256_ctx, addr + so_far, size);
         so_far += size;
 
+        if (stream != NULL) {
+            pthread_mutex_lock(&stream->lock);
+            stream->ready = so_far;
+            pthread_cond_signal(&stream->cond);
+            pthread_mutex_unlock(&stream->lock);
+            // throttle: stay within DUAL_HASH_MAX_LEAD chunks of the
+            // follower so it only touches recently-faulted pages
+            if (!stream->aborted) {
+                while (sem_wait(&stream->lead) != 0 && errno == EINTR) { }
+            }
+        }
+
         double f = so_far / (double)signed_len;
         if (f > frac + 0.02 || size == so_far) {
             ui->SetProgress(f);
@@ -221,9 +482,22 @@ int verify_file(unsigned char* addr, size_t length,
         }
     }
 
+    if (stream != NULL) {
+        pthread_join(sha256_thread, NULL);
+        g_active_stream = NULL;
+        sha256_ctx = stream->ctx;
+        pthread_mutex_destroy(&stream->lock);
+        pthread_cond_destroy(&stream->cond);
+        sem_destroy(&stream->lead);
+        free(stream);
+    }
+
     const uint8_t* sha1 = SHA_final(&sha1_ctx);
     const uint8_t* sha256 = SHA256_final(&sha256_ctx);
 
+    gVerifyTiming.hash_us = verify_now_us() - t_mark;
+    t_mark = verify_now_us();
+
     uint8_t* sig_der = NULL;
     size_t sig_der_length = 0;
 
@@ -238,57 +512,52 @@ int verify_file(unsigned char* addr, size_t length,
      * Check to make sure at least one of the keys matches the signature. Since
      * any key can match, we need to try each before determining a verification
      * failure has happened.
+     *
+     * Key files accumulate historical keys but packages in one session
+     * are almost always signed by the same one, so start with whichever
+     * key verified last time instead of always attempting the keys in
+     * file order.  The trials are independent modexps, so a small pool
+     * of threads (this one included) claims them concurrently and a
+     * mismatched package costs roughly one trial's latency instead of
+     * numKeys of them.
      */
-    for (i = 0; i < numKeys; ++i) {
-        const uint8_t* hash;
-        switch (pKeys[i].hash_len) {
-            case SHA_DIGEST_SIZE: hash = sha1; break;
-            case SHA256_DIGEST_SIZE: hash = sha256; break;
-            default: continue;
-        }
-
-        // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
-        // the signing tool appends after the signature itself.
-        if (pKeys[i].key_type == Certificate::RSA) {
-            if (sig_der_length < RSANUMBYTES) {
-                // "signature" block isn't big enough to contain an RSA block.
-                LOGI("signature is too short for RSA key %zu\n", i);
-                continue;
-            }
-
-            if (!RSA_verify(pKeys[i].rsa, sig_der, RSANUMBYTES,
-                            hash, pKeys[i].hash_len)) {
-                LOGI("failed to verify against RSA key %zu\n", i);
-                continue;
-            }
-
-            LOGI("whole-file signature verified against RSA key %zu\n", i);
-            free(sig_der);
-            return VERIFY_SUCCESS;
-        } else if (pKeys[i].key_type == Certificate::EC
-                && pKeys[i].hash_len == SHA256_DIGEST_SIZE) {
-            p256_int r, s;
-            if (!dsa_sig_unpack(sig_der, sig_der_length, &r, &s)) {
-                LOGI("Not a DSA signature block for EC key %zu\n", i);
-                continue;
-            }
-
-            p256_int p256_hash;
-            p256_from_bin(hash, &p256_hash);
-            if (!p256_ecdsa_verify(&(pKeys[i].ec->x), &(pKeys[i].ec->y),
-                                   &p256_hash, &r, &s)) {
-                LOGI("failed to verify against EC key %zu\n", i);
-                continue;
-            }
-
-            LOGI("whole-file signature verified against EC key %zu\n", i);
-            free(sig_der);
-            return VERIFY_SUCCESS;
-        } else {
-            LOGI("Unknown key type %d\n", pKeys[i].key_type);
+    static int last_key_hit = -1;
+
+    VerifyPool pool;
+    pool.keys = pKeys;
+    pool.numKeys = numKeys;
+    pool.sha1 = sha1;
+    pool.sha256 = sha256;
+    pool.sig_der = sig_der;
+    pool.sig_der_length = sig_der_length;
+    pool.hint = (last_key_hit >= 0 && (unsigned int)last_key_hit < numKeys)
+            ? last_key_hit : -1;
+    pool.next = 0;
+    pool.hit = -1;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    pthread_t workers[VERIFY_MAX_THREADS];
+    unsigned int nworkers =
+            numKeys < VERIFY_MAX_THREADS ? numKeys : VERIFY_MAX_THREADS;
+    unsigned int w;
+    unsigned int started = 0;
+    for (w = 0; w + 1 < nworkers; ++w) {
+        if (pthread_create(&workers[started], NULL, verify_pool_worker, &pool) == 0) {
+            ++started;
         }
     }
+    verify_pool_worker(&pool);  // this thread is the pool's last worker
+    for (w = 0; w < started; ++w) {
+        pthread_join(workers[w], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+
     free(sig_der);
+    gVerifyTiming.rsa_us = verify_now_us() - t_mark;
+    if (pool.hit >= 0) {
+        last_key_hit = pool.hit;
+        return VERIFY_SUCCESS;
+    }
     LOGE("failed to verify whole-file signature\n");
     return VERIFY_FAILURE;
 }
@@ -322,6 +591,81 @@ int verify_file(unsigned char* addr, size_t length,
 //       4: 2048-bit RSA key with e=65537 and SHA-256 hash
 //       5: 256-bit EC key using the NIST P-256 curve parameters and SHA-256 hash
 //
+// The build may compile the text listing above into a binary key
+// store (see mkkeystore.py): the magic "RKS1", a little-endian 32-bit
+// key count, then for each key a 32-bit key type (0 = RSA, 1 = EC) and
+// 32-bit hash length followed by the key payload -- the raw
+// little-endian RSAPublicKey fields for RSA, or the 32-byte x and y
+// coordinates for EC, most-significant byte first as p256_from_bin
+// expects (the text format lists them least-significant first; the
+// generator reverses them).
+// This loads with one read and pointer fixups into the blob instead of
+// thousands of fscanf calls per install.
+#define KEY_STORE_MAGIC "RKS1"
+
+static Certificate* load_key_store(FILE* f, int* numKeys) {
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+
+    unsigned char* blob = (unsigned char*)malloc(size);
+    if (blob == NULL || fread(blob, 1, size, f) != (size_t)size) {
+        free(blob);
+        return NULL;
+    }
+
+    unsigned char* p = blob + sizeof(KEY_STORE_MAGIC) - 1;
+    unsigned char* end = blob + size;
+    uint32_t count;
+    if (end - p < (ptrdiff_t)sizeof(count)) {
+        free(blob);
+        return NULL;
+    }
+    memcpy(&count, p, sizeof(count));
+    p += sizeof(count);
+
+    Certificate* out = (Certificate*)calloc(count, sizeof(Certificate));
+    uint32_t k;
+    for (k = 0; k < count; ++k) {
+        uint32_t key_type, hash_len;
+        if (end - p < (ptrdiff_t)(2 * sizeof(uint32_t))) goto bad;
+        memcpy(&key_type, p, sizeof(key_type));
+        memcpy(&hash_len, p + sizeof(key_type), sizeof(hash_len));
+        p += 2 * sizeof(uint32_t);
+
+        Certificate* cert = out + k;
+        cert->hash_len = hash_len;
+        if (key_type == 0) {
+            if (end - p < (ptrdiff_t)sizeof(RSAPublicKey)) goto bad;
+            cert->key_type = Certificate::RSA;
+            cert->rsa = (RSAPublicKey*)p;  // points into the blob
+            p += sizeof(RSAPublicKey);
+            if (cert->rsa->len != RSANUMWORDS) goto bad;
+        } else if (key_type == 1) {
+            if (end - p < (ptrdiff_t)(2 * P256_NBYTES)) goto bad;
+            cert->key_type = Certificate::EC;
+            cert->ec = (ECPublicKey*)calloc(1, sizeof(ECPublicKey));
+            p256_from_bin(p, &cert->ec->x);
+            p256_from_bin(p + P256_NBYTES, &cert->ec->y);
+            p += 2 * P256_NBYTES;
+        } else {
+            goto bad;
+        }
+    }
+
+    // The RSA payloads alias the blob, so it stays allocated for the
+    // life of the process (the text parser's per-key mallocs are never
+    // freed either).
+    *numKeys = count;
+    return out;
+
+bad:
+    LOGE("malformed key store\n");
+    free(blob);
+    free(out);
+    return NULL;
+}
+
 // Returns NULL if the file failed to parse, or if it contain zero keys.
 Certificate*
 load_keys(const char* filename, int* numKeys) {
@@ -334,6 +678,19 @@ load_keys(const char* filename, int* numKeys) {
         goto exit;
     }
 
+    // A compiled store is identified by its magic; anything else goes
+    // through the text parser below.
+    {
+        char magic[sizeof(KEY_STORE_MAGIC) - 1];
+        if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+            memcmp(magic, KEY_STORE_MAGIC, sizeof(magic)) == 0) {
+            out = load_key_store(f, numKeys);
+            fclose(f);
+            return out;
+        }
+        rewind(f);
+    }
+
     {
         int i;
         bool done = false;
@@ -17,6 +17,8 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stdint.h>
+
 #include "mincrypt/p256.h"
 #include "mincrypt/rsa.h"
 
@@ -45,6 +47,31 @@ typedef struct {
 int verify_file(unsigned char* addr, size_t length,
                 const Certificate *pKeys, unsigned int numKeys);
 
+/* Abort support for SIGBUS on fuse-backed packages.  If verify_file
+ * is interrupted by a longjmp, the caller must invoke
+ * verify_file_abort() before releasing the package mapping: it stops
+ * and joins the SHA-256 follower thread, which hashes straight out of
+ * the mapping.  verify_file_sigbus() is the async-signal-safe poison
+ * for a handler running on the follower thread itself; the handler
+ * must then pthread_exit rather than longjmp into another thread's
+ * jmp_buf.  Both are no-ops when no follower is in flight.
+ */
+void verify_file_abort();
+void verify_file_sigbus();
+
+/* Wall-clock cost of the stages of the most recent verify_file()
+ * call, refreshed on every call.  Consumed by verifier_test's
+ * benchmark mode; the bookkeeping is four clock_gettime()s per
+ * verification, so it stays on unconditionally.
+ */
+typedef struct {
+    uint64_t parse_us;   // footer read and EOCD scan
+    uint64_t hash_us;    // SHA-1/SHA-256 over the signed region
+    uint64_t rsa_us;     // PKCS#7 parse and signature trials
+} VerifyTiming;
+
+extern VerifyTiming gVerifyTiming;
+
 Certificate* load_keys(const char* filename, int* numKeys);
 
 #define VERIFY_SUCCESS        0
@@ -176,17 +176,32 @@ static Certificate* add_certificate(Certificate** certsp, int* num_keys,
     return &certs[i];
 }
 
-int main(int argc, char **argv) {
+extern "C" int verifier_test_main(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s [-sha256] [-ec | -f4 | -file <keys>] <package>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-sha256] [-ec | -f4 | -file <keys>] "
+                "[-bench [-n iters]] <package>\n", argv[0]);
         return 2;
     }
     Certificate* certs = NULL;
     int num_keys = 0;
+    bool bench = false;
+    int bench_iters = 10;
 
     int argn = 1;
     while (argn < argc) {
-        if (strcmp(argv[argn], "-sha256") == 0) {
+        if (strcmp(argv[argn], "-bench") == 0) {
+            ++argn;
+            bench = true;
+        } else if (strcmp(argv[argn], "-n") == 0) {
+            ++argn;
+            if (argn == argc) {
+                fprintf(stderr, "-n requires an iteration count\n");
+                return 2;
+            }
+            bench_iters = atoi(argv[argn]);
+            if (bench_iters < 1) bench_iters = 1;
+            ++argn;
+        } else if (strcmp(argv[argn], "-sha256") == 0) {
             if (num_keys == 0) {
                 fprintf(stderr, "May only specify -sha256 after key type\n");
                 return 2;
@@ -248,6 +263,48 @@ int main(int argc, char **argv) {
         return 4;
     }
 
+    if (bench) {
+        // Throughput mode: re-verify the same mapping and report MB/s
+        // plus the per-stage split verify_file records in gVerifyTiming.
+        // Pass the key flags matching how the package is signed; the
+        // hashing cost is paid either way, but a signature miss skews
+        // the RSA stage toward the all-keys worst case.
+        uint64_t parse_us = 0, hash_us = 0, rsa_us = 0;
+        int failures = 0;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t start_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+        for (int i = 0; i < bench_iters; ++i) {
+            if (verify_file(map.addr, map.length, certs, num_keys)
+                    != VERIFY_SUCCESS) {
+                ++failures;
+            }
+            parse_us += gVerifyTiming.parse_us;
+            hash_us += gVerifyTiming.hash_us;
+            rsa_us += gVerifyTiming.rsa_us;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t total_us =
+                (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - start_us;
+
+        double mb = map.length / (1024.0 * 1024.0);
+        printf("%d x %.1f MB in %llu us: %.1f MB/s%s\n",
+               bench_iters, mb, (unsigned long long)total_us,
+               total_us ? mb * bench_iters * 1000000.0 / total_us : 0.0,
+               failures ? " [NOT VERIFIED]" : "");
+        printf("  parse: %7llu us/iter\n",
+               (unsigned long long)(parse_us / bench_iters));
+        printf("  hash:  %7llu us/iter (%.1f MB/s)\n",
+               (unsigned long long)(hash_us / bench_iters),
+               hash_us ? mb * bench_iters * 1000000.0 / hash_us : 0.0);
+        printf("  rsa:   %7llu us/iter\n",
+               (unsigned long long)(rsa_us / bench_iters));
+        return failures ? 1 : 0;
+    }
+
     int result = verify_file(map.addr, map.length, certs, num_keys);
     if (result == VERIFY_SUCCESS) {
         printf("VERIFIED\n");
@@ -260,3 +317,13 @@ int main(int argc, char **argv) {
         return 3;
     }
 }
+
+/* When the suite is linked into the unified runner (benchrunner.c at
+ * the top level) the runner provides main and calls the entry point
+ * above by name.
+ */
+#ifndef RECOVERY_BENCH_RUNNER
+int main(int argc, char **argv) {
+    return verifier_test_main(argc, argv);
+}
+#endif
@@ -172,20 +172,77 @@ static void set_volume_state(char* path, int state) {
     pthread_rwlock_unlock(&rwlock);
 }
 
+// Callback delivery is deferred: the handlers below fold each
+// broadcast into the volume list right away but only record that a
+// callback is owed.  The event loop calls vold_dispatch_flush() once
+// the vold socket drains, so a burst of broadcasts (sdcard insertion,
+// an OTG hub enumerating) costs the menu layer one rebuild instead of
+// one per event.  Only the latest event of each kind is kept; the
+// callbacks are "volumes changed" signals and per-volume state is
+// already in the list above.  Everything here runs on the vold event
+// thread, so no locking is needed.
+struct pending_event {
+    int pending;
+    char* label;
+    char* path;
+    int state;
+};
+
+static struct pending_event pending_state_change;
+static struct pending_event pending_disk_added;
+static struct pending_event pending_disk_removed;
+
+static void record_event(struct pending_event* ev, const char* label,
+        const char* path, int state) {
+
+    free(ev->label);
+    free(ev->path);
+    ev->label = strdup(label);
+    ev->path = strdup(path);
+    ev->state = state;
+    ev->pending = 1;
+}
+
+static void deliver_event(struct pending_event* ev,
+        int (*state_cb)(char* label, char* path, int state),
+        int (*disk_cb)(char* label, char* path)) {
+
+    if (!ev->pending)
+        return;
+    ev->pending = 0;
+
+    if (state_cb != NULL)
+        state_cb(ev->label, ev->path, ev->state);
+    else if (disk_cb != NULL)
+        disk_cb(ev->label, ev->path);
+}
+
+void vold_dispatch_flush() {
+
+    if (callbacks == NULL) {
+        pending_disk_added.pending = 0;
+        pending_disk_removed.pending = 0;
+        pending_state_change.pending = 0;
+        return;
+    }
+
+    deliver_event(&pending_disk_added, NULL, callbacks->disk_added);
+    deliver_event(&pending_disk_removed, NULL, callbacks->disk_removed);
+    deliver_event(&pending_state_change, callbacks->state_changed, NULL);
+}
+
 static void vold_handle_volume_state_change(char* label, char* path, int state) {
 
     set_volume_state(path, state);
 
-    if (callbacks != NULL && callbacks->state_changed != NULL)
-        callbacks->state_changed(label, path, state);
+    record_event(&pending_state_change, label, path, state);
 }
 
 static void vold_handle_volume_inserted(char* label, char* path) {
 
     set_volume_state(path, Volume::State_Idle);
 
-    if (callbacks != NULL && callbacks->disk_added != NULL)
-        callbacks->disk_added(label, path);
+    record_event(&pending_disk_added, label, path, Volume::State_Idle);
 
     if (should_automount)
         vold_mount_volume(path, false);
@@ -195,38 +252,75 @@ static void vold_handle_volume_removed(char* label, char* path) {
 
     set_volume_state(path, Volume::State_NoMedia);
 
-    if (callbacks != NULL && callbacks->disk_removed != NULL)
-        callbacks->disk_removed(label, path);
+    record_event(&pending_disk_removed, label, path, Volume::State_NoMedia);
 }
 
-int vold_dispatch(int code, char** tokens, int len) {
+static void dispatch_volume_list(char** tokens, int len) {
+    // <code> <seq> <label> <path> <state>
+    vold_handle_volume_list(tokens[2], tokens[3], atoi(tokens[4]));
+}
 
-    int i = 0;
-    int ret = 0;
+static void dispatch_command_okay(char** tokens, int len) {
+    if (is_listing_volumes)
+        vold_handle_volume_list_done();
+}
+
+static void dispatch_volume_state_change(char** tokens, int len) {
+    // <code> "Volume <label> <path> state changed from <old_#> (<old_str>) to <new_#> (<new_str>)"
+    vold_handle_volume_state_change(tokens[2], tokens[3], atoi(tokens[10]));
+}
+
+static void dispatch_volume_inserted(char** tokens, int len) {
+    // <code> Volume <label> <path> disk inserted (<blk_id>)"
+    vold_handle_volume_inserted(tokens[2], tokens[3]);
+}
 
-    if (code == ResponseCode::VolumeListResult) {
-        // <code> <seq> <label> <path> <state>
-        vold_handle_volume_list(tokens[2], tokens[3], atoi(tokens[4]));
+static void dispatch_volume_removed(char** tokens, int len) {
+    // <code> Volume <label> <path> disk removed (<blk_id>)"
+    vold_handle_volume_removed(tokens[2], tokens[3]);
+}
 
-    } else if (code == ResponseCode::VolumeStateChange) {
-        // <code> "Volume <label> <path> state changed from <old_#> (<old_str>) to <new_#> (<new_str>)"
-        vold_handle_volume_state_change(tokens[2], tokens[3], atoi(tokens[10]));
+// Dispatch table keyed on the numeric response code, kept sorted by
+// code so lookup is a binary search.  min_tokens is checked before
+// the handler runs so truncated lines can't index past the token
+// array.
+struct dispatch_entry {
+    int code;
+    int min_tokens;
+    void (*handler)(char** tokens, int len);
+};
 
-    } else if (code == ResponseCode::VolumeDiskInserted) {
-        // <code> Volume <label> <path> disk inserted (<blk_id>)"
-        vold_handle_volume_inserted(tokens[2], tokens[3]);
+static const struct dispatch_entry dispatch_table[] = {
+    { ResponseCode::VolumeListResult,    5, dispatch_volume_list },
+    { ResponseCode::CommandOkay,         1, dispatch_command_okay },
+    { ResponseCode::VolumeStateChange,  11, dispatch_volume_state_change },
+    { ResponseCode::VolumeDiskInserted,  4, dispatch_volume_inserted },
+    { ResponseCode::VolumeDiskRemoved,   4, dispatch_volume_removed },
+    { ResponseCode::VolumeBadRemoval,    4, dispatch_volume_removed },
+};
 
-    } else if (code == ResponseCode::VolumeDiskRemoved || code == ResponseCode::VolumeBadRemoval) {
-        // <code> Volume <label> <path> disk removed (<blk_id>)"
-        vold_handle_volume_removed(tokens[2], tokens[3]);
+static const int dispatch_table_len =
+        sizeof(dispatch_table) / sizeof(dispatch_table[0]);
 
-    } else if (code == ResponseCode::CommandOkay && is_listing_volumes) {
-        vold_handle_volume_list_done();
+int vold_dispatch(int code, char** tokens, int len) {
 
-    } else {
-        ret = 0;
+    int lo = 0;
+    int hi = dispatch_table_len - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const struct dispatch_entry* e = &dispatch_table[mid];
+        if (e->code < code) {
+            lo = mid + 1;
+        } else if (e->code > code) {
+            hi = mid - 1;
+        } else {
+            if (len >= e->min_tokens)
+                e->handler(tokens, len);
+            break;
+        }
     }
 
-    return ret;
+    return 0;
 }
 
@@ -42,11 +42,22 @@
 static pthread_mutex_t mutex      = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t  completion = PTHREAD_COND_INITIALIZER;
 
-// command result status, read with mutex held
-static int cmd_result = 0;
-
-// commands currently in flight
-static int cmd_inflight = 0;
+// in-flight commands, multiplexed by the sequence number we send with
+// each command and vold echoes back as the second response token.
+// List is kept in submission order so responses without a sequence
+// number complete the oldest request, matching the old behavior.
+struct vold_request {
+    int seq;
+    int done;
+    int result;
+    int discard;                    // reap on completion, nobody waits
+    vold_command_callback callback;
+    void* cookie;
+    struct vold_request* next;
+};
+
+static struct vold_request* requests = NULL;
+static int next_seq = 1;
 
 // socket fd
 static int sock = -1;
@@ -76,42 +87,115 @@ static int vold_connect() {
     return ret;
 }
 
-static int split(char *str, char **splitstr) {
+extern int vold_dispatch(int code, char** tokens, int len);
+extern void vold_dispatch_flush();
 
-    char *p;
-    int i = 0;
+// tokenize the line in place -- no per-token allocations.  The tokens
+// are only valid for the duration of the dispatch; handlers copy
+// whatever they keep.
+static int handle_response(char* response, int* seq) {
 
-    p = strtok(str, " ");
+    char *tokens[32];
+    char *save = NULL;
+    int len = 0;
 
-    while(p != NULL) {
-        splitstr[i] = (char *)malloc(strlen(p) + 1);
-        if (splitstr[i])
-            strcpy(splitstr[i], p);
-        i++;
-        p = strtok (NULL, " ");
+    char *p = strtok_r(response, " ", &save);
+    while (p != NULL && len < 32) {
+        tokens[len++] = p;
+        p = strtok_r(NULL, " ", &save);
     }
+    if (len == 0)
+        return 0;
+
+    int code = atoi(tokens[0]);
+    *seq = (len > 1) ? atoi(tokens[1]) : -1;
 
-    return i;
+    vold_dispatch(code, tokens, len);
+
+    return code;
 }
 
-extern int vold_dispatch(int code, char** tokens, int len);
+// complete the in-flight request matching seq (or the oldest one if
+// the response carried no usable sequence number) and hand the result
+// to its waiter or callback.
+static void complete_request(int seq, int code) {
+
+    pthread_mutex_lock(&mutex);
+
+    struct vold_request* req = requests;
+    struct vold_request* prev = NULL;
+    while (req != NULL && seq > 0 && req->seq != seq) {
+        prev = req;
+        req = req->next;
+    }
+    if (req == NULL) {
+        req = requests;
+        prev = NULL;
+    }
+    if (req == NULL) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
 
-static int handle_response(char* response) {
+    req->result = code;
+    req->done = 1;
+
+    // Capture everything we need while still holding the lock: once
+    // it drops, a woken waiter can unlink and free a waiter-owned
+    // request before we get another look at it.  Reaped requests are
+    // unlinked here, so no waiter can ever find them and freeing them
+    // after the unlock is safe.
+    vold_command_callback callback = req->callback;
+    void* cookie = req->cookie;
+    int reap = req->discard || callback != NULL;
+    if (reap) {
+        if (prev != NULL)
+            prev->next = req->next;
+        else
+            requests = req->next;
+    }
 
-    int code = 0, len = 0, i = 0;
-    char *tokens[32] = { NULL };
+    pthread_cond_broadcast(&completion);
+    pthread_mutex_unlock(&mutex);
 
-    len = split(response, tokens);
-    code = atoi(tokens[0]);
+    // run the callback without the lock so it may submit new commands
+    if (callback != NULL)
+        callback(code, cookie);
+    if (reap)
+        free(req);
+}
 
-    if (len) {
-        vold_dispatch(code, tokens, len);
+// fail everything still in flight; called when the vold connection
+// drops so waiters don't hang until reconnect.
+static void fail_all_requests() {
 
-        for (i = 0; i < len; i++)
-            free(tokens[i]);
+    pthread_mutex_lock(&mutex);
+    struct vold_request* req = requests;
+    struct vold_request* discarded = NULL;
+    struct vold_request** link = &requests;
+    while (req != NULL) {
+        struct vold_request* next = req->next;
+        req->result = 0;
+        req->done = 1;
+        if (req->discard || req->callback != NULL) {
+            *link = next;
+            req->next = discarded;
+            discarded = req;
+        } else {
+            link = &req->next;
+        }
+        req = next;
     }
+    pthread_cond_broadcast(&completion);
+    pthread_mutex_unlock(&mutex);
 
-    return code;
+    while (discarded != NULL) {
+        struct vold_request* next = discarded->next;
+        if (discarded->callback != NULL)
+            discarded->callback(0, discarded->cookie);
+        free(discarded);
+        discarded = next;
+    }
 }
 
 static int monitor_started = 0;
@@ -121,6 +205,7 @@ static int monitor() {
 
     char *buffer = (char *)malloc(4096);
     int code = 0;
+    struct timeval burst_start = { 0, 0 };
 
     while(1) {
         fd_set read_fds;
@@ -154,6 +239,7 @@ static int monitor() {
                     LOGE("Lost connection to Vold - did it crash?\n");
                 else
                     LOGE("Error reading data (%s)\n", strerror(errno));
+                vold_dispatch_flush();
                 if (rc == 0)
                     return ECONNRESET;
                 goto out;
@@ -166,19 +252,46 @@ static int monitor() {
             for (i = 0; i < rc; i++) {
                 if (buffer[i] == '\0') {
 
+                    int seq = -1;
                     LOGI("%s\n", buffer + offset);
-                    code = handle_response(strdup(buffer + offset));
+                    code = handle_response(buffer + offset, &seq);
 
                     if (code >= 200 && code < 600) {
-                        pthread_mutex_lock(&mutex);
-                        cmd_result = code;
-                        cmd_inflight--;
-                        pthread_cond_signal(&completion);
-                        pthread_mutex_unlock(&mutex);
+                        complete_request(seq, code);
                     }
                     offset = i + 1;
                 }
             }
+
+            // Coalesce event bursts: while more data is already queued
+            // on the socket, keep reading and hold the deferred
+            // callbacks back so N broadcasts cost the UI one
+            // notification.  A continuous flood can't starve the flush
+            // forever -- after 250ms of batching we flush anyway.
+            int flush = 1;
+            fd_set poll_fds;
+            struct timeval poll_to = { 0, 0 };
+
+            FD_ZERO(&poll_fds);
+            FD_SET(sock, &poll_fds);
+
+            if (select(sock + 1, &poll_fds, NULL, NULL, &poll_to) > 0) {
+                struct timeval now;
+                gettimeofday(&now, NULL);
+                if (burst_start.tv_sec == 0) {
+                    burst_start = now;
+                    flush = 0;
+                } else if ((now.tv_sec - burst_start.tv_sec) * 1000 +
+                           (now.tv_usec - burst_start.tv_usec) / 1000 < 250) {
+                    flush = 0;
+                }
+            }
+
+            if (flush) {
+                vold_dispatch_flush();
+                burst_start.tv_sec = 0;
+                burst_start.tv_usec = 0;
+            }
         }
     }
 out:
@@ -195,8 +308,12 @@ static void *event_thread_func(void* v) {
         if (vold_connect()) {
             monitor();
 
-            if (sock)
+            if (sock > 0)
                 close(sock);
+            sock = -1;
+
+            // nothing in flight will ever be answered now
+            fail_all_requests();
         }
         sleep(3);
     }
@@ -230,19 +347,30 @@ void vold_client_start(struct vold_callbacks* callbacks, int automount) {
     vold_set_automount(automount);
 }
 
-// send a command to vold. waits for completion and returns result
-// code if wait is 1, otherwise returns zero immediately.
-int vold_command(int len, const char** command, int wait) {
+// submit a command to vold without waiting for the response.  Returns
+// a handle (> 0) to pass to vold_command_wait, or -1 on error.  If
+// callback is non-NULL it runs on the event thread when the response
+// arrives and the handle must not be waited on; with a NULL callback
+// the caller owns the handle and must reap it with vold_command_wait.
+static int submit_command(int len, const char** command,
+        vold_command_callback callback, void* cookie, int discard) {
 
-    char final_cmd[255] = "0 "; /* 0 is a (now required) sequence number */
+    char final_cmd[255];
     int i;
     size_t sz;
-    int ret = 0;
 
     if (!vold_connect()) {
         return -1;
     }
 
+    pthread_mutex_lock(&mutex);
+    int seq = next_seq++;
+    if (next_seq > 0x7ffffff)
+        next_seq = 1;
+    pthread_mutex_unlock(&mutex);
+
+    snprintf(final_cmd, sizeof(final_cmd), "%d ", seq);
+
     for (i = 0; i < len; i++) {
         char *cmp;
 
@@ -261,22 +389,99 @@ int vold_command(int len, const char** command, int wait) {
         free(cmp);
     }
 
-    // only one writer at a time
+    struct vold_request* req =
+            (struct vold_request*)calloc(1, sizeof(struct vold_request));
+    if (req == NULL) {
+        return -1;
+    }
+    req->seq = seq;
+    req->callback = callback;
+    req->cookie = cookie;
+    req->discard = discard;
+
+    // only one writer at a time; queue before writing so the response
+    // can't race the bookkeeping
     pthread_mutex_lock(&mutex);
+
+    struct vold_request** link = &requests;
+    while (*link != NULL)
+        link = &(*link)->next;
+    *link = req;
+
     if (write(sock, final_cmd, strlen(final_cmd) + 1) < 0) {
         LOGE("Unable to send command to vold!\n");
-        ret = -1;
+        *link = req->next;
+        pthread_mutex_unlock(&mutex);
+        free(req);
+        return -1;
     }
-    cmd_inflight++;
+    pthread_mutex_unlock(&mutex);
 
-    if (wait) {
-        while (cmd_inflight) {
-            // wait for completion
-            pthread_cond_wait(&completion, &mutex);
-            ret = cmd_result;
-        }
+    return seq;
+}
+
+int vold_command_async(int len, const char** command,
+        vold_command_callback callback, void* cookie) {
+    return submit_command(len, command, callback, cookie,
+            callback != NULL);
+}
+
+// wait for an async command to complete and reap its handle.
+// Returns 0 if vold reported success, otherwise -1.
+int vold_command_wait(int handle) {
+
+    int ret = -1;
+
+    if (handle <= 0)
+        return -1;
+
+    pthread_mutex_lock(&mutex);
+
+    struct vold_request* req = requests;
+    struct vold_request* prev = NULL;
+    while (req != NULL && req->seq != handle) {
+        prev = req;
+        req = req->next;
+    }
+    if (req == NULL) {
+        pthread_mutex_unlock(&mutex);
+        return -1;
     }
+
+    while (!req->done)
+        pthread_cond_wait(&completion, &mutex);
+
+    ret = req->result;
+
+    // relocate prev; the list may have changed while we slept
+    prev = NULL;
+    struct vold_request* p = requests;
+    while (p != NULL && p != req) {
+        prev = p;
+        p = p->next;
+    }
+    if (prev != NULL)
+        prev->next = req->next;
+    else
+        requests = req->next;
+
     pthread_mutex_unlock(&mutex);
+    free(req);
 
     return ret == ResponseCode::CommandOkay ? 0 : -1;
 }
+
+// send a command to vold. waits for completion and returns result
+// code if wait is 1, otherwise returns zero immediately.
+int vold_command(int len, const char** command, int wait) {
+
+    if (wait) {
+        int handle = submit_command(len, command, NULL, NULL, 0);
+        if (handle < 0)
+            return -1;
+        return vold_command_wait(handle);
+    }
+
+    // fire and forget; the event thread reaps the request
+    return submit_command(len, command, NULL, NULL, 1) > 0 ? 0 : -1;
+}
@@ -47,6 +47,16 @@ void vold_client_start(struct vold_callbacks* callbacks, int automount);
 void vold_set_automount(int enabled);
 int vold_command(int len, const char** command, int wait);
 
+// Async command interface.  Commands are multiplexed over the vold
+// socket by sequence number, so several may be in flight at once.
+// With a callback, it runs on the event thread when the response
+// arrives; with a NULL callback the returned handle must be reaped
+// with vold_command_wait, which blocks until the response arrives.
+typedef void (*vold_command_callback)(int result, void* cookie);
+int vold_command_async(int len, const char** command,
+        vold_command_callback callback, void* cookie);
+int vold_command_wait(int handle);
+
 const char* volume_state_to_string(int state);
 
 #endif